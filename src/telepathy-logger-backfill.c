@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <config.h>
+
+#include <glib.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include <telepathy-logger/conf-internal.h>
+#include <telepathy-logger/log-backfill-internal.h>
+#include <telepathy-logger/log-store-internal.h>
+#include <telepathy-logger/log-store-empathy-internal.h>
+#include <telepathy-logger/log-store-xml-internal.h>
+#include <telepathy-logger/log-store-pidgin-internal.h>
+#include <telepathy-logger/log-store-sqlite-internal.h>
+#include <telepathy-logger/log-store-sqlite-events-internal.h>
+
+#define DEBUG_FLAG TPL_DEBUG_MAIN
+#include <telepathy-logger/debug-internal.h>
+
+static gint n_jobs = 0;
+static gboolean restart = FALSE;
+
+static GOptionEntry entries[] = {
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &n_jobs,
+      "Number of targets read at the same time", "N" },
+    { "restart", 'r', 0, G_OPTION_ARG_NONE, &restart,
+      "Go through the targets already backfilled again", NULL },
+    { NULL }
+};
+
+
+static GList *
+add_store (GList *stores,
+    GType type)
+{
+  TplLogStore *store = g_object_new (type, NULL);
+
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (store), "testmode"))
+      g_object_set (store,
+          "testmode", (g_getenv ("TPL_TEST_MODE") != NULL),
+          NULL);
+
+  return g_list_prepend (stores, store);
+}
+
+
+static void
+account_manager_prepared_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  GMainLoop *loop = user_data;
+  GError *error = NULL;
+
+  if (!tp_proxy_prepare_finish (source, result, &error))
+    {
+      g_printerr ("Failed to prepare the account manager: %s\n",
+          error->message);
+      g_error_free (error);
+    }
+
+  g_main_loop_quit (loop);
+}
+
+
+static void
+progress_cb (guint done,
+    guint total,
+    gpointer user_data)
+{
+  g_print ("\r%u/%u", done, total);
+
+  if (done == total)
+    g_print ("\n");
+}
+
+
+int
+main (int argc,
+    char *argv[])
+{
+  GOptionContext *context;
+  TpAccountManager *account_manager;
+  TplLogStore *counters;
+  TplConf *conf;
+  GMainLoop *loop;
+  GList *stores = NULL;
+  GList *accounts;
+  GError *error = NULL;
+  int retval = 0;
+
+  g_type_init ();
+
+  context = g_option_context_new ("- rebuild the message counters from "
+      "the logs");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      g_option_context_free (context);
+      return 1;
+    }
+
+  g_option_context_free (context);
+
+  if (n_jobs < 0)
+    {
+      g_printerr ("The number of jobs can't be negative\n");
+      return 1;
+    }
+
+#ifdef ENABLE_DEBUG
+  _tpl_debug_set_flags_from_env ();
+#endif /* ENABLE_DEBUG */
+
+  account_manager = tp_account_manager_dup ();
+  loop = g_main_loop_new (NULL, FALSE);
+
+  tp_proxy_prepare_async (account_manager, NULL,
+      account_manager_prepared_cb, loop);
+  g_main_loop_run (loop);
+
+  accounts = tp_account_manager_get_valid_accounts (account_manager);
+
+  /* the stores the log manager reads from */
+  conf = _tpl_conf_dup ();
+  if (_tpl_conf_is_sqlite_events_enabled (conf))
+    stores = add_store (stores, TPL_TYPE_LOG_STORE_SQLITE_EVENTS);
+  stores = add_store (stores, TPL_TYPE_LOG_STORE_XML);
+  stores = add_store (stores, TPL_TYPE_LOG_STORE_EMPATHY);
+  stores = add_store (stores, TPL_TYPE_LOG_STORE_PIDGIN);
+
+  counters = g_object_new (TPL_TYPE_LOG_STORE_SQLITE,
+      "synchronous", _tpl_conf_get_sqlite_synchronous (conf),
+      NULL);
+  g_object_unref (conf);
+
+  if (!_tpl_log_backfill_run (TPL_LOG_STORE_SQLITE (counters), stores,
+        accounts, n_jobs, restart, progress_cb, NULL, &error))
+    {
+      g_printerr ("Backfill incomplete, run again to retry: %s\n",
+          error->message);
+      g_error_free (error);
+      retval = 1;
+    }
+
+  g_object_unref (counters);
+  g_list_free_full (stores, g_object_unref);
+  g_list_free (accounts);
+  g_main_loop_unref (loop);
+  g_object_unref (account_manager);
+
+  return retval;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TPL_ACCOUNT_MAP_H__
+#define __TPL_ACCOUNT_MAP_H__
+
+#include <glib.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+G_BEGIN_DECLS
+
+/* Finds the valid account a log store keeps logs under a given name for
+ * (a directory name, usually). The names of every account are worked out
+ * once, and again whenever the account manager says accounts came, went or
+ * changed validity, so looking one up is a hash table lookup. It can be used
+ * from any thread. */
+typedef struct _TplAccountMap TplAccountMap;
+
+/* Returns: (transfer full): the name @account's logs are kept under, or
+ * NULL if it doesn't have any */
+typedef gchar * (*TplAccountMapKeyFunc) (TpAccount *account);
+
+TplAccountMap * _tpl_account_map_new (TpAccountManager *account_manager,
+    TplAccountMapKeyFunc key_func);
+
+void _tpl_account_map_free (TplAccountMap *self);
+
+TpAccount * _tpl_account_map_dup_account (TplAccountMap *self,
+    const gchar *key);
+
+G_END_DECLS
+
+#endif /* __TPL_ACCOUNT_MAP_H__ */
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "account-map-internal.h"
+
+#define DEBUG_FLAG TPL_DEBUG_LOG_STORE
+#include "debug-internal.h"
+
+struct _TplAccountMap
+{
+  TpAccountManager *account_manager;
+  TplAccountMapKeyFunc key_func;
+  gulong validity_changed_id;
+  gulong removed_id;
+
+  /* Protects everything below */
+  GMutex mutex;
+  /* owned name => owned TpAccount */
+  GHashTable *accounts;
+  /* set by the account manager's signals, which come from the main thread,
+   * so that the next lookup starts over */
+  gboolean stale;
+};
+
+
+static void
+account_map_invalidate (TplAccountMap *self)
+{
+  g_mutex_lock (&self->mutex);
+  self->stale = TRUE;
+  g_mutex_unlock (&self->mutex);
+}
+
+
+static void
+account_map_validity_changed_cb (TpAccountManager *account_manager,
+    TpAccount *account,
+    gboolean valid,
+    gpointer user_data)
+{
+  account_map_invalidate (user_data);
+}
+
+
+static void
+account_map_removed_cb (TpAccountManager *account_manager,
+    TpAccount *account,
+    gpointer user_data)
+{
+  account_map_invalidate (user_data);
+}
+
+
+/* Must be called with the mutex held */
+static void
+account_map_fill (TplAccountMap *self)
+{
+  GList *accounts, *l;
+
+  g_hash_table_remove_all (self->accounts);
+
+  /* FIXME: This assumes the account manager is prepared, but the
+   * synchronous API forces this. See bug #599189. Until it is, the map is
+   * filled again on every lookup. */
+  self->stale = !tp_proxy_is_prepared (self->account_manager,
+      TP_ACCOUNT_MANAGER_FEATURE_CORE);
+
+  accounts = tp_account_manager_dup_valid_accounts (self->account_manager);
+
+  for (l = accounts; l != NULL; l = g_list_next (l))
+    {
+      TpAccount *account = l->data;
+      gchar *key = self->key_func (account);
+
+      /* The first account wins when several have the same name */
+      if (key == NULL || g_hash_table_lookup (self->accounts, key) != NULL)
+        g_free (key);
+      else
+        g_hash_table_insert (self->accounts, key, g_object_ref (account));
+    }
+
+  g_list_free_full (accounts, g_object_unref);
+
+  DEBUG ("%u accounts", g_hash_table_size (self->accounts));
+}
+
+
+TplAccountMap *
+_tpl_account_map_new (TpAccountManager *account_manager,
+    TplAccountMapKeyFunc key_func)
+{
+  TplAccountMap *self;
+
+  g_return_val_if_fail (TP_IS_ACCOUNT_MANAGER (account_manager), NULL);
+  g_return_val_if_fail (key_func != NULL, NULL);
+
+  self = g_slice_new0 (TplAccountMap);
+  self->account_manager = g_object_ref (account_manager);
+  self->key_func = key_func;
+  self->accounts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      g_object_unref);
+  self->stale = TRUE;
+  g_mutex_init (&self->mutex);
+
+  self->validity_changed_id = g_signal_connect (account_manager,
+      "account-validity-changed",
+      G_CALLBACK (account_map_validity_changed_cb), self);
+  self->removed_id = g_signal_connect (account_manager, "account-removed",
+      G_CALLBACK (account_map_removed_cb), self);
+
+  return self;
+}
+
+
+void
+_tpl_account_map_free (TplAccountMap *self)
+{
+  g_return_if_fail (self != NULL);
+
+  g_signal_handler_disconnect (self->account_manager,
+      self->validity_changed_id);
+  g_signal_handler_disconnect (self->account_manager, self->removed_id);
+  g_object_unref (self->account_manager);
+
+  g_hash_table_unref (self->accounts);
+  g_mutex_clear (&self->mutex);
+
+  g_slice_free (TplAccountMap, self);
+}
+
+
+/* Returns: (transfer full): the account whose logs are kept under @key, or
+ * NULL */
+TpAccount *
+_tpl_account_map_dup_account (TplAccountMap *self,
+    const gchar *key)
+{
+  TpAccount *account;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  g_mutex_lock (&self->mutex);
+
+  if (self->stale)
+    account_map_fill (self);
+
+  account = g_hash_table_lookup (self->accounts, key);
+  if (account != NULL)
+    g_object_ref (account);
+
+  g_mutex_unlock (&self->mutex);
+
+  return account;
+}
@@ -49,7 +49,11 @@ GType _tpl_conf_get_type (void);
 TplConf *_tpl_conf_dup (void);
 
 gboolean  _tpl_conf_is_globally_enabled (TplConf *self);
+gboolean  _tpl_conf_is_sqlite_events_enabled (TplConf *self);
+guint _tpl_conf_get_sqlite_synchronous (TplConf *self);
 const gchar **_tpl_conf_get_ignorelist (TplConf *self);
+gboolean _tpl_conf_is_ignored (TplConf *self, const gchar *account_name,
+    const gchar *identifier);
 
 void _tpl_conf_globally_enable (TplConf *self, gboolean enable);
 void _tpl_conf_set_ignorelist (TplConf *self, const gchar **newlist);
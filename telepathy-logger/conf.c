@@ -22,6 +22,8 @@
 #include "config.h"
 #include "conf-internal.h"
 
+#include <string.h>
+
 #include <glib.h>
 #include <gio/gio.h>
 #include <telepathy-glib/telepathy-glib.h>
@@ -34,6 +36,12 @@
 
 #define GSETTINGS_SCHEMA "org.freedesktop.Telepathy.Logger"
 #define KEY_ENABLED "enabled"
+#define KEY_IGNORELIST "ignorelist"
+#define KEY_SQLITE_EVENTS "sqlite-events"
+#define KEY_SQLITE_SYNCHRONOUS "sqlite-synchronous"
+
+/* the default of KEY_SQLITE_SYNCHRONOUS, SQLite's NORMAL */
+#define DEFAULT_SQLITE_SYNCHRONOUS 1
 
 G_DEFINE_TYPE (TplConf, _tpl_conf, G_TYPE_OBJECT)
 
@@ -42,7 +50,12 @@ static TplConf *conf_singleton = NULL;
 typedef struct
 {
   gboolean test_mode;
+  /* cached from GSettings, so that the checks made for each event don't
+   * read the settings */
+  gboolean enabled;
   gchar **ignore_list;
+  /* account name -> set of ignored identifiers, built from ignore_list */
+  GHashTable *ignored;
   GSettings *gsettings;
 } TplConfPriv;
 
@@ -60,10 +73,78 @@ _notify_globally_enable (GSettings *gsettings,
     const gchar *key,
     GObject *self)
 {
+  TplConfPriv *priv = GET_PRIV (self);
+
+  priv->enabled = g_settings_get_boolean (gsettings, KEY_ENABLED);
+
   g_object_notify (self, "globally-enabled");
 }
 
 
+static void
+update_ignored (TplConfPriv *priv)
+{
+  guint i;
+
+  g_hash_table_remove_all (priv->ignored);
+
+  for (i = 0; priv->ignore_list != NULL && priv->ignore_list[i] != NULL; i++)
+    {
+      const gchar *entry = priv->ignore_list[i];
+      const gchar *identifier = entry;
+      GHashTable *identifiers;
+      gchar *account;
+      guint n;
+
+      /* entries are "cm/protocol/account/identifier", and only the
+       * identifier may contain more slashes */
+      for (n = 0; n < 3 && identifier != NULL; n++)
+        {
+          identifier = strchr (identifier, '/');
+          if (identifier != NULL)
+            identifier++;
+        }
+
+      if (identifier == NULL)
+        {
+          DEBUG ("Skipping malformed ignore list entry: %s", entry);
+          continue;
+        }
+
+      account = g_strndup (entry, identifier - entry - 1);
+
+      identifiers = g_hash_table_lookup (priv->ignored, account);
+      if (identifiers == NULL)
+        {
+          identifiers = g_hash_table_new_full (g_str_hash, g_str_equal,
+              g_free, NULL);
+          g_hash_table_insert (priv->ignored, account, identifiers);
+        }
+      else
+        {
+          g_free (account);
+        }
+
+      g_hash_table_add (identifiers, g_strdup (identifier));
+    }
+}
+
+
+static void
+_notify_ignorelist (GSettings *gsettings,
+    const gchar *key,
+    GObject *self)
+{
+  TplConfPriv *priv = GET_PRIV (self);
+
+  g_strfreev (priv->ignore_list);
+  priv->ignore_list = g_settings_get_strv (gsettings, KEY_IGNORELIST);
+  update_ignored (priv);
+
+  g_object_notify (self, "ignore-list");
+}
+
+
 static void
 tpl_conf_get_property (GObject *self,
     guint prop_id,
@@ -113,6 +194,8 @@ tpl_conf_finalize (GObject *obj)
   g_strfreev (priv->ignore_list);
   priv->ignore_list = NULL;
 
+  g_hash_table_unref (priv->ignored);
+
   if (priv->gsettings != NULL)
     {
       g_object_unref (priv->gsettings);
@@ -178,9 +261,14 @@ _tpl_conf_init (TplConf *self)
   TplConfPriv *priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
       TPL_TYPE_CONF, TplConfPriv);
 
+  priv->ignore_list = NULL;
+  priv->ignored = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) g_hash_table_unref);
+
   if (g_getenv ("TPL_TEST_MODE") != NULL)
     {
       priv->test_mode = TRUE;
+      priv->enabled = TRUE;
     }
   else
     {
@@ -188,9 +276,14 @@ _tpl_conf_init (TplConf *self)
 
       g_signal_connect (priv->gsettings, "changed::" KEY_ENABLED,
           G_CALLBACK (_notify_globally_enable), self);
-    }
+      g_signal_connect (priv->gsettings, "changed::" KEY_IGNORELIST,
+          G_CALLBACK (_notify_ignorelist), self);
 
-  priv->ignore_list = NULL;
+      priv->enabled = g_settings_get_boolean (priv->gsettings, KEY_ENABLED);
+      priv->ignore_list = g_settings_get_strv (priv->gsettings,
+          KEY_IGNORELIST);
+      update_ignored (priv);
+    }
 }
 
 
@@ -226,10 +319,51 @@ _tpl_conf_is_globally_enabled (TplConf *self)
 {
   g_return_val_if_fail (TPL_IS_CONF (self), FALSE);
 
+  return GET_PRIV (self)->enabled;
+}
+
+
+/**
+ * _tpl_conf_is_sqlite_events_enabled:
+ * @self: a TplConf instance
+ *
+ * Whether logs are kept in an SQLite database instead of XML files. This is
+ * only looked at when the log manager starts.
+ *
+ * Returns: %TRUE if logs are kept in SQLite, otherwise returns %FALSE.
+ */
+gboolean
+_tpl_conf_is_sqlite_events_enabled (TplConf *self)
+{
+  g_return_val_if_fail (TPL_IS_CONF (self), FALSE);
+
+  if (GET_PRIV (self)->test_mode)
+    return FALSE;
+  else
+    return g_settings_get_boolean (GET_PRIV (self)->gsettings,
+        KEY_SQLITE_EVENTS);
+}
+
+
+/**
+ * _tpl_conf_get_sqlite_synchronous:
+ * @self: a TplConf instance
+ *
+ * How hard the message counters database makes sure writes reach the disk.
+ * This is only looked at when the log manager starts.
+ *
+ * Returns: the level of SQLite's synchronous pragma to use
+ */
+guint
+_tpl_conf_get_sqlite_synchronous (TplConf *self)
+{
+  g_return_val_if_fail (TPL_IS_CONF (self), DEFAULT_SQLITE_SYNCHRONOUS);
+
   if (GET_PRIV (self)->test_mode)
-    return TRUE;
+    return DEFAULT_SQLITE_SYNCHRONOUS;
   else
-    return g_settings_get_boolean (GET_PRIV (self)->gsettings, KEY_ENABLED);
+    return g_settings_get_uint (GET_PRIV (self)->gsettings,
+        KEY_SQLITE_SYNCHRONOUS);
 }
 
 
@@ -253,6 +387,9 @@ _tpl_conf_globally_enable (TplConf *self,
   if (GET_PRIV (self)->test_mode)
     return;
 
+  /* the change notification may only come later */
+  GET_PRIV (self)->enabled = enable;
+
   g_settings_set_boolean (GET_PRIV (self)->gsettings,
       KEY_ENABLED, enable);
 }
@@ -273,11 +410,12 @@ _tpl_conf_set_ignorelist (TplConf *self,
   priv = GET_PRIV (self);
 
   if (!priv->test_mode) {
-    g_settings_set_strv (GET_PRIV (self)->gsettings, "ignorelist", newlist);
+    g_settings_set_strv (GET_PRIV (self)->gsettings, KEY_IGNORELIST, newlist);
   }
 
   g_strfreev (priv->ignore_list);
   priv->ignore_list = g_strdupv ((gchar **) newlist);
+  update_ignored (priv);
 
   g_object_notify (G_OBJECT (self), "ignore-list");
 }
@@ -300,9 +438,33 @@ _tpl_conf_get_ignorelist (TplConf *self)
 
   priv = GET_PRIV (self);
 
-  if ((priv->ignore_list == NULL) && (!priv->test_mode)) {
-    priv->ignore_list = g_settings_get_strv (priv->gsettings, "ignorelist");
-  }
-
   return (const gchar **) priv->ignore_list;
 }
+
+
+/**
+ * _tpl_conf_is_ignored:
+ * @self: a TplConf instance
+ * @account_name: the object path of an account, without
+ *  %TP_ACCOUNT_OBJECT_PATH_BASE
+ * @identifier: the identifier of an entity
+ *
+ * Looks "@account_name/@identifier" up in the ignore list without
+ * allocating, so that it can be called for each event.
+ *
+ * Returns: %TRUE if events from or to @identifier should not be logged
+ */
+gboolean
+_tpl_conf_is_ignored (TplConf *self,
+    const gchar *account_name,
+    const gchar *identifier)
+{
+  GHashTable *identifiers;
+
+  g_return_val_if_fail (TPL_IS_CONF (self), FALSE);
+
+  identifiers = g_hash_table_lookup (GET_PRIV (self)->ignored, account_name);
+
+  return identifiers != NULL && identifier != NULL &&
+    g_hash_table_contains (identifiers, identifier);
+}
@@ -37,6 +37,8 @@ typedef struct
 } TplEntityClass;
 
 gint _tpl_entity_compare (TplEntity *e1, TplEntity *e2);
+guint _tpl_entity_hash (gconstpointer key);
+gboolean _tpl_entity_equal (gconstpointer a, gconstpointer b);
 TplEntityType _tpl_entity_type_from_str (const gchar *type_str);
 const gchar * _tpl_entity_type_to_str (TplEntityType type);
 
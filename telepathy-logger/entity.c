@@ -388,6 +388,41 @@ _tpl_entity_compare (TplEntity *a,
 }
 
 
+/*
+ * _tpl_entity_hash:
+ * @key: a #TplEntity
+ *
+ * Returns: a hash of the identifier and type of @key, for use in a
+ *  #GHashTable along with _tpl_entity_equal()
+ */
+guint
+_tpl_entity_hash (gconstpointer key)
+{
+  TplEntity *entity = (TplEntity *) key;
+
+  g_return_val_if_fail (TPL_IS_ENTITY (entity), 0);
+
+  return g_str_hash (tpl_entity_get_identifier (entity)) * 31 +
+    tpl_entity_get_entity_type (entity);
+}
+
+
+/*
+ * _tpl_entity_equal:
+ * @a: a #TplEntity
+ * @b: a #TplEntity
+ *
+ * Returns: %TRUE if @a and @b have the same identifier and type, as
+ *  _tpl_entity_compare() would find
+ */
+gboolean
+_tpl_entity_equal (gconstpointer a,
+    gconstpointer b)
+{
+  return _tpl_entity_compare ((TplEntity *) a, (TplEntity *) b) == 0;
+}
+
+
 TplEntityType
 _tpl_entity_type_from_str (const gchar *type_str)
 {
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TPL_LOG_BACKFILL_H__
+#define __TPL_LOG_BACKFILL_H__
+
+#include <glib.h>
+
+#include <telepathy-logger/log-store-sqlite-internal.h>
+
+G_BEGIN_DECLS
+
+/* Called from the thread running the backfill, after each target is done */
+typedef void (*TplLogBackfillProgressFunc) (guint done,
+    guint total,
+    gpointer user_data);
+
+gboolean _tpl_log_backfill_run (TplLogStoreSqlite *counters,
+    GList *stores,
+    GList *accounts,
+    guint n_workers,
+    gboolean restart,
+    TplLogBackfillProgressFunc progress,
+    gpointer user_data,
+    GError **error);
+
+G_END_DECLS
+
+#endif /* __TPL_LOG_BACKFILL_H__ */
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Rebuilds the message counters of the SQLite cache from the logs already
+ * on disk, so that the frequency ranking doesn't only cover what was logged
+ * since the cache was created.
+ *
+ * Each (account, target) pair is a job for a pool of worker threads, which
+ * count the text events of the target per day across all the stores and
+ * replace its counters in one transaction. Targets done are recorded in the
+ * cache, so an interrupted backfill carries on where it stopped. */
+
+#include "config.h"
+#include "log-backfill-internal.h"
+
+#include <telepathy-logger/entity.h>
+#include <telepathy-logger/entity-internal.h>
+#include <telepathy-logger/event.h>
+#include <telepathy-logger/log-store-internal.h>
+
+#define DEBUG_FLAG TPL_DEBUG_LOG_STORE
+#include "debug-internal.h"
+
+#define DEFAULT_WORKERS 4
+
+typedef struct
+{
+  TpAccount *account;
+  TplEntity *target;
+  GError *error;
+} Job;
+
+typedef struct
+{
+  TplLogStoreSqlite *counters;
+  GList *stores;
+  /* Julian day of today (UTC): the live logger may still be counting it */
+  guint today;
+  /* of Job, handed back by the workers */
+  GAsyncQueue *done;
+} Backfill;
+
+
+static Job *
+job_new (TpAccount *account,
+    TplEntity *target)
+{
+  Job *job = g_slice_new0 (Job);
+
+  job->account = g_object_ref (account);
+  job->target = g_object_ref (target);
+
+  return job;
+}
+
+
+static void
+job_free (Job *job)
+{
+  g_object_unref (job->account);
+  g_object_unref (job->target);
+  g_clear_error (&job->error);
+  g_slice_free (Job, job);
+}
+
+
+static guint
+get_julian_day (gint64 timestamp)
+{
+  GDateTime *ts;
+  GDate date;
+
+  ts = g_date_time_new_from_unix_utc (timestamp);
+  g_return_val_if_fail (ts != NULL, 0);
+
+  g_date_clear (&date, 1);
+  g_date_set_dmy (&date, g_date_time_get_day_of_month (ts),
+      g_date_time_get_month (ts), g_date_time_get_year (ts));
+  g_date_time_unref (ts);
+
+  return g_date_get_julian (&date);
+}
+
+
+static void
+count_events (GHashTable *counts,
+    GList *events,
+    guint today)
+{
+  GList *l;
+
+  for (l = events; l != NULL; l = g_list_next (l))
+    {
+      guint day = get_julian_day (tpl_event_get_timestamp (l->data));
+      gpointer messages;
+
+      if (day == 0 || day >= today)
+        continue;
+
+      messages = g_hash_table_lookup (counts, GUINT_TO_POINTER (day));
+      g_hash_table_insert (counts, GUINT_TO_POINTER (day),
+          GUINT_TO_POINTER (GPOINTER_TO_UINT (messages) + 1));
+    }
+}
+
+
+/* Runs in a worker thread */
+static void
+backfill_job (gpointer data,
+    gpointer user_data)
+{
+  Job *job = data;
+  Backfill *backfill = user_data;
+  GHashTable *counts;
+  GList *l;
+
+  counts = g_hash_table_new (NULL, NULL);
+
+  for (l = backfill->stores; l != NULL; l = g_list_next (l))
+    {
+      TplLogStore *store = l->data;
+      GList *dates, *d;
+
+      dates = _tpl_log_store_get_dates (store, job->account, job->target,
+          TPL_EVENT_MASK_TEXT);
+
+      for (d = dates; d != NULL; d = g_list_next (d))
+        {
+          GList *events;
+
+          /* the stores don't all use UTC days, so today's logs can still
+           * hold some of yesterday's events; count_events() drops the rest */
+          if (g_date_get_julian (d->data) <= backfill->today)
+            {
+              events = _tpl_log_store_get_events_for_date (store,
+                  job->account, job->target, TPL_EVENT_MASK_TEXT, d->data);
+              count_events (counts, events, backfill->today);
+              g_list_free_full (events, g_object_unref);
+            }
+        }
+
+      g_list_free_full (dates, (GDestroyNotify) g_date_free);
+    }
+
+  DEBUG ("%s: %u days with messages",
+      tpl_entity_get_identifier (job->target), g_hash_table_size (counts));
+
+  _tpl_log_store_sqlite_set_message_counts (backfill->counters,
+      job->account, job->target, counts, &job->error);
+
+  g_hash_table_unref (counts);
+
+  g_async_queue_push (backfill->done, job);
+}
+
+
+/* Returns: the jobs for the targets of @account which aren't backfilled
+ * yet, in any of @stores */
+static GList *
+get_account_jobs (TplLogStoreSqlite *counters,
+    GList *stores,
+    TpAccount *account)
+{
+  GHashTable *seen;
+  GList *jobs = NULL;
+  GList *l;
+
+  /* of TplEntity, owned */
+  seen = g_hash_table_new_full (_tpl_entity_hash, _tpl_entity_equal,
+      g_object_unref, NULL);
+
+  for (l = stores; l != NULL; l = g_list_next (l))
+    {
+      GList *entities, *e;
+
+      entities = _tpl_log_store_get_entities (l->data, account);
+
+      for (e = entities; e != NULL; e = g_list_next (e))
+        {
+          TplEntity *target = e->data;
+
+          if (g_hash_table_contains (seen, target))
+            continue;
+
+          g_hash_table_add (seen, g_object_ref (target));
+
+          if (!_tpl_log_store_sqlite_is_backfilled (counters, account,
+                target))
+            jobs = g_list_prepend (jobs, job_new (account, target));
+        }
+
+      g_list_free_full (entities, g_object_unref);
+    }
+
+  g_hash_table_unref (seen);
+
+  return jobs;
+}
+
+
+/**
+ * _tpl_log_backfill_run:
+ * @counters: the SQLite cache holding the message counters
+ * @stores: a #GList of the #TplLogStore to read the logs from
+ * @accounts: a #GList of the #TpAccount whose logs are read
+ * @n_workers: the number of worker threads, or 0 for a default
+ * @restart: whether to go through targets already backfilled again
+ * @progress: (allow-none): called each time a target is done
+ * @user_data: user data for @progress
+ * @error: a #GError to be set on error, or %NULL
+ *
+ * Replaces the message counters in @counters with the number of text events
+ * found in @stores, for every day before today. Blocks until every target
+ * is done; a target whose counters couldn't be written is not marked as
+ * backfilled and is tried again by the next run.
+ *
+ * Returns: %TRUE if every target was backfilled, %FALSE with @error set to
+ *  the first error otherwise
+ */
+gboolean
+_tpl_log_backfill_run (TplLogStoreSqlite *counters,
+    GList *stores,
+    GList *accounts,
+    guint n_workers,
+    gboolean restart,
+    TplLogBackfillProgressFunc progress,
+    gpointer user_data,
+    GError **error)
+{
+  Backfill backfill = { NULL, };
+  GThreadPool *pool;
+  GList *jobs = NULL;
+  GList *l;
+  GDateTime *now;
+  guint total, done;
+  GError *first_error = NULL;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE (counters), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (n_workers == 0)
+    n_workers = DEFAULT_WORKERS;
+
+  if (restart)
+    _tpl_log_store_sqlite_clear_backfilled (counters);
+
+  backfill.counters = counters;
+
+  for (l = stores; l != NULL; l = g_list_next (l))
+    if (_tpl_log_store_is_readable (l->data))
+      backfill.stores = g_list_prepend (backfill.stores, l->data);
+
+  now = g_date_time_new_now_utc ();
+  backfill.today = get_julian_day (g_date_time_to_unix (now));
+  g_date_time_unref (now);
+
+  for (l = accounts; l != NULL; l = g_list_next (l))
+    jobs = g_list_concat (get_account_jobs (counters, backfill.stores,
+          l->data), jobs);
+
+  total = g_list_length (jobs);
+  DEBUG ("Backfilling %u targets with %u workers", total, n_workers);
+
+  if (total == 0)
+    {
+      g_list_free (backfill.stores);
+      return TRUE;
+    }
+
+  pool = g_thread_pool_new (backfill_job, &backfill, n_workers, FALSE,
+      error);
+  if (pool == NULL)
+    {
+      g_list_free_full (jobs, (GDestroyNotify) job_free);
+      g_list_free (backfill.stores);
+      return FALSE;
+    }
+
+  backfill.done = g_async_queue_new ();
+
+  for (l = jobs; l != NULL; l = g_list_next (l))
+    g_thread_pool_push (pool, l->data, NULL);
+
+  g_list_free (jobs);
+
+  for (done = 1; done <= total; done++)
+    {
+      Job *job = g_async_queue_pop (backfill.done);
+
+      if (job->error != NULL)
+        {
+          DEBUG ("Failed to backfill %s: %s",
+              tpl_entity_get_identifier (job->target), job->error->message);
+
+          if (first_error == NULL)
+            first_error = g_error_copy (job->error);
+        }
+
+      job_free (job);
+
+      if (progress != NULL)
+        progress (done, total, user_data);
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_async_queue_unref (backfill.done);
+  g_list_free (backfill.stores);
+
+  if (first_error != NULL)
+    {
+      g_propagate_error (error, first_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -25,6 +25,7 @@
 #include <telepathy-logger/log-manager.h>
 #include <telepathy-logger/log-store-factory-internal.h>
 #include <telepathy-logger/log-store-internal.h>
+#include <telepathy-logger/log-write-queue-internal.h>
 
 #define TPL_TYPE_LOG_SEARCH_HIT (_tpl_log_manager_search_hit_get_type ())
 
@@ -35,6 +36,32 @@ gboolean _tpl_log_manager_add_event (TplLogManager *manager,
 gboolean _tpl_log_manager_register_log_store (TplLogManager *self,
     TplLogStore *logstore);
 
+void _tpl_log_manager_set_flush_policy (TplLogManager *self,
+    TplLogFlushPolicy policy,
+    guint limit);
+
+void _tpl_log_manager_flush (TplLogManager *self);
+
+/* Counters of the pool running the tpl_log_manager_*_async () operations */
+typedef struct
+{
+  /* operations waiting for a worker, and the most there ever were */
+  guint queued;
+  guint max_queued;
+  guint running;
+  /* operations done, and how long they waited for a worker in total and
+   * at most, in microseconds */
+  guint64 completed;
+  gint64 total_wait;
+  gint64 max_wait;
+} TplLogManagerAsyncStats;
+
+void _tpl_log_manager_set_max_async_workers (TplLogManager *self,
+    guint max_workers);
+
+void _tpl_log_manager_get_async_stats (TplLogManager *self,
+    TplLogManagerAsyncStats *stats);
+
 GList * _tpl_log_manager_get_dates (TplLogManager *manager,
     TpAccount *account,
     TplEntity *target,
@@ -61,6 +88,11 @@ GList * _tpl_log_manager_search (TplLogManager *manager,
     const gchar *text,
     gint type_mask);
 
+GList * _tpl_log_manager_search_scoped (TplLogManager *manager,
+    const gchar *text,
+    gint type_mask,
+    const TplLogSearchScope *scope);
+
 void _tpl_log_manager_clear (TplLogManager *self);
 
 void _tpl_log_manager_clear_account (TplLogManager *self, TpAccount *account);
@@ -38,11 +38,13 @@
 #include <telepathy-logger/entity-internal.h>
 #include <telepathy-logger/event.h>
 #include <telepathy-logger/event-internal.h>
+#include <telepathy-logger/log-merge-internal.h>
 #include <telepathy-logger/log-store-internal.h>
 #include <telepathy-logger/log-store-empathy-internal.h>
 #include <telepathy-logger/log-store-xml-internal.h>
 #include <telepathy-logger/log-store-pidgin-internal.h>
 #include <telepathy-logger/log-store-sqlite-internal.h>
+#include <telepathy-logger/log-store-sqlite-events-internal.h>
 
 #define DEBUG_FLAG TPL_DEBUG_LOG_MANAGER
 #include <telepathy-logger/debug-internal.h>
@@ -71,6 +73,17 @@
  * Returns: %TRUE if @event should appear in the result
  */
 
+/**
+ * TplLogSearchHitsFunc:
+ * @manager: the #TplLogManager searching
+ * @hits: (element-type TelepathyLogger.LogSearchHit) (transfer none): the
+ *  hits found since the last call
+ * @user_data: user-supplied data
+ *
+ * Receives the hits of a search started with
+ * tpl_log_manager_search_incremental_async () as they are found.
+ */
+
 /**
  * TPL_LOG_MANAGER_ERROR:
  *
@@ -82,6 +95,21 @@
  * are used to avoid copying the full list on every call. */
 #define _LIST_TAKEN(l) ((l) != NULL && (l)->data == NULL)
 
+/* Events are written by a separate thread as soon as possible, grouping
+ * whatever piled up while the previous batch was being written */
+#define DEFAULT_FLUSH_POLICY  TPL_LOG_FLUSH_LATENCY
+#define DEFAULT_FLUSH_LIMIT   0
+
+/* The readable stores are queried at the same time, each by its own thread
+ * but for the first one which is queried by the caller */
+#define MAX_STORE_QUERY_THREADS 4
+
+/* The async operations are run by a pool of workers owned by the manager,
+ * highest priority first, so that a burst of history queries can't hold an
+ * interactive search up */
+#define DEFAULT_MAX_ASYNC_WORKERS 4
+#define INTERACTIVE_PRIORITY G_PRIORITY_HIGH
+
 typedef struct
 {
   TplConf *conf;
@@ -89,6 +117,17 @@ typedef struct
   GList *stores;
   GList *writable_stores;
   GList *readable_stores;
+
+  TplLogWriteQueue *write_queue;
+  TplLogFlushPolicy flush_policy;
+
+  GThreadPool *store_query_pool;
+
+  GThreadPool *async_pool;
+  /* protects the counters below */
+  GMutex async_lock;
+  guint64 async_seq;
+  TplLogManagerAsyncStats async_stats;
 } TplLogManagerPriv;
 
 
@@ -101,6 +140,7 @@ typedef struct
   TplEntity *target;
   gint type_mask;
   GDate *date;
+  GDate *end_date;
   guint num_events;
   TplLogEventFilter filter;
   gchar *search_text;
@@ -109,6 +149,35 @@ typedef struct
 } TplLogManagerEventInfo;
 
 
+/* A search started with tpl_log_manager_search_incremental_async (). Hits
+ * are found by a thread and delivered in the caller's main context: the
+ * thread queues them up in pending and schedules an idle source to deliver
+ * them if there isn't one on its way already. */
+typedef struct
+{
+  volatile gint ref_count;
+
+  TplLogManager *manager;
+  gchar *text;
+  gint type_mask;
+  guint max_hits;
+  GCancellable *cancellable;
+  TplLogSearchHitsFunc hits_func;
+  gpointer hits_user_data;
+  GDestroyNotify hits_destroy;
+  GAsyncReadyCallback callback;
+  gpointer user_data;
+  GMainContext *context;
+
+  /* only used by the searching thread */
+  guint n_hits;
+
+  GMutex lock;
+  GList *pending;
+  gboolean flush_scheduled;
+} TplLogManagerSearch;
+
+
 typedef struct
 {
   TplLogManager *manager;
@@ -119,6 +188,56 @@ typedef struct
 } TplLogManagerAsyncData;
 
 
+/* The arguments of a query made to each readable store */
+typedef struct
+{
+  TpAccount *account;
+  TplEntity *target;
+  gint type_mask;
+  const GDate *date;
+  const gchar *text;
+} StoreQuery;
+
+typedef GList * (*StoreQueryFunc) (TplLogStore *store,
+    const StoreQuery *query);
+
+/* The stores being queried for a single call, waited for by the caller */
+typedef struct
+{
+  StoreQueryFunc func;
+  const StoreQuery *query;
+  /* one result per store, in the order of readable_stores */
+  GList **results;
+
+  GMutex lock;
+  GCond done;
+  guint pending;
+} StoreQueries;
+
+typedef struct
+{
+  StoreQueries *queries;
+  TplLogStore *store;
+  guint index;
+} StoreQueryTask;
+
+
+/* An async operation waiting for, or run by, a worker of async_pool */
+typedef struct
+{
+  TplLogManager *manager;
+  GSimpleAsyncResult *result;
+  GSimpleAsyncThreadFunc func;
+  GCancellable *cancellable;
+  /* the context the job was started from, where it completes */
+  GMainContext *context;
+  gint priority;
+  /* the order the job was queued in, for jobs of the same priority */
+  guint64 seq;
+  gint64 queued_at;
+} AsyncJob;
+
+
 G_DEFINE_TYPE (TplLogManager, tpl_log_manager, G_TYPE_OBJECT);
 
 G_DEFINE_BOXED_TYPE (TplLogSearchHit,
@@ -136,6 +255,16 @@ log_manager_finalize (GObject *object)
 
   priv = TPL_LOG_MANAGER (object)->priv;
 
+  /* writes whatever is still queued, the stores are still alive */
+  _tpl_log_write_queue_free (priv->write_queue);
+
+  g_thread_pool_free (priv->store_query_pool, FALSE, TRUE);
+
+  /* the jobs keep the manager alive until they completed in the main
+   * context, so there are none left and no worker is waiting for us */
+  g_thread_pool_free (priv->async_pool, FALSE, TRUE);
+  g_mutex_clear (&priv->async_lock);
+
   g_object_unref (priv->conf);
 
   g_list_foreach (priv->stores, (GFunc) g_object_unref, NULL);
@@ -188,9 +317,16 @@ tpl_log_manager_class_init (TplLogManagerClass *klass)
 }
 
 
+static gboolean log_manager_register_log_store (TplLogManager *self,
+    TplLogStore *logstore, gboolean writable);
+
+
+/* Events are only written to @store if @writable and it implements
+ * add_event */
 static void
-add_log_store (TplLogManager *self,
-    TplLogStore *store)
+add_log_store_full (TplLogManager *self,
+    TplLogStore *store,
+    gboolean writable)
 {
   g_return_if_fail (TPL_IS_LOG_STORE (store));
 
@@ -201,7 +337,8 @@ add_log_store (TplLogManager *self,
           "testmode", (g_getenv ("TPL_TEST_MODE") != NULL),
           NULL);
 
-  if (!_tpl_log_manager_register_log_store (self, store))
+  if (!log_manager_register_log_store (self, store,
+        writable && _tpl_log_store_is_writable (store)))
     CRITICAL ("Failed to register store name=%s",
         _tpl_log_store_get_name (store));
 
@@ -210,6 +347,14 @@ add_log_store (TplLogManager *self,
 }
 
 
+static void
+add_log_store (TplLogManager *self,
+    TplLogStore *store)
+{
+  add_log_store_full (self, store, TRUE);
+}
+
+
 static void
 _globally_enabled_changed (TplConf *conf,
     GParamSpec *pspec,
@@ -260,6 +405,273 @@ _list_of_date_free (gpointer data)
 }
 
 
+/* Runs in the writer thread */
+static void
+log_manager_write_events (GList *events,
+    gpointer user_data)
+{
+  TplLogManager *self = user_data;
+  TplLogManagerPriv *priv = self->priv;
+  gboolean written = FALSE;
+  GList *l;
+
+  for (l = priv->writable_stores; l != NULL; l = g_list_next (l))
+    {
+      GError *loc_error = NULL;
+      TplLogStore *store = l->data;
+
+      if (_tpl_log_store_add_events (store, events, &loc_error))
+        {
+          written = TRUE;
+        }
+      else
+        {
+          CRITICAL ("logstore name=%s: %s. "
+              "Events may not be logged properly.",
+              _tpl_log_store_get_name (store),
+              loc_error != NULL ? loc_error->message : "no error message");
+          g_clear_error (&loc_error);
+        }
+    }
+
+  if (!written)
+    CRITICAL ("Failed to write %u events to all writable LogStores.",
+        g_list_length (events));
+}
+
+
+/* Runs in a thread of the store query pool */
+static void
+store_query_task_run (gpointer data,
+    gpointer user_data)
+{
+  StoreQueryTask *task = data;
+  StoreQueries *queries = task->queries;
+  GList *result;
+
+  result = queries->func (task->store, queries->query);
+
+  g_mutex_lock (&queries->lock);
+
+  queries->results[task->index] = result;
+  if (--queries->pending == 0)
+    g_cond_signal (&queries->done);
+
+  g_mutex_unlock (&queries->lock);
+
+  g_slice_free (StoreQueryTask, task);
+}
+
+
+/* Runs @func on all the readable stores at the same time, and waits for
+ * them all to return. The latency is then that of the slowest store rather
+ * than the sum of all of them.
+ *
+ * Returns: an array of the *@n_results lists returned by @func, in the
+ *  order of the readable stores, to be freed with g_free() */
+static GList **
+log_manager_query_stores (TplLogManager *self,
+    StoreQueryFunc func,
+    const StoreQuery *query,
+    guint *n_results)
+{
+  TplLogManagerPriv *priv = self->priv;
+  StoreQueries queries;
+  GList *l;
+  guint i;
+
+  *n_results = g_list_length (priv->readable_stores);
+
+  queries.func = func;
+  queries.query = query;
+  queries.results = g_new0 (GList *, MAX (*n_results, 1));
+  queries.pending = *n_results;
+  g_mutex_init (&queries.lock);
+  g_cond_init (&queries.done);
+
+  if (*n_results == 0)
+    goto out;
+
+  for (l = g_list_next (priv->readable_stores), i = 1;
+      l != NULL;
+      l = g_list_next (l), i++)
+    {
+      StoreQueryTask *task = g_slice_new (StoreQueryTask);
+
+      task->queries = &queries;
+      task->store = l->data;
+      task->index = i;
+
+      g_thread_pool_push (priv->store_query_pool, task, NULL);
+    }
+
+  /* query the first store meanwhile, rather than just waiting */
+  queries.results[0] = func (priv->readable_stores->data, query);
+
+  g_mutex_lock (&queries.lock);
+
+  queries.pending--;
+  while (queries.pending > 0)
+    g_cond_wait (&queries.done, &queries.lock);
+
+  g_mutex_unlock (&queries.lock);
+
+out:
+  g_cond_clear (&queries.done);
+  g_mutex_clear (&queries.lock);
+
+  return queries.results;
+}
+
+
+static GList *
+store_query_dates (TplLogStore *store,
+    const StoreQuery *query)
+{
+  return _tpl_log_store_get_dates (store, query->account, query->target,
+      query->type_mask);
+}
+
+
+static GList *
+store_query_events_for_date (TplLogStore *store,
+    const StoreQuery *query)
+{
+  return _tpl_log_store_get_events_for_date (store, query->account,
+      query->target, query->type_mask, query->date);
+}
+
+
+static GList *
+store_query_entities (TplLogStore *store,
+    const StoreQuery *query)
+{
+  return _tpl_log_store_get_entities (store, query->account);
+}
+
+
+static GList *
+store_query_search (TplLogStore *store,
+    const StoreQuery *query)
+{
+  return _tpl_log_store_search_new (store, query->text, query->type_mask);
+}
+
+
+static gint
+async_job_compare (gconstpointer a,
+    gconstpointer b,
+    gpointer user_data)
+{
+  const AsyncJob *job_a = a;
+  const AsyncJob *job_b = b;
+
+  if (job_a->priority != job_b->priority)
+    return job_a->priority < job_b->priority ? -1 : 1;
+
+  return job_a->seq < job_b->seq ? -1 : 1;
+}
+
+
+static void
+async_job_free (AsyncJob *job)
+{
+  g_object_unref (job->result);
+  if (job->cancellable != NULL)
+    g_object_unref (job->cancellable);
+  g_main_context_unref (job->context);
+  g_object_unref (job->manager);
+  g_slice_free (AsyncJob, job);
+}
+
+
+/* Runs in the context the job was started from. The job's refs are only
+ * released here, so that the manager is never finalized in a worker of the
+ * async pool, which would then wait for itself. */
+static gboolean
+async_job_complete (gpointer data)
+{
+  AsyncJob *job = data;
+
+  g_simple_async_result_complete (job->result);
+  async_job_free (job);
+
+  return FALSE;
+}
+
+
+/* Runs in a thread of the async pool */
+static void
+async_job_run (gpointer data,
+    gpointer user_data)
+{
+  AsyncJob *job = data;
+  TplLogManagerPriv *priv = job->manager->priv;
+  TplLogManagerAsyncStats *stats = &priv->async_stats;
+  GSource *source;
+  GError *error = NULL;
+  gint64 wait = g_get_monotonic_time () - job->queued_at;
+
+  g_mutex_lock (&priv->async_lock);
+  stats->queued--;
+  stats->running++;
+  stats->total_wait += wait;
+  stats->max_wait = MAX (stats->max_wait, wait);
+  g_mutex_unlock (&priv->async_lock);
+
+  /* as g_simple_async_result_run_in_thread () does, a job cancelled while
+   * it was queued fails without running */
+  if (g_cancellable_set_error_if_cancelled (job->cancellable, &error))
+    g_simple_async_result_take_error (job->result, error);
+  else
+    job->func (job->result, G_OBJECT (job->manager), job->cancellable);
+
+  g_mutex_lock (&priv->async_lock);
+  stats->running--;
+  stats->completed++;
+  g_mutex_unlock (&priv->async_lock);
+
+  /* as g_simple_async_result_complete_in_idle () does; the job isn't ours
+   * anymore once the source is attached */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, async_job_complete, job, NULL);
+  g_source_attach (source, job->context);
+  g_source_unref (source);
+}
+
+
+/* Like g_simple_async_result_run_in_thread (), but in the manager's pool,
+ * where jobs with a lower @priority value run first */
+static void
+log_manager_run_in_pool (TplLogManager *self,
+    GSimpleAsyncResult *result,
+    GSimpleAsyncThreadFunc func,
+    gint priority,
+    GCancellable *cancellable)
+{
+  TplLogManagerPriv *priv = self->priv;
+  AsyncJob *job = g_slice_new (AsyncJob);
+
+  job->manager = g_object_ref (self);
+  job->result = g_object_ref (result);
+  job->func = func;
+  job->cancellable = (cancellable != NULL) ? g_object_ref (cancellable) :
+    NULL;
+  job->context = g_main_context_ref_thread_default ();
+  job->priority = priority;
+  job->queued_at = g_get_monotonic_time ();
+
+  g_mutex_lock (&priv->async_lock);
+  job->seq = priv->async_seq++;
+  priv->async_stats.queued++;
+  priv->async_stats.max_queued = MAX (priv->async_stats.max_queued,
+      priv->async_stats.queued);
+  g_mutex_unlock (&priv->async_lock);
+
+  g_thread_pool_push (priv->async_pool, job, NULL);
+}
+
+
 static void
 tpl_log_manager_init (TplLogManager *self)
 {
@@ -275,10 +687,38 @@ tpl_log_manager_init (TplLogManager *self)
   g_signal_connect (priv->conf, "notify::globally-enabled",
       G_CALLBACK (_globally_enabled_changed), NULL);
 
-  /* The TPL's default read-write logstore */
-  add_log_store (self,
-      g_object_new (TPL_TYPE_LOG_STORE_XML,
-          NULL));
+  priv->write_queue = _tpl_log_write_queue_new (log_manager_write_events,
+      self, g_object_unref);
+  _tpl_log_manager_set_flush_policy (self, DEFAULT_FLUSH_POLICY,
+      DEFAULT_FLUSH_LIMIT);
+
+  priv->store_query_pool = g_thread_pool_new (store_query_task_run, NULL,
+      MAX_STORE_QUERY_THREADS, FALSE, NULL);
+
+  g_mutex_init (&priv->async_lock);
+  priv->async_pool = g_thread_pool_new (async_job_run, NULL,
+      DEFAULT_MAX_ASYNC_WORKERS, FALSE, NULL);
+  g_thread_pool_set_sort_function (priv->async_pool, async_job_compare,
+      NULL);
+
+  /* The TPL's default read-write logstore, or the SQLite one in its place
+   * if the deployment asked for it */
+  if (_tpl_conf_is_sqlite_events_enabled (priv->conf))
+    {
+      add_log_store (self,
+          g_object_new (TPL_TYPE_LOG_STORE_SQLITE_EVENTS,
+              NULL));
+
+      /* Keep reading the logs written to XML files until then */
+      add_log_store_full (self,
+          g_object_new (TPL_TYPE_LOG_STORE_XML,
+              NULL),
+          FALSE);
+    }
+  else
+    add_log_store (self,
+        g_object_new (TPL_TYPE_LOG_STORE_XML,
+            NULL));
 
   /* Load by default the Empathy's legacy 'past coversations' LogStore */
   add_log_store (self,
@@ -292,6 +732,7 @@ tpl_log_manager_init (TplLogManager *self)
   /* Load the event counting cache */
   add_log_store (self,
       g_object_new (TPL_TYPE_LOG_STORE_SQLITE,
+          "synchronous", _tpl_conf_get_sqlite_synchronous (priv->conf),
           NULL));
 
   DEBUG ("Log Manager initialised");
@@ -318,6 +759,11 @@ tpl_log_manager_dup_singleton (void)
  * It stores @event, sending it to all the writable registered #TplLogStore objects.
  * (Every TplLogManager is guaranteed to have at least one writable log store.)
  *
+ * Unless the flush policy is %TPL_LOG_FLUSH_IMMEDIATE, @event is only queued
+ * and written later by the writer thread; write failures are then only
+ * reported in the debug output. Events are written in the order they are
+ * added.
+ *
  * Returns: %TRUE if the event has been successfully added, otherwise %FALSE.
  */
 gboolean
@@ -356,6 +802,12 @@ _tpl_log_manager_add_event (TplLogManager *manager,
   if (tpl_log_manager_is_disabled_for_entity (manager, account, target))
     return FALSE;
 
+  if (priv->flush_policy != TPL_LOG_FLUSH_IMMEDIATE)
+    {
+      _tpl_log_write_queue_push (priv->write_queue, g_object_ref (event));
+      return TRUE;
+    }
+
   /* send the event to any writable log store */
   for (l = priv->writable_stores; l != NULL; l = g_list_next (l))
     {
@@ -387,6 +839,101 @@ _tpl_log_manager_add_event (TplLogManager *manager,
 }
 
 
+/*
+ * _tpl_log_manager_set_flush_policy:
+ * @self: the log manager
+ * @policy: when queued events have to be written
+ * @limit: the latency bound in milliseconds for %TPL_LOG_FLUSH_LATENCY, the
+ *  batch size for %TPL_LOG_FLUSH_BATCH, ignored otherwise
+ *
+ * Chooses how _tpl_log_manager_add_event() hands events to the writable
+ * stores. Events which are still queued are kept in order when switching
+ * policy.
+ */
+void
+_tpl_log_manager_set_flush_policy (TplLogManager *self,
+    TplLogFlushPolicy policy,
+    guint limit)
+{
+  TplLogManagerPriv *priv;
+
+  g_return_if_fail (TPL_IS_LOG_MANAGER (self));
+
+  priv = self->priv;
+
+  DEBUG ("flush policy %d, limit %u", policy, limit);
+
+  /* this flushes the queue when switching to immediate writes */
+  _tpl_log_write_queue_set_policy (priv->write_queue, policy, limit);
+  priv->flush_policy = policy;
+}
+
+
+/*
+ * _tpl_log_manager_flush:
+ * @self: the log manager
+ *
+ * Blocks until every event added so far has been written to the writable
+ * stores. All the query methods do this first, so that they see the events
+ * which are still queued.
+ */
+void
+_tpl_log_manager_flush (TplLogManager *self)
+{
+  TplLogManagerPriv *priv;
+
+  g_return_if_fail (TPL_IS_LOG_MANAGER (self));
+
+  priv = self->priv;
+
+  _tpl_log_write_queue_flush (priv->write_queue);
+}
+
+
+/*
+ * _tpl_log_manager_set_max_async_workers:
+ * @self: the log manager
+ * @max_workers: the number of async operations run at the same time, at
+ *  least 1
+ *
+ * Operations which are queued beyond that limit wait for a worker, highest
+ * priority first: searches go before the other queries.
+ */
+void
+_tpl_log_manager_set_max_async_workers (TplLogManager *self,
+    guint max_workers)
+{
+  g_return_if_fail (TPL_IS_LOG_MANAGER (self));
+  g_return_if_fail (max_workers > 0);
+
+  DEBUG ("max async workers %u", max_workers);
+
+  g_thread_pool_set_max_threads (self->priv->async_pool, max_workers, NULL);
+}
+
+
+/*
+ * _tpl_log_manager_get_async_stats:
+ * @self: the log manager
+ * @stats: (out): filled with the current counters of the async pool
+ */
+void
+_tpl_log_manager_get_async_stats (TplLogManager *self,
+    TplLogManagerAsyncStats *stats)
+{
+  TplLogManagerPriv *priv;
+
+  g_return_if_fail (TPL_IS_LOG_MANAGER (self));
+  g_return_if_fail (stats != NULL);
+
+  priv = self->priv;
+
+  g_mutex_lock (&priv->async_lock);
+  *stats = priv->async_stats;
+  g_mutex_unlock (&priv->async_lock);
+}
+
+
 /*
  * _tpl_log_manager_register_log_store:
  * @self: the log manager
@@ -401,14 +948,24 @@ _tpl_log_manager_add_event (TplLogManager *manager,
 gboolean
 _tpl_log_manager_register_log_store (TplLogManager *self,
     TplLogStore *logstore)
+{
+  g_return_val_if_fail (TPL_IS_LOG_MANAGER (self), FALSE);
+  g_return_val_if_fail (TPL_IS_LOG_STORE (logstore), FALSE);
+
+  return log_manager_register_log_store (self, logstore,
+      _tpl_log_store_is_writable (logstore));
+}
+
+
+static gboolean
+log_manager_register_log_store (TplLogManager *self,
+    TplLogStore *logstore,
+    gboolean writable)
 {
   TplLogManagerPriv *priv = self->priv;
   const gchar *name = _tpl_log_store_get_name (logstore);
   GList *l;
 
-  g_return_val_if_fail (TPL_IS_LOG_MANAGER (self), FALSE);
-  g_return_val_if_fail (TPL_IS_LOG_STORE (logstore), FALSE);
-
   /* check that the logstore name is not already used */
   for (l = priv->stores; l != NULL; l = g_list_next (l))
     {
@@ -424,7 +981,7 @@ _tpl_log_manager_register_log_store (TplLogManager *self,
   if (_tpl_log_store_is_readable (logstore))
     priv->readable_stores = g_list_prepend (priv->readable_stores, logstore);
 
-  if (_tpl_log_store_is_writable (logstore))
+  if (writable)
     priv->writable_stores = g_list_prepend (priv->writable_stores, logstore);
 
   /* reference just once, writable/readable lists are kept in sync with the
@@ -464,6 +1021,8 @@ tpl_log_manager_exists (TplLogManager *manager,
 
   priv = manager->priv;
 
+  _tpl_log_manager_flush (manager);
+
   for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
     {
       if (_tpl_log_store_exists (TPL_LOG_STORE (l->data), account, target,
@@ -496,37 +1055,30 @@ _tpl_log_manager_get_dates (TplLogManager *manager,
     TplEntity *target,
     gint type_mask)
 {
-  GList *l, *out = NULL;
-  TplLogManagerPriv *priv;
+  StoreQuery query = { account, target, type_mask, };
+  GList **results;
+  TplLogMerge *merge;
+  guint i, n;
 
   g_return_val_if_fail (TPL_IS_LOG_MANAGER (manager), NULL);
   g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
 
-  priv = manager->priv;
+  _tpl_log_manager_flush (manager);
 
-  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
-    {
-      TplLogStore *store = TPL_LOG_STORE (l->data);
-      GList *new;
+  results = log_manager_query_stores (manager, store_query_dates, &query,
+      &n);
 
-      /* Insert dates of each store in the out list. Keep the out list sorted
-       * and avoid to insert dups. */
-      new = _tpl_log_store_get_dates (store, account, target, type_mask);
-      while (new)
-        {
-          if (g_list_find_custom (out, new->data,
-                (GCompareFunc) g_date_compare))
-            g_date_free (new->data);
-          else
-            out =
-              g_list_insert_sorted (out, new->data,
-                  (GCompareFunc) g_date_compare);
+  /* Each store's dates are sorted, merge them dropping the days found in
+   * more than one store */
+  merge = _tpl_log_merge_new ((GCompareFunc) g_date_compare,
+      (GDestroyNotify) g_date_free, TPL_LOG_MERGE_UNIQUE);
 
-          new = g_list_delete_link (new, new);
-        }
-    }
+  for (i = 0; i < n; i++)
+    _tpl_log_merge_add (merge, results[i]);
 
-  return out;
+  g_free (results);
+
+  return _tpl_log_merge_finish (merge, 0);
 }
 
 
@@ -537,23 +1089,28 @@ _tpl_log_manager_get_events_for_date (TplLogManager *manager,
     gint type_mask,
     const GDate *date)
 {
-  GList *l, *out = NULL;
-  TplLogManagerPriv *priv;
+  StoreQuery query = { account, target, type_mask, date, };
+  GList **results;
+  TplLogMerge *merge;
+  guint i, n;
 
   g_return_val_if_fail (TPL_IS_LOG_MANAGER (manager), NULL);
   g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
 
-  priv = manager->priv;
+  _tpl_log_manager_flush (manager);
 
-  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
-    {
-      TplLogStore *store = TPL_LOG_STORE (l->data);
+  results = log_manager_query_stores (manager, store_query_events_for_date,
+      &query, &n);
 
-      out = g_list_concat (out, _tpl_log_store_get_events_for_date (store,
-          account, target, type_mask, date));
-    }
+  merge = _tpl_log_merge_new (_tpl_event_compare_timestamps,
+      g_object_unref, 0);
 
-  return out;
+  for (i = 0; i < n; i++)
+    _tpl_log_merge_add (merge, results[i]);
+
+  g_free (results);
+
+  return _tpl_log_merge_finish (merge, 0);
 }
 
 
@@ -567,7 +1124,7 @@ _tpl_log_manager_get_filtered_events (TplLogManager *manager,
     gpointer user_data)
 {
   TplLogManagerPriv *priv;
-  GQueue out = G_QUEUE_INIT;
+  TplLogMerge *merge;
   GList *l;
 
   g_return_val_if_fail (TPL_IS_LOG_MANAGER (manager), NULL);
@@ -575,31 +1132,27 @@ _tpl_log_manager_get_filtered_events (TplLogManager *manager,
 
   priv = manager->priv;
 
-  /* Get num_events from each log store and keep only the
-   * newest ones in the out list. Keep that list sorted: olders first. */
-  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
-    {
-      TplLogStore *store = TPL_LOG_STORE (l->data);
-      GList *new, *index = NULL;
+  _tpl_log_manager_flush (manager);
 
-      new = _tpl_log_store_get_filtered_events (store, account, target,
-          type_mask, num_events, filter, user_data);
+  if (num_events == 0)
+    return NULL;
 
-      while (new != NULL)
-        {
-          index = _tpl_event_queue_insert_sorted_after (&out, index, new->data);
+  /* Get num_events from each log store and keep only the newest ones,
+   * sorted olders first. Unlike the other queries, the stores are queried
+   * one after the other, as @filter is only ever called from one thread at
+   * a time. */
+  merge = _tpl_log_merge_new (_tpl_event_compare_timestamps,
+      g_object_unref, TPL_LOG_MERGE_FROM_END);
 
-          if (out.length > num_events)
-            {
-              /* We have too many elements. Remove the oldest event. */
-              g_object_unref (g_queue_pop_head (&out));
-            }
+  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
+    {
+      TplLogStore *store = TPL_LOG_STORE (l->data);
 
-          new = g_list_delete_link (new, new);
-        }
+      _tpl_log_merge_add (merge, _tpl_log_store_get_filtered_events (store,
+          account, target, type_mask, num_events, filter, user_data));
     }
 
-  return out.head;
+  return _tpl_log_merge_finish (merge, num_events);
 }
 
 
@@ -618,29 +1171,37 @@ GList *
 _tpl_log_manager_get_entities (TplLogManager *manager,
     TpAccount *account)
 {
-  GList *l, *out = NULL;
-  TplLogManagerPriv *priv;
+  StoreQuery query = { account, };
+  GList **results;
+  GList *out = NULL;
+  GHashTable *seen;
+  guint i, n;
 
   g_return_val_if_fail (TPL_IS_LOG_MANAGER (manager), NULL);
   g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
 
-  priv = manager->priv;
+  _tpl_log_manager_flush (manager);
 
-  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
+  results = log_manager_query_stores (manager, store_query_entities, &query,
+      &n);
+
+  /* of TplEntity, borrowed from out */
+  seen = g_hash_table_new (_tpl_entity_hash, _tpl_entity_equal);
+
+  for (i = 0; i < n; i++)
     {
-      TplLogStore *store = TPL_LOG_STORE (l->data);
-      GList *in, *j;
+      GList *in = results[i];
+      GList *j;
 
-      in = _tpl_log_store_get_entities (store, account);
       /* merge the lists avoiding duplicates */
       for (j = in; j != NULL; j = g_list_next (j))
         {
           TplEntity *entity = TPL_ENTITY (j->data);
 
-          if (g_list_find_custom (out, entity,
-                (GCompareFunc) _tpl_entity_compare) == NULL)
+          if (!g_hash_table_contains (seen, entity))
             {
               /* add data if not already present */
+              g_hash_table_add (seen, entity);
               out = g_list_prepend (out, entity);
             }
           else
@@ -650,6 +1211,9 @@ _tpl_log_manager_get_entities (TplLogManager *manager,
       g_list_free (in);
     }
 
+  g_hash_table_unref (seen);
+  g_free (results);
+
   return out;
 }
 
@@ -658,6 +1222,50 @@ GList *
 _tpl_log_manager_search (TplLogManager *manager,
     const gchar *text,
     gint type_mask)
+{
+  StoreQuery query = { NULL, NULL, type_mask, };
+  GList **results;
+  GList *out = NULL;
+  guint i, n;
+
+  g_return_val_if_fail (TPL_IS_LOG_MANAGER (manager), NULL);
+  g_return_val_if_fail (!TPL_STR_EMPTY (text), NULL);
+
+  _tpl_log_manager_flush (manager);
+
+  query.text = text;
+  results = log_manager_query_stores (manager, store_query_search, &query,
+      &n);
+
+  /* concatenated from the last one, so that each list is only walked once */
+  for (i = n; i > 0; i--)
+    out = g_list_concat (results[i - 1], out);
+
+  g_free (results);
+
+  return out;
+}
+
+
+static gboolean
+log_manager_search_collect (GList *hits,
+    gpointer user_data)
+{
+  GList **out = user_data;
+
+  *out = g_list_concat (*out, hits);
+
+  return TRUE;
+}
+
+
+/* Like _tpl_log_manager_search (), but only looks at the logs within @scope,
+ * which may be NULL to look at all of them */
+GList *
+_tpl_log_manager_search_scoped (TplLogManager *manager,
+    const gchar *text,
+    gint type_mask,
+    const TplLogSearchScope *scope)
 {
   GList *l, *out = NULL;
   TplLogManagerPriv *priv;
@@ -667,13 +1275,11 @@ _tpl_log_manager_search (TplLogManager *manager,
 
   priv = manager->priv;
 
-  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
-    {
-      TplLogStore *store = TPL_LOG_STORE (l->data);
+  _tpl_log_manager_flush (manager);
 
-      out = g_list_concat (out, _tpl_log_store_search_new (store, text,
-            type_mask));
-    }
+  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
+    _tpl_log_store_search (TPL_LOG_STORE (l->data), text, type_mask, scope,
+        NULL, log_manager_search_collect, &out);
 
   return out;
 }
@@ -770,6 +1376,7 @@ tpl_log_manager_event_info_free (TplLogManagerEventInfo *data)
   tp_clear_object (&data->target);
 
   tp_clear_pointer (&data->date, g_date_free);
+  tp_clear_pointer (&data->end_date, g_date_free);
   tp_clear_pointer (&data->search_text, g_free);
   g_slice_free (TplLogManagerEventInfo, data);
 }
@@ -800,6 +1407,8 @@ _tpl_log_manager_clear (TplLogManager *self)
 
   priv = self->priv;
 
+  _tpl_log_manager_flush (self);
+
   for (l = priv->stores; l != NULL; l = g_list_next (l))
     {
       _tpl_log_store_clear (TPL_LOG_STORE (l->data));
@@ -818,6 +1427,8 @@ _tpl_log_manager_clear_account (TplLogManager *self,
 
   priv = self->priv;
 
+  _tpl_log_manager_flush (self);
+
   for (l = priv->stores; l != NULL; l = g_list_next (l))
     {
       _tpl_log_store_clear_account (TPL_LOG_STORE (l->data), account);
@@ -837,6 +1448,8 @@ _tpl_log_manager_clear_entity (TplLogManager *self,
 
   priv = self->priv;
 
+  _tpl_log_manager_flush (self);
+
   for (l = priv->stores; l != NULL; l = g_list_next (l))
     {
       _tpl_log_store_clear_entity (TPL_LOG_STORE (l->data), account, entity);
@@ -875,16 +1488,19 @@ typedef struct
 {
   GSimpleAsyncResult *result;
   GSimpleAsyncThreadFunc func;
+  gint priority;
 } AsyncOpData;
 
 static AsyncOpData *
 async_op_data_new (GSimpleAsyncResult *result,
-    GSimpleAsyncThreadFunc func)
+    GSimpleAsyncThreadFunc func,
+    gint priority)
 {
   AsyncOpData *data = g_slice_new (AsyncOpData);
 
   data->result = g_object_ref (result);
   data->func = func;
+  data->priority = priority;
   return data;
 }
 
@@ -910,7 +1526,12 @@ account_prepared_cb (GObject *source,
     }
   else
     {
-      g_simple_async_result_run_in_thread (data->result, data->func, 0, NULL);
+      GObject *manager = g_async_result_get_source_object (
+          G_ASYNC_RESULT (data->result));
+
+      log_manager_run_in_pool (TPL_LOG_MANAGER (manager), data->result,
+          data->func, data->priority, NULL);
+      g_object_unref (manager);
     }
 
   async_op_data_free (data);
@@ -919,7 +1540,8 @@ account_prepared_cb (GObject *source,
 static void
 start_async_op_in_thread (TpAccount *account,
     GSimpleAsyncResult *result,
-    GSimpleAsyncThreadFunc func)
+    GSimpleAsyncThreadFunc func,
+    gint priority)
 {
   if (account != NULL)
     {
@@ -930,11 +1552,16 @@ start_async_op_in_thread (TpAccount *account,
        * this in the main thread, before starting the actual
        * operation in the other thread. */
       tp_proxy_prepare_async (account, features, account_prepared_cb,
-          async_op_data_new (result, func));
+          async_op_data_new (result, func, priority));
     }
   else
     {
-      g_simple_async_result_run_in_thread (result, func, 0, NULL);
+      GObject *manager = g_async_result_get_source_object (
+          G_ASYNC_RESULT (result));
+
+      log_manager_run_in_pool (TPL_LOG_MANAGER (manager), result, func,
+          priority, NULL);
+      g_object_unref (manager);
     }
 }
 
@@ -984,7 +1611,8 @@ tpl_log_manager_get_dates_async (TplLogManager *manager,
       _tpl_log_manager_async_operation_cb, async_data,
       tpl_log_manager_get_dates_async);
 
-  start_async_op_in_thread (account, simple, _get_dates_async_thread);
+  start_async_op_in_thread (account, simple, _get_dates_async_thread,
+      G_PRIORITY_DEFAULT);
 
   g_object_unref (simple);
 }
@@ -1094,7 +1722,8 @@ tpl_log_manager_get_events_for_date_async (TplLogManager *manager,
       _tpl_log_manager_async_operation_cb, async_data,
       tpl_log_manager_get_events_for_date_async);
 
-  start_async_op_in_thread (account, simple, _get_events_for_date_async_thread);
+  start_async_op_in_thread (account, simple, _get_events_for_date_async_thread,
+      G_PRIORITY_DEFAULT);
 
   g_object_unref (simple);
 }
@@ -1210,7 +1839,8 @@ tpl_log_manager_get_filtered_events_async (TplLogManager *manager,
       _tpl_log_manager_async_operation_cb, async_data,
       tpl_log_manager_get_filtered_events_async);
 
-  start_async_op_in_thread (account, simple, _get_filtered_events_async_thread);
+  start_async_op_in_thread (account, simple, _get_filtered_events_async_thread,
+      G_PRIORITY_DEFAULT);
 
   g_object_unref (simple);
 }
@@ -1280,6 +1910,9 @@ tpl_log_manager_walk_filtered_events (TplLogManager *manager,
   g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
 
   priv = manager->priv;
+
+  _tpl_log_manager_flush (manager);
+
   walker = tpl_log_walker_new (filter, filter_data);
 
   for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
@@ -1350,7 +1983,8 @@ tpl_log_manager_get_entities_async (TplLogManager *self,
       _tpl_log_manager_async_operation_cb, async_data,
       tpl_log_manager_get_entities_async);
 
-  start_async_op_in_thread (account, simple, _get_entities_async_thread);
+  start_async_op_in_thread (account, simple, _get_entities_async_thread,
+      G_PRIORITY_DEFAULT);
 
   g_object_unref (simple);
 }
@@ -1449,7 +2083,8 @@ tpl_log_manager_search_async (TplLogManager *manager,
       _tpl_log_manager_async_operation_cb, async_data,
       tpl_log_manager_search_async);
 
-  start_async_op_in_thread (NULL, simple, _search_async_thread);
+  start_async_op_in_thread (NULL, simple, _search_async_thread,
+      INTERACTIVE_PRIORITY);
 
   g_object_unref (simple);
 }
@@ -1489,6 +2124,386 @@ tpl_log_manager_search_finish (TplLogManager *self,
 }
 
 
+static void
+_search_scoped_async_thread (GSimpleAsyncResult *simple,
+    GObject *object,
+    GCancellable *cancellable)
+{
+  TplLogManagerAsyncData *async_data;
+  TplLogManagerEventInfo *event_info;
+  TplLogSearchScope scope;
+  GList *lst;
+
+  async_data = g_async_result_get_user_data (G_ASYNC_RESULT (simple));
+  event_info = async_data->request;
+
+  scope.account = event_info->account;
+  scope.target = event_info->target;
+  scope.from = event_info->date;
+  scope.to = event_info->end_date;
+
+  lst = _tpl_log_manager_search_scoped (async_data->manager,
+      event_info->search_text, event_info->type_mask, &scope);
+
+  g_simple_async_result_set_op_res_gpointer (simple, lst,
+      (GDestroyNotify) tpl_log_manager_search_free);
+}
+
+
+/**
+ * tpl_log_manager_search_scoped_async:
+ * @manager: a #TplLogManager
+ * @text: the pattern to search
+ * @type_mask: event type filter see #TplEventTypeMask
+ * @account: (allow-none): the #TpAccount to search the logs of, or %NULL
+ *  for all of them
+ * @target: (allow-none): the #TplEntity to search the logs of, or %NULL for
+ *  all of them; only used along with @account
+ * @from: (allow-none): the first day to search, or %NULL
+ * @to: (allow-none): the last day to search, or %NULL
+ * @callback: a callback to call when the request is satisfied
+ * @user_data: data to pass to @callback
+ *
+ * Searches for the conversations containing @text, like
+ * tpl_log_manager_search_async () does, but only in the logs of @account
+ * and @target, between @from and @to (both included). Logs out of that
+ * range aren't even opened.
+ */
+void
+tpl_log_manager_search_scoped_async (TplLogManager *manager,
+    const gchar *text,
+    gint type_mask,
+    TpAccount *account,
+    TplEntity *target,
+    const GDate *from,
+    const GDate *to,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  TplLogManagerEventInfo *event_info = tpl_log_manager_event_info_new ();
+  TplLogManagerAsyncData *async_data = tpl_log_manager_async_data_new ();
+  GSimpleAsyncResult *simple;
+
+  g_return_if_fail (TPL_IS_LOG_MANAGER (manager));
+  g_return_if_fail (!TPL_STR_EMPTY (text));
+  g_return_if_fail (account == NULL || TP_IS_ACCOUNT (account));
+  g_return_if_fail (target == NULL || TPL_IS_ENTITY (target));
+
+  event_info->search_text = g_strdup (text);
+  event_info->type_mask = type_mask;
+
+  if (account != NULL)
+    {
+      event_info->account = g_object_ref (account);
+
+      if (target != NULL)
+        event_info->target = g_object_ref (target);
+    }
+
+  if (from != NULL)
+    event_info->date = copy_date (from);
+
+  if (to != NULL)
+    event_info->end_date = copy_date (to);
+
+  async_data->manager = g_object_ref (manager);
+  async_data->request = event_info;
+  async_data->request_free =
+    (TplLogManagerFreeFunc) tpl_log_manager_event_info_free;
+  async_data->cb = callback;
+  async_data->user_data = user_data;
+
+  simple = g_simple_async_result_new (G_OBJECT (manager),
+      _tpl_log_manager_async_operation_cb, async_data,
+      tpl_log_manager_search_scoped_async);
+
+  start_async_op_in_thread (account, simple, _search_scoped_async_thread,
+      INTERACTIVE_PRIORITY);
+
+  g_object_unref (simple);
+}
+
+
+/**
+ * tpl_log_manager_search_scoped_finish:
+ * @self: a #TplLogManager
+ * @result: a #GAsyncResult
+ * @hits: (out) (transfer full) (element-type TelepathyLogger.LogSearchHit): a
+ *  pointer to a #GList used to return the list of #TplLogSearchHit
+ * @error: a #GError to fill
+ *
+ * Returns: #TRUE if the operation was successful, otherwise #FALSE
+ */
+gboolean
+tpl_log_manager_search_scoped_finish (TplLogManager *self,
+    GAsyncResult *result,
+    GList **hits,
+    GError **error)
+{
+  GSimpleAsyncResult *simple;
+
+  g_return_val_if_fail (TPL_IS_LOG_MANAGER (self), FALSE);
+  g_return_val_if_fail (G_IS_SIMPLE_ASYNC_RESULT (result), FALSE);
+  g_return_val_if_fail (g_simple_async_result_is_valid (result,
+        G_OBJECT (self), tpl_log_manager_search_scoped_async), FALSE);
+
+  simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return FALSE;
+
+  if (hits != NULL)
+    *hits = _take_list (g_simple_async_result_get_op_res_gpointer (simple));
+  return TRUE;
+}
+
+
+static TplLogManagerSearch *
+log_manager_search_ref (TplLogManagerSearch *search)
+{
+  g_atomic_int_inc (&search->ref_count);
+  return search;
+}
+
+
+static void
+log_manager_search_unref (TplLogManagerSearch *search)
+{
+  if (!g_atomic_int_dec_and_test (&search->ref_count))
+    return;
+
+  if (search->hits_destroy != NULL)
+    search->hits_destroy (search->hits_user_data);
+
+  g_object_unref (search->manager);
+  g_free (search->text);
+  tp_clear_object (&search->cancellable);
+  g_main_context_unref (search->context);
+  g_mutex_clear (&search->lock);
+  tpl_log_manager_search_free (search->pending);
+  g_slice_free (TplLogManagerSearch, search);
+}
+
+
+/* Called in the caller's main context */
+static void
+log_manager_search_flush (TplLogManagerSearch *search)
+{
+  GList *hits;
+
+  g_mutex_lock (&search->lock);
+  hits = search->pending;
+  search->pending = NULL;
+  search->flush_scheduled = FALSE;
+  g_mutex_unlock (&search->lock);
+
+  if (hits != NULL && !g_cancellable_is_cancelled (search->cancellable))
+    search->hits_func (search->manager, hits, search->hits_user_data);
+
+  tpl_log_manager_search_free (hits);
+}
+
+
+static gboolean
+log_manager_search_flush_idle (gpointer user_data)
+{
+  log_manager_search_flush (user_data);
+  return FALSE;
+}
+
+
+/* Called in the searching thread, see TplLogStoreSearchFunc */
+static gboolean
+log_manager_search_add_hits (GList *hits,
+    gpointer user_data)
+{
+  TplLogManagerSearch *search = user_data;
+  GList *kept = NULL;
+  GList *l;
+
+  for (l = hits; l != NULL; l = g_list_next (l))
+    {
+      if (search->max_hits == 0 || search->n_hits < search->max_hits)
+        {
+          kept = g_list_prepend (kept, l->data);
+          search->n_hits++;
+        }
+      else
+        {
+          _tpl_log_manager_search_hit_free (l->data);
+        }
+    }
+
+  g_list_free (hits);
+
+  g_mutex_lock (&search->lock);
+
+  search->pending = g_list_concat (search->pending, g_list_reverse (kept));
+
+  if (search->pending != NULL && !search->flush_scheduled)
+    {
+      GSource *source = g_idle_source_new ();
+
+      g_source_set_callback (source, log_manager_search_flush_idle,
+          log_manager_search_ref (search),
+          (GDestroyNotify) log_manager_search_unref);
+      g_source_attach (source, search->context);
+      g_source_unref (source);
+
+      search->flush_scheduled = TRUE;
+    }
+
+  g_mutex_unlock (&search->lock);
+
+  return (search->max_hits == 0 || search->n_hits < search->max_hits)
+    && !g_cancellable_is_cancelled (search->cancellable);
+}
+
+
+static void
+_search_incremental_async_thread (GSimpleAsyncResult *simple,
+    GObject *object,
+    GCancellable *cancellable)
+{
+  TplLogManagerSearch *search;
+  TplLogManagerPriv *priv;
+  GList *l;
+
+  search = g_async_result_get_user_data (G_ASYNC_RESULT (simple));
+  priv = search->manager->priv;
+
+  _tpl_log_manager_flush (search->manager);
+
+  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
+    {
+      if (g_cancellable_is_cancelled (cancellable))
+        break;
+
+      if (search->max_hits != 0 && search->n_hits >= search->max_hits)
+        break;
+
+      _tpl_log_store_search (TPL_LOG_STORE (l->data), search->text,
+          search->type_mask, NULL, cancellable, log_manager_search_add_hits,
+          search);
+    }
+}
+
+
+static void
+_search_incremental_async_cb (GObject *source_object,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  TplLogManagerSearch *search = user_data;
+
+  /* The search is over, so whatever it found is already pending */
+  log_manager_search_flush (search);
+
+  if (search->callback != NULL)
+    search->callback (source_object, result, search->user_data);
+
+  log_manager_search_unref (search);
+}
+
+
+/**
+ * tpl_log_manager_search_incremental_async:
+ * @manager: a #TplLogManager
+ * @text: the pattern to search
+ * @type_mask: event type filter see #TplEventTypeMask
+ * @max_hits: the number of hits to stop the search at, or 0 for no limit
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @hits_func: (scope notified): a function to pass hits to as they are
+ *  found
+ * @hits_user_data: (closure hits_func): data to pass to @hits_func
+ * @hits_destroy: (allow-none): a function to free @hits_user_data with, in
+ *  the same main context, once @hits_func won't be called any more
+ * @callback: a callback to call once the search is over
+ * @user_data: data to pass to @callback
+ *
+ * Searches for all the conversations containing @text, like
+ * tpl_log_manager_search_async () does, but passes the hits to @hits_func,
+ * in the thread-default main context of the caller, as soon as they are
+ * found. @callback is called after the last of them.
+ *
+ * Cancelling @cancellable stops the search: @hits_func isn't called any more
+ * and tpl_log_manager_search_incremental_finish () fails with
+ * %G_IO_ERROR_CANCELLED.
+ */
+void
+tpl_log_manager_search_incremental_async (TplLogManager *manager,
+    const gchar *text,
+    gint type_mask,
+    guint max_hits,
+    GCancellable *cancellable,
+    TplLogSearchHitsFunc hits_func,
+    gpointer hits_user_data,
+    GDestroyNotify hits_destroy,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  TplLogManagerSearch *search;
+  GSimpleAsyncResult *simple;
+
+  g_return_if_fail (TPL_IS_LOG_MANAGER (manager));
+  g_return_if_fail (!TPL_STR_EMPTY (text));
+  g_return_if_fail (hits_func != NULL);
+
+  search = g_slice_new0 (TplLogManagerSearch);
+  search->ref_count = 1;
+  search->manager = g_object_ref (manager);
+  search->text = g_strdup (text);
+  search->type_mask = type_mask;
+  search->max_hits = max_hits;
+  search->cancellable = (cancellable != NULL) ?
+    g_object_ref (cancellable) : NULL;
+  search->hits_func = hits_func;
+  search->hits_user_data = hits_user_data;
+  search->hits_destroy = hits_destroy;
+  search->callback = callback;
+  search->user_data = user_data;
+  search->context = g_main_context_ref_thread_default ();
+  g_mutex_init (&search->lock);
+
+  simple = g_simple_async_result_new (G_OBJECT (manager),
+      _search_incremental_async_cb, search,
+      tpl_log_manager_search_incremental_async);
+
+  g_simple_async_result_set_check_cancellable (simple, cancellable);
+  log_manager_run_in_pool (manager, simple, _search_incremental_async_thread,
+      INTERACTIVE_PRIORITY, cancellable);
+
+  g_object_unref (simple);
+}
+
+
+/**
+ * tpl_log_manager_search_incremental_finish:
+ * @self: a #TplLogManager
+ * @result: a #GAsyncResult
+ * @error: a #GError to fill
+ *
+ * Returns: #TRUE if the search went through, or stopped at the requested
+ *  number of hits, otherwise #FALSE
+ */
+gboolean
+tpl_log_manager_search_incremental_finish (TplLogManager *self,
+    GAsyncResult *result,
+    GError **error)
+{
+  GSimpleAsyncResult *simple;
+
+  g_return_val_if_fail (TPL_IS_LOG_MANAGER (self), FALSE);
+  g_return_val_if_fail (G_IS_SIMPLE_ASYNC_RESULT (result), FALSE);
+  g_return_val_if_fail (g_simple_async_result_is_valid (result,
+        G_OBJECT (self), tpl_log_manager_search_incremental_async), FALSE);
+
+  simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  return !g_simple_async_result_propagate_error (simple, error);
+}
+
+
 /**
  * tpl_log_manager_errors_quark:
  *
@@ -1518,40 +2533,37 @@ _tpl_log_manager_search_hit_copy (TplLogSearchHit *hit)
       hit->date);
 }
 
+static const gchar *
+_tpl_log_manager_get_account_name (TpAccount *account)
+{
+    const gchar *acc_name = tp_proxy_get_object_path (account);
+    if (g_str_has_prefix (acc_name, TP_ACCOUNT_OBJECT_PATH_BASE))
+        acc_name += strlen (TP_ACCOUNT_OBJECT_PATH_BASE);
+
+    return acc_name;
+}
+
 static gchar *
 _tpl_log_manager_build_identifier (TpAccount *account,
     TplEntity *entity)
 {
     gchar *identifier;
-    const gchar *acc_name = tp_proxy_get_object_path (account);
-    if (g_str_has_prefix (acc_name, TP_ACCOUNT_OBJECT_PATH_BASE))
-        acc_name += strlen (TP_ACCOUNT_OBJECT_PATH_BASE);
 
-    identifier = g_strconcat (acc_name, "/", tpl_entity_get_identifier (entity), NULL);
+    identifier = g_strconcat (_tpl_log_manager_get_account_name (account),
+        "/", tpl_entity_get_identifier (entity), NULL);
 
     return identifier;
 }
 
+/* Called for each event, so it doesn't allocate */
 static gboolean
 _tpl_log_manager_is_disabled_for_entity (TplLogManager *self,
-    const gchar *identifier)
+    TpAccount *account,
+    TplEntity *entity)
 {
-    gint i;
-    TplLogManagerPriv *priv = self->priv;
-    const gchar **ignorelist;
-
-    priv = self->priv;
-    ignorelist = _tpl_conf_get_ignorelist (priv->conf);
-
-    for (i = 0; ignorelist && ignorelist[i]; i++)
-      {
-        if (g_strcmp0 (ignorelist[i], identifier) == 0)
-        {
-            return TRUE;
-        }
-      }
-
-    return FALSE;
+    return _tpl_conf_is_ignored (self->priv->conf,
+        _tpl_log_manager_get_account_name (account),
+        tpl_entity_get_identifier (entity));
 }
 
 /**
@@ -1576,7 +2588,7 @@ tpl_log_manager_disable_for_entity (TplLogManager *self,
 
     priv = self->priv;
     identifier = _tpl_log_manager_build_identifier (account, entity);
-    if (!_tpl_log_manager_is_disabled_for_entity (self, identifier))
+    if (!_tpl_log_manager_is_disabled_for_entity (self, account, entity))
       {
         const gchar **ignorelist = _tpl_conf_get_ignorelist (priv->conf);
         gchar **newlist;
@@ -1624,7 +2636,7 @@ tpl_log_manager_enable_for_entity (TplLogManager *self,
 
     priv = self->priv;
     identifier = _tpl_log_manager_build_identifier (account, entity);
-    if (_tpl_log_manager_is_disabled_for_entity (self, identifier))
+    if (_tpl_log_manager_is_disabled_for_entity (self, account, entity))
       {
         gint i, j;
         const gchar **ignorelist = _tpl_conf_get_ignorelist (priv->conf);
@@ -1667,16 +2679,9 @@ tpl_log_manager_is_disabled_for_entity (TplLogManager *self,
     TpAccount *account,
     TplEntity *entity)
 {
-    gboolean is_disabled;
-    gchar *identifier;
-
     g_return_val_if_fail (TPL_IS_LOG_MANAGER (self), FALSE);
     g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
     g_return_val_if_fail (TPL_IS_ENTITY (entity), FALSE);
 
-    identifier = _tpl_log_manager_build_identifier (account, entity);
-    is_disabled = _tpl_log_manager_is_disabled_for_entity (self, identifier);
-    g_free (identifier);
-
-    return is_disabled;
+    return _tpl_log_manager_is_disabled_for_entity (self, account, entity);
 }
@@ -98,6 +98,10 @@ struct _TplLogSearchHit
 typedef gboolean (*TplLogEventFilter) (TplEvent *event,
     gpointer user_data);
 
+typedef void (*TplLogSearchHitsFunc) (TplLogManager *manager,
+    GList *hits,
+    gpointer user_data);
+
 GType tpl_log_manager_get_type (void);
 
 TplLogManager *tpl_log_manager_dup_singleton (void);
@@ -175,6 +179,36 @@ gboolean tpl_log_manager_search_finish (TplLogManager *self,
     GList **hits,
     GError **error);
 
+void tpl_log_manager_search_scoped_async (TplLogManager *manager,
+    const gchar *text,
+    gint type_mask,
+    TpAccount *account,
+    TplEntity *target,
+    const GDate *from,
+    const GDate *to,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+gboolean tpl_log_manager_search_scoped_finish (TplLogManager *self,
+    GAsyncResult *result,
+    GList **hits,
+    GError **error);
+
+void tpl_log_manager_search_incremental_async (TplLogManager *manager,
+    const gchar *text,
+    gint type_mask,
+    guint max_hits,
+    GCancellable *cancellable,
+    TplLogSearchHitsFunc hits_func,
+    gpointer hits_user_data,
+    GDestroyNotify hits_destroy,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+gboolean tpl_log_manager_search_incremental_finish (TplLogManager *self,
+    GAsyncResult *result,
+    GError **error);
+
 void tpl_log_manager_disable_for_entity (TplLogManager *self,
     TpAccount *account,
     TplEntity *entity);
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TPL_LOG_MERGE_H__
+#define __TPL_LOG_MERGE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  /* drop the items comparing equal to the one taken before them */
+  TPL_LOG_MERGE_UNIQUE = 1 << 0,
+  /* take the greatest items first, e.g. to keep the newest events */
+  TPL_LOG_MERGE_FROM_END = 1 << 1
+} TplLogMergeFlags;
+
+typedef struct _TplLogMerge TplLogMerge;
+
+TplLogMerge * _tpl_log_merge_new (GCompareFunc compare,
+    GDestroyNotify free_func,
+    TplLogMergeFlags flags);
+
+void _tpl_log_merge_add (TplLogMerge *self,
+    GList *sorted);
+
+gpointer _tpl_log_merge_pop (TplLogMerge *self);
+
+GList * _tpl_log_merge_finish (TplLogMerge *self,
+    guint limit);
+
+void _tpl_log_merge_free (TplLogMerge *self);
+
+G_END_DECLS
+
+#endif /* __TPL_LOG_MERGE_H__ */
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Merges the sorted lists returned by each log store into one, keeping a
+ * binary heap of the lists ordered by their first item, so that taking n
+ * items out of k lists costs O(n log k). */
+
+#include "config.h"
+#include "log-merge-internal.h"
+
+typedef struct
+{
+  /* the items not taken yet, the next one first */
+  GList *items;
+  /* the order the list was added in, which breaks ties */
+  guint index;
+} Source;
+
+struct _TplLogMerge
+{
+  GCompareFunc compare;
+  GDestroyNotify free_func;
+  TplLogMergeFlags flags;
+  /* of Source, heap ordered */
+  GArray *heap;
+  guint n_added;
+};
+
+
+/* Returns: whether @a must be taken before @b */
+static gboolean
+source_before (TplLogMerge *self,
+    const Source *a,
+    const Source *b)
+{
+  gint c = self->compare (a->items->data, b->items->data);
+
+  if (self->flags & TPL_LOG_MERGE_FROM_END)
+    {
+      /* equal items are taken from the last list first, so that once the
+       * result is turned around they are in the order of the lists */
+      if (c == 0)
+        return a->index > b->index;
+
+      return c > 0;
+    }
+
+  if (c == 0)
+    return a->index < b->index;
+
+  return c < 0;
+}
+
+
+static void
+sift_up (TplLogMerge *self,
+    guint i)
+{
+  Source *heap = (Source *) self->heap->data;
+
+  while (i > 0)
+    {
+      guint parent = (i - 1) / 2;
+      Source tmp;
+
+      if (!source_before (self, &heap[i], &heap[parent]))
+        break;
+
+      tmp = heap[i];
+      heap[i] = heap[parent];
+      heap[parent] = tmp;
+      i = parent;
+    }
+}
+
+
+static void
+sift_down (TplLogMerge *self,
+    guint i)
+{
+  Source *heap = (Source *) self->heap->data;
+  guint len = self->heap->len;
+
+  for (;;)
+    {
+      guint first = i;
+      guint left = 2 * i + 1;
+      guint right = left + 1;
+      Source tmp;
+
+      if (left < len && source_before (self, &heap[left], &heap[first]))
+        first = left;
+      if (right < len && source_before (self, &heap[right], &heap[first]))
+        first = right;
+
+      if (first == i)
+        break;
+
+      tmp = heap[i];
+      heap[i] = heap[first];
+      heap[first] = tmp;
+      i = first;
+    }
+}
+
+
+/* Returns: the next item of the first list, which is then moved to its
+ * place in the heap */
+static gpointer
+take_first (TplLogMerge *self)
+{
+  Source *first = &g_array_index (self->heap, Source, 0);
+  gpointer data = first->items->data;
+
+  first->items = g_list_delete_link (first->items, first->items);
+
+  if (first->items == NULL)
+    {
+      g_array_remove_index_fast (self->heap, 0);
+      if (self->heap->len == 0)
+        return data;
+    }
+
+  sift_down (self, 0);
+
+  return data;
+}
+
+
+/*
+ * _tpl_log_merge_new:
+ * @compare: the order of the items
+ * @free_func: (allow-none): called on the items which are not returned
+ * @flags: a #TplLogMergeFlags
+ *
+ * Returns: a new #TplLogMerge, to be freed with _tpl_log_merge_finish() or
+ *  _tpl_log_merge_free()
+ */
+TplLogMerge *
+_tpl_log_merge_new (GCompareFunc compare,
+    GDestroyNotify free_func,
+    TplLogMergeFlags flags)
+{
+  TplLogMerge *self;
+
+  g_return_val_if_fail (compare != NULL, NULL);
+
+  self = g_slice_new0 (TplLogMerge);
+  self->compare = compare;
+  self->free_func = free_func;
+  self->flags = flags;
+  self->heap = g_array_new (FALSE, FALSE, sizeof (Source));
+
+  return self;
+}
+
+
+/*
+ * _tpl_log_merge_add:
+ * @self: a #TplLogMerge
+ * @sorted: (transfer full): a #GList sorted in ascending order, as the log
+ *  stores return them
+ *
+ * Adds the items of @sorted to the merge. Unless %TPL_LOG_MERGE_UNIQUE is
+ * set, items comparing equal are taken in the order of the lists.
+ */
+void
+_tpl_log_merge_add (TplLogMerge *self,
+    GList *sorted)
+{
+  Source source;
+
+  g_return_if_fail (self != NULL);
+
+  if (sorted == NULL)
+    return;
+
+  if (self->flags & TPL_LOG_MERGE_FROM_END)
+    sorted = g_list_reverse (sorted);
+
+  source.items = sorted;
+  source.index = self->n_added++;
+
+  g_array_append_val (self->heap, source);
+  sift_up (self, self->heap->len - 1);
+}
+
+
+/*
+ * _tpl_log_merge_pop:
+ * @self: a #TplLogMerge
+ *
+ * Returns: (transfer full): the smallest item left, or the greatest with
+ *  %TPL_LOG_MERGE_FROM_END, or %NULL once all the items were taken
+ */
+gpointer
+_tpl_log_merge_pop (TplLogMerge *self)
+{
+  gpointer data;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  if (self->heap->len == 0)
+    return NULL;
+
+  data = take_first (self);
+
+  /* the duplicates of data are all at the start of the lists now */
+  if (self->flags & TPL_LOG_MERGE_UNIQUE)
+    while (self->heap->len > 0 &&
+        self->compare (g_array_index (self->heap, Source, 0).items->data,
+          data) == 0)
+      {
+        gpointer dup = take_first (self);
+
+        if (self->free_func != NULL)
+          self->free_func (dup);
+      }
+
+  return data;
+}
+
+
+/*
+ * _tpl_log_merge_finish:
+ * @self: (transfer full): a #TplLogMerge
+ * @limit: the maximum number of items to take, or 0 for all of them
+ *
+ * Takes up to @limit items and frees @self along with the items left. With
+ * %TPL_LOG_MERGE_FROM_END, those are the greatest items.
+ *
+ * Returns: (transfer full): a #GList of the items taken, in ascending order
+ */
+GList *
+_tpl_log_merge_finish (TplLogMerge *self,
+    guint limit)
+{
+  GList *out = NULL;
+  gpointer data;
+  guint n = 0;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  while ((limit == 0 || n < limit) &&
+      (data = _tpl_log_merge_pop (self)) != NULL)
+    {
+      out = g_list_prepend (out, data);
+      n++;
+    }
+
+  if (!(self->flags & TPL_LOG_MERGE_FROM_END))
+    out = g_list_reverse (out);
+
+  _tpl_log_merge_free (self);
+
+  return out;
+}
+
+
+void
+_tpl_log_merge_free (TplLogMerge *self)
+{
+  guint i;
+
+  if (self == NULL)
+    return;
+
+  for (i = 0; i < self->heap->len; i++)
+    {
+      Source *source = &g_array_index (self->heap, Source, i);
+
+      if (self->free_func != NULL)
+        g_list_free_full (source->items, self->free_func);
+      else
+        g_list_free (source->items);
+    }
+
+  g_array_unref (self->heap);
+  g_slice_free (TplLogMerge, self);
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TPL_LOG_SEARCH_INDEX_H__
+#define __TPL_LOG_SEARCH_INDEX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A full-text index of log files, kept in an SQLite database. It only
+ * narrows searches down: the files it returns may not actually match, but
+ * the files it leaves out don't contain the searched text (as of when they
+ * were indexed). */
+typedef struct _TplLogSearchIndex TplLogSearchIndex;
+
+/* What a file looked like when it was indexed. Files that couldn't be read
+ * are recorded with indexed set to FALSE, and have to be searched some other
+ * way. */
+typedef struct
+{
+  gint64 inode;
+  gint64 size;
+  gint64 mtime;
+  gboolean indexed;
+} TplLogSearchIndexStamp;
+
+/* A file read for _tpl_log_search_index_set_files(), see
+ * _tpl_log_search_index_set_file() */
+typedef struct
+{
+  const gchar *path;
+  TplLogSearchIndexStamp stamp;
+  gchar *text;
+} TplLogSearchIndexFile;
+
+/* Texts shorter than this (in characters) can't be looked up */
+#define TPL_LOG_SEARCH_INDEX_MIN_TEXT_LEN 3
+
+TplLogSearchIndex * _tpl_log_search_index_new (const gchar *filename);
+
+void _tpl_log_search_index_free (TplLogSearchIndex *self);
+
+GHashTable * _tpl_log_search_index_dup_stamps (TplLogSearchIndex *self,
+    const gchar *dir);
+
+gboolean _tpl_log_search_index_set_file (TplLogSearchIndex *self,
+    const gchar *path,
+    const TplLogSearchIndexStamp *stamp,
+    const gchar *text);
+
+gboolean _tpl_log_search_index_set_files (TplLogSearchIndex *self,
+    GPtrArray *files);
+
+gboolean _tpl_log_search_index_append (TplLogSearchIndex *self,
+    const gchar *path,
+    const TplLogSearchIndexStamp *before,
+    const TplLogSearchIndexStamp *after,
+    const gchar *text);
+
+void _tpl_log_search_index_remove_file (TplLogSearchIndex *self,
+    const gchar *path);
+
+GHashTable * _tpl_log_search_index_match (TplLogSearchIndex *self,
+    const gchar *text);
+
+void _tpl_log_search_index_clear (TplLogSearchIndex *self);
+
+G_END_DECLS
+
+#endif /* __TPL_LOG_SEARCH_INDEX_H__ */
@@ -0,0 +1,617 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "log-search-index-internal.h"
+
+#include <string.h>
+
+#include <sqlite3.h>
+
+#define DEBUG_FLAG TPL_DEBUG_LOG_STORE
+#include "debug-internal.h"
+
+/* The text of a file is stored as chunks, one per batch of events indexed
+ * together, so that appending to a file doesn't rewrite what was already
+ * indexed. The trigram tokenizer lets any substring of at least three
+ * characters be looked up, ignoring case, like the searches the stores run
+ * on their files. */
+#define LOG_SEARCH_INDEX_SCHEMA \
+  "PRAGMA journal_mode = WAL;" \
+  "PRAGMA synchronous = NORMAL;" \
+  "CREATE TABLE IF NOT EXISTS files (" \
+  "  id INTEGER PRIMARY KEY," \
+  "  path TEXT NOT NULL UNIQUE," \
+  "  inode INTEGER NOT NULL," \
+  "  size INTEGER NOT NULL," \
+  "  mtime INTEGER NOT NULL," \
+  "  indexed INTEGER NOT NULL);" \
+  "CREATE TABLE IF NOT EXISTS chunks (" \
+  "  id INTEGER PRIMARY KEY," \
+  "  file INTEGER NOT NULL);" \
+  "CREATE INDEX IF NOT EXISTS chunks_file ON chunks (file);" \
+  "CREATE VIRTUAL TABLE IF NOT EXISTS chunks_text USING fts5 (" \
+  "  text, tokenize = 'trigram');"
+
+struct _TplLogSearchIndex
+{
+  /* The log manager searches from its worker threads while its writer
+   * thread appends, so the connection is only used with the mutex held */
+  GMutex mutex;
+  sqlite3 *db;
+};
+
+
+static gboolean
+log_search_index_exec (TplLogSearchIndex *self,
+    const gchar *sql)
+{
+  gchar *errmsg = NULL;
+
+  if (sqlite3_exec (self->db, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+      DEBUG ("Failed to run '%s': %s", sql, errmsg);
+      sqlite3_free (errmsg);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+static sqlite3_stmt *
+log_search_index_prepare (TplLogSearchIndex *self,
+    const gchar *sql)
+{
+  sqlite3_stmt *stmt = NULL;
+
+  if (sqlite3_prepare_v2 (self->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Failed to prepare '%s': %s", sql, sqlite3_errmsg (self->db));
+      return NULL;
+    }
+
+  return stmt;
+}
+
+
+/* Runs @stmt, which returns no rows, and finalizes it */
+static gboolean
+log_search_index_run (TplLogSearchIndex *self,
+    sqlite3_stmt *stmt)
+{
+  gint e;
+
+  if (stmt == NULL)
+    return FALSE;
+
+  e = sqlite3_step (stmt);
+  if (e != SQLITE_DONE)
+    DEBUG ("SQL error: %s", sqlite3_errmsg (self->db));
+
+  sqlite3_finalize (stmt);
+
+  return e == SQLITE_DONE;
+}
+
+
+static gboolean
+log_search_index_commit (TplLogSearchIndex *self,
+    gboolean ok)
+{
+  if (ok)
+    ok = log_search_index_exec (self, "COMMIT");
+
+  if (!ok)
+    log_search_index_exec (self, "ROLLBACK");
+
+  return ok;
+}
+
+
+/* Returns the id of @path, or 0 if it isn't indexed */
+static gint64
+log_search_index_get_file_id (TplLogSearchIndex *self,
+    const gchar *path)
+{
+  sqlite3_stmt *stmt;
+  gint64 id = 0;
+
+  stmt = log_search_index_prepare (self,
+      "SELECT id FROM files WHERE path = ?");
+  if (stmt == NULL)
+    return 0;
+
+  sqlite3_bind_text (stmt, 1, path, -1, SQLITE_STATIC);
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    id = sqlite3_column_int64 (stmt, 0);
+
+  sqlite3_finalize (stmt);
+
+  return id;
+}
+
+
+static gboolean
+log_search_index_delete_chunks (TplLogSearchIndex *self,
+    gint64 file_id)
+{
+  sqlite3_stmt *stmt;
+
+  stmt = log_search_index_prepare (self,
+      "DELETE FROM chunks_text WHERE rowid IN "
+      "(SELECT id FROM chunks WHERE file = ?)");
+  if (stmt != NULL)
+    sqlite3_bind_int64 (stmt, 1, file_id);
+
+  if (!log_search_index_run (self, stmt))
+    return FALSE;
+
+  stmt = log_search_index_prepare (self, "DELETE FROM chunks WHERE file = ?");
+  if (stmt != NULL)
+    sqlite3_bind_int64 (stmt, 1, file_id);
+
+  return log_search_index_run (self, stmt);
+}
+
+
+static gboolean
+log_search_index_add_chunk (TplLogSearchIndex *self,
+    gint64 file_id,
+    const gchar *text)
+{
+  sqlite3_stmt *stmt;
+
+  if (text == NULL || *text == '\0')
+    return TRUE;
+
+  stmt = log_search_index_prepare (self,
+      "INSERT INTO chunks (file) VALUES (?)");
+  if (stmt != NULL)
+    sqlite3_bind_int64 (stmt, 1, file_id);
+
+  if (!log_search_index_run (self, stmt))
+    return FALSE;
+
+  stmt = log_search_index_prepare (self,
+      "INSERT INTO chunks_text (rowid, text) VALUES (?, ?)");
+  if (stmt != NULL)
+    {
+      sqlite3_bind_int64 (stmt, 1, sqlite3_last_insert_rowid (self->db));
+      sqlite3_bind_text (stmt, 2, text, -1, SQLITE_STATIC);
+    }
+
+  return log_search_index_run (self, stmt);
+}
+
+
+static void
+log_search_index_bind_stamp (sqlite3_stmt *stmt,
+    gint first,
+    const TplLogSearchIndexStamp *stamp)
+{
+  sqlite3_bind_int64 (stmt, first, stamp->inode);
+  sqlite3_bind_int64 (stmt, first + 1, stamp->size);
+  sqlite3_bind_int64 (stmt, first + 2, stamp->mtime);
+}
+
+
+/*
+ * _tpl_log_search_index_new:
+ * @filename: the database to use, which is created if needed, or
+ * ":memory:" for an index that only lasts as long as the process
+ *
+ * Returns: a new index, or %NULL if the database can't be opened or SQLite
+ * lacks the FTS5 trigram tokenizer
+ */
+TplLogSearchIndex *
+_tpl_log_search_index_new (const gchar *filename)
+{
+  TplLogSearchIndex *self;
+
+  self = g_slice_new0 (TplLogSearchIndex);
+  g_mutex_init (&self->mutex);
+
+  DEBUG ("search index is '%s'", filename);
+
+  if (sqlite3_open (filename, &self->db) != SQLITE_OK)
+    {
+      DEBUG ("Failed to open search index: %s", sqlite3_errmsg (self->db));
+      goto fail;
+    }
+
+  if (!log_search_index_exec (self, LOG_SEARCH_INDEX_SCHEMA))
+    goto fail;
+
+  return self;
+
+fail:
+  _tpl_log_search_index_free (self);
+  return NULL;
+}
+
+
+void
+_tpl_log_search_index_free (TplLogSearchIndex *self)
+{
+  sqlite3_close (self->db);
+  g_mutex_clear (&self->mutex);
+  g_slice_free (TplLogSearchIndex, self);
+}
+
+
+/*
+ * _tpl_log_search_index_dup_stamps:
+ * @dir: a directory
+ *
+ * Returns: a new hash table mapping the path of every file indexed below
+ * @dir to its #TplLogSearchIndexStamp
+ */
+GHashTable *
+_tpl_log_search_index_dup_stamps (TplLogSearchIndex *self,
+    const gchar *dir)
+{
+  GHashTable *stamps;
+  sqlite3_stmt *stmt;
+  gchar *lower;
+  gchar *upper;
+
+  stamps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  /* Every path starting with "dir/" sorts before "dir0" */
+  if (g_str_has_suffix (dir, G_DIR_SEPARATOR_S))
+    lower = g_strdup (dir);
+  else
+    lower = g_strconcat (dir, G_DIR_SEPARATOR_S, NULL);
+  upper = g_strdup (lower);
+  upper[strlen (upper) - 1]++;
+
+  g_mutex_lock (&self->mutex);
+
+  stmt = log_search_index_prepare (self,
+      "SELECT path, inode, size, mtime, indexed FROM files "
+      "WHERE path >= ? AND path < ?");
+  if (stmt == NULL)
+    goto out;
+
+  sqlite3_bind_text (stmt, 1, lower, -1, SQLITE_STATIC);
+  sqlite3_bind_text (stmt, 2, upper, -1, SQLITE_STATIC);
+
+  while (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      TplLogSearchIndexStamp *stamp = g_new (TplLogSearchIndexStamp, 1);
+
+      stamp->inode = sqlite3_column_int64 (stmt, 1);
+      stamp->size = sqlite3_column_int64 (stmt, 2);
+      stamp->mtime = sqlite3_column_int64 (stmt, 3);
+      stamp->indexed = sqlite3_column_int (stmt, 4);
+
+      g_hash_table_insert (stamps,
+          g_strdup ((const gchar *) sqlite3_column_text (stmt, 0)), stamp);
+    }
+
+  sqlite3_finalize (stmt);
+
+out:
+  g_mutex_unlock (&self->mutex);
+  g_free (lower);
+  g_free (upper);
+
+  return stamps;
+}
+
+
+/* Replaces whatever was indexed for @path, inside a transaction */
+static gboolean
+log_search_index_store_file (TplLogSearchIndex *self,
+    const gchar *path,
+    const TplLogSearchIndexStamp *stamp,
+    const gchar *text)
+{
+  sqlite3_stmt *stmt;
+  gint64 id;
+  gboolean ok;
+
+  id = log_search_index_get_file_id (self, path);
+
+  if (id != 0)
+    {
+      ok = log_search_index_delete_chunks (self, id);
+
+      stmt = log_search_index_prepare (self,
+          "UPDATE files SET inode = ?, size = ?, mtime = ?, indexed = ? "
+          "WHERE id = ?");
+      if (stmt != NULL)
+        {
+          log_search_index_bind_stamp (stmt, 1, stamp);
+          sqlite3_bind_int (stmt, 4, stamp->indexed);
+          sqlite3_bind_int64 (stmt, 5, id);
+        }
+
+      ok = log_search_index_run (self, stmt) && ok;
+    }
+  else
+    {
+      stmt = log_search_index_prepare (self,
+          "INSERT INTO files (inode, size, mtime, indexed, path) "
+          "VALUES (?, ?, ?, ?, ?)");
+      if (stmt != NULL)
+        {
+          log_search_index_bind_stamp (stmt, 1, stamp);
+          sqlite3_bind_int (stmt, 4, stamp->indexed);
+          sqlite3_bind_text (stmt, 5, path, -1, SQLITE_STATIC);
+        }
+
+      ok = log_search_index_run (self, stmt);
+      id = sqlite3_last_insert_rowid (self->db);
+    }
+
+  if (ok && stamp->indexed)
+    ok = log_search_index_add_chunk (self, id, text);
+
+  return ok;
+}
+
+
+/*
+ * _tpl_log_search_index_set_file:
+ * @path: the file that was indexed
+ * @stamp: what the file looked like when it was read
+ * @text: (allow-none): everything searchable in the file, or %NULL if
+ *  @stamp says it couldn't be indexed
+ *
+ * Replaces whatever was indexed for @path.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+_tpl_log_search_index_set_file (TplLogSearchIndex *self,
+    const gchar *path,
+    const TplLogSearchIndexStamp *stamp,
+    const gchar *text)
+{
+  gboolean ok;
+
+  g_mutex_lock (&self->mutex);
+
+  if (!log_search_index_exec (self, "BEGIN IMMEDIATE"))
+    {
+      g_mutex_unlock (&self->mutex);
+      return FALSE;
+    }
+
+  ok = log_search_index_store_file (self, path, stamp, text);
+  ok = log_search_index_commit (self, ok);
+
+  g_mutex_unlock (&self->mutex);
+
+  return ok;
+}
+
+
+/*
+ * _tpl_log_search_index_set_files:
+ * @files: (element-type TplLogSearchIndexFile): files that were read
+ *
+ * Like _tpl_log_search_index_set_file() for each of @files, in a single
+ * transaction.
+ *
+ * Returns: %TRUE if all of @files were indexed, %FALSE if none were
+ */
+gboolean
+_tpl_log_search_index_set_files (TplLogSearchIndex *self,
+    GPtrArray *files)
+{
+  gboolean ok = TRUE;
+  guint i;
+
+  if (files->len == 0)
+    return TRUE;
+
+  g_mutex_lock (&self->mutex);
+
+  if (!log_search_index_exec (self, "BEGIN IMMEDIATE"))
+    {
+      g_mutex_unlock (&self->mutex);
+      return FALSE;
+    }
+
+  for (i = 0; ok && i < files->len; i++)
+    {
+      TplLogSearchIndexFile *file = g_ptr_array_index (files, i);
+
+      ok = log_search_index_store_file (self, file->path, &file->stamp,
+          file->text);
+    }
+
+  ok = log_search_index_commit (self, ok);
+
+  g_mutex_unlock (&self->mutex);
+
+  return ok;
+}
+
+
+/*
+ * _tpl_log_search_index_append:
+ * @path: a file that was appended to
+ * @before: what the file looked like before @text was written to it
+ * @after: what it looks like now
+ * @text: everything searchable in what was written
+ *
+ * Adds @text to what is indexed for @path, provided the index was up to date
+ * with @path as described by @before.
+ *
+ * Returns: %TRUE if @text was added, %FALSE if @path has to be indexed anew
+ */
+gboolean
+_tpl_log_search_index_append (TplLogSearchIndex *self,
+    const gchar *path,
+    const TplLogSearchIndexStamp *before,
+    const TplLogSearchIndexStamp *after,
+    const gchar *text)
+{
+  sqlite3_stmt *stmt;
+  gboolean ok;
+
+  g_mutex_lock (&self->mutex);
+
+  if (!log_search_index_exec (self, "BEGIN IMMEDIATE"))
+    {
+      g_mutex_unlock (&self->mutex);
+      return FALSE;
+    }
+
+  stmt = log_search_index_prepare (self,
+      "UPDATE files SET inode = ?, size = ?, mtime = ? "
+      "WHERE path = ? AND inode = ? AND size = ? AND mtime = ? "
+      "AND indexed = 1");
+  if (stmt != NULL)
+    {
+      log_search_index_bind_stamp (stmt, 1, after);
+      sqlite3_bind_text (stmt, 4, path, -1, SQLITE_STATIC);
+      log_search_index_bind_stamp (stmt, 5, before);
+    }
+
+  ok = log_search_index_run (self, stmt)
+    && sqlite3_changes (self->db) == 1
+    && log_search_index_add_chunk (self,
+        log_search_index_get_file_id (self, path), text);
+
+  ok = log_search_index_commit (self, ok);
+
+  g_mutex_unlock (&self->mutex);
+
+  return ok;
+}
+
+
+void
+_tpl_log_search_index_remove_file (TplLogSearchIndex *self,
+    const gchar *path)
+{
+  sqlite3_stmt *stmt;
+  gint64 id;
+  gboolean ok;
+
+  g_mutex_lock (&self->mutex);
+
+  if (!log_search_index_exec (self, "BEGIN IMMEDIATE"))
+    {
+      g_mutex_unlock (&self->mutex);
+      return;
+    }
+
+  id = log_search_index_get_file_id (self, path);
+  ok = (id != 0 && log_search_index_delete_chunks (self, id));
+
+  if (ok)
+    {
+      stmt = log_search_index_prepare (self, "DELETE FROM files WHERE id = ?");
+      if (stmt != NULL)
+        sqlite3_bind_int64 (stmt, 1, id);
+
+      ok = log_search_index_run (self, stmt);
+    }
+
+  log_search_index_commit (self, ok);
+
+  g_mutex_unlock (&self->mutex);
+}
+
+
+/*
+ * _tpl_log_search_index_match:
+ * @text: the text to look for
+ *
+ * Returns: a new set of the paths of indexed files which may contain @text,
+ *  ignoring case, or %NULL if the index can't tell, e.g. because @text is
+ *  shorter than %TPL_LOG_SEARCH_INDEX_MIN_TEXT_LEN.
+ */
+GHashTable *
+_tpl_log_search_index_match (TplLogSearchIndex *self,
+    const gchar *text)
+{
+  GHashTable *paths = NULL;
+  sqlite3_stmt *stmt;
+  GString *query;
+  const gchar *p;
+  gint e;
+
+  if (g_utf8_strlen (text, -1) < TPL_LOG_SEARCH_INDEX_MIN_TEXT_LEN)
+    return NULL;
+
+  /* The whole text as a single FTS5 string */
+  query = g_string_new ("\"");
+  for (p = text; *p != '\0'; p++)
+    {
+      if (*p == '"')
+        g_string_append_c (query, '"');
+      g_string_append_c (query, *p);
+    }
+  g_string_append_c (query, '"');
+
+  g_mutex_lock (&self->mutex);
+
+  stmt = log_search_index_prepare (self,
+      "SELECT DISTINCT files.path FROM chunks_text "
+      "JOIN chunks ON chunks.id = chunks_text.rowid "
+      "JOIN files ON files.id = chunks.file "
+      "WHERE chunks_text MATCH ?");
+  if (stmt == NULL)
+    goto out;
+
+  sqlite3_bind_text (stmt, 1, query->str, -1, SQLITE_STATIC);
+
+  paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  while ((e = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      gchar *path = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+
+      g_hash_table_insert (paths, path, path);
+    }
+
+  if (e != SQLITE_DONE)
+    {
+      DEBUG ("Failed to look '%s' up: %s", text, sqlite3_errmsg (self->db));
+      g_hash_table_unref (paths);
+      paths = NULL;
+    }
+
+  sqlite3_finalize (stmt);
+
+out:
+  g_mutex_unlock (&self->mutex);
+  g_string_free (query, TRUE);
+
+  return paths;
+}
+
+
+void
+_tpl_log_search_index_clear (TplLogSearchIndex *self)
+{
+  g_mutex_lock (&self->mutex);
+  log_search_index_exec (self,
+      "DELETE FROM chunks_text;"
+      "DELETE FROM chunks;"
+      "DELETE FROM files;");
+  g_mutex_unlock (&self->mutex);
+}
@@ -64,4 +64,5 @@ log_store_iface_init (gpointer g_iface,
   /* We don't want to store new logs in Empathy's directory, just read the old
    * ones. */
   iface->add_event = NULL;
+  iface->add_events = NULL;
 }
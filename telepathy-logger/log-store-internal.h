@@ -57,6 +57,21 @@ typedef enum
 
 typedef struct _TplLogStore TplLogStore;  /*dummy object */
 
+/* Receives search hits as a store finds them, in whichever thread searches.
+ * Takes ownership of @hits; returning FALSE stops the search. */
+typedef gboolean (*TplLogStoreSearchFunc) (GList *hits, gpointer user_data);
+
+/* Restricts a search to some of the logs. account, target (which is only
+ * looked at along with account) and the first and last days (both included)
+ * are all optional. */
+typedef struct
+{
+  TpAccount *account;
+  TplEntity *target;
+  GDate *from;
+  GDate *to;
+} TplLogSearchScope;
+
 typedef struct
 {
   GTypeInterface parent;
@@ -66,6 +81,8 @@ typedef struct
       TplEntity *target, gint type_mask);
   gboolean (*add_event) (TplLogStore *self, TplEvent *event,
       GError **error);
+  gboolean (*add_events) (TplLogStore *self, GList *events,
+      GError **error);
   GList * (*get_dates) (TplLogStore *self, TpAccount *account,
       TplEntity *target, gint type_mask);
   GList * (*get_events_for_date) (TplLogStore *self, TpAccount *account,
@@ -74,6 +91,9 @@ typedef struct
       TplEntity *target, gint type_mask);
   GList * (*get_entities) (TplLogStore *self, TpAccount *account);
   GList * (*search_new) (TplLogStore *self, const gchar *text, gint type_mask);
+  void (*search) (TplLogStore *self, const gchar *text, gint type_mask,
+      const TplLogSearchScope *scope, GCancellable *cancellable,
+      TplLogStoreSearchFunc func, gpointer user_data);
   GList * (*get_filtered_events) (TplLogStore *self, TpAccount *account,
       TplEntity *target, gint type_mask, guint num_events,
       TplLogEventFilter filter, gpointer user_data);
@@ -92,6 +112,8 @@ gboolean _tpl_log_store_exists (TplLogStore *self, TpAccount *account,
     TplEntity *target, gint type_mask);
 gboolean _tpl_log_store_add_event (TplLogStore *self, TplEvent *event,
     GError **error);
+gboolean _tpl_log_store_add_events (TplLogStore *self, GList *events,
+    GError **error);
 GList * _tpl_log_store_get_dates (TplLogStore *self, TpAccount *account,
     TplEntity *target, gint type_mask);
 GList * _tpl_log_store_get_events_for_date (TplLogStore *self,
@@ -101,6 +123,14 @@ GList * _tpl_log_store_get_recent_events (TplLogStore *self,
 GList * _tpl_log_store_get_entities (TplLogStore *self, TpAccount *account);
 GList * _tpl_log_store_search_new (TplLogStore *self, const gchar *text,
     gint type_mask);
+void _tpl_log_store_search (TplLogStore *self, const gchar *text,
+    gint type_mask, const TplLogSearchScope *scope,
+    GCancellable *cancellable, TplLogStoreSearchFunc func,
+    gpointer user_data);
+gboolean _tpl_log_search_scope_has_date (const TplLogSearchScope *scope,
+    const GDate *date);
+gboolean _tpl_log_search_scope_has_hit (const TplLogSearchScope *scope,
+    TplLogSearchHit *hit);
 GList * _tpl_log_store_get_filtered_events (TplLogStore *self,
     TpAccount *account, TplEntity *target, gint type_mask, guint num_events,
     TplLogEventFilter filter, gpointer user_data);
@@ -28,6 +28,7 @@
 
 #include <telepathy-glib/telepathy-glib.h>
 
+#include "account-map-internal.h"
 #include "log-iter-pidgin-internal.h"
 #include "log-store-internal.h"
 #include "log-store-pidgin-internal.h"
@@ -48,6 +49,8 @@ struct _TplLogStorePidginPriv
 {
   gboolean test_mode;
   TpAccountManager *account_manager;
+  /* "protocol/username" -> TpAccount, for search hits */
+  TplAccountMap *accounts;
 
   gchar *basedir;
 };
@@ -130,6 +133,7 @@ tpl_log_store_pidgin_dispose (GObject *self)
 {
   TplLogStorePidginPriv *priv = TPL_LOG_STORE_PIDGIN (self)->priv;
 
+  tp_clear_pointer (&priv->accounts, _tpl_account_map_free);
   g_clear_object (&priv->account_manager);
   g_free (priv->basedir);
   priv->basedir = NULL;
@@ -174,6 +178,31 @@ tpl_log_store_pidgin_class_init (TplLogStorePidginClass *klass)
 }
 
 
+/* Pidgin keeps the logs of an account in protocol/username, where the
+ * username of IRC accounts also has the server: username@server. You can have
+ * multiple accounts with the same username, so the protocol is part of the
+ * key too. */
+static gchar *
+log_store_pidgin_account_to_key (TpAccount *account)
+{
+  const GHashTable *params = tp_account_get_parameters (account);
+  const gchar *protocol = tp_account_get_protocol_name (account);
+  const gchar *username = tp_asv_get_string (params, "account");
+  const gchar *server = NULL;
+
+  if (username == NULL)
+    return NULL;
+
+  if (!tp_strdiff (protocol, "irc"))
+    server = tp_asv_get_string (params, "server");
+
+  if (server != NULL)
+    return g_strdup_printf ("%s/%s@%s", protocol, username, server);
+  else
+    return g_strdup_printf ("%s/%s", protocol, username);
+}
+
+
 static void
 tpl_log_store_pidgin_init (TplLogStorePidgin *self)
 {
@@ -181,6 +210,8 @@ tpl_log_store_pidgin_init (TplLogStorePidgin *self)
       TPL_TYPE_LOG_STORE_PIDGIN, TplLogStorePidginPriv);
 
   self->priv->account_manager = tp_account_manager_dup ();
+  self->priv->accounts = _tpl_account_map_new (self->priv->account_manager,
+      log_store_pidgin_account_to_key);
 }
 
 
@@ -484,59 +515,19 @@ static TpAccount *
 log_store_pidgin_dup_account (TplLogStorePidgin *self,
     const gchar *filename)
 {
-  GList *accounts, *l;
-  TpAccount *account = NULL;
+  TpAccount *account;
   gchar **strv;
   guint len;
-  gchar *protocol, *username, *server = NULL, *tmp;
-  gboolean is_irc;
-
-  accounts = tp_account_manager_dup_valid_accounts (
-      self->priv->account_manager);
+  gchar *key;
 
   strv = g_strsplit (filename, G_DIR_SEPARATOR_S, -1);
   len = g_strv_length (strv);
 
-  protocol = strv[len - 4];
-  tmp = strchr (strv[len - 3], '@');
-  is_irc = !tp_strdiff (protocol, "irc");
-
-  if (is_irc && tmp != NULL)
-    {
-      username = g_strndup (strv[len - 3], tmp - strv[len - 3]);
-      server = g_strdup (strv[len - 3] + (tmp - strv[len - 3]) + 1);
-    }
-  else
-    {
-      username = g_strdup (strv[len - 3]);
-    }
-
-  /* You can have multiple accounts with the same username so we have to
-   * look at all the accounts to find the right one going on the username and
-   * protocol. */
-  for (l = accounts; l != NULL; l = l->next)
-    {
-      TpAccount *acc = (TpAccount *) l->data;
-      const GHashTable *params;
-
-      if (tp_strdiff (tp_account_get_protocol_name (acc), protocol))
-        continue;
-
-      params = tp_account_get_parameters (acc);
-
-      if (!tp_strdiff (username, tp_asv_get_string (params, "account")))
-        {
-          if (is_irc && tp_strdiff (server, tp_asv_get_string (params, "server")))
-            continue;
-
-          account = g_object_ref (acc);
-          break;
-        }
-    }
+  /* See log_store_pidgin_account_to_key () */
+  key = g_strconcat (strv[len - 4], "/", strv[len - 3], NULL);
+  account = _tpl_account_map_dup_account (self->priv->accounts, key);
 
-  g_free (username);
-  g_free (server);
-  g_list_free_full (accounts, g_object_unref);
+  g_free (key);
   g_strfreev (strv);
 
   return account;
@@ -860,11 +851,34 @@ log_store_pidgin_get_events_for_files (TplLogStore *self,
 }
 
 
+/* Whether the log file called @basename is within @scope's dates */
+static gboolean
+log_store_pidgin_scope_has_filename (const TplLogSearchScope *scope,
+    const gchar *basename)
+{
+  GDate *date;
+  gboolean ret;
+
+  if (scope == NULL || (scope->from == NULL && scope->to == NULL))
+    return TRUE;
+
+  date = log_store_pidgin_get_time (basename);
+  if (date == NULL)
+    return FALSE;
+
+  ret = g_date_valid (date) && _tpl_log_search_scope_has_date (scope, date);
+  g_date_free (date);
+
+  return ret;
+}
+
+
 /* internal: return a GList of file names (char *) which need to be freed with
- * g_free */
+ * g_free. Files out of @scope's dates are left out. */
 static GList *
 log_store_pidgin_get_all_files (TplLogStore *self,
-    const gchar *dir)
+    const gchar *dir,
+    const TplLogSearchScope *scope)
 {
   GDir *gdir;
   GList *files = NULL;
@@ -887,14 +901,18 @@ log_store_pidgin_get_all_files (TplLogStore *self,
       if (g_str_has_suffix (filename, TXT_LOG_FILENAME_SUFFIX)
           || g_str_has_suffix (filename, HTML_LOG_FILENAME_SUFFIX))
         {
-          files = g_list_prepend (files, filename);
+          if (log_store_pidgin_scope_has_filename (scope, name))
+            files = g_list_prepend (files, filename);
+          else
+            g_free (filename);
+
           continue;
         }
 
       if (g_file_test (filename, G_FILE_TEST_IS_DIR))
         {
           files = g_list_concat (files,
-              log_store_pidgin_get_all_files (self, filename));
+              log_store_pidgin_get_all_files (self, filename, scope));
         }
 
       g_free (filename);
@@ -906,16 +924,52 @@ log_store_pidgin_get_all_files (TplLogStore *self,
 }
 
 
-static GList *
+/* Looks for @text_casefold in @contents, ignoring case. When the text is
+ * plain ASCII, the file only has to be case folded if it has characters
+ * that fold to ASCII ones. */
+static gboolean
+log_store_pidgin_match_in_contents (const gchar *contents,
+    gsize length,
+    const gchar *text_casefold,
+    gboolean text_is_ascii)
+{
+  gchar *contents_casefold;
+  gboolean found;
+
+  if (text_is_ascii)
+    {
+      if (_tpl_ascii_strcasestr_len (contents, length, text_casefold,
+              strlen (text_casefold)) != NULL)
+        return TRUE;
+
+      if (!_tpl_utf8_has_ascii_case_folds (contents, length))
+        return FALSE;
+    }
+
+  contents_casefold = g_utf8_casefold (contents, length);
+  found = strstr (contents_casefold, text_casefold) != NULL;
+  g_free (contents_casefold);
+
+  return found;
+}
+
+
+/* Passes each hit to @func as soon as it is found, until @func returns
+ * FALSE, @cancellable is cancelled or there are no files left */
+static void
 _log_store_pidgin_search_in_files (TplLogStorePidgin *self,
     const gchar *text,
-    GList *files)
+    GList *files,
+    GCancellable *cancellable,
+    TplLogStoreSearchFunc func,
+    gpointer user_data)
 {
   GList *l;
-  GList *hits = NULL;
   gchar *text_casefold;
+  gboolean text_is_ascii;
 
   text_casefold = g_utf8_casefold (text, -1);
+  text_is_ascii = _tpl_str_is_ascii (text_casefold);
 
   for (l = files; l != NULL; l = l->next)
     {
@@ -923,7 +977,10 @@ _log_store_pidgin_search_in_files (TplLogStorePidgin *self,
       GMappedFile *file;
       gsize length;
       gchar *contents;
-      gchar *contents_casefold = NULL;
+      gboolean found;
+
+      if (g_cancellable_is_cancelled (cancellable))
+        break;
 
       filename = l->data;
 
@@ -934,15 +991,12 @@ _log_store_pidgin_search_in_files (TplLogStorePidgin *self,
       length = g_mapped_file_get_length (file);
       contents = g_mapped_file_get_contents (file);
 
-      if (contents != NULL)
-        contents_casefold = g_utf8_casefold (contents, length);
+      found = contents != NULL && log_store_pidgin_match_in_contents (contents,
+          length, text_casefold, text_is_ascii);
 
       g_mapped_file_unref (file);
 
-      if (contents_casefold == NULL)
-        continue;
-
-      if (strstr (contents_casefold, text_casefold))
+      if (found)
         {
           TplLogSearchHit *hit;
 
@@ -951,44 +1005,85 @@ _log_store_pidgin_search_in_files (TplLogStorePidgin *self,
 
           if (hit != NULL)
             {
-              hits = g_list_prepend (hits, hit);
               DEBUG ("Found text:'%s' in file:'%s' on date:'%04u-%02u-%02u'",
                   text_casefold, filename, g_date_get_year (hit->date),
                   g_date_get_month (hit->date), g_date_get_day (hit->date));
+
+              if (!func (g_list_prepend (NULL, hit), user_data))
+                break;
             }
         }
-
-      g_free (contents_casefold);
     }
 
   g_free (text_casefold);
+}
 
-  return hits;
+
+static gboolean
+log_store_pidgin_search_collect (GList *hits,
+    gpointer user_data)
+{
+  GList **collected = user_data;
+
+  *collected = g_list_concat (g_list_reverse (hits), *collected);
+
+  return TRUE;
 }
 
 
-static GList *
-log_store_pidgin_search_new (TplLogStore *self,
+static void
+log_store_pidgin_search (TplLogStore *self,
     const gchar *text,
-    gint type_mask)
+    gint type_mask,
+    const TplLogSearchScope *scope,
+    GCancellable *cancellable,
+    TplLogStoreSearchFunc func,
+    gpointer user_data)
 {
   GList *files;
-  GList *retval;
+  gchar *dir = NULL;
 
-  g_return_val_if_fail (TPL_IS_LOG_STORE_PIDGIN (self), NULL);
-  g_return_val_if_fail (!tp_str_empty (text), NULL);
+  g_return_if_fail (TPL_IS_LOG_STORE_PIDGIN (self));
+  g_return_if_fail (!tp_str_empty (text));
 
   if (!(type_mask & TPL_EVENT_MASK_TEXT))
-    return NULL;
+    return;
 
-  files = log_store_pidgin_get_all_files (self, NULL);
-  DEBUG ("Found %d log files in total", g_list_length (files));
+  if (scope != NULL && scope->account != NULL)
+    {
+      dir = log_store_pidgin_get_dir (self, scope->account, scope->target);
+
+      /* Pidgin doesn't know about this account */
+      if (dir == NULL)
+        return;
+    }
+
+  files = log_store_pidgin_get_all_files (self, dir, scope);
+  DEBUG ("Found %d log files in %s", g_list_length (files),
+      dir != NULL ? dir : "total");
+
+  g_free (dir);
 
-  retval = _log_store_pidgin_search_in_files (TPL_LOG_STORE_PIDGIN (self),
-      text, files);
+  _log_store_pidgin_search_in_files (TPL_LOG_STORE_PIDGIN (self),
+      text, files, cancellable, func, user_data);
 
   g_list_foreach (files, (GFunc) g_free, NULL);
   g_list_free (files);
+}
+
+
+static GList *
+log_store_pidgin_search_new (TplLogStore *self,
+    const gchar *text,
+    gint type_mask)
+{
+  GList *retval = NULL;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_PIDGIN (self), NULL);
+  g_return_val_if_fail (!tp_str_empty (text), NULL);
+
+  log_store_pidgin_search (self, text, type_mask, NULL, NULL,
+      log_store_pidgin_search_collect, &retval);
 
   return retval;
 }
@@ -1160,6 +1255,7 @@ log_store_iface_init (gpointer g_iface,
   iface->get_events_for_date = log_store_pidgin_get_events_for_date;
   iface->get_entities = log_store_pidgin_get_entities;
   iface->search_new = log_store_pidgin_search_new;
+  iface->search = log_store_pidgin_search;
   iface->get_filtered_events = log_store_pidgin_get_filtered_events;
   iface->create_iter = log_store_pidgin_create_iter;
 }
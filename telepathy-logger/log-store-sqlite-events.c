@@ -0,0 +1,1262 @@
+/*
+ * Copyright (C) 2010-2011 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "log-store-sqlite-events-internal.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <telepathy-glib/telepathy-glib.h>
+#include <sqlite3.h>
+
+#include "account-map-internal.h"
+#include "call-event.h"
+#include "call-event-internal.h"
+#include "entity-internal.h"
+#include "event-internal.h"
+#include "log-iter-xml-internal.h"
+#include "log-manager-internal.h"
+#include "log-search-index-internal.h"
+#include "log-store-internal.h"
+#include "text-event.h"
+#include "text-event-internal.h"
+
+#define DEBUG_FLAG TPL_DEBUG_LOG_STORE
+#include "debug-internal.h"
+#include "util-internal.h"
+
+#define TPL_LOG_STORE_SQLITE_EVENTS_NAME "TpLoggerSqlite"
+#define DB_FILENAME "events.sqlite"
+
+/* Events are keyed by (account, target, chatroom, date, timestamp), so that
+ * listing the dates or entities of an account or target, and reading a day,
+ * are index range scans. The date is the Julian day of the timestamp, in
+ * UTC, as for the days of the XML store. Senders are stored like the XML
+ * store does: the receiver is worked out from the target and the account. */
+#define EVENTS_SCHEMA \
+  "PRAGMA journal_mode = WAL;" \
+  "PRAGMA synchronous = NORMAL;" \
+  "CREATE TABLE IF NOT EXISTS events (" \
+  "  id INTEGER PRIMARY KEY," \
+  "  account TEXT NOT NULL," \
+  "  target TEXT NOT NULL," \
+  "  chatroom BOOLEAN NOT NULL," \
+  "  type INTEGER NOT NULL," \
+  "  date INTEGER NOT NULL," \
+  "  timestamp INTEGER NOT NULL," \
+  "  sender TEXT," \
+  "  sender_type INTEGER," \
+  "  sender_alias TEXT," \
+  "  sender_token TEXT," \
+  "  message_type INTEGER," \
+  "  message TEXT," \
+  "  message_token TEXT," \
+  "  supersedes_token TEXT," \
+  "  edit_timestamp INTEGER," \
+  "  duration INTEGER," \
+  "  actor TEXT," \
+  "  actor_type INTEGER," \
+  "  actor_alias TEXT," \
+  "  actor_token TEXT," \
+  "  reason INTEGER," \
+  "  detail TEXT);" \
+  "CREATE INDEX IF NOT EXISTS events_key" \
+  "  ON events (account, target, chatroom, date, timestamp);"
+
+/* Messages are indexed with the FTS5 trigram tokenizer, so that searches can
+ * look any substring of at least three characters up, ignoring case. SQLite
+ * only has it since 3.34: without it, messages are searched by scanning
+ * them. */
+#define EVENTS_TEXT_SCHEMA \
+  "CREATE VIRTUAL TABLE IF NOT EXISTS events_text USING fts5 (" \
+  "  message, content = 'events', content_rowid = 'id'," \
+  "  tokenize = 'trigram');" \
+  "CREATE TRIGGER IF NOT EXISTS events_text_insert AFTER INSERT ON events" \
+  "  WHEN new.message IS NOT NULL BEGIN" \
+  "    INSERT INTO events_text (rowid, message)" \
+  "      VALUES (new.id, new.message);" \
+  "  END;" \
+  "CREATE TRIGGER IF NOT EXISTS events_text_delete AFTER DELETE ON events" \
+  "  WHEN old.message IS NOT NULL BEGIN" \
+  "    INSERT INTO events_text (events_text, rowid, message)" \
+  "      VALUES ('delete', old.id, old.message);" \
+  "  END;"
+
+/* The columns events are read back from, in this order */
+#define EVENT_COLUMNS \
+  "type, timestamp, " \
+  "sender, sender_type, sender_alias, sender_token, " \
+  "message_type, message, message_token, supersedes_token, edit_timestamp, " \
+  "duration, actor, actor_type, actor_alias, actor_token, reason, detail"
+
+typedef enum
+{
+  COL_TYPE,
+  COL_TIMESTAMP,
+  COL_SENDER,
+  COL_SENDER_TYPE,
+  COL_SENDER_ALIAS,
+  COL_SENDER_TOKEN,
+  COL_MESSAGE_TYPE,
+  COL_MESSAGE,
+  COL_MESSAGE_TOKEN,
+  COL_SUPERSEDES_TOKEN,
+  COL_EDIT_TIMESTAMP,
+  COL_DURATION,
+  COL_ACTOR,
+  COL_ACTOR_TYPE,
+  COL_ACTOR_ALIAS,
+  COL_ACTOR_TOKEN,
+  COL_REASON,
+  COL_DETAIL
+} Column;
+
+typedef enum
+{
+  STMT_ADD_EVENT,
+  STMT_EXISTS_ACCOUNT,
+  STMT_EXISTS_TARGET,
+  STMT_GET_DATES,
+  STMT_GET_EVENTS_FOR_DATE,
+  STMT_GET_ENTITIES,
+  STMT_SEARCH,
+  STMT_SEARCH_LIKE,
+  STMT_CLEAR,
+  STMT_CLEAR_ACCOUNT,
+  STMT_CLEAR_ENTITY,
+  N_STMTS
+} Statement;
+
+static const gchar * const statements_sql[N_STMTS] = {
+    /* STMT_ADD_EVENT */
+    "INSERT INTO events (account, target, chatroom, type, date, timestamp, "
+        "sender, sender_type, sender_alias, sender_token, "
+        "message_type, message, message_token, supersedes_token, "
+        "edit_timestamp, "
+        "duration, actor, actor_type, actor_alias, actor_token, reason, "
+        "detail) "
+      "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, "
+        "?, ?)",
+    /* STMT_EXISTS_ACCOUNT */
+    "SELECT 1 FROM events WHERE "
+        "account=? AND (type & ?) != 0 "
+      "LIMIT 1",
+    /* STMT_EXISTS_TARGET */
+    "SELECT 1 FROM events WHERE "
+        "account=? AND target=? AND chatroom=? AND (type & ?) != 0 "
+      "LIMIT 1",
+    /* STMT_GET_DATES */
+    "SELECT DISTINCT date FROM events WHERE "
+        "account=? AND target=? AND chatroom=? AND (type & ?) != 0 "
+      "ORDER BY date",
+    /* STMT_GET_EVENTS_FOR_DATE: call events sort after text events with the
+     * same timestamp, as in the XML store */
+    "SELECT " EVENT_COLUMNS " FROM events WHERE "
+        "account=? AND target=? AND chatroom=? AND date=? "
+        "AND (type & ?) != 0 "
+      "ORDER BY timestamp, type, id",
+    /* STMT_GET_ENTITIES */
+    "SELECT DISTINCT target, chatroom FROM events WHERE account=?",
+    /* STMT_SEARCH: the text, as an FTS5 string */
+    "SELECT DISTINCT account, target, chatroom, date FROM events "
+      "WHERE id IN "
+        "(SELECT rowid FROM events_text WHERE events_text MATCH ?) "
+      "AND (type & ?) != 0",
+    /* STMT_SEARCH_LIKE: for texts too short for the index, or without one */
+    "SELECT DISTINCT account, target, chatroom, date FROM events "
+      "WHERE message LIKE ? ESCAPE '\\' "
+      "AND (type & ?) != 0",
+    /* STMT_CLEAR */
+    "DELETE FROM events",
+    /* STMT_CLEAR_ACCOUNT */
+    "DELETE FROM events WHERE account=?",
+    /* STMT_CLEAR_ENTITY */
+    "DELETE FROM events WHERE account=? AND target=? AND chatroom=?",
+};
+
+struct _TplLogStoreSqliteEventsPriv
+{
+  gchar *filename;
+  gboolean test_mode;
+  TpAccountManager *account_manager;
+  /* account name -> TpAccount, for search hits */
+  TplAccountMap *accounts;
+
+  /* Events are written from the log manager's writer thread and read from
+   * its worker threads. The database is opened on first use, and it and its
+   * statements are only used with the lock held. */
+  GMutex lock;
+  sqlite3 *db;
+  gboolean db_failed;
+  /* whether messages are in events_text */
+  gboolean text_indexed;
+  sqlite3_stmt *statements[N_STMTS];
+};
+
+enum
+{
+  PROP_0,
+  PROP_READABLE,
+  PROP_FILENAME,
+  PROP_TESTMODE
+};
+
+static void log_store_iface_init (gpointer g_iface, gpointer iface_data);
+
+G_DEFINE_TYPE_WITH_CODE (TplLogStoreSqliteEvents,
+    _tpl_log_store_sqlite_events, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (TPL_TYPE_LOG_STORE, log_store_iface_init))
+
+
+static const gchar *
+get_account_name (TpAccount *account)
+{
+  return tp_proxy_get_object_path (account) +
+    strlen (TP_ACCOUNT_OBJECT_PATH_BASE);
+}
+
+
+static gchar *
+log_store_sqlite_events_account_to_name (TpAccount *account)
+{
+  return g_strdup (get_account_name (account));
+}
+
+
+static void
+log_store_sqlite_events_dispose (GObject *object)
+{
+  TplLogStoreSqliteEvents *self = TPL_LOG_STORE_SQLITE_EVENTS (object);
+  TplLogStoreSqliteEventsPriv *priv = self->priv;
+  guint i;
+
+  tp_clear_pointer (&priv->accounts, _tpl_account_map_free);
+  g_clear_object (&priv->account_manager);
+
+  g_mutex_lock (&priv->lock);
+
+  for (i = 0; i < N_STMTS; i++)
+    {
+      if (priv->statements[i] != NULL)
+        {
+          sqlite3_finalize (priv->statements[i]);
+          priv->statements[i] = NULL;
+        }
+    }
+
+  if (priv->db != NULL)
+    {
+      sqlite3_close (priv->db);
+      priv->db = NULL;
+    }
+
+  g_mutex_unlock (&priv->lock);
+
+  G_OBJECT_CLASS (_tpl_log_store_sqlite_events_parent_class)->dispose (
+      object);
+}
+
+
+static void
+log_store_sqlite_events_finalize (GObject *object)
+{
+  TplLogStoreSqliteEvents *self = TPL_LOG_STORE_SQLITE_EVENTS (object);
+
+  g_free (self->priv->filename);
+  g_mutex_clear (&self->priv->lock);
+
+  G_OBJECT_CLASS (_tpl_log_store_sqlite_events_parent_class)->finalize (
+      object);
+}
+
+
+static void
+log_store_sqlite_events_get_property (GObject *object,
+    guint param_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  TplLogStoreSqliteEvents *self = TPL_LOG_STORE_SQLITE_EVENTS (object);
+
+  switch (param_id)
+    {
+      case PROP_READABLE:
+        g_value_set_boolean (value, TRUE);
+        break;
+
+      case PROP_FILENAME:
+        g_value_set_string (value, self->priv->filename);
+        break;
+
+      case PROP_TESTMODE:
+        g_value_set_boolean (value, self->priv->test_mode);
+        break;
+
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+        break;
+    };
+}
+
+
+static void
+log_store_sqlite_events_set_property (GObject *object,
+    guint param_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  TplLogStoreSqliteEvents *self = TPL_LOG_STORE_SQLITE_EVENTS (object);
+
+  switch (param_id)
+    {
+      case PROP_FILENAME:
+        g_free (self->priv->filename);
+        self->priv->filename = g_value_dup_string (value);
+        break;
+
+      case PROP_TESTMODE:
+        self->priv->test_mode = g_value_get_boolean (value);
+        break;
+
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
+        break;
+    };
+}
+
+
+static void
+_tpl_log_store_sqlite_events_class_init (TplLogStoreSqliteEventsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GParamSpec *param_spec;
+
+  object_class->dispose = log_store_sqlite_events_dispose;
+  object_class->finalize = log_store_sqlite_events_finalize;
+  object_class->get_property = log_store_sqlite_events_get_property;
+  object_class->set_property = log_store_sqlite_events_set_property;
+
+  g_object_class_override_property (object_class, PROP_READABLE, "readable");
+
+  /**
+   * TplLogStoreSqliteEvents:filename:
+   *
+   * The database file, by default events.sqlite in the TpLogger directory
+   * of the user data directory.
+   */
+  param_spec = g_param_spec_string ("filename",
+      "Filename",
+      "The database file",
+      NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_FILENAME, param_spec);
+
+  param_spec = g_param_spec_boolean ("testmode",
+      "TestMode",
+      "Whether the logstore is in testmode, for testsuite use only",
+      FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_TESTMODE, param_spec);
+
+  g_type_class_add_private (object_class,
+      sizeof (TplLogStoreSqliteEventsPriv));
+}
+
+
+static void
+_tpl_log_store_sqlite_events_init (TplLogStoreSqliteEvents *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      TPL_TYPE_LOG_STORE_SQLITE_EVENTS, TplLogStoreSqliteEventsPriv);
+  self->priv->account_manager = tp_account_manager_dup ();
+  self->priv->accounts = _tpl_account_map_new (self->priv->account_manager,
+      log_store_sqlite_events_account_to_name);
+
+  g_mutex_init (&self->priv->lock);
+}
+
+
+static gchar *
+log_store_sqlite_events_get_filename (TplLogStoreSqliteEvents *self)
+{
+  const gchar *user_data_dir;
+
+  if (self->priv->filename != NULL)
+    return g_strdup (self->priv->filename);
+
+  if (self->priv->test_mode && g_getenv ("TPL_TEST_LOG_DIR") != NULL)
+    user_data_dir = g_getenv ("TPL_TEST_LOG_DIR");
+  else
+    user_data_dir = g_get_user_data_dir ();
+
+  return g_build_filename (user_data_dir, "TpLogger", DB_FILENAME, NULL);
+}
+
+
+/* Must be called with the lock held. Returns: the database, opened and
+ * brought up to date if it wasn't yet, or NULL if that failed */
+static sqlite3 *
+log_store_sqlite_events_get_db (TplLogStoreSqliteEvents *self)
+{
+  TplLogStoreSqliteEventsPriv *priv = self->priv;
+  gchar *filename, *dirname;
+  char *errmsg = NULL;
+
+  if (priv->db != NULL || priv->db_failed)
+    return priv->db;
+
+  filename = log_store_sqlite_events_get_filename (self);
+  dirname = g_path_get_dirname (filename);
+  g_mkdir_with_parents (dirname, 0700);
+  g_free (dirname);
+
+  DEBUG ("Opening %s", filename);
+
+  if (sqlite3_open_v2 (filename, &priv->db,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+    {
+      CRITICAL ("Failed to open %s: %s", filename,
+          sqlite3_errmsg (priv->db));
+      goto error;
+    }
+
+  sqlite3_exec (priv->db, EVENTS_SCHEMA, NULL, NULL, &errmsg);
+  if (errmsg != NULL)
+    {
+      CRITICAL ("Failed to create the events table in %s: %s", filename,
+          errmsg);
+      sqlite3_free (errmsg);
+      goto error;
+    }
+
+  sqlite3_exec (priv->db, EVENTS_TEXT_SCHEMA, NULL, NULL, &errmsg);
+  if (errmsg != NULL)
+    {
+      DEBUG ("Messages won't be indexed in %s: %s", filename, errmsg);
+      sqlite3_free (errmsg);
+    }
+  else
+    {
+      priv->text_indexed = TRUE;
+    }
+
+  g_free (filename);
+
+  return priv->db;
+
+error:
+  sqlite3_close (priv->db);
+  priv->db = NULL;
+  priv->db_failed = TRUE;
+  g_free (filename);
+
+  return NULL;
+}
+
+
+/* Must be called with the lock held */
+static sqlite3_stmt *
+log_store_sqlite_events_prepare (TplLogStoreSqliteEvents *self,
+    Statement id)
+{
+  TplLogStoreSqliteEventsPriv *priv = self->priv;
+  sqlite3 *db;
+
+  if (priv->statements[id] != NULL)
+    return priv->statements[id];
+
+  db = log_store_sqlite_events_get_db (self);
+  if (db == NULL)
+    return NULL;
+
+  if (sqlite3_prepare_v3 (db, statements_sql[id], -1,
+        SQLITE_PREPARE_PERSISTENT, &priv->statements[id], NULL) != SQLITE_OK)
+    {
+      DEBUG ("Failed to prepare SQL: %s", sqlite3_errmsg (db));
+      priv->statements[id] = NULL;
+    }
+
+  return priv->statements[id];
+}
+
+
+static gboolean
+log_store_sqlite_events_is_text_indexed (TplLogStoreSqliteEvents *self)
+{
+  gboolean indexed;
+
+  g_mutex_lock (&self->priv->lock);
+  indexed = (log_store_sqlite_events_get_db (self) != NULL &&
+      self->priv->text_indexed);
+  g_mutex_unlock (&self->priv->lock);
+
+  return indexed;
+}
+
+
+/* Returns: the statement @id, locked until it is passed to
+ * log_store_sqlite_events_release (), or NULL if it can't be prepared */
+static sqlite3_stmt *
+log_store_sqlite_events_get_statement (TplLogStoreSqliteEvents *self,
+    Statement id)
+{
+  sqlite3_stmt *sql;
+
+  g_mutex_lock (&self->priv->lock);
+
+  sql = log_store_sqlite_events_prepare (self, id);
+  if (sql == NULL)
+    g_mutex_unlock (&self->priv->lock);
+
+  return sql;
+}
+
+
+static void
+log_store_sqlite_events_release (TplLogStoreSqliteEvents *self,
+    sqlite3_stmt *sql)
+{
+  sqlite3_reset (sql);
+  sqlite3_clear_bindings (sql);
+
+  g_mutex_unlock (&self->priv->lock);
+}
+
+
+static void
+bind_target (sqlite3_stmt *sql,
+    gint first,
+    TpAccount *account,
+    TplEntity *target)
+{
+  sqlite3_bind_text (sql, first, get_account_name (account), -1,
+      SQLITE_TRANSIENT);
+  sqlite3_bind_text (sql, first + 1, tpl_entity_get_identifier (target), -1,
+      SQLITE_TRANSIENT);
+  sqlite3_bind_int (sql, first + 2,
+      tpl_entity_get_entity_type (target) == TPL_ENTITY_ROOM);
+}
+
+
+static void
+bind_entity (sqlite3_stmt *sql,
+    gint first,
+    TplEntity *entity)
+{
+  if (entity == NULL)
+    return;
+
+  sqlite3_bind_text (sql, first, tpl_entity_get_identifier (entity), -1,
+      SQLITE_STATIC);
+  sqlite3_bind_int (sql, first + 1, tpl_entity_get_entity_type (entity));
+  sqlite3_bind_text (sql, first + 2, tpl_entity_get_alias (entity), -1,
+      SQLITE_STATIC);
+  sqlite3_bind_text (sql, first + 3, tpl_entity_get_avatar_token (entity), -1,
+      SQLITE_STATIC);
+}
+
+
+static guint32
+get_julian_day (gint64 timestamp)
+{
+  GDateTime *ts;
+  GDate date;
+
+  ts = g_date_time_new_from_unix_utc (timestamp);
+  g_date_clear (&date, 1);
+  g_date_set_dmy (&date, g_date_time_get_day_of_month (ts),
+      g_date_time_get_month (ts), g_date_time_get_year (ts));
+  g_date_time_unref (ts);
+
+  return g_date_get_julian (&date);
+}
+
+
+/* Must be called with the lock held */
+static gboolean
+log_store_sqlite_events_insert (TplLogStoreSqliteEvents *self,
+    sqlite3_stmt *sql,
+    TplEvent *event,
+    GError **error)
+{
+  gint64 timestamp = tpl_event_get_timestamp (event);
+  gint type;
+  int e;
+
+  if (TPL_IS_TEXT_EVENT (event))
+    type = TPL_EVENT_MASK_TEXT;
+  else if (TPL_IS_CALL_EVENT (event))
+    type = TPL_EVENT_MASK_CALL;
+  else
+    {
+      DEBUG ("TplEvent type not handled by this LogStore (%s). "
+          "The event may not be logged properly.",
+          _tpl_log_store_get_name (TPL_LOG_STORE (self)));
+      return TRUE;
+    }
+
+  sqlite3_bind_text (sql, 1, tpl_event_get_account_path (event) +
+      strlen (TP_ACCOUNT_OBJECT_PATH_BASE), -1, SQLITE_STATIC);
+  sqlite3_bind_text (sql, 2, _tpl_event_get_target_id (event), -1,
+      SQLITE_STATIC);
+  sqlite3_bind_int (sql, 3, _tpl_event_target_is_room (event));
+  sqlite3_bind_int (sql, 4, type);
+  sqlite3_bind_int64 (sql, 5, get_julian_day (timestamp));
+  sqlite3_bind_int64 (sql, 6, timestamp);
+  bind_entity (sql, 7, tpl_event_get_sender (event));
+
+  if (type == TPL_EVENT_MASK_TEXT)
+    {
+      TplTextEvent *text = TPL_TEXT_EVENT (event);
+
+      sqlite3_bind_int (sql, 11, tpl_text_event_get_message_type (text));
+      sqlite3_bind_text (sql, 12, tpl_text_event_get_message (text), -1,
+          SQLITE_STATIC);
+      sqlite3_bind_text (sql, 13, tpl_text_event_get_message_token (text),
+          -1, SQLITE_STATIC);
+      sqlite3_bind_text (sql, 14, tpl_text_event_get_supersedes_token (text),
+          -1, SQLITE_STATIC);
+      sqlite3_bind_int64 (sql, 15, tpl_text_event_get_edit_timestamp (text));
+    }
+  else
+    {
+      TplCallEvent *call = TPL_CALL_EVENT (event);
+
+      sqlite3_bind_int64 (sql, 16, tpl_call_event_get_duration (call));
+      bind_entity (sql, 17, tpl_call_event_get_end_actor (call));
+      sqlite3_bind_int (sql, 21, tpl_call_event_get_end_reason (call));
+      sqlite3_bind_text (sql, 22,
+          tpl_call_event_get_detailed_end_reason (call), -1, SQLITE_STATIC);
+    }
+
+  e = sqlite3_step (sql);
+
+  sqlite3_reset (sql);
+  sqlite3_clear_bindings (sql);
+
+  if (e != SQLITE_DONE)
+    {
+      g_set_error (error, TPL_LOG_STORE_ERROR,
+          TPL_LOG_STORE_ERROR_ADD_EVENT,
+          "SQL Error adding event in %s: %s", G_STRFUNC,
+          sqlite3_errmsg (self->priv->db));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+static gboolean
+log_store_sqlite_events_add_events (TplLogStore *store,
+    GList *events,
+    GError **error)
+{
+  TplLogStoreSqliteEvents *self = (TplLogStoreSqliteEvents *) store;
+  sqlite3_stmt *sql;
+  gboolean retval = TRUE;
+  GList *l;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (store), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  sql = log_store_sqlite_events_get_statement (self, STMT_ADD_EVENT);
+  if (sql == NULL)
+    {
+      g_set_error (error, TPL_LOG_STORE_ERROR,
+          TPL_LOG_STORE_ERROR_ADD_EVENT,
+          "Failed to prepare SQL in %s", G_STRFUNC);
+      return FALSE;
+    }
+
+  /* a batch is written in a single transaction, each event in a savepoint
+   * of its own so that a failing one doesn't undo the others */
+  sqlite3_exec (self->priv->db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+  for (l = events; l != NULL; l = g_list_next (l))
+    {
+      sqlite3_exec (self->priv->db, "SAVEPOINT ev", NULL, NULL, NULL);
+
+      if (!log_store_sqlite_events_insert (self, sql, l->data,
+            retval ? error : NULL))
+        {
+          sqlite3_exec (self->priv->db, "ROLLBACK TO ev", NULL, NULL, NULL);
+          retval = FALSE;
+        }
+
+      sqlite3_exec (self->priv->db, "RELEASE ev", NULL, NULL, NULL);
+    }
+
+  sqlite3_exec (self->priv->db, "COMMIT", NULL, NULL, NULL);
+
+  log_store_sqlite_events_release (self, sql);
+
+  return retval;
+}
+
+
+static gboolean
+log_store_sqlite_events_add_event (TplLogStore *store,
+    TplEvent *event,
+    GError **error)
+{
+  GList events = { event, NULL, NULL };
+
+  g_return_val_if_fail (TPL_IS_EVENT (event), FALSE);
+
+  return log_store_sqlite_events_add_events (store, &events, error);
+}
+
+
+static gboolean
+log_store_sqlite_events_exists (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask)
+{
+  TplLogStoreSqliteEvents *self = (TplLogStoreSqliteEvents *) store;
+  sqlite3_stmt *sql;
+  gboolean exists;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (self), FALSE);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
+  g_return_val_if_fail (target == NULL || TPL_IS_ENTITY (target), FALSE);
+
+  if (target == NULL)
+    {
+      sql = log_store_sqlite_events_get_statement (self, STMT_EXISTS_ACCOUNT);
+      if (sql == NULL)
+        return FALSE;
+
+      sqlite3_bind_text (sql, 1, get_account_name (account), -1,
+          SQLITE_TRANSIENT);
+      sqlite3_bind_int (sql, 2, type_mask);
+    }
+  else
+    {
+      sql = log_store_sqlite_events_get_statement (self, STMT_EXISTS_TARGET);
+      if (sql == NULL)
+        return FALSE;
+
+      bind_target (sql, 1, account, target);
+      sqlite3_bind_int (sql, 4, type_mask);
+    }
+
+  exists = (sqlite3_step (sql) == SQLITE_ROW);
+
+  log_store_sqlite_events_release (self, sql);
+
+  return exists;
+}
+
+
+static GList *
+log_store_sqlite_events_get_dates (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask)
+{
+  TplLogStoreSqliteEvents *self = (TplLogStoreSqliteEvents *) store;
+  sqlite3_stmt *sql;
+  GList *dates = NULL;
+  int e;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (self), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
+
+  sql = log_store_sqlite_events_get_statement (self, STMT_GET_DATES);
+  if (sql == NULL)
+    return NULL;
+
+  bind_target (sql, 1, account, target);
+  sqlite3_bind_int (sql, 4, type_mask);
+
+  while ((e = sqlite3_step (sql)) == SQLITE_ROW)
+    dates = g_list_prepend (dates,
+        g_date_new_julian (sqlite3_column_int64 (sql, 0)));
+
+  if (e != SQLITE_DONE)
+    DEBUG ("Failed to list dates: %s", sqlite3_errmsg (self->priv->db));
+
+  log_store_sqlite_events_release (self, sql);
+
+  return g_list_reverse (dates);
+}
+
+
+static const gchar *
+column_text (sqlite3_stmt *sql,
+    Column column)
+{
+  /* for some reason this returns unsigned char */
+  return (const gchar *) sqlite3_column_text (sql, column);
+}
+
+
+/* Returns: the entity stored from @first on, or NULL if there isn't one */
+static TplEntity *
+entity_from_row (sqlite3_stmt *sql,
+    Column first)
+{
+  if (TPL_STR_EMPTY (column_text (sql, first)))
+    return NULL;
+
+  return tpl_entity_new (column_text (sql, first),
+      sqlite3_column_int (sql, first + 1),
+      column_text (sql, first + 2),
+      column_text (sql, first + 3));
+}
+
+
+static TplEvent *
+event_from_row (sqlite3_stmt *sql,
+    TpAccount *account,
+    TplEntity *target)
+{
+  TplEvent *event;
+  TplEntity *sender;
+  TplEntity *receiver;
+  gboolean is_user;
+
+  sender = entity_from_row (sql, COL_SENDER);
+  is_user = (sender != NULL &&
+      tpl_entity_get_entity_type (sender) == TPL_ENTITY_SELF);
+
+  if (tpl_entity_get_entity_type (target) == TPL_ENTITY_ROOM)
+    receiver = tpl_entity_new_from_room_id (
+        tpl_entity_get_identifier (target));
+  else if (is_user)
+    receiver = tpl_entity_new (tpl_entity_get_identifier (target),
+        TPL_ENTITY_CONTACT, NULL, NULL);
+  else
+    receiver = tpl_entity_new (tp_account_get_normalized_name (account),
+        TPL_ENTITY_SELF, tp_account_get_nickname (account), NULL);
+
+  if (sqlite3_column_int (sql, COL_TYPE) == TPL_EVENT_MASK_TEXT)
+    {
+      event = g_object_new (TPL_TYPE_TEXT_EVENT,
+          /* TplEvent */
+          "account", account,
+          "receiver", receiver,
+          "sender", sender,
+          "timestamp", sqlite3_column_int64 (sql, COL_TIMESTAMP),
+          /* TplTextEvent */
+          "message-type", sqlite3_column_int (sql, COL_MESSAGE_TYPE),
+          "message", column_text (sql, COL_MESSAGE),
+          "message-token", column_text (sql, COL_MESSAGE_TOKEN),
+          "supersedes-token", column_text (sql, COL_SUPERSEDES_TOKEN),
+          "edit-timestamp", sqlite3_column_int64 (sql, COL_EDIT_TIMESTAMP),
+          NULL);
+    }
+  else
+    {
+      TplEntity *actor = entity_from_row (sql, COL_ACTOR);
+
+      event = g_object_new (TPL_TYPE_CALL_EVENT,
+          /* TplEvent */
+          "account", account,
+          "receiver", receiver,
+          "sender", sender,
+          "timestamp", sqlite3_column_int64 (sql, COL_TIMESTAMP),
+          /* TplCallEvent */
+          "duration", sqlite3_column_int64 (sql, COL_DURATION),
+          "end-actor", actor,
+          "end-reason", sqlite3_column_int (sql, COL_REASON),
+          "detailed-end-reason", column_text (sql, COL_DETAIL),
+          NULL);
+
+      g_clear_object (&actor);
+    }
+
+  g_clear_object (&sender);
+  g_object_unref (receiver);
+
+  return event;
+}
+
+
+/* Adds @event after the events of @events, replacing the message it edits if
+ * that was sent earlier the same day, as the XML store does */
+static void
+event_queue_add (GQueue *events,
+    GHashTable *messages,
+    TplEvent *event)
+{
+  const gchar *token;
+  GList *link;
+
+  if (!TPL_IS_TEXT_EVENT (event))
+    {
+      g_queue_push_tail (events, event);
+      return;
+    }
+
+  token = tpl_text_event_get_supersedes_token (TPL_TEXT_EVENT (event));
+  link = (token != NULL) ? g_hash_table_lookup (messages, token) : NULL;
+
+  if (link != NULL)
+    {
+      _tpl_text_event_add_supersedes (TPL_TEXT_EVENT (event), link->data);
+      g_object_unref (link->data);
+      link->data = event;
+    }
+  else
+    {
+      g_queue_push_tail (events, event);
+      link = events->tail;
+    }
+
+  token = tpl_text_event_get_message_token (TPL_TEXT_EVENT (event));
+  if (token != NULL)
+    g_hash_table_insert (messages, g_strdup (token), link);
+}
+
+
+static GList *
+log_store_sqlite_events_get_events_for_date (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask,
+    const GDate *date)
+{
+  TplLogStoreSqliteEvents *self = (TplLogStoreSqliteEvents *) store;
+  sqlite3_stmt *sql;
+  GQueue events = G_QUEUE_INIT;
+  GHashTable *messages;
+  int e;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (self), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
+  g_return_val_if_fail (date != NULL, NULL);
+
+  sql = log_store_sqlite_events_get_statement (self,
+      STMT_GET_EVENTS_FOR_DATE);
+  if (sql == NULL)
+    return NULL;
+
+  bind_target (sql, 1, account, target);
+  sqlite3_bind_int64 (sql, 4, g_date_get_julian (date));
+  sqlite3_bind_int (sql, 5, type_mask);
+
+  /* message token -> link of the event in events */
+  messages = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  while ((e = sqlite3_step (sql)) == SQLITE_ROW)
+    event_queue_add (&events, messages,
+        event_from_row (sql, account, target));
+
+  if (e != SQLITE_DONE)
+    DEBUG ("Failed to read events: %s", sqlite3_errmsg (self->priv->db));
+
+  log_store_sqlite_events_release (self, sql);
+
+  g_hash_table_unref (messages);
+
+  return events.head;
+}
+
+
+static GList *
+log_store_sqlite_events_get_filtered_events (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask,
+    guint num_events,
+    TplLogEventFilter filter,
+    gpointer user_data)
+{
+  GList *dates, *l, *events = NULL;
+  guint i = 0;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (store), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
+
+  dates = log_store_sqlite_events_get_dates (store, account, target,
+      type_mask);
+
+  for (l = g_list_last (dates); l != NULL && i < num_events;
+       l = g_list_previous (l))
+    {
+      GList *new_events, *n;
+
+      new_events = log_store_sqlite_events_get_events_for_date (store,
+          account, target, type_mask, l->data);
+
+      for (n = g_list_last (new_events); n != NULL && i < num_events;
+           n = g_list_previous (n))
+        {
+          if (filter == NULL || filter (n->data, user_data))
+            {
+              events = g_list_prepend (events, g_object_ref (n->data));
+              i++;
+            }
+        }
+
+      g_list_free_full (new_events, g_object_unref);
+    }
+
+  g_list_free_full (dates, (GDestroyNotify) g_date_free);
+
+  return events;
+}
+
+
+static GList *
+log_store_sqlite_events_get_entities (TplLogStore *store,
+    TpAccount *account)
+{
+  TplLogStoreSqliteEvents *self = (TplLogStoreSqliteEvents *) store;
+  sqlite3_stmt *sql;
+  GList *entities = NULL;
+  int e;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (self), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+
+  sql = log_store_sqlite_events_get_statement (self, STMT_GET_ENTITIES);
+  if (sql == NULL)
+    return NULL;
+
+  sqlite3_bind_text (sql, 1, get_account_name (account), -1,
+      SQLITE_TRANSIENT);
+
+  while ((e = sqlite3_step (sql)) == SQLITE_ROW)
+    {
+      const gchar *identifier = (const gchar *) sqlite3_column_text (sql, 0);
+      TplEntity *entity;
+
+      if (sqlite3_column_int (sql, 1))
+        entity = tpl_entity_new_from_room_id (identifier);
+      else
+        entity = tpl_entity_new (identifier, TPL_ENTITY_CONTACT, NULL, NULL);
+
+      entities = g_list_prepend (entities, entity);
+    }
+
+  if (e != SQLITE_DONE)
+    DEBUG ("Failed to list entities: %s", sqlite3_errmsg (self->priv->db));
+
+  log_store_sqlite_events_release (self, sql);
+
+  return entities;
+}
+
+
+static GList *
+log_store_sqlite_events_search_new (TplLogStore *store,
+    const gchar *text,
+    gint type_mask)
+{
+  TplLogStoreSqliteEvents *self = (TplLogStoreSqliteEvents *) store;
+  sqlite3_stmt *sql;
+  GString *query;
+  GList *hits = NULL;
+  const gchar *p;
+  gboolean indexed;
+  int e;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (self), NULL);
+  g_return_val_if_fail (!TPL_STR_EMPTY (text), NULL);
+
+  indexed = (g_utf8_strlen (text, -1) >= TPL_LOG_SEARCH_INDEX_MIN_TEXT_LEN &&
+      log_store_sqlite_events_is_text_indexed (self));
+
+  if (indexed)
+    {
+      /* The whole text as a single FTS5 string */
+      query = g_string_new ("\"");
+      for (p = text; *p != '\0'; p++)
+        {
+          if (*p == '"')
+            g_string_append_c (query, '"');
+          g_string_append_c (query, *p);
+        }
+      g_string_append_c (query, '"');
+    }
+  else
+    {
+      query = g_string_new ("%");
+      for (p = text; *p != '\0'; p++)
+        {
+          if (*p == '%' || *p == '_' || *p == '\\')
+            g_string_append_c (query, '\\');
+          g_string_append_c (query, *p);
+        }
+      g_string_append_c (query, '%');
+    }
+
+  sql = log_store_sqlite_events_get_statement (self,
+      indexed ? STMT_SEARCH : STMT_SEARCH_LIKE);
+  if (sql == NULL)
+    goto out;
+
+  sqlite3_bind_text (sql, 1, query->str, -1, SQLITE_STATIC);
+  sqlite3_bind_int (sql, 2, type_mask);
+
+  while ((e = sqlite3_step (sql)) == SQLITE_ROW)
+    {
+      const gchar *identifier = (const gchar *) sqlite3_column_text (sql, 1);
+      TpAccount *account;
+      TplEntity *target;
+      GDate *date;
+
+      account = _tpl_account_map_dup_account (self->priv->accounts,
+          (const gchar *) sqlite3_column_text (sql, 0));
+
+      if (sqlite3_column_int (sql, 2))
+        target = tpl_entity_new_from_room_id (identifier);
+      else
+        target = tpl_entity_new (identifier, TPL_ENTITY_CONTACT, NULL, NULL);
+
+      date = g_date_new_julian (sqlite3_column_int64 (sql, 3));
+
+      hits = g_list_prepend (hits,
+          _tpl_log_manager_search_hit_new (account, target, date));
+
+      g_date_free (date);
+      g_object_unref (target);
+      tp_clear_object (&account);
+    }
+
+  if (e != SQLITE_DONE)
+    DEBUG ("Failed to search '%s': %s", text,
+        sqlite3_errmsg (self->priv->db));
+
+  log_store_sqlite_events_release (self, sql);
+
+out:
+  g_string_free (query, TRUE);
+
+  return hits;
+}
+
+
+static void
+log_store_sqlite_events_clear (TplLogStore *store)
+{
+  TplLogStoreSqliteEvents *self = TPL_LOG_STORE_SQLITE_EVENTS (store);
+  sqlite3_stmt *sql;
+
+  DEBUG ("Clear all logs from SQLite store");
+
+  sql = log_store_sqlite_events_get_statement (self, STMT_CLEAR);
+  if (sql == NULL)
+    return;
+
+  if (sqlite3_step (sql) != SQLITE_DONE)
+    DEBUG ("Failed to clear logs: %s", sqlite3_errmsg (self->priv->db));
+
+  log_store_sqlite_events_release (self, sql);
+}
+
+
+static void
+log_store_sqlite_events_clear_account (TplLogStore *store,
+    TpAccount *account)
+{
+  TplLogStoreSqliteEvents *self = TPL_LOG_STORE_SQLITE_EVENTS (store);
+  sqlite3_stmt *sql;
+
+  DEBUG ("Clear account logs from SQLite store: %s",
+      get_account_name (account));
+
+  sql = log_store_sqlite_events_get_statement (self, STMT_CLEAR_ACCOUNT);
+  if (sql == NULL)
+    return;
+
+  sqlite3_bind_text (sql, 1, get_account_name (account), -1,
+      SQLITE_TRANSIENT);
+
+  if (sqlite3_step (sql) != SQLITE_DONE)
+    DEBUG ("Failed to clear account logs: %s",
+        sqlite3_errmsg (self->priv->db));
+
+  log_store_sqlite_events_release (self, sql);
+}
+
+
+static void
+log_store_sqlite_events_clear_entity (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *entity)
+{
+  TplLogStoreSqliteEvents *self = TPL_LOG_STORE_SQLITE_EVENTS (store);
+  sqlite3_stmt *sql;
+
+  DEBUG ("Clear entity logs from SQLite store: %s/%s",
+      get_account_name (account), tpl_entity_get_identifier (entity));
+
+  sql = log_store_sqlite_events_get_statement (self, STMT_CLEAR_ENTITY);
+  if (sql == NULL)
+    return;
+
+  bind_target (sql, 1, account, entity);
+
+  if (sqlite3_step (sql) != SQLITE_DONE)
+    DEBUG ("Failed to clear entity logs: %s",
+        sqlite3_errmsg (self->priv->db));
+
+  log_store_sqlite_events_release (self, sql);
+}
+
+
+static const gchar *
+log_store_sqlite_events_get_name (TplLogStore *store)
+{
+  return TPL_LOG_STORE_SQLITE_EVENTS_NAME;
+}
+
+
+static TplLogIter *
+log_store_sqlite_events_create_iter (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask)
+{
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE_EVENTS (store), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
+
+  /* The XML iterator walks any store a day at a time, through get_dates
+   * and get_events_for_date, which are both index scans here */
+  return tpl_log_iter_xml_new (store, account, target, type_mask);
+}
+
+
+static void
+log_store_iface_init (gpointer g_iface,
+    gpointer iface_data)
+{
+  TplLogStoreInterface *iface = (TplLogStoreInterface *) g_iface;
+
+  iface->get_name = log_store_sqlite_events_get_name;
+  iface->exists = log_store_sqlite_events_exists;
+  iface->add_event = log_store_sqlite_events_add_event;
+  iface->add_events = log_store_sqlite_events_add_events;
+  iface->get_dates = log_store_sqlite_events_get_dates;
+  iface->get_events_for_date = log_store_sqlite_events_get_events_for_date;
+  iface->get_entities = log_store_sqlite_events_get_entities;
+  iface->search_new = log_store_sqlite_events_search_new;
+  iface->get_filtered_events = log_store_sqlite_events_get_filtered_events;
+  iface->clear = log_store_sqlite_events_clear;
+  iface->clear_account = log_store_sqlite_events_clear_account;
+  iface->clear_entity = log_store_sqlite_events_clear_entity;
+  iface->create_iter = log_store_sqlite_events_create_iter;
+}
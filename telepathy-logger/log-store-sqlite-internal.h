@@ -65,6 +65,7 @@ typedef struct _TplLogStoreSqlite TplLogStoreSqlite;
 typedef struct _TplLogStoreSqlitePrivate TplLogStoreSqlitePrivate;
 typedef struct _TplLogStoreSqliteClass TplLogStoreSqliteClass;
 typedef struct _TplPendingMessage TplPendingMessage;
+typedef struct _TplContactStats TplContactStats;
 
 struct _TplLogStoreSqlite
 {
@@ -83,6 +84,15 @@ struct _TplPendingMessage
   gint64 timestamp;
 };
 
+struct _TplContactStats
+{
+  gchar *identifier;
+  /* as returned by _tpl_log_store_sqlite_get_most_recent() */
+  gint64 most_recent;
+  /* as returned by _tpl_log_store_sqlite_get_frequency() */
+  double frequency;
+};
+
 GType _tpl_log_store_sqlite_get_type (void);
 TplLogStore * _tpl_log_store_sqlite_dup (void);
 
@@ -97,6 +107,15 @@ gint64 _tpl_log_store_sqlite_get_most_recent (TplLogStoreSqlite *self,
     TpAccount *account, const char *identifier);
 double _tpl_log_store_sqlite_get_frequency (TplLogStoreSqlite *self,
     TpAccount *account, const char *identifier);
+GHashTable * _tpl_log_store_sqlite_get_contact_stats (TplLogStoreSqlite *self,
+    TpAccount *account);
+
+gboolean _tpl_log_store_sqlite_is_backfilled (TplLogStoreSqlite *self,
+    TpAccount *account, TplEntity *target);
+gboolean _tpl_log_store_sqlite_set_message_counts (TplLogStoreSqlite *self,
+    TpAccount *account, TplEntity *target, GHashTable *counts,
+    GError **error);
+void _tpl_log_store_sqlite_clear_backfilled (TplLogStoreSqlite *self);
 
 G_END_DECLS
 
@@ -41,6 +41,26 @@
 
 #define TPL_LOG_STORE_SQLITE_NAME "Sqlite"
 
+/* Writes are grouped in a transaction, committed that long after the first
+ * of them, or once there are that many */
+#define TRANSACTION_TIMEOUT_MS 500
+#define TRANSACTION_MAX_WRITES 1000
+
+/* The database is shared by every process with a log manager, and by the
+ * backfill tool; a writer waits that long for another one to commit, which
+ * takes up to TRANSACTION_TIMEOUT_MS */
+#define BUSY_TIMEOUT_MS 5000
+
+/* Message counters are added up in memory and written that long after the
+ * first of them, or once that many different counters are pending */
+#define COUNTERS_FLUSH_TIMEOUT_S 5
+#define COUNTERS_MAX_PENDING 500
+
+/* PRAGMA synchronous levels */
+#define SYNCHRONOUS_OFF 0
+#define SYNCHRONOUS_NORMAL 1
+#define SYNCHRONOUS_EXTRA 3
+
 static void log_store_iface_init (TplLogStoreInterface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (TplLogStoreSqlite, _tpl_log_store_sqlite,
@@ -51,13 +71,113 @@ enum /* properties */
 {
   PROP_0,
   PROP_READABLE,
+  PROP_SYNCHRONOUS,
+};
+
+/* The queries run over and over, which are only prepared once */
+typedef enum
+{
+  STMT_ADD_MESSAGE_COUNTER,
+  STMT_GET_ENTITIES,
+  STMT_GET_PENDING_MESSAGES,
+  STMT_REMOVE_PENDING_MESSAGE,
+  STMT_ADD_PENDING_MESSAGE,
+  STMT_GET_MOST_RECENT,
+  STMT_GET_FREQUENCY,
+  STMT_GET_CONTACT_STATS,
+  STMT_SET_MESSAGE_COUNTER,
+  STMT_IS_BACKFILLED,
+  STMT_ADD_BACKFILLED,
+  STMT_CLEAR_BACKFILLED,
+  N_STMTS
+} Statement;
+
+static const gchar * const statements_sql[N_STMTS] = {
+    /* STMT_ADD_MESSAGE_COUNTER */
+    "INSERT INTO messagecounts "
+      "(account, identifier, chatroom, date, messages) "
+    "VALUES (?, ?, ?, date(?), ?) "
+    "ON CONFLICT (account, identifier, chatroom, date) "
+    "DO UPDATE SET messages=messages + excluded.messages",
+    /* STMT_GET_ENTITIES */
+    "SELECT DISTINCT identifier, chatroom FROM messagecounts WHERE "
+        "account=?",
+    /* STMT_GET_PENDING_MESSAGES */
+    "SELECT id,timestamp "
+      "FROM pending_messages "
+      "WHERE channel=? "
+      "ORDER BY id ASC",
+    /* STMT_REMOVE_PENDING_MESSAGE */
+    "DELETE FROM pending_messages WHERE channel=? AND id=?",
+    /* STMT_ADD_PENDING_MESSAGE: replaces a stale message with the same id */
+    "INSERT OR REPLACE INTO pending_messages (channel, id, timestamp) "
+      "VALUES (?, ?, ?)",
+    /* STMT_GET_MOST_RECENT: the most recent date for a single identifier */
+    "SELECT STRFTIME('%s', date) FROM messagecounts WHERE "
+        "account=? AND "
+        "identifier=? "
+      "ORDER BY date DESC LIMIT 1",
+    /* STMT_GET_FREQUENCY: the frequency for a single identifier */
+    "SELECT SUM(messages / ROUND(JULIANDAY('now') - JULIANDAY(date) + 1)) "
+      "FROM messagecounts WHERE "
+        "account=? AND "
+        "identifier=?",
+    /* STMT_GET_CONTACT_STATS: the most recent date and the frequency of
+     * every identifier of an account, walking the account's counters once in
+     * messagecounts_recent order */
+    "SELECT identifier, STRFTIME('%s', MAX(date)), "
+        "SUM(messages / ROUND(JULIANDAY('now') - JULIANDAY(date) + 1)) "
+      "FROM messagecounts WHERE "
+        "account=? "
+      "GROUP BY identifier",
+    /* STMT_SET_MESSAGE_COUNTER: a counter worked out from the logs */
+    "INSERT INTO messagecounts "
+      "(account, identifier, chatroom, date, messages) "
+    "VALUES (?, ?, ?, date(?), ?) "
+    "ON CONFLICT (account, identifier, chatroom, date) "
+    "DO UPDATE SET messages=excluded.messages",
+    /* STMT_IS_BACKFILLED */
+    "SELECT 1 FROM backfilled WHERE "
+        "account=? AND identifier=? AND chatroom=?",
+    /* STMT_ADD_BACKFILLED */
+    "INSERT OR IGNORE INTO backfilled (account, identifier, chatroom) "
+      "VALUES (?, ?, ?)",
+    /* STMT_CLEAR_BACKFILLED */
+    "DELETE FROM backfilled",
 };
 
 struct _TplLogStoreSqlitePrivate
 {
   sqlite3 *db;
+
+  guint synchronous;
+
+  /* Statements are used from both the log manager's writer thread and the
+   * main thread, and are bound, stepped and reset with the lock held. The
+   * transaction writes are grouped in is also committed with it held. */
+  GMutex statements_lock;
+  sqlite3_stmt *statements[N_STMTS];
+  guint transaction_writes;
+  guint commit_id;
+
+  /* Counter increments not written yet, a set of Counter. They are taken
+   * out and written with the statements lock held, so that reading the
+   * counters after flushing them always finds them written; the counters
+   * lock is only ever taken within the statements lock. */
+  GMutex counters_lock;
+  GHashTable *counters;
+  guint flush_id;
 };
 
+typedef struct
+{
+  gchar *account;
+  gchar *identifier;
+  gboolean chatroom;
+  gchar *date;
+  guint messages;
+} Counter;
+
 static GObject *singleton = NULL;
 
 
@@ -108,6 +228,50 @@ tpl_log_store_sqlite_get_property (GObject *self,
         g_value_set_boolean (value, FALSE);
         break;
 
+      case PROP_SYNCHRONOUS:
+        g_value_set_uint (value,
+            TPL_LOG_STORE_SQLITE (self)->priv->synchronous);
+        break;
+
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (self, id, pspec);
+        break;
+    }
+}
+
+
+static void
+set_synchronous (TplLogStoreSqlitePrivate *priv,
+    guint synchronous)
+{
+  gchar *query;
+
+  priv->synchronous = synchronous;
+
+  if (priv->db == NULL)
+    return;
+
+  query = g_strdup_printf ("PRAGMA synchronous = %u", synchronous);
+  g_mutex_lock (&priv->statements_lock);
+  sqlite3_exec (priv->db, query, NULL, NULL, NULL);
+  g_mutex_unlock (&priv->statements_lock);
+  g_free (query);
+}
+
+
+static void
+tpl_log_store_sqlite_set_property (GObject *self,
+    guint id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  switch (id)
+    {
+      case PROP_SYNCHRONOUS:
+        set_synchronous (TPL_LOG_STORE_SQLITE (self)->priv,
+            g_value_get_uint (value));
+        break;
+
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (self, id, pspec);
         break;
@@ -115,6 +279,410 @@ tpl_log_store_sqlite_get_property (GObject *self,
 }
 
 
+/* Must be called with the statements lock held */
+static sqlite3_stmt *
+prepare_statement (TplLogStoreSqlitePrivate *priv,
+    Statement id)
+{
+  sqlite3_stmt *sql;
+
+  if (priv->statements[id] == NULL)
+    {
+      if (sqlite3_prepare_v3 (priv->db, statements_sql[id], -1,
+            SQLITE_PREPARE_PERSISTENT, &sql, NULL) != SQLITE_OK)
+        return NULL;
+
+      priv->statements[id] = sql;
+    }
+
+  return priv->statements[id];
+}
+
+
+/* Returns: the statement @id, locked until it is passed to
+ * release_statement (), or NULL if it can't be prepared */
+static sqlite3_stmt *
+get_statement (TplLogStoreSqlitePrivate *priv,
+    Statement id)
+{
+  sqlite3_stmt *sql;
+
+  g_mutex_lock (&priv->statements_lock);
+
+  sql = prepare_statement (priv, id);
+  if (sql == NULL)
+    g_mutex_unlock (&priv->statements_lock);
+
+  return sql;
+}
+
+
+static void
+release_statement (TplLogStoreSqlitePrivate *priv,
+    sqlite3_stmt *sql)
+{
+  sqlite3_reset (sql);
+  sqlite3_clear_bindings (sql);
+
+  g_mutex_unlock (&priv->statements_lock);
+}
+
+
+/* Must be called with the statements lock held */
+static void
+commit_transaction (TplLogStoreSqlitePrivate *priv)
+{
+  char *errmsg = NULL;
+
+  if (priv->commit_id != 0)
+    {
+      g_source_remove (priv->commit_id);
+      priv->commit_id = 0;
+    }
+
+  DEBUG ("Committing %u writes", priv->transaction_writes);
+  priv->transaction_writes = 0;
+
+  /* SQLite may have rolled the transaction back already on some errors */
+  if (sqlite3_get_autocommit (priv->db))
+    return;
+
+  sqlite3_exec (priv->db, "COMMIT", NULL, NULL, &errmsg);
+  if (errmsg != NULL)
+    {
+      DEBUG ("Failed to commit: %s", errmsg);
+      sqlite3_free (errmsg);
+      sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+    }
+}
+
+
+static gboolean
+commit_transaction_cb (gpointer user_data)
+{
+  TplLogStoreSqlitePrivate *priv = user_data;
+
+  g_mutex_lock (&priv->statements_lock);
+
+  /* the writer thread may have committed, and scheduled another commit,
+   * while this one was being dispatched */
+  if (priv->commit_id == g_source_get_id (g_main_current_source ()))
+    priv->commit_id = 0;
+
+  commit_transaction (priv);
+  g_mutex_unlock (&priv->statements_lock);
+
+  return FALSE;
+}
+
+
+/* Writes arriving close together, from any thread, are grouped in a single
+ * transaction, so that the database is only synced once for all of them.
+ * Must be called with the statements lock held, before writing. */
+static void
+begin_write (TplLogStoreSqlitePrivate *priv)
+{
+  if (priv->transaction_writes >= TRANSACTION_MAX_WRITES)
+    commit_transaction (priv);
+
+  if (sqlite3_get_autocommit (priv->db))
+    {
+      char *errmsg = NULL;
+
+      sqlite3_exec (priv->db, "BEGIN TRANSACTION", NULL, NULL, &errmsg);
+      if (errmsg != NULL)
+        {
+          /* the write is committed on its own */
+          DEBUG ("Failed to start a transaction: %s", errmsg);
+          sqlite3_free (errmsg);
+          return;
+        }
+    }
+
+  if (priv->commit_id == 0)
+    priv->commit_id = g_timeout_add (TRANSACTION_TIMEOUT_MS,
+        commit_transaction_cb, priv);
+
+  priv->transaction_writes++;
+}
+
+
+static guint
+counter_hash (gconstpointer key)
+{
+  const Counter *counter = key;
+
+  return g_str_hash (counter->account) ^
+    (g_str_hash (counter->identifier) * 31) ^
+    (g_str_hash (counter->date) * 17) ^
+    counter->chatroom;
+}
+
+
+static gboolean
+counter_equal (gconstpointer a,
+    gconstpointer b)
+{
+  const Counter *counter_a = a;
+  const Counter *counter_b = b;
+
+  return counter_a->chatroom == counter_b->chatroom &&
+    !tp_strdiff (counter_a->date, counter_b->date) &&
+    !tp_strdiff (counter_a->identifier, counter_b->identifier) &&
+    !tp_strdiff (counter_a->account, counter_b->account);
+}
+
+
+static void
+counter_free (Counter *counter)
+{
+  g_free (counter->account);
+  g_free (counter->identifier);
+  g_free (counter->date);
+  g_slice_free (Counter, counter);
+}
+
+
+static GHashTable *
+counters_new (void)
+{
+  return g_hash_table_new_full (counter_hash, counter_equal,
+      (GDestroyNotify) counter_free, NULL);
+}
+
+
+static gboolean flush_counters_cb (gpointer user_data);
+
+
+/* Must be called with the counters lock held */
+static void
+schedule_flush_counters (TplLogStoreSqlitePrivate *priv)
+{
+  if (priv->flush_id == 0)
+    /* low priority, so that counters are written when the main loop is
+     * otherwise idle */
+    priv->flush_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+        COUNTERS_FLUSH_TIMEOUT_S, flush_counters_cb, priv, NULL);
+}
+
+
+/* Adds @counters, which failed to be written, back to the pending ones so
+ * that the next flush retries them. Must be called with the counters lock
+ * held. */
+static void
+requeue_counters (TplLogStoreSqlitePrivate *priv,
+    GList *counters)
+{
+  GList *l;
+
+  for (l = counters; l != NULL; l = g_list_next (l))
+    {
+      Counter *counter = l->data;
+      Counter *pending = g_hash_table_lookup (priv->counters, counter);
+
+      if (pending != NULL)
+        {
+          pending->messages += counter->messages;
+          counter_free (counter);
+        }
+      else
+        {
+          g_hash_table_add (priv->counters, counter);
+        }
+    }
+
+  schedule_flush_counters (priv);
+}
+
+
+/* Writes the pending counter increments, joining the transaction writes are
+ * grouped in. Must be called without the statements lock held. */
+static void
+flush_counters (TplLogStoreSqlitePrivate *priv)
+{
+  GHashTable *counters;
+  GHashTableIter iter;
+  Counter *counter;
+  GList *failed = NULL;
+  sqlite3_stmt *sql;
+
+  /* Counters left pending are written by the next flush */
+  sql = get_statement (priv, STMT_ADD_MESSAGE_COUNTER);
+  if (sql == NULL)
+    {
+      DEBUG ("Failed to prepare SQL: %s", sqlite3_errmsg (priv->db));
+      return;
+    }
+
+  g_mutex_lock (&priv->counters_lock);
+
+  if (priv->flush_id != 0)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+
+  if (g_hash_table_size (priv->counters) == 0)
+    {
+      g_mutex_unlock (&priv->counters_lock);
+      release_statement (priv, sql);
+      return;
+    }
+
+  counters = priv->counters;
+  priv->counters = counters_new ();
+
+  g_mutex_unlock (&priv->counters_lock);
+
+  DEBUG ("Flushing %u counters", g_hash_table_size (counters));
+
+  begin_write (priv);
+
+  g_hash_table_iter_init (&iter, counters);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &counter, NULL))
+    {
+      sqlite3_bind_text (sql, 1, counter->account, -1, SQLITE_STATIC);
+      sqlite3_bind_text (sql, 2, counter->identifier, -1, SQLITE_STATIC);
+      sqlite3_bind_int (sql, 3, counter->chatroom);
+      sqlite3_bind_text (sql, 4, counter->date, -1, SQLITE_STATIC);
+      sqlite3_bind_int (sql, 5, counter->messages);
+
+      if (sqlite3_step (sql) != SQLITE_DONE)
+        {
+          DEBUG ("Failed to update counter for %s on %s: %s",
+              counter->identifier, counter->date, sqlite3_errmsg (priv->db));
+
+          g_hash_table_iter_steal (&iter);
+          failed = g_list_prepend (failed, counter);
+        }
+
+      sqlite3_reset (sql);
+    }
+
+  if (failed != NULL)
+    {
+      g_mutex_lock (&priv->counters_lock);
+      requeue_counters (priv, failed);
+      g_mutex_unlock (&priv->counters_lock);
+
+      g_list_free (failed);
+    }
+
+  release_statement (priv, sql);
+
+  g_hash_table_unref (counters);
+}
+
+
+static gboolean
+flush_counters_cb (gpointer user_data)
+{
+  TplLogStoreSqlitePrivate *priv = user_data;
+
+  /* the writer thread may have flushed, and scheduled another flush, while
+   * this one was being dispatched */
+  g_mutex_lock (&priv->counters_lock);
+  if (priv->flush_id == g_source_get_id (g_main_current_source ()))
+    priv->flush_id = 0;
+  g_mutex_unlock (&priv->counters_lock);
+
+  flush_counters (priv);
+
+  return FALSE;
+}
+
+
+/* Each migration brings the tables created by _tpl_log_store_sqlite_init ()
+ * from the version of the schema before it to the next one; the version a
+ * database is at is kept in its user_version. */
+static const gchar * const migrations[] = {
+    /* 1: keys for every lookup. Counters used to be looked up and then
+     * inserted or updated, and pending messages were removed before being
+     * added again, so only the keys prevent duplicates: should there be
+     * any, counters are merged and the latest pending message is kept. */
+    "CREATE TEMP TABLE merged_messagecounts AS "
+      "SELECT account, identifier, chatroom, date, "
+        "SUM(messages) AS messages "
+      "FROM messagecounts "
+      "GROUP BY account, identifier, chatroom, date;"
+    "DELETE FROM messagecounts;"
+    "INSERT INTO messagecounts "
+        "(account, identifier, chatroom, date, messages) "
+      "SELECT account, identifier, chatroom, date, messages "
+      "FROM merged_messagecounts;"
+    "DROP TABLE merged_messagecounts;"
+    "CREATE UNIQUE INDEX IF NOT EXISTS messagecounts_key "
+      "ON messagecounts (account, identifier, chatroom, date);"
+    "CREATE INDEX IF NOT EXISTS messagecounts_recent "
+      "ON messagecounts (account, identifier, date);"
+    "DELETE FROM pending_messages WHERE rowid NOT IN "
+      "(SELECT MAX(rowid) FROM pending_messages GROUP BY channel, id);"
+    "CREATE UNIQUE INDEX IF NOT EXISTS pending_messages_key "
+      "ON pending_messages (channel, id)",
+    /* 2: the targets whose counters were worked out from the logs, so that
+     * an interrupted backfill can carry on where it stopped */
+    "CREATE TABLE IF NOT EXISTS backfilled ("
+        "account TEXT, "
+        "identifier TEXT, "
+        "chatroom BOOLEAN, "
+        "UNIQUE (account, identifier, chatroom))",
+};
+
+#define SCHEMA_VERSION G_N_ELEMENTS (migrations)
+
+
+static gboolean
+migrate_schema (TplLogStoreSqlitePrivate *priv)
+{
+  sqlite3_stmt *sql = NULL;
+  guint version = 0;
+
+  if (sqlite3_prepare_v2 (priv->db, "PRAGMA user_version", -1, &sql,
+        NULL) != SQLITE_OK)
+    {
+      CRITICAL ("Failed to get the schema version: %s\n",
+          sqlite3_errmsg (priv->db));
+      return FALSE;
+    }
+
+  if (sqlite3_step (sql) == SQLITE_ROW)
+    version = sqlite3_column_int (sql, 0);
+
+  sqlite3_finalize (sql);
+
+  if (version > SCHEMA_VERSION)
+    DEBUG ("Schema version %u is newer than %u, leaving it alone",
+        version, (guint) SCHEMA_VERSION);
+
+  for (; version < SCHEMA_VERSION; version++)
+    {
+      char *errmsg = NULL;
+      gchar *query;
+
+      DEBUG ("Migrating schema to version %u", version + 1);
+
+      query = g_strdup_printf ("BEGIN TRANSACTION;"
+          "%s;"
+          "PRAGMA user_version = %u;"
+          "COMMIT",
+          migrations[version], version + 1);
+      sqlite3_exec (priv->db, query, NULL, NULL, &errmsg);
+      g_free (query);
+
+      if (errmsg != NULL)
+        {
+          CRITICAL ("Failed to migrate schema to version %u: %s\n",
+              version + 1, errmsg);
+          sqlite3_free (errmsg);
+          sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+
 static void
 purge_pending_messages (TplLogStoreSqlitePrivate *priv,
     GTimeSpan delta,
@@ -183,6 +751,9 @@ _tpl_log_store_sqlite_init (TplLogStoreSqlite *self)
   GError *error = NULL;
 
   self->priv = priv;
+  g_mutex_init (&priv->statements_lock);
+  g_mutex_init (&priv->counters_lock);
+  priv->counters = counters_new ();
 
   DEBUG ("cache file is '%s'", filename);
 
@@ -198,8 +769,10 @@ _tpl_log_store_sqlite_init (TplLogStoreSqlite *self)
       g_free (dirname);
     }
 
+  /* counters are updated from the log manager's writer thread while
+   * pending messages are handled in the main thread */
   e = sqlite3_open_v2 (filename, &priv->db,
-      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX,
       NULL);
   if (e != SQLITE_OK)
     {
@@ -207,6 +780,21 @@ _tpl_log_store_sqlite_init (TplLogStoreSqlite *self)
           sqlite3_errmsg (priv->db));
       goto out;
     }
+
+  sqlite3_busy_timeout (priv->db, BUSY_TIMEOUT_MS);
+
+  /* With a write-ahead log, a transaction is a single append to the log, and
+   * NORMAL only syncs it when checkpointing: the last transactions may be
+   * lost on power failure, but never corrupt the cache */
+  sqlite3_exec (priv->db, "PRAGMA journal_mode = WAL", NULL, NULL, &errmsg);
+  if (errmsg != NULL)
+    {
+      DEBUG ("Failed to use a write-ahead log: %s", errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+
+  set_synchronous (priv, SYNCHRONOUS_NORMAL);
   /* end of common part */
 
   /* start of cache table init */
@@ -262,8 +850,12 @@ _tpl_log_store_sqlite_init (TplLogStoreSqlite *self)
       sqlite3_free (errmsg);
       goto out;
     }
+
   /* end of counter table init */
 
+  if (!migrate_schema (priv))
+    goto out;
+
 out:
   g_free (filename);
 }
@@ -273,6 +865,34 @@ static void
 tpl_log_store_sqlite_dispose (GObject *self)
 {
   TplLogStoreSqlitePrivate *priv = TPL_LOG_STORE_SQLITE (self)->priv;
+  guint i;
+
+  if (priv->db != NULL)
+    {
+      flush_counters (priv);
+
+      g_mutex_lock (&priv->statements_lock);
+      commit_transaction (priv);
+      g_mutex_unlock (&priv->statements_lock);
+    }
+
+  /* counters which still failed to be written are lost */
+  g_mutex_lock (&priv->counters_lock);
+  if (priv->flush_id != 0)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+  g_mutex_unlock (&priv->counters_lock);
+
+  for (i = 0; i < N_STMTS; i++)
+    {
+      if (priv->statements[i] != NULL)
+        {
+          sqlite3_finalize (priv->statements[i]);
+          priv->statements[i] = NULL;
+        }
+    }
 
   if (priv->db != NULL)
     {
@@ -284,6 +904,19 @@ tpl_log_store_sqlite_dispose (GObject *self)
 }
 
 
+static void
+tpl_log_store_sqlite_finalize (GObject *self)
+{
+  TplLogStoreSqlitePrivate *priv = TPL_LOG_STORE_SQLITE (self)->priv;
+
+  g_hash_table_unref (priv->counters);
+  g_mutex_clear (&priv->counters_lock);
+  g_mutex_clear (&priv->statements_lock);
+
+  G_OBJECT_CLASS (_tpl_log_store_sqlite_parent_class)->finalize (self);
+}
+
+
 static void
 _tpl_log_store_sqlite_class_init (TplLogStoreSqliteClass *klass)
 {
@@ -291,10 +924,26 @@ _tpl_log_store_sqlite_class_init (TplLogStoreSqliteClass *klass)
 
   gobject_class->constructor = tpl_log_store_sqlite_constructor;
   gobject_class->get_property = tpl_log_store_sqlite_get_property;
+  gobject_class->set_property = tpl_log_store_sqlite_set_property;
   gobject_class->dispose = tpl_log_store_sqlite_dispose;
+  gobject_class->finalize = tpl_log_store_sqlite_finalize;
 
   g_object_class_override_property (gobject_class, PROP_READABLE, "readable");
 
+  /**
+   * TplLogStoreSqlite:synchronous:
+   *
+   * How hard SQLite tries to make sure writes reach the disk, as the
+   * synchronous pragma: 0 (OFF), 1 (NORMAL), 2 (FULL) or 3 (EXTRA). The log
+   * manager sets it from the sqlite-synchronous GSettings key.
+   */
+  g_object_class_install_property (gobject_class, PROP_SYNCHRONOUS,
+      g_param_spec_uint ("synchronous",
+          "Synchronous",
+          "The SQLite synchronous level",
+          SYNCHRONOUS_OFF, SYNCHRONOUS_EXTRA, SYNCHRONOUS_NORMAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   g_type_class_add_private (gobject_class, sizeof (TplLogStoreSqlitePrivate));
 }
 
@@ -367,145 +1016,63 @@ tpl_log_store_sqlite_add_message_counter (TplLogStore *self,
     GError **error)
 {
   TplLogStoreSqlitePrivate *priv = TPL_LOG_STORE_SQLITE (self)->priv;
-  const char *account, *identifier;
-  gboolean chatroom;
-  char *date = NULL;
-  int count = 0;
-  sqlite3_stmt *sql = NULL;
-  gboolean retval = FALSE;
-  gboolean insert = FALSE;
-  int e;
+  Counter key;
+  Counter *counter;
+  gboolean flush = FALSE;
 
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
   if (TPL_IS_TEXT_EVENT (message) == FALSE)
     {
       DEBUG ("ignoring non-text event not intersting for message-counter");
-      retval = TRUE;
-      goto out;
+      return TRUE;
     }
 
   DEBUG ("message received");
 
-  account = get_account_name_from_event (message);
-  identifier = _tpl_event_get_target_id (message);
-  chatroom = _tpl_event_target_is_room (message);
-  date = get_date (message);
-
-  DEBUG ("account = %s", account);
-  DEBUG ("identifier = %s", identifier);
-  DEBUG ("chatroom = %i", chatroom);
-  DEBUG ("date = %s", date);
-
-  /* get the existing row */
-  e = sqlite3_prepare_v2 (priv->db,
-      "SELECT messages FROM messagecounts WHERE "
-        "account=? AND "
-        "identifier=? AND "
-        "chatroom=? AND "
-        "date=date(?)",
-      -1, &sql, NULL);
-  if (e != SQLITE_OK)
-    {
-      g_set_error (error, TPL_LOG_STORE_ERROR,
-          TPL_LOG_STORE_ERROR_ADD_EVENT,
-          "SQL Error checking current counter in %s: %s", G_STRFUNC,
-          sqlite3_errmsg (priv->db));
+  key.account = (gchar *) get_account_name_from_event (message);
+  key.identifier = (gchar *) _tpl_event_get_target_id (message);
+  key.chatroom = _tpl_event_target_is_room (message);
+  key.date = get_date (message);
 
-      goto out;
-    }
+  DEBUG ("account = %s", key.account);
+  DEBUG ("identifier = %s", key.identifier);
+  DEBUG ("chatroom = %i", key.chatroom);
+  DEBUG ("date = %s", key.date);
 
-  sqlite3_bind_text (sql, 1, account, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_text (sql, 2, identifier, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_int (sql, 3, chatroom);
-  sqlite3_bind_text (sql, 4, date, -1, SQLITE_TRANSIENT);
+  /* add the message up in memory, it is written with the others later */
+  g_mutex_lock (&priv->counters_lock);
 
-  e = sqlite3_step (sql);
-  if (e == SQLITE_DONE)
-    {
-      DEBUG ("no rows, insert");
-      insert = TRUE;
-    }
-  else if (e == SQLITE_ROW)
+  counter = g_hash_table_lookup (priv->counters, &key);
+  if (counter == NULL)
     {
-      count = sqlite3_column_int (sql, 0);
-      DEBUG ("got row, count = %i", count);
-    }
-  else
-    {
-      g_set_error (error, TPL_LOG_STORE_ERROR,
-          TPL_LOG_STORE_ERROR_ADD_EVENT,
-          "SQL Error binding counter checking query in %s: %s", G_STRFUNC,
-          sqlite3_errmsg (priv->db));
-
-      goto out;
-    }
-
-  sqlite3_finalize (sql);
-  sql = NULL;
-
-  /* increment the message count */
-  count++;
+      counter = g_slice_new (Counter);
+      counter->account = g_strdup (key.account);
+      counter->identifier = g_strdup (key.identifier);
+      counter->chatroom = key.chatroom;
+      counter->date = key.date;
+      counter->messages = 0;
 
-  DEBUG ("new count = %i, insert = %i", count, insert);
+      key.date = NULL;
 
-  /* update table with new message count */
-  if (insert)
-    e = sqlite3_prepare_v2 (priv->db,
-        "INSERT INTO messagecounts "
-          "(messages, account, identifier, chatroom, date) "
-        "VALUES (?, ?, ?, ?, date(?))",
-        -1, &sql, NULL);
-  else
-    e = sqlite3_prepare_v2 (priv->db,
-        "UPDATE messagecounts SET messages=? WHERE "
-          "account=? AND "
-          "identifier=? AND "
-          "chatroom=? AND "
-          "date=date(?)",
-        -1, &sql, NULL);
-
-  if (e != SQLITE_OK)
-    {
-      g_set_error (error, TPL_LOG_STORE_ERROR,
-          TPL_LOG_STORE_ERROR_ADD_EVENT,
-          "SQL Error preparing query in %s: %s", G_STRFUNC,
-          sqlite3_errmsg (priv->db));
-
-      goto out;
+      g_hash_table_add (priv->counters, counter);
     }
 
-  sqlite3_bind_int (sql, 1, count);
-  sqlite3_bind_text (sql, 2, account, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_text (sql, 3, identifier, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_int (sql, 4, chatroom);
-  sqlite3_bind_text (sql, 5, date, -1, SQLITE_TRANSIENT);
-
-  e = sqlite3_step (sql);
-  if (e != SQLITE_DONE)
-    {
-      g_set_error (error, TPL_LOG_STORE_ERROR,
-          TPL_LOG_STORE_ERROR_ADD_EVENT,
-          "SQL Error %s counter in %s: %s",
-          (insert ? "inserting new" : "updating"),
-          G_STRFUNC, sqlite3_errmsg (priv->db));
-
-      goto out;
-    }
+  counter->messages++;
 
-  retval = TRUE;
+  if (g_hash_table_size (priv->counters) >= COUNTERS_MAX_PENDING)
+    flush = TRUE;
+  else
+    schedule_flush_counters (priv);
 
-out:
-  g_free (date);
+  g_mutex_unlock (&priv->counters_lock);
 
-  if (sql != NULL)
-    sqlite3_finalize (sql);
+  g_free (key.date);
 
-  /* check that we set an error if appropriate */
-  g_assert ((retval == TRUE && *error == NULL) ||
-            (retval == FALSE && *error != NULL));
+  if (flush)
+    flush_counters (priv);
 
-  return retval;
+  return TRUE;
 }
 
 
@@ -567,12 +1134,11 @@ tpl_log_store_sqlite_get_entities (TplLogStore *self,
 
   DEBUG ("account = %s", account_name);
 
+  flush_counters (priv);
+
   /* list all the identifiers known to the database */
-  e = sqlite3_prepare_v2 (priv->db,
-      "SELECT DISTINCT identifier, chatroom FROM messagecounts WHERE "
-          "account=?",
-      -1, &sql, NULL);
-  if (e != SQLITE_OK)
+  sql = get_statement (priv, STMT_GET_ENTITIES);
+  if (sql == NULL)
     {
       DEBUG ("Failed to prepare SQL: %s",
           sqlite3_errmsg (priv->db));
@@ -609,7 +1175,7 @@ tpl_log_store_sqlite_get_entities (TplLogStore *self,
 
 out:
   if (sql != NULL)
-    sqlite3_finalize (sql);
+    release_statement (priv, sql);
 
   return list;
 }
@@ -658,13 +1224,8 @@ _tpl_log_store_sqlite_get_pending_messages (TplLogStore *self,
   DEBUG ("Listing pending messages for channel %s",
       get_channel_name (channel));
 
-  e = sqlite3_prepare_v2 (priv->db, "SELECT id,timestamp "
-      "FROM pending_messages "
-      "WHERE channel=? "
-      "ORDER BY id ASC",
-      -1, &sql, NULL);
-
-  if (e != SQLITE_OK)
+  sql = get_statement (priv, STMT_GET_PENDING_MESSAGES);
+  if (sql == NULL)
     {
       CRITICAL ("Error preparing SQL for pending messages list: %s",
           sqlite3_errmsg (priv->db));
@@ -707,7 +1268,7 @@ _tpl_log_store_sqlite_get_pending_messages (TplLogStore *self,
 
 out:
   if (sql != NULL)
-    sqlite3_finalize (sql);
+    release_statement (priv, sql);
 
   /* check that we set an error if appropriate
    * NOTE: retval == NULL && *error !=
@@ -737,7 +1298,6 @@ _tpl_log_store_sqlite_remove_pending_messages (TplLogStore *self,
 {
   TplLogStoreSqlitePrivate *priv = TPL_LOG_STORE_SQLITE (self)->priv;
   gboolean retval = TRUE;
-  GString *query = NULL;
   GList *it;
   sqlite3_stmt *sql = NULL;
 
@@ -748,45 +1308,49 @@ _tpl_log_store_sqlite_remove_pending_messages (TplLogStore *self,
   DEBUG ("Removing pending messages for channel %s",
       get_channel_name (channel));
 
-  query = g_string_new ("DELETE FROM pending_messages WHERE ");
+  sql = get_statement (priv, STMT_REMOVE_PENDING_MESSAGE);
+  if (sql == NULL)
+    {
+      g_set_error (error, TPL_LOG_STORE_SQLITE_ERROR,
+          TPL_LOG_STORE_SQLITE_ERROR_REMOVE_PENDING_MESSAGES,
+          "SQL Error in %s: %s", G_STRFUNC, sqlite3_errmsg (priv->db));
+      return FALSE;
+    }
 
-  g_string_append_printf (query, "channel='%s' AND id IN (%u",
-      get_channel_name (channel), GPOINTER_TO_UINT (pending_ids->data));
+  begin_write (priv);
 
-  DEBUG (" - pending_id: %u", GPOINTER_TO_UINT (pending_ids->data));
+  /* all the messages are removed at once, or none is */
+  sqlite3_exec (priv->db, "SAVEPOINT remove_pending_messages", NULL, NULL,
+      NULL);
+
+  sqlite3_bind_text (sql, 1, get_channel_name (channel), -1,
+      SQLITE_TRANSIENT);
 
-  for (it = g_list_next (pending_ids); it != NULL; it = g_list_next (it))
+  for (it = pending_ids; it != NULL && retval; it = g_list_next (it))
     {
       DEBUG (" - pending_id: %u", GPOINTER_TO_UINT (it->data));
-      g_string_append_printf (query, ",%u", GPOINTER_TO_UINT (it->data));
-    }
 
-  g_string_append (query, ")");
+      sqlite3_bind_int (sql, 2, (gint) GPOINTER_TO_UINT (it->data));
 
-  if (sqlite3_prepare_v2 (priv->db, query->str, -1, &sql, NULL) != SQLITE_OK)
-    {
-      g_set_error (error, TPL_LOG_STORE_SQLITE_ERROR,
-          TPL_LOG_STORE_SQLITE_ERROR_REMOVE_PENDING_MESSAGES,
-          "SQL Error in %s: %s", G_STRFUNC, sqlite3_errmsg (priv->db));
-      retval = FALSE;
-      goto out;
-    }
+      if (sqlite3_step (sql) != SQLITE_DONE)
+        {
+          g_set_error (error, TPL_LOG_STORE_SQLITE_ERROR,
+              TPL_LOG_STORE_SQLITE_ERROR_REMOVE_PENDING_MESSAGES,
+              "SQL Error in %s: %s", G_STRFUNC, sqlite3_errmsg (priv->db));
+          retval = FALSE;
+        }
 
-  if (sqlite3_step (sql) != SQLITE_DONE)
-    {
-      g_set_error (error, TPL_LOG_STORE_SQLITE_ERROR,
-          TPL_LOG_STORE_SQLITE_ERROR_REMOVE_PENDING_MESSAGES,
-          "SQL Error in %s: %s", G_STRFUNC, sqlite3_errmsg (priv->db));
-      retval = FALSE;
-      goto out;
+      sqlite3_reset (sql);
     }
 
-out:
-  if (query != NULL)
-    g_string_free (query, TRUE);
+  if (!retval)
+    sqlite3_exec (priv->db, "ROLLBACK TO remove_pending_messages", NULL,
+        NULL, NULL);
 
-  if (sql != NULL)
-    sqlite3_finalize (sql);
+  sqlite3_exec (priv->db, "RELEASE remove_pending_messages", NULL, NULL,
+      NULL);
+
+  release_statement (priv, sql);
 
   return retval;
 }
@@ -836,10 +1400,8 @@ _tpl_log_store_sqlite_add_pending_message (TplLogStore *self,
       goto out;
     }
 
-  e = sqlite3_prepare_v2 (priv->db,
-      "INSERT INTO pending_messages (channel, id, timestamp) VALUES (?, ?, ?)",
-      -1, &sql, NULL);
-  if (e != SQLITE_OK)
+  sql = get_statement (priv, STMT_ADD_PENDING_MESSAGE);
+  if (sql == NULL)
     {
       g_set_error (error, TPL_LOG_STORE_ERROR,
           TPL_LOG_STORE_SQLITE_ERROR_ADD_PENDING_MESSAGE,
@@ -847,6 +1409,8 @@ _tpl_log_store_sqlite_add_pending_message (TplLogStore *self,
       goto out;
     }
 
+  begin_write (priv);
+
   sqlite3_bind_text (sql, 1, channel_path, -1, SQLITE_TRANSIENT);
   sqlite3_bind_int (sql, 2, (gint) id);
   sqlite3_bind_int64 (sql, 3, timestamp);
@@ -866,7 +1430,7 @@ out:
   g_free (date);
 
   if (sql != NULL)
-    sqlite3_finalize (sql);
+    release_statement (priv, sql);
 
   /* check that we set an error if appropriate */
   g_assert ((retval == TRUE && *error == NULL) ||
@@ -889,14 +1453,10 @@ _tpl_log_store_sqlite_get_most_recent (TplLogStoreSqlite *self,
 
   account_name = get_account_name (account);
 
-  /* this SQL gets this most recent date for a single identifier */
-  e = sqlite3_prepare_v2 (priv->db,
-      "SELECT STRFTIME('%s', date) FROM messagecounts WHERE "
-          "account=? AND "
-          "identifier=? "
-        "ORDER BY date DESC LIMIT 1",
-      -1, &sql, NULL);
-  if (e != SQLITE_OK)
+  flush_counters (priv);
+
+  sql = get_statement (priv, STMT_GET_MOST_RECENT);
+  if (sql == NULL)
     {
       DEBUG ("Failed to prepare SQL: %s",
           sqlite3_errmsg (priv->db));
@@ -928,7 +1488,7 @@ _tpl_log_store_sqlite_get_most_recent (TplLogStoreSqlite *self,
 out:
 
   if (sql != NULL)
-    sqlite3_finalize (sql);
+    release_statement (priv, sql);
 
   return date;
 }
@@ -947,14 +1507,10 @@ _tpl_log_store_sqlite_get_frequency (TplLogStoreSqlite *self,
 
   account_name = get_account_name (account);
 
-  /* this SQL query builds the frequency for a single identifier */
-  e = sqlite3_prepare_v2 (priv->db,
-      "SELECT SUM(messages / ROUND(JULIANDAY('now') - JULIANDAY(date) + 1)) "
-        "FROM messagecounts WHERE "
-          "account=? AND "
-          "identifier=?",
-      -1, &sql, NULL);
-  if (e != SQLITE_OK)
+  flush_counters (priv);
+
+  sql = get_statement (priv, STMT_GET_FREQUENCY);
+  if (sql == NULL)
     {
       DEBUG ("Failed to prepare SQL: %s",
           sqlite3_errmsg (priv->db));
@@ -986,7 +1542,301 @@ _tpl_log_store_sqlite_get_frequency (TplLogStoreSqlite *self,
 out:
 
   if (sql != NULL)
-    sqlite3_finalize (sql);
+    release_statement (priv, sql);
 
   return freq;
 }
+
+
+static void
+contact_stats_free (TplContactStats *stats)
+{
+  g_free (stats->identifier);
+  g_slice_free (TplContactStats, stats);
+}
+
+
+/**
+ * _tpl_log_store_sqlite_get_contact_stats:
+ * @self: a TplLogStoreSqlite instance
+ * @account: a #TpAccount
+ *
+ * Gets the same figures as _tpl_log_store_sqlite_get_most_recent() and
+ * _tpl_log_store_sqlite_get_frequency() for all the identifiers of @account
+ * at once, with a single query. Meant to rank a whole contact list.
+ *
+ * Returns: (transfer full): a #GHashTable mapping each identifier to its
+ *  #TplContactStats, or %NULL on error
+ */
+GHashTable *
+_tpl_log_store_sqlite_get_contact_stats (TplLogStoreSqlite *self,
+    TpAccount *account)
+{
+  TplLogStoreSqlitePrivate *priv;
+  sqlite3_stmt *sql = NULL;
+  GHashTable *stats;
+  int e;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE (self), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+
+  priv = self->priv;
+  stats = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) contact_stats_free);
+
+  flush_counters (priv);
+
+  sql = get_statement (priv, STMT_GET_CONTACT_STATS);
+  if (sql == NULL)
+    {
+      DEBUG ("Failed to prepare SQL: %s",
+          sqlite3_errmsg (priv->db));
+
+      goto error;
+    }
+
+  sqlite3_bind_text (sql, 1, get_account_name (account), -1,
+      SQLITE_TRANSIENT);
+
+  while ((e = sqlite3_step (sql)) == SQLITE_ROW)
+    {
+      TplContactStats *contact;
+
+      contact = g_slice_new (TplContactStats);
+      contact->identifier = g_strdup (
+          (const char *) sqlite3_column_text (sql, 0));
+      contact->most_recent = sqlite3_column_int64 (sql, 1);
+      contact->frequency = sqlite3_column_double (sql, 2);
+
+      /* the key is owned by the value */
+      g_hash_table_insert (stats, contact->identifier, contact);
+    }
+
+  if (e != SQLITE_DONE)
+    {
+      DEBUG ("Failed to execute SQL: %s",
+          sqlite3_errmsg (priv->db));
+
+      goto error;
+    }
+
+  release_statement (priv, sql);
+
+  DEBUG ("got stats for %u identifiers", g_hash_table_size (stats));
+
+  return stats;
+
+error:
+  if (sql != NULL)
+    release_statement (priv, sql);
+
+  g_hash_table_unref (stats);
+
+  return NULL;
+}
+
+
+static void
+bind_target (sqlite3_stmt *sql,
+    TpAccount *account,
+    TplEntity *target)
+{
+  sqlite3_bind_text (sql, 1, get_account_name (account), -1,
+      SQLITE_TRANSIENT);
+  sqlite3_bind_text (sql, 2, tpl_entity_get_identifier (target), -1,
+      SQLITE_TRANSIENT);
+  sqlite3_bind_int (sql, 3,
+      tpl_entity_get_entity_type (target) == TPL_ENTITY_ROOM);
+}
+
+
+/**
+ * _tpl_log_store_sqlite_is_backfilled:
+ * @self: a TplLogStoreSqlite instance
+ * @account: a #TpAccount
+ * @target: a #TplEntity
+ *
+ * Returns: %TRUE if the counters of @target were set with
+ *  _tpl_log_store_sqlite_set_message_counts() since the last call to
+ *  _tpl_log_store_sqlite_clear_backfilled()
+ */
+gboolean
+_tpl_log_store_sqlite_is_backfilled (TplLogStoreSqlite *self,
+    TpAccount *account,
+    TplEntity *target)
+{
+  TplLogStoreSqlitePrivate *priv;
+  sqlite3_stmt *sql;
+  gboolean backfilled;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE (self), FALSE);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), FALSE);
+
+  priv = self->priv;
+
+  sql = get_statement (priv, STMT_IS_BACKFILLED);
+  if (sql == NULL)
+    {
+      DEBUG ("Failed to prepare SQL: %s", sqlite3_errmsg (priv->db));
+      return FALSE;
+    }
+
+  bind_target (sql, account, target);
+  backfilled = (sqlite3_step (sql) == SQLITE_ROW);
+
+  release_statement (priv, sql);
+
+  return backfilled;
+}
+
+
+/**
+ * _tpl_log_store_sqlite_set_message_counts:
+ * @self: a TplLogStoreSqlite instance
+ * @account: a #TpAccount
+ * @target: a #TplEntity
+ * @counts: a #GHashTable mapping Julian days to the number of text events
+ *  with @target logged on that day, both as #guint
+ * @error: a #GError to be set on error, or %NULL
+ *
+ * Replaces the counters of @target for the days in @counts, and marks it as
+ * backfilled, in a single transaction committed before returning.
+ *
+ * Returns: %TRUE on success, %FALSE on error with @error set
+ */
+gboolean
+_tpl_log_store_sqlite_set_message_counts (TplLogStoreSqlite *self,
+    TpAccount *account,
+    TplEntity *target,
+    GHashTable *counts,
+    GError **error)
+{
+  TplLogStoreSqlitePrivate *priv;
+  sqlite3_stmt *set_sql, *add_sql;
+  GHashTableIter iter;
+  gpointer day, messages;
+  gboolean retval = FALSE;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_SQLITE (self), FALSE);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  priv = self->priv;
+
+  g_mutex_lock (&priv->statements_lock);
+
+  set_sql = prepare_statement (priv, STMT_SET_MESSAGE_COUNTER);
+  add_sql = prepare_statement (priv, STMT_ADD_BACKFILLED);
+  if (set_sql == NULL || add_sql == NULL)
+    {
+      g_set_error (error, TPL_LOG_STORE_SQLITE_ERROR,
+          TPL_LOG_STORE_SQLITE_ERROR_FAILED,
+          "SQL Error preparing query in %s: %s", G_STRFUNC,
+          sqlite3_errmsg (priv->db));
+      goto out;
+    }
+
+  begin_write (priv);
+
+  sqlite3_exec (priv->db, "SAVEPOINT set_message_counts", NULL, NULL, NULL);
+
+  bind_target (set_sql, account, target);
+
+  g_hash_table_iter_init (&iter, counts);
+  while (g_hash_table_iter_next (&iter, &day, &messages))
+    {
+      GDate *date = g_date_new_julian (GPOINTER_TO_UINT (day));
+      gchar str[16];
+
+      g_date_strftime (str, sizeof (str), "%Y-%m-%d", date);
+      g_date_free (date);
+
+      sqlite3_bind_text (set_sql, 4, str, -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int (set_sql, 5, GPOINTER_TO_UINT (messages));
+
+      if (sqlite3_step (set_sql) != SQLITE_DONE)
+        {
+          g_set_error (error, TPL_LOG_STORE_SQLITE_ERROR,
+              TPL_LOG_STORE_SQLITE_ERROR_FAILED,
+              "SQL Error setting counter in %s: %s", G_STRFUNC,
+              sqlite3_errmsg (priv->db));
+          goto rollback;
+        }
+
+      sqlite3_reset (set_sql);
+    }
+
+  bind_target (add_sql, account, target);
+
+  if (sqlite3_step (add_sql) != SQLITE_DONE)
+    {
+      g_set_error (error, TPL_LOG_STORE_SQLITE_ERROR,
+          TPL_LOG_STORE_SQLITE_ERROR_FAILED,
+          "SQL Error in %s: %s", G_STRFUNC, sqlite3_errmsg (priv->db));
+      goto rollback;
+    }
+
+  retval = TRUE;
+
+rollback:
+  if (!retval)
+    sqlite3_exec (priv->db, "ROLLBACK TO set_message_counts", NULL, NULL,
+        NULL);
+
+  sqlite3_exec (priv->db, "RELEASE set_message_counts", NULL, NULL, NULL);
+
+  /* so that an interruption doesn't lose what is marked as done */
+  commit_transaction (priv);
+
+out:
+  if (set_sql != NULL)
+    {
+      sqlite3_reset (set_sql);
+      sqlite3_clear_bindings (set_sql);
+    }
+
+  if (add_sql != NULL)
+    {
+      sqlite3_reset (add_sql);
+      sqlite3_clear_bindings (add_sql);
+    }
+
+  g_mutex_unlock (&priv->statements_lock);
+
+  return retval;
+}
+
+
+/**
+ * _tpl_log_store_sqlite_clear_backfilled:
+ * @self: a TplLogStoreSqlite instance
+ *
+ * Forgets which targets were backfilled, so that the next backfill goes
+ * through all the logs again.
+ */
+void
+_tpl_log_store_sqlite_clear_backfilled (TplLogStoreSqlite *self)
+{
+  TplLogStoreSqlitePrivate *priv;
+  sqlite3_stmt *sql;
+
+  g_return_if_fail (TPL_IS_LOG_STORE_SQLITE (self));
+
+  priv = self->priv;
+
+  sql = get_statement (priv, STMT_CLEAR_BACKFILLED);
+  if (sql == NULL)
+    {
+      DEBUG ("Failed to prepare SQL: %s", sqlite3_errmsg (priv->db));
+      return;
+    }
+
+  begin_write (priv);
+
+  if (sqlite3_step (sql) != SQLITE_DONE)
+    DEBUG ("Failed to execute SQL: %s", sqlite3_errmsg (priv->db));
+
+  release_statement (priv, sql);
+}
@@ -25,18 +25,25 @@
 #include "log-store-xml-internal.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <glib/gstdio.h>
 
 #include <glib-object.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include "telepathy-logger/account-map-internal.h"
 #include "telepathy-logger/call-event.h"
 #include "telepathy-logger/call-event-internal.h"
 #include "telepathy-logger/entity-internal.h"
@@ -44,6 +51,7 @@
 #include "telepathy-logger/text-event.h"
 #include "telepathy-logger/text-event-internal.h"
 #include "telepathy-logger/log-iter-xml-internal.h"
+#include "telepathy-logger/log-search-index-internal.h"
 #include "telepathy-logger/log-manager.h"
 #include "telepathy-logger/log-store-internal.h"
 #include "telepathy-logger/log-manager-internal.h"
@@ -72,23 +80,150 @@
 #define LOG_FOOTER \
     "</log>\n"
 
+/* Day files kept open on the append path, see OpenLogFile */
+#define LOG_OPEN_FILES_MAX_DEFAULT  16
+#define LOG_OPEN_FILE_IDLE_TIMEOUT  60 /* seconds */
+#define SECONDS_PER_DAY             (60 * 60 * 24)
+
+/* Parsed day files kept in memory, see CachedDay. A cached day is charged
+ * for its events, see log_store_xml_event_cost(), rather than for the size of
+ * the XML they were parsed from. */
+#define EVENT_CACHE_SIZE_DEFAULT    (4 * 1024 * 1024) /* bytes */
+#define EVENT_CACHE_EVENT_COST      256 /* bytes, per event and entity */
+#define CACHED_DAY_TAIL_LEN         64
+
+/* Searches spread the files over up to this many threads (the calling one
+ * and the store's search pool), each with at least SEARCH_FILES_PER_THREAD
+ * files to go through */
+#define SEARCH_THREADS_MAX          8
+#define SEARCH_FILES_PER_THREAD     16
+
+/* Files indexed for searches in a single transaction */
+#define SEARCH_INDEX_BATCH_FILES    64
+
+/* Hits are passed on after every batch of this many files */
+#define SEARCH_BATCH_FILES (SEARCH_THREADS_MAX * SEARCH_FILES_PER_THREAD)
+
 #define ALL_SUPPORTED_TYPES (TPL_EVENT_MASK_TEXT | TPL_EVENT_MASK_CALL)
 #define CONTAINS_ALL_SUPPORTED_TYPES(type_mask) \
   (((type_mask) & ALL_SUPPORTED_TYPES) == ALL_SUPPORTED_TYPES)
 
 
+/* A day file kept open between writes. footer_offset is where LOG_FOOTER
+ * starts, so the next event is written over it (events carry their own
+ * trailing footer). */
+typedef struct
+{
+  gchar *filename;
+  gint fd;
+  off_t footer_offset;
+  gint64 day;
+  gint64 last_used;
+  GList *lru_link;
+} OpenLogFile;
+
+/* The events parsed from a day file so far, with what is needed to carry on
+ * parsing events appended to it later. */
+typedef struct
+{
+  GQueue events;
+  /* (borrowed) supersedes-token -> (borrowed) link in events, for any event
+   * that was once in events, but has since been superseded (and therefore
+   * won't be found by a linear search). */
+  GHashTable *supersedes_links;
+  /* where the last event was inserted */
+  GList *index;
+} DayParse;
+
+/* A parsed day file, handed out to every reader of that day until the file
+ * changes. inode, size and mtime are what the file looked like before it was
+ * parsed. When the file grows, only what was written from footer_offset on
+ * is parsed, provided the tail bytes right before it are unchanged; a
+ * footer_offset of 0 means the file has to be parsed from the start. */
+typedef struct
+{
+  gchar *filename;
+  GType type;
+  ino_t inode;
+  off_t size;
+  time_t mtime;
+  DayParse parse;
+  gsize footer_offset;
+  gchar tail[CACHED_DAY_TAIL_LEN];
+  gsize tail_len;
+  gsize cost;
+  GList *lru_link;
+} CachedDay;
+
+/* The days an entity directory has day files for, as sorted arrays of Julian
+ * days, so that listing dates doesn't need a readdir. Files created by the
+ * store are added as they are written; anything else is noticed through the
+ * directory mtime, and the index is rebuilt. mtime only has a resolution of
+ * one second, so an index built (or verified) within the second the
+ * directory last changed isn't trusted: see log_store_xml_date_index_get (). */
+typedef struct
+{
+  GArray *text_days;
+  GArray *call_days;
+  time_t mtime;
+  time_t verified_at;
+} DateIndex;
+
 struct _TplLogStoreXmlPriv
 {
   gchar *basedir;
   gboolean test_mode;
   TpAccountManager *account_manager;
+  /* account directory name -> TpAccount, for search hits */
+  TplAccountMap *accounts;
+
+  /* filename -> owned OpenLogFile; the filename already encodes the
+   * account, target, event type and day. The most recently used file is
+   * at the head of open_files_lru. Events may be added from the log
+   * manager's writer thread, so all of this is protected by
+   * open_files_lock. */
+  GMutex open_files_lock;
+  GHashTable *open_files;
+  GQueue open_files_lru;
+  guint max_open_files;
+  gint64 newest_day;
+  guint open_files_sweep_id;
+
+  /* filename -> owned CachedDay, the most recently used at the head of
+   * event_cache_lru. Days are read from the log manager's worker threads
+   * and invalidated from its writer thread, hence event_cache_lock. */
+  GMutex event_cache_lock;
+  GHashTable *event_cache;
+  GQueue event_cache_lru;
+  gsize event_cache_cost;
+  guint event_cache_size;
+  guint event_cache_hits;
+  guint event_cache_misses;
+
+  /* entity directory -> owned DateIndex. Added to from the log manager's
+   * writer thread, read from its worker threads. */
+  GMutex date_index_lock;
+  GHashTable *date_indexes;
+
+  /* Opened on first use; if that fails, search_index_failed is set and
+   * searches read every file */
+  GMutex search_index_lock;
+  TplLogSearchIndex *search_index;
+  gboolean search_index_failed;
+
+  /* Helps the searching thread through the files, see SearchScan */
+  GThreadPool *search_pool;
 };
 
 enum {
     PROP_0,
     PROP_READABLE,
     PROP_BASEDIR,
-    PROP_TESTMODE
+    PROP_TESTMODE,
+    PROP_MAX_OPEN_FILES,
+    PROP_EVENT_CACHE_SIZE,
+    PROP_EVENT_CACHE_HITS,
+    PROP_EVENT_CACHE_MISSES
 };
 
 static void log_store_iface_init (gpointer g_iface, gpointer iface_data);
@@ -97,8 +232,21 @@ static void tpl_log_store_xml_get_property (GObject *object, guint param_id, GVa
 static void tpl_log_store_xml_set_property (GObject *object, guint param_id, const GValue *value,
     GParamSpec *pspec);
 static const gchar *log_store_xml_get_basedir (TplLogStoreXml *self);
+static void log_store_xml_search_scan_worker (gpointer data,
+    gpointer user_data);
+static guint log_store_xml_get_n_processors (void);
 static void log_store_xml_set_basedir (TplLogStoreXml *self,
     const gchar *data);
+static void log_store_xml_close_all_files (TplLogStoreXml *self);
+static void log_store_xml_trim_open_files (TplLogStoreXml *self);
+static void log_store_xml_cache_trim (TplLogStoreXml *self);
+static void log_store_xml_cache_clear (TplLogStoreXml *self);
+static time_t log_store_xml_get_dir_mtime (const gchar *filename);
+static void log_store_xml_date_index_add (TplLogStoreXml *self,
+    const gchar *filename, time_t dir_mtime);
+static void log_store_xml_date_index_clear (TplLogStoreXml *self);
+static gboolean log_store_xml_has_dates (TplLogStoreXml *self,
+    const gchar *dirname, gint type_mask);
 
 
 G_DEFINE_TYPE_WITH_CODE (TplLogStoreXml, _tpl_log_store_xml,
@@ -118,12 +266,21 @@ log_store_xml_dispose (GObject *object)
      the TplLogManager is kept, so that until TplObserver is instanced,
      there will always be a TpLogManager reference and it won't be
      diposed */
+  tp_clear_pointer (&priv->accounts, _tpl_account_map_free);
+
   if (priv->account_manager != NULL)
     {
       g_object_unref (priv->account_manager);
       priv->account_manager = NULL;
     }
 
+  g_mutex_lock (&priv->open_files_lock);
+  log_store_xml_close_all_files (self);
+  g_mutex_unlock (&priv->open_files_lock);
+
+  log_store_xml_cache_clear (self);
+  log_store_xml_date_index_clear (self);
+
   G_OBJECT_CLASS (_tpl_log_store_xml_parent_class)->dispose (object);
 }
 
@@ -139,6 +296,18 @@ log_store_xml_finalize (GObject *object)
       g_free (priv->basedir);
       priv->basedir = NULL;
     }
+
+  g_hash_table_unref (priv->open_files);
+  g_mutex_clear (&priv->open_files_lock);
+  g_hash_table_unref (priv->event_cache);
+  g_mutex_clear (&priv->event_cache_lock);
+  g_hash_table_unref (priv->date_indexes);
+  g_mutex_clear (&priv->date_index_lock);
+  tp_clear_pointer (&priv->search_index, _tpl_log_search_index_free);
+  g_mutex_clear (&priv->search_index_lock);
+  g_thread_pool_free (priv->search_pool, TRUE, TRUE);
+
+  G_OBJECT_CLASS (_tpl_log_store_xml_parent_class)->finalize (object);
 }
 
 
@@ -161,6 +330,22 @@ tpl_log_store_xml_get_property (GObject *object,
       case PROP_TESTMODE:
         g_value_set_boolean (value, priv->test_mode);
         break;
+      case PROP_MAX_OPEN_FILES:
+        g_value_set_uint (value, priv->max_open_files);
+        break;
+      case PROP_EVENT_CACHE_SIZE:
+        g_value_set_uint (value, priv->event_cache_size);
+        break;
+      case PROP_EVENT_CACHE_HITS:
+        g_mutex_lock (&priv->event_cache_lock);
+        g_value_set_uint (value, priv->event_cache_hits);
+        g_mutex_unlock (&priv->event_cache_lock);
+        break;
+      case PROP_EVENT_CACHE_MISSES:
+        g_mutex_lock (&priv->event_cache_lock);
+        g_value_set_uint (value, priv->event_cache_misses);
+        g_mutex_unlock (&priv->event_cache_lock);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
         break;
@@ -184,6 +369,18 @@ tpl_log_store_xml_set_property (GObject *object,
       case PROP_TESTMODE:
         self->priv->test_mode = g_value_get_boolean (value);
         break;
+      case PROP_MAX_OPEN_FILES:
+        g_mutex_lock (&self->priv->open_files_lock);
+        self->priv->max_open_files = g_value_get_uint (value);
+        log_store_xml_trim_open_files (self);
+        g_mutex_unlock (&self->priv->open_files_lock);
+        break;
+      case PROP_EVENT_CACHE_SIZE:
+        g_mutex_lock (&self->priv->event_cache_lock);
+        self->priv->event_cache_size = g_value_get_uint (value);
+        log_store_xml_cache_trim (self);
+        g_mutex_unlock (&self->priv->event_cache_lock);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
         break;
@@ -222,16 +419,111 @@ _tpl_log_store_xml_class_init (TplLogStoreXmlClass *klass)
       FALSE, G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
   g_object_class_install_property (object_class, PROP_TESTMODE, param_spec);
 
+  /**
+   * TplLogStoreXml:max-open-files:
+   *
+   * How many day files are kept open between writes. Set it to 0 to open
+   * and close the file for every event.
+   */
+  param_spec = g_param_spec_uint ("max-open-files",
+      "Max open files",
+      "Maximum number of log files kept open for appending",
+      0, G_MAXUINT, LOG_OPEN_FILES_MAX_DEFAULT,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_MAX_OPEN_FILES,
+      param_spec);
+
+  /**
+   * TplLogStoreXml:event-cache-size:
+   *
+   * How many bytes of parsed day files are kept in memory for later reads.
+   * Set it to 0 to parse the day files on every read.
+   */
+  param_spec = g_param_spec_uint ("event-cache-size",
+      "Event cache size",
+      "Memory budget in bytes of the parsed events cache",
+      0, G_MAXUINT, EVENT_CACHE_SIZE_DEFAULT,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_EVENT_CACHE_SIZE,
+      param_spec);
+
+  param_spec = g_param_spec_uint ("event-cache-hits",
+      "Event cache hits",
+      "How many day files were read from the parsed events cache",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_EVENT_CACHE_HITS,
+      param_spec);
+
+  param_spec = g_param_spec_uint ("event-cache-misses",
+      "Event cache misses",
+      "How many day files had to be parsed",
+      0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_EVENT_CACHE_MISSES,
+      param_spec);
+
   g_type_class_add_private (object_class, sizeof (TplLogStoreXmlPriv));
 }
 
 
 static void
-_tpl_log_store_xml_init (TplLogStoreXml *self)
+open_log_file_free (OpenLogFile *file)
 {
-  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
-      TPL_TYPE_LOG_STORE_XML, TplLogStoreXmlPriv);
-  self->priv->account_manager = tp_account_manager_dup ();
+  if (close (file->fd) != 0)
+    DEBUG ("Failed to close %s: %s", file->filename, g_strerror (errno));
+
+  g_free (file->filename);
+  g_slice_free (OpenLogFile, file);
+}
+
+
+static void
+day_parse_init (DayParse *parse)
+{
+  g_queue_init (&parse->events);
+  parse->supersedes_links = g_hash_table_new (g_str_hash, g_str_equal);
+  parse->index = NULL;
+}
+
+
+static void
+day_parse_clear (DayParse *parse)
+{
+  g_queue_foreach (&parse->events, (GFunc) g_object_unref, NULL);
+  g_queue_clear (&parse->events);
+  tp_clear_pointer (&parse->supersedes_links, g_hash_table_unref);
+  parse->index = NULL;
+}
+
+
+static void
+cached_day_free (CachedDay *day)
+{
+  day_parse_clear (&day->parse);
+  g_free (day->filename);
+  g_slice_free (CachedDay, day);
+}
+
+
+static DateIndex *
+date_index_new (void)
+{
+  DateIndex *index = g_slice_new0 (DateIndex);
+
+  index->text_days = g_array_new (FALSE, FALSE, sizeof (guint32));
+  index->call_days = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  return index;
+}
+
+
+static void
+date_index_free (DateIndex *index)
+{
+  g_array_unref (index->text_days);
+  g_array_unref (index->call_days);
+  g_slice_free (DateIndex, index);
 }
 
 
@@ -250,6 +542,42 @@ log_store_account_to_dirname (TpAccount *account)
 }
 
 
+static void
+_tpl_log_store_xml_init (TplLogStoreXml *self)
+{
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self,
+      TPL_TYPE_LOG_STORE_XML, TplLogStoreXmlPriv);
+  self->priv->account_manager = tp_account_manager_dup ();
+  self->priv->accounts = _tpl_account_map_new (self->priv->account_manager,
+      log_store_account_to_dirname);
+
+  self->priv->open_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, (GDestroyNotify) open_log_file_free);
+  g_queue_init (&self->priv->open_files_lru);
+  g_mutex_init (&self->priv->open_files_lock);
+  self->priv->max_open_files = LOG_OPEN_FILES_MAX_DEFAULT;
+
+  self->priv->event_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, (GDestroyNotify) cached_day_free);
+  g_queue_init (&self->priv->event_cache_lru);
+  g_mutex_init (&self->priv->event_cache_lock);
+  self->priv->event_cache_size = EVENT_CACHE_SIZE_DEFAULT;
+
+  self->priv->date_indexes = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) date_index_free);
+  g_mutex_init (&self->priv->date_index_lock);
+
+  g_mutex_init (&self->priv->search_index_lock);
+
+  /* The searching thread is one of them */
+  self->priv->search_pool = g_thread_pool_new (
+      log_store_xml_search_scan_worker, NULL,
+      MAX (1, MIN (log_store_xml_get_n_processors (),
+          SEARCH_THREADS_MAX) - 1),
+      FALSE, NULL);
+}
+
+
 /* id can be NULL, but if present have to be a non zero-lenght string.
  * If NULL, the returned dir will be composed until the account part.
  * If non-NULL, the returned dir will be composed until the id part */
@@ -370,742 +698,1853 @@ log_store_xml_get_filename (TplLogStoreXml *self,
 }
 
 
-/* this is a method used at the end of the add_event process, used by any
- * Event<Type> instance. it should the only method allowed to write to the
- * store */
-static gboolean
-_log_store_xml_write_to_store (TplLogStoreXml *self,
-    TpAccount *account,
-    TplEntity *target,
-    const gchar *event,
-    GType type,
-    gint64 timestamp,
-    GError **error)
+static void
+log_store_xml_close_file (TplLogStoreXml *self,
+    OpenLogFile *file)
 {
-  FILE *file;
-  gchar *filename;
-  gchar *basedir;
-  gboolean ret = TRUE;
+  TplLogStoreXmlPriv *priv = self->priv;
 
-  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), FALSE);
-  g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
-  g_return_val_if_fail (TPL_IS_ENTITY (target), FALSE);
+  g_queue_delete_link (&priv->open_files_lru, file->lru_link);
+  g_hash_table_remove (priv->open_files, file->filename);
+}
 
 
-  filename = log_store_xml_get_filename (self, account, target, type, timestamp);
-  basedir = g_path_get_dirname (filename);
+/* Must be called before removing anything from the log directory, or the
+ * next event would be appended to an unlinked file. Keep open_files_lock
+ * held until the removal is done. */
+static void
+log_store_xml_close_all_files (TplLogStoreXml *self)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
 
-  if (!g_file_test (basedir, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
+  while (priv->open_files_lru.length > 0)
+    log_store_xml_close_file (self,
+        g_queue_peek_tail (&priv->open_files_lru));
+
+  if (priv->open_files_sweep_id != 0)
     {
-      DEBUG ("Creating directory: '%s'", basedir);
-      g_mkdir_with_parents (basedir, LOG_DIR_CREATE_MODE);
+      g_source_remove (priv->open_files_sweep_id);
+      priv->open_files_sweep_id = 0;
     }
+}
 
-  g_free (basedir);
 
-  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
-    {
-      file = g_fopen (filename, "w+");
-      if (file != NULL)
-        g_fprintf (file, LOG_HEADER);
+static void
+log_store_xml_trim_open_files (TplLogStoreXml *self)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
 
-      g_chmod (filename, LOG_FILE_CREATE_MODE);
-    }
-  else
+  while (priv->open_files_lru.length > priv->max_open_files)
+    log_store_xml_close_file (self,
+        g_queue_peek_tail (&priv->open_files_lru));
+}
+
+
+static gboolean
+log_store_xml_sweep_open_files (gpointer user_data)
+{
+  TplLogStoreXml *self = user_data;
+  TplLogStoreXmlPriv *priv = self->priv;
+  gint64 idle_since;
+  OpenLogFile *file;
+
+  idle_since = g_get_monotonic_time ()
+    - LOG_OPEN_FILE_IDLE_TIMEOUT * G_USEC_PER_SEC;
+
+  g_mutex_lock (&priv->open_files_lock);
+
+  while ((file = g_queue_peek_tail (&priv->open_files_lru)) != NULL
+      && file->last_used <= idle_since)
     {
-      file = g_fopen (filename, "r+");
-      if (file != NULL)
-        fseek (file, -strlen (LOG_FOOTER), SEEK_END);
+      DEBUG ("Closing idle log file: %s", file->filename);
+      log_store_xml_close_file (self, file);
     }
 
-  if (file == NULL)
+  if (priv->open_files_lru.length == 0)
     {
-      g_set_error (error, TPL_LOG_STORE_ERROR,
-          TPL_LOG_STORE_ERROR_FAILED,
-          "Couldn't open log file: %s", filename);
-      ret = FALSE;
-      goto out;
+      priv->open_files_sweep_id = 0;
+      g_mutex_unlock (&priv->open_files_lock);
+      return FALSE;
     }
 
-  g_fprintf (file, "%s", event);
-  DEBUG ("%s: written: %s", filename, event);
+  g_mutex_unlock (&priv->open_files_lock);
+  return TRUE;
+}
 
-  fclose (file);
- out:
-  g_free (filename);
-  return ret;
+
+/* The day changed: files for previous days won't be appended to (unless
+ * an event is delayed), so stop holding them open */
+static void
+log_store_xml_close_old_files (TplLogStoreXml *self)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
+  GList *l = priv->open_files_lru.head;
+
+  while (l != NULL)
+    {
+      OpenLogFile *file = l->data;
+
+      l = l->next;
+
+      if (file->day < priv->newest_day)
+        log_store_xml_close_file (self, file);
+    }
 }
 
 
 static gboolean
-add_text_event (TplLogStoreXml *self,
-    TplTextEvent *message,
+log_store_xml_write_at (gint fd,
+    off_t offset,
+    const gchar *data,
+    gsize len)
+{
+  if (lseek (fd, offset, SEEK_SET) == (off_t) -1)
+    return FALSE;
+
+  while (len > 0)
+    {
+      gssize written = write (fd, data, len);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          return FALSE;
+        }
+
+      data += written;
+      len -= written;
+    }
+
+  return TRUE;
+}
+
+
+static OpenLogFile *
+log_store_xml_open_file (const gchar *filename,
+    gint64 day,
+    gboolean *created,
     GError **error)
 {
-  gboolean ret = FALSE;
-  gint64 timestamp;
-  TpDBusDaemon *bus_daemon;
-  TpAccount *account;
-  TplEntity *sender;
-  const gchar *body_str;
-  const gchar *token_str;
-  gchar *avatar_token = NULL;
-  gchar *body = NULL;
-  gchar *time_str = NULL;
-  gchar *contact_name = NULL;
-  gchar *contact_id = NULL;
-  GString *event = NULL;
-  TpChannelTextMessageType msg_type;
+  OpenLogFile *file;
+  struct stat st;
+  gchar *basedir;
+  gint fd;
 
-  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), FALSE);
-  g_return_val_if_fail (TPL_IS_TEXT_EVENT (message), FALSE);
+  basedir = g_path_get_dirname (filename);
 
-  bus_daemon = tp_dbus_daemon_dup (error);
-  if (bus_daemon == NULL)
+  if (!g_file_test (basedir, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
     {
-      DEBUG ("Error acquiring bus daemon: %s", (*error)->message);
-      goto out;
+      DEBUG ("Creating directory: '%s'", basedir);
+      g_mkdir_with_parents (basedir, LOG_DIR_CREATE_MODE);
     }
 
-  account =  tpl_event_get_account (TPL_EVENT (message));
+  g_free (basedir);
 
-  body_str = tpl_text_event_get_message (message);
-  if (TPL_STR_EMPTY (body_str))
+  fd = g_open (filename, O_RDWR | O_CREAT, LOG_FILE_CREATE_MODE);
+
+  if (fd < 0 || fstat (fd, &st) != 0)
     {
       g_set_error (error, TPL_LOG_STORE_ERROR,
           TPL_LOG_STORE_ERROR_FAILED,
-          "The message body is empty or NULL");
-      goto out;
-    }
-
-  body = g_markup_escape_text (body_str, -1);
-  msg_type = tpl_text_event_get_message_type (message);
-  time_str = log_store_xml_get_timestamp_from_event (
-      TPL_EVENT (message));
+          "Couldn't open log file: %s: %s", filename, g_strerror (errno));
 
-  sender = tpl_event_get_sender (TPL_EVENT (message));
+      if (fd >= 0)
+        close (fd);
 
-  if (sender != NULL)
-    {
-      contact_id = g_markup_escape_text (tpl_entity_get_identifier (sender), -1);
-      contact_name = g_markup_escape_text (tpl_entity_get_alias (sender), -1);
-      avatar_token = g_markup_escape_text (tpl_entity_get_avatar_token (sender),
-          -1);
+      return NULL;
     }
 
-  event = g_string_new (NULL);
-  g_string_printf (event, "<message time='%s' id='%s' name='%s' "
-      "token='%s' isuser='%s' type='%s'",
-      time_str,
-      contact_id ? contact_id : "",
-      contact_name ? contact_name : "",
-      avatar_token ? avatar_token : "",
-      (sender && tpl_entity_get_entity_type (sender)
-          == TPL_ENTITY_SELF) ? "true" : "false",
-      _tpl_text_event_message_type_to_str (msg_type));
+  file = g_slice_new0 (OpenLogFile);
+  file->filename = g_strdup (filename);
+  file->fd = fd;
+  file->day = day;
 
-  token_str = tpl_text_event_get_message_token (message);
-  if (!TPL_STR_EMPTY (token_str))
+  if (st.st_size == 0)
     {
-      gchar *message_token = g_markup_escape_text (token_str, -1);
-      g_string_append_printf (event, " message-token='%s'", message_token);
-      g_free (message_token);
-
-      token_str = tpl_text_event_get_supersedes_token (message);
-      if (!TPL_STR_EMPTY (token_str))
+      if (!log_store_xml_write_at (fd, 0, LOG_HEADER, strlen (LOG_HEADER)))
         {
-          gchar *supersedes_token = g_markup_escape_text (token_str, -1);
-          guint edit_timestamp;
-          g_string_append_printf (event, " supersedes-token='%s'",
-              supersedes_token);
-          g_free (supersedes_token);
-
-          edit_timestamp = tpl_text_event_get_edit_timestamp (message);
-          if (edit_timestamp != 0)
-            {
-              gchar *edit_timestamp_str =
-                  log_store_xml_format_timestamp (edit_timestamp);
-              g_string_append_printf (event, " edit-timestamp='%s'",
-                  edit_timestamp_str);
-              g_free (edit_timestamp_str);
-            }
+          g_set_error (error, TPL_LOG_STORE_ERROR,
+              TPL_LOG_STORE_ERROR_FAILED,
+              "Couldn't write log file header: %s: %s", filename,
+              g_strerror (errno));
+          open_log_file_free (file);
+          return NULL;
         }
 
+      g_chmod (filename, LOG_FILE_CREATE_MODE);
+      file->footer_offset = strlen (LOG_HEADER);
+      *created = TRUE;
+    }
+  else
+    {
+      file->footer_offset = MAX (st.st_size - (off_t) strlen (LOG_FOOTER), 0);
     }
 
-  timestamp = tpl_event_get_timestamp (TPL_EVENT (message));
+  return file;
+}
 
-  g_string_append_printf (event, ">%s</message>\n" LOG_FOOTER, body);
 
-  DEBUG ("writing text event from %s (ts %s)",
-      contact_id, time_str);
+/* Caller holds event_cache_lock */
+static void
+log_store_xml_cache_unlink (TplLogStoreXml *self,
+    CachedDay *day)
+{
+  g_queue_delete_link (&self->priv->event_cache_lru, day->lru_link);
+  day->lru_link = NULL;
+  self->priv->event_cache_cost -= day->cost;
+  g_hash_table_steal (self->priv->event_cache, day->filename);
+}
 
-  ret = _log_store_xml_write_to_store (self, account,
-      _tpl_event_get_target (TPL_EVENT (message)), event->str,
-      TPL_TYPE_TEXT_EVENT, timestamp, error);
 
-out:
-  g_free (contact_id);
-  g_free (contact_name);
-  g_free (time_str);
-  g_free (body);
-  g_string_free (event, TRUE);
-  g_free (avatar_token);
+/* Caller holds event_cache_lock */
+static void
+log_store_xml_cache_remove (TplLogStoreXml *self,
+    CachedDay *day)
+{
+  log_store_xml_cache_unlink (self, day);
+  cached_day_free (day);
+}
 
-  if (bus_daemon != NULL)
-    g_object_unref (bus_daemon);
 
-  return ret;
+/* Caller holds event_cache_lock */
+static void
+log_store_xml_cache_trim (TplLogStoreXml *self)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
+
+  while (priv->event_cache_cost > priv->event_cache_size)
+    log_store_xml_cache_remove (self,
+        g_queue_peek_tail (&priv->event_cache_lru));
 }
 
 
-static gboolean
-add_call_event (TplLogStoreXml *self,
-    TplCallEvent *event,
-    GError **error)
+static void
+log_store_xml_cache_clear (TplLogStoreXml *self)
 {
-  gboolean ret = FALSE;
-  TpDBusDaemon *bus_daemon;
-  TpAccount *account;
-  TplEntity *sender;
-  TplEntity *actor;
-  TplEntity *target;
-  gchar *time_str = NULL;
-  gchar *sender_avatar = NULL;
-  gchar *sender_name = NULL;
-  gchar *sender_id = NULL;
-  gchar *actor_name = NULL;
-  gchar *actor_avatar = NULL;
-  gchar *actor_id = NULL;
-  gchar *log_str = NULL;
-  TpCallStateChangeReason reason;
+  TplLogStoreXmlPriv *priv = self->priv;
 
-  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), FALSE);
-  g_return_val_if_fail (TPL_IS_CALL_EVENT (event), FALSE);
+  g_mutex_lock (&priv->event_cache_lock);
+  g_queue_clear (&priv->event_cache_lru);
+  g_hash_table_remove_all (priv->event_cache);
+  priv->event_cache_cost = 0;
+  g_mutex_unlock (&priv->event_cache_lock);
+}
+
+
+static void
+log_store_xml_cache_forget (TplLogStoreXml *self,
+    const gchar *filename)
+{
+  CachedDay *day;
+
+  g_mutex_lock (&self->priv->event_cache_lock);
+
+  day = g_hash_table_lookup (self->priv->event_cache, filename);
+  if (day != NULL)
+    log_store_xml_cache_remove (self, day);
+
+  g_mutex_unlock (&self->priv->event_cache_lock);
+}
+
+
+/* Appends new references to the cached events of @filename to @events,
+ * provided the file still matches @st. If the file has grown since, the day
+ * is taken out of the cache and returned in @grown instead, for the caller
+ * to parse what was written and put it back. */
+static gboolean
+log_store_xml_cache_lookup (TplLogStoreXml *self,
+    const gchar *filename,
+    GType type,
+    const GStatBuf *st,
+    GQueue *events,
+    CachedDay **grown)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
+  CachedDay *day;
+  GList *l;
+
+  *grown = NULL;
 
-  bus_daemon = tp_dbus_daemon_dup (error);
-  if (bus_daemon == NULL)
+  g_mutex_lock (&priv->event_cache_lock);
+
+  day = g_hash_table_lookup (priv->event_cache, filename);
+
+  if (day == NULL)
     {
-      DEBUG ("Error acquiring bus daemon: %s", (*error)->message);
-      goto out;
+      g_mutex_unlock (&priv->event_cache_lock);
+      return FALSE;
     }
 
-  account = tpl_event_get_account (TPL_EVENT (event));
+  if (day->type == type
+      && day->inode == st->st_ino
+      && day->size == st->st_size
+      && day->mtime == st->st_mtime)
+    {
+      for (l = day->parse.events.head; l != NULL; l = g_list_next (l))
+        g_queue_push_tail (events, g_object_ref (l->data));
 
-  time_str = log_store_xml_get_timestamp_from_event (
-      TPL_EVENT (event));
-  reason = tpl_call_event_get_end_reason (event);
+      g_queue_unlink (&priv->event_cache_lru, day->lru_link);
+      g_queue_push_head_link (&priv->event_cache_lru, day->lru_link);
+      priv->event_cache_hits++;
 
-  sender = tpl_event_get_sender (TPL_EVENT (event));
-  actor = tpl_call_event_get_end_actor (event);
-  target = _tpl_event_get_target (TPL_EVENT (event));
+      g_mutex_unlock (&priv->event_cache_lock);
+      return TRUE;
+    }
 
-  if (sender != NULL)
+  if (day->type == type
+      && day->inode == st->st_ino
+      && day->size < st->st_size
+      && day->footer_offset > 0)
     {
-      sender_id = g_markup_escape_text (tpl_entity_get_identifier (sender), -1);
-      sender_name = g_markup_escape_text (tpl_entity_get_alias (sender), -1);
-      sender_avatar = g_markup_escape_text (tpl_entity_get_avatar_token (sender),
-          -1);
+      log_store_xml_cache_unlink (self, day);
+      *grown = day;
     }
-
-  if (actor != NULL)
+  else
     {
-      actor_id = g_markup_escape_text (tpl_entity_get_identifier (actor), -1);
-      actor_name = g_markup_escape_text (tpl_entity_get_alias (actor), -1);
-      actor_avatar = g_markup_escape_text (tpl_entity_get_avatar_token (actor),
-          -1);
+      log_store_xml_cache_remove (self, day);
     }
 
+  g_mutex_unlock (&priv->event_cache_lock);
 
-  log_str = g_strdup_printf ("<call time='%s' "
-      "id='%s' name='%s' isuser='%s' token='%s' "
-      "duration='%" G_GINT64_FORMAT "' "
-      "actor='%s' actortype='%s' "
-      "actorname='%s' actortoken='%s' "
-      "reason='%s' detail='%s'/>\n"
-      LOG_FOOTER,
-        time_str,
-        sender_id ? sender_id : "",
-        sender_name ? sender_name : "",
-        (sender && tpl_entity_get_entity_type (sender) ==
-            TPL_ENTITY_SELF) ? "true" : "false",
-        sender_avatar ? sender_avatar : "",
-        tpl_call_event_get_duration (event),
-        actor_id ? actor_id : "",
-        actor ? _tpl_entity_type_to_str (tpl_entity_get_entity_type (actor)) : "",
-        actor_name ? actor_name : "",
-        actor_avatar ? actor_avatar : "",
-        _tpl_call_event_end_reason_to_str (reason),
-        tpl_call_event_get_detailed_end_reason (event));
+  return FALSE;
+}
 
-  DEBUG ("writing call event from %s (ts %s)",
-      tpl_entity_get_identifier (target),
-      time_str);
 
-  ret = _log_store_xml_write_to_store (self, account, target, log_str,
-      TPL_TYPE_CALL_EVENT, tpl_event_get_timestamp (TPL_EVENT (event)),
-      error);
+/* Roughly what @event takes in memory: the object and its entities, plus the
+ * text of a message */
+static gsize
+log_store_xml_event_cost (TplEvent *event)
+{
+  gsize cost = EVENT_CACHE_EVENT_COST;
 
-out:
-  g_free (sender_id);
-  g_free (sender_name);
-  g_free (sender_avatar);
-  g_free (actor_id);
-  g_free (actor_name);
-  g_free (actor_avatar);
-  g_free (time_str);
-  g_free (log_str);
+  if (TPL_IS_TEXT_EVENT (event))
+    {
+      const gchar *message = tpl_text_event_get_message (
+          TPL_TEXT_EVENT (event));
 
-  if (bus_daemon != NULL)
-    g_object_unref (bus_daemon);
+      if (message != NULL)
+        cost += strlen (message);
+    }
 
-  return ret;
+  return cost;
 }
 
 
-/* First of two phases selection: understand the type Event */
-static gboolean
-log_store_xml_add_event (TplLogStore *store,
-    TplEvent *event,
-    GError **error)
+/* Puts @day into the cache, taking ownership of it. @parsed_from_start tells
+ * a miss from a day that only had its new events parsed. */
+static void
+log_store_xml_cache_insert (TplLogStoreXml *self,
+    CachedDay *day,
+    gboolean parsed_from_start)
 {
-  TplLogStoreXml *self = TPL_LOG_STORE_XML (store);
+  TplLogStoreXmlPriv *priv = self->priv;
+  CachedDay *old;
+  GList *l;
 
-  g_return_val_if_fail (TPL_IS_EVENT (event), FALSE);
-  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+  day->cost = 0;
+  for (l = day->parse.events.head; l != NULL; l = g_list_next (l))
+    day->cost += log_store_xml_event_cost (l->data);
 
-  if (TPL_IS_TEXT_EVENT (event))
-    return add_text_event (self, TPL_TEXT_EVENT (event), error);
-  else if (TPL_IS_CALL_EVENT (event))
-    return add_call_event (self, TPL_CALL_EVENT (event), error);
+  g_mutex_lock (&priv->event_cache_lock);
 
-  DEBUG ("TplEntry not handled by this LogStore (%s). "
-      "Ignoring Event", _tpl_log_store_get_name (store));
-  /* do not consider it an error, this LogStore simply do not want/need
-   * this Event */
-  return TRUE;
+  if (parsed_from_start)
+    priv->event_cache_misses++;
+  else
+    priv->event_cache_hits++;
+
+  if (day->cost > priv->event_cache_size)
+    {
+      cached_day_free (day);
+      goto out;
+    }
+
+  /* Another thread may have parsed the same file meanwhile */
+  old = g_hash_table_lookup (priv->event_cache, day->filename);
+  if (old != NULL)
+    log_store_xml_cache_remove (self, old);
+
+  g_queue_push_head (&priv->event_cache_lru, day);
+  day->lru_link = priv->event_cache_lru.head;
+  g_hash_table_insert (priv->event_cache, day->filename, day);
+  priv->event_cache_cost += day->cost;
+
+  log_store_xml_cache_trim (self);
+
+ out:
+  g_mutex_unlock (&priv->event_cache_lock);
 }
 
 
-static gboolean
-log_store_xml_exists_in_directory (const gchar *dirname,
-    GRegex *regex,
-    gint type_mask,
-    gboolean recursive)
+/* The index of a test-mode store only lasts as long as the store, as it
+ * mustn't end up in the user's cache. */
+static gchar *
+log_store_xml_get_search_index_filename (TplLogStoreXml *self)
 {
-  gboolean exists;
-  const gchar *basename;
-  GDir *dir;
+  gchar *checksum;
+  gchar *name;
+  gchar *dir;
+  gchar *filename;
 
-  DEBUG ("Looking in directory '%s' %s",
-      dirname, recursive ? "resursively" : "");
+  if (self->priv->test_mode)
+    return g_strdup (":memory:");
 
-  dir = g_dir_open (dirname, 0, NULL);
-  exists = (dir != NULL);
+  /* One index per store directory, next to the SQLite store's cache */
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1,
+      log_store_xml_get_basedir (self), -1);
+  name = g_strconcat ("xml-search-", checksum, NULL);
+  dir = g_build_filename (g_get_user_cache_dir (), "telepathy", "logger",
+      NULL);
+  g_mkdir_with_parents (dir, LOG_DIR_CREATE_MODE);
+  filename = g_build_filename (dir, name, NULL);
 
-  if (CONTAINS_ALL_SUPPORTED_TYPES (type_mask) || !exists)
-    goto out;
+  g_free (checksum);
+  g_free (name);
+  g_free (dir);
 
-  exists = FALSE;
-  while ((basename = g_dir_read_name (dir)) != NULL)
-    {
-      gchar *filename;
+  return filename;
+}
 
-      filename = g_build_filename (dirname, basename, NULL);
 
-      DEBUG ("Matching with filename '%s'", basename);
+static TplLogSearchIndex *
+log_store_xml_get_search_index (TplLogStoreXml *self)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
+  TplLogSearchIndex *index;
 
-      if (recursive && g_file_test (filename, G_FILE_TEST_IS_DIR))
-        exists = log_store_xml_exists_in_directory (filename, regex, type_mask,
-            !tp_strdiff (basename, LOG_DIR_CHATROOMS));
-      else if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
-        exists = g_regex_match (regex, basename, 0, 0);
+  g_mutex_lock (&priv->search_index_lock);
 
-      g_free (filename);
+  if (priv->search_index == NULL && !priv->search_index_failed)
+    {
+      gchar *filename = log_store_xml_get_search_index_filename (self);
 
-      if (exists)
-        break;
+      priv->search_index = _tpl_log_search_index_new (filename);
+      priv->search_index_failed = (priv->search_index == NULL);
+      g_free (filename);
     }
 
-out:
-  if (dir != NULL)
-    g_dir_close (dir);
+  index = priv->search_index;
 
-  return exists;
+  g_mutex_unlock (&priv->search_index_lock);
+
+  return index;
 }
 
 
-static GRegex *
-log_store_xml_create_filename_regex (gint type_mask)
+static void
+log_store_xml_get_search_index_stamp (const struct stat *st,
+    TplLogSearchIndexStamp *stamp)
 {
-  GString *pattern;
-  GRegex *regex = NULL;
-  GError *error = NULL;
-
-  pattern = g_string_new ("");
-
-  if (type_mask & TPL_EVENT_MASK_TEXT)
-    g_string_append (pattern, LOG_FILENAME_PATTERN);
+  stamp->inode = st->st_ino;
+  stamp->size = st->st_size;
+  stamp->mtime = st->st_mtime;
+  stamp->indexed = TRUE;
+}
 
-  if (type_mask & TPL_EVENT_MASK_CALL)
-    g_string_append_printf (pattern,
-        "%s" LOG_FILENAME_CALL_PATTERN,
-        pattern->len == 0 ? "" : "|");
 
-  if (pattern->len == 0)
-    goto out;
+/* Reads the whole of @filename, whose state is @st, into @file for the
+ * search index; @file borrows @filename.
+ *
+ * The raw XML is indexed: searches look for the escaped text anywhere in
+ * it, which finds at least every file the search regex would match. Files
+ * which aren't valid UTF-8 text can't be indexed; their stamp says so, and
+ * they have to be searched every time. */
+static void
+log_store_xml_search_index_read_file (const gchar *filename,
+    const struct stat *st,
+    TplLogSearchIndexFile *file)
+{
+  GMappedFile *mapped;
+  const gchar *contents = NULL;
+  gsize length = 0;
 
-  DEBUG ("Pattern is '%s'", pattern->str);
+  DEBUG ("Indexing '%s'", filename);
 
-  regex = g_regex_new (pattern->str, G_REGEX_OPTIMIZE, 0, &error);
+  file->path = filename;
+  file->text = NULL;
+  log_store_xml_get_search_index_stamp (st, &file->stamp);
 
-  if (regex == NULL)
+  mapped = g_mapped_file_new (filename, FALSE, NULL);
+  if (mapped != NULL)
     {
-      DEBUG ("Failed to create regex: %s", error->message);
-      g_error_free (error);
+      contents = g_mapped_file_get_contents (mapped);
+      length = g_mapped_file_get_length (mapped);
     }
 
-out:
-  g_string_free (pattern, TRUE);
+  file->stamp.indexed = (mapped != NULL
+      && (length == 0 || memchr (contents, '\0', length) == NULL)
+      && g_utf8_validate (contents, length, NULL));
 
-  return regex;
+  if (file->stamp.indexed)
+    file->text = g_strndup (contents, length);
+
+  if (mapped != NULL)
+    g_mapped_file_unref (mapped);
 }
 
 
-static gboolean
-log_store_xml_exists (TplLogStore *store,
-    TpAccount *account,
-    TplEntity *target,
-    gint type_mask)
+static void
+log_store_xml_search_index_file_free (gpointer data)
 {
-  TplLogStoreXml *self = (TplLogStoreXml *) store;
-  gchar *dirname;
-  GRegex *regex;
-  gboolean exists = FALSE;
+  TplLogSearchIndexFile *file = data;
 
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), FALSE);
-  g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
-  g_return_val_if_fail (target == NULL || TPL_IS_ENTITY (target), FALSE);
+  g_free (file->text);
+  g_slice_free (TplLogSearchIndexFile, file);
+}
 
-  dirname = log_store_xml_get_dir (self, account, target);
-  regex = log_store_xml_create_filename_regex (type_mask);
 
-  if (regex != NULL)
-    exists = log_store_xml_exists_in_directory (dirname, regex, type_mask,
-        target == NULL);
+/* Writes the files read into @pending to @index in one transaction, adding
+ * those which could be indexed to @indexed */
+static void
+log_store_xml_search_index_flush (TplLogSearchIndex *index,
+    GPtrArray *pending,
+    GHashTable *indexed)
+{
+  guint i;
 
-  g_free (dirname);
+  if (_tpl_log_search_index_set_files (index, pending))
+    {
+      for (i = 0; i < pending->len; i++)
+        {
+          TplLogSearchIndexFile *file = g_ptr_array_index (pending, i);
 
-  if (regex != NULL)
-    g_regex_unref (regex);
+          if (file->stamp.indexed)
+            g_hash_table_insert (indexed, (gchar *) file->path,
+                (gchar *) file->path);
+        }
+    }
 
-  return exists;
+  g_ptr_array_set_size (pending, 0);
 }
 
-static GDate *
-create_date_from_string (const gchar *str)
+
+/* Feeds @events, just written over the footer of @filename, to the search
+ * index. @before and @after are the file's state around the write. If the
+ * index wasn't up to date with the file, the file is left for the next
+ * search to index in full. */
+static void
+log_store_xml_search_index_append (TplLogStoreXml *self,
+    const gchar *filename,
+    gboolean created,
+    const struct stat *before,
+    const struct stat *after,
+    const gchar *events,
+    gsize len)
 {
-  GDate *date;
-  guint u;
-  guint day, month, year;
+  TplLogSearchIndex *index = log_store_xml_get_search_index (self);
+  TplLogSearchIndexStamp old_stamp, new_stamp;
+  gchar *text;
 
-  if (sscanf (str, "%u", &u) != 1)
-    return NULL;
+  if (index == NULL)
+    return;
 
-  day = (u % 100);
-  month = ((u / 100) % 100);
-  year = (u / 10000);
+  if (!g_utf8_validate (events, len, NULL))
+    {
+      _tpl_log_search_index_remove_file (index, filename);
+      return;
+    }
 
-  if (!g_date_valid_dmy (day, month, year))
-    return NULL;
+  log_store_xml_get_search_index_stamp (before, &old_stamp);
+  log_store_xml_get_search_index_stamp (after, &new_stamp);
 
-  date = g_date_new_dmy (day, month, year);
+  if (created)
+    {
+      text = g_strdup_printf ("%s%.*s", LOG_HEADER, (gint) len, events);
+      _tpl_log_search_index_set_file (index, filename, &new_stamp, text);
+    }
+  else
+    {
+      text = g_strndup (events, len);
+      _tpl_log_search_index_append (index, filename, &old_stamp, &new_stamp,
+          text);
+    }
 
-  return date;
+  g_free (text);
 }
 
 
+/* this is a method used at the end of the add_event process, used by any
+ * Event<Type> instance. it should the only method allowed to write to the
+ * store. @event has to end with LOG_FOOTER, it may hold several events for
+ * the same file. */
 static gboolean
-log_store_xml_match_in_file (const gchar *filename,
-    GRegex *regex)
+log_store_xml_write_to_file (TplLogStoreXml *self,
+    const gchar *filename,
+    gint64 timestamp,
+    const gchar *event,
+    GError **error)
 {
-  gboolean retval = FALSE;
-  GMappedFile *file;
-  gsize length;
-  gchar *contents = NULL;
-
-  file = g_mapped_file_new (filename, FALSE, NULL);
-  if (file == NULL)
-    goto out;
-
-  length = g_mapped_file_get_length (file);
-  contents = g_mapped_file_get_contents (file);
-
-  if (length == 0 || contents == NULL)
-    goto out;
-
-  retval = g_regex_match_full (regex, contents, length, 0, 0, NULL, NULL);
-
-  DEBUG ("%s pattern '%s' in file '%s'",
-      retval ? "Matched" : "Not matched",
-      g_regex_get_pattern (regex),
-      filename);
-
-out:
-  if (file != NULL)
-    g_mapped_file_unref (file);
-
-  return retval;
-}
-
+  TplLogStoreXmlPriv *priv = self->priv;
+  OpenLogFile *file;
+  gint64 day;
+  gsize len;
+  gboolean created = FALSE;
+  struct stat before, after;
+  gboolean stamped;
+  gboolean indexable = FALSE;
+  gboolean ret = TRUE;
 
-static GList *
-log_store_xml_get_dates (TplLogStore *store,
-    TpAccount *account,
-    TplEntity *target,
-    gint type_mask)
-{
-  TplLogStoreXml *self = (TplLogStoreXml *) store;
-  GList *dates = NULL;
-  GList *l;
-  gchar *directory = NULL;
-  GDir *dir = NULL;
-  GString *pattern = NULL;
-  GRegex *regex = NULL;
-  const gchar *basename;
+  day = timestamp / SECONDS_PER_DAY;
 
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
-  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
-  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
+  g_mutex_lock (&priv->open_files_lock);
 
-  directory = log_store_xml_get_dir (self, account, target);
-  dir = g_dir_open (directory, 0, NULL);
-  if (!dir)
+  if (day > priv->newest_day)
     {
-      DEBUG ("Could not open directory:'%s'", directory);
-      goto out;
+      priv->newest_day = day;
+      log_store_xml_close_old_files (self);
     }
 
-  DEBUG ("Collating a list of dates in:'%s'", directory);
-  regex = log_store_xml_create_filename_regex (type_mask);
-
-  if (regex == NULL)
-    goto out;
+  file = g_hash_table_lookup (priv->open_files, filename);
 
-  while ((basename = g_dir_read_name (dir)) != NULL)
+  if (file == NULL)
     {
-      const gchar *p;
-      gchar *str;
-      GDate *date;
-
-      if (!g_regex_match (regex, basename, 0, NULL))
-        continue;
+      time_t dir_mtime;
 
-      p = strstr (basename, LOG_FILENAME_CALL_SUFFIX);
-
-      if (p == NULL)
-        p = strstr (basename, LOG_FILENAME_SUFFIX);
-
-      str = g_strndup (basename, p - basename);
+      dir_mtime = log_store_xml_get_dir_mtime (filename);
+      file = log_store_xml_open_file (filename, day, &created, error);
+      if (file == NULL)
+        {
+          ret = FALSE;
+          goto out;
+        }
 
-      if (str == NULL)
-        continue;
+      if (created)
+        log_store_xml_date_index_add (self, filename, dir_mtime);
 
-      date = create_date_from_string (str);
+      g_queue_push_head (&priv->open_files_lru, file);
+      file->lru_link = priv->open_files_lru.head;
+      g_hash_table_insert (priv->open_files, file->filename, file);
+    }
+  else
+    {
+      g_queue_unlink (&priv->open_files_lru, file->lru_link);
+      g_queue_push_head_link (&priv->open_files_lru, file->lru_link);
+    }
 
-      if (date != NULL)
-        dates = g_list_insert_sorted (dates, date,
-            (GCompareFunc) g_date_compare);
+  len = strlen (event);
+  stamped = (fstat (file->fd, &before) == 0);
 
-      g_free (str);
+  if (!log_store_xml_write_at (file->fd, file->footer_offset, event, len))
+    {
+      g_set_error (error, TPL_LOG_STORE_ERROR,
+          TPL_LOG_STORE_ERROR_FAILED,
+          "Couldn't write to log file: %s: %s", filename, g_strerror (errno));
+      log_store_xml_close_file (self, file);
+      ret = FALSE;
+      goto out;
     }
 
-  /* Filter out duplicate dates in-place */
-  for (l = dates; g_list_next (l) != NULL; l = g_list_next (l))
-    {
-      GList *next = g_list_next (l);
+  DEBUG ("%s: written: %s", filename, event);
 
-      if (g_date_compare ((GDate *) next->data, (GDate *) l->data) == 0)
-        {
-          g_date_free ((GDate *) next->data);
-          l = g_list_delete_link (l, next);
-        }
-    }
+  file->footer_offset += len - strlen (LOG_FOOTER);
+  file->last_used = g_get_monotonic_time ();
 
-out:
-  g_free (directory);
+  /* The index is fed once the lock is released */
+  indexable = stamped && fstat (file->fd, &after) == 0;
 
-  if (dir != NULL)
-    g_dir_close (dir);
+  /* Delayed events for a past day are rare, don't keep their file open */
+  if (day < priv->newest_day)
+    log_store_xml_close_file (self, file);
 
-  if (pattern != NULL)
-    g_string_free (pattern, TRUE);
+  log_store_xml_trim_open_files (self);
 
-  if (regex != NULL)
-    g_regex_unref (regex);
+  if (priv->open_files_lru.length > 0 && priv->open_files_sweep_id == 0)
+    priv->open_files_sweep_id = g_timeout_add_seconds (
+        LOG_OPEN_FILE_IDLE_TIMEOUT, log_store_xml_sweep_open_files, self);
 
-  DEBUG ("Parsed %d dates", g_list_length (dates));
+ out:
+  g_mutex_unlock (&priv->open_files_lock);
 
-  return dates;
+  /* If another write to the file gets to the index first, the stamps won't
+   * match and the file is left for the next search to index in full */
+  if (indexable)
+    log_store_xml_search_index_append (self, filename, created, &before,
+        &after, event, len - strlen (LOG_FOOTER));
+
+  return ret;
 }
 
 
-static gchar *
-log_store_xml_get_filename_for_date (TplLogStoreXml *self,
+static gboolean
+_log_store_xml_write_to_store (TplLogStoreXml *self,
     TpAccount *account,
     TplEntity *target,
-    const GDate *date,
-    GType type)
+    const gchar *event,
+    GType type,
+    gint64 timestamp,
+    GError **error)
 {
-  gchar *basedir;
-  gchar *timestamp;
   gchar *filename;
-  gchar str[9];
-
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
-  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
-  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
-  g_return_val_if_fail (date != NULL, NULL);
-
-  g_date_strftime (str, 9, "%Y%m%d", date);
+  gboolean ret;
 
-  basedir = log_store_xml_get_dir (self, account, target);
-  timestamp = g_strconcat (str, log_store_xml_get_file_suffix (type), NULL);
-  filename = g_build_filename (basedir, timestamp, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), FALSE);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), FALSE);
 
-  g_free (basedir);
-  g_free (timestamp);
+  filename = log_store_xml_get_filename (self, account, target, type, timestamp);
+  ret = log_store_xml_write_to_file (self, filename, timestamp, event, error);
+  g_free (filename);
 
-  return filename;
+  return ret;
 }
 
 
-static TplLogSearchHit *
-log_store_xml_search_hit_new (TplLogStoreXml *self,
-    const gchar *filename)
+static gchar *
+log_store_xml_format_text_event (TplTextEvent *message,
+    GError **error)
 {
-  TplLogSearchHit *hit;
-  gchar *account_name;
-  const gchar *end;
-  gchar **strv;
-  guint len;
-  GList *accounts, *l;
-  gchar *tmp;
-  TpAccount *account = NULL;
-  GDate *date;
-  const gchar *chat_id;
-  gboolean is_chatroom;
-  TplEntity *target;
-
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
-  g_return_val_if_fail (!TPL_STR_EMPTY (filename), NULL);
-  g_return_val_if_fail (g_str_has_suffix (filename, LOG_FILENAME_SUFFIX),
-      NULL);
+  TplEntity *sender;
+  const gchar *body_str;
+  const gchar *token_str;
+  gchar *avatar_token = NULL;
+  gchar *body = NULL;
+  gchar *time_str = NULL;
+  gchar *contact_name = NULL;
+  gchar *contact_id = NULL;
+  GString *event = NULL;
+  TpChannelTextMessageType msg_type;
 
-  strv = g_strsplit (filename, G_DIR_SEPARATOR_S, -1);
-  len = g_strv_length (strv);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+  g_return_val_if_fail (TPL_IS_TEXT_EVENT (message), NULL);
 
-  end = strstr (strv[len - 1], LOG_FILENAME_SUFFIX);
-  tmp = g_strndup (strv[len - 1], end - strv[len - 1]);
-  date = create_date_from_string (tmp);
-  g_free (tmp);
-  chat_id = strv[len - 2];
-  is_chatroom = (strcmp (strv[len - 3], LOG_DIR_CHATROOMS) == 0);
+  body_str = tpl_text_event_get_message (message);
+  if (TPL_STR_EMPTY (body_str))
+    {
+      g_set_error (error, TPL_LOG_STORE_ERROR,
+          TPL_LOG_STORE_ERROR_FAILED,
+          "The message body is empty or NULL");
+      goto out;
+    }
 
-  if (is_chatroom)
-    account_name = strv[len - 4];
-  else
-    account_name = strv[len - 3];
+  body = g_markup_escape_text (body_str, -1);
+  msg_type = tpl_text_event_get_message_type (message);
+  time_str = log_store_xml_get_timestamp_from_event (
+      TPL_EVENT (message));
 
-  /* FIXME: This assumes the account manager is prepared, but the
-   * synchronous API forces this. See bug #599189. */
-  accounts = tp_account_manager_dup_valid_accounts (
-      self->priv->account_manager);
+  sender = tpl_event_get_sender (TPL_EVENT (message));
 
-  for (l = accounts; l != NULL && account == NULL; l = g_list_next (l))
+  if (sender != NULL)
     {
-      TpAccount *acc = TP_ACCOUNT (l->data);
-      gchar *name;
-
-      name = log_store_account_to_dirname (acc);
-      if (!tp_strdiff (name, account_name))
-        account = acc;
-      g_free (name);
+      contact_id = g_markup_escape_text (tpl_entity_get_identifier (sender), -1);
+      contact_name = g_markup_escape_text (tpl_entity_get_alias (sender), -1);
+      avatar_token = g_markup_escape_text (tpl_entity_get_avatar_token (sender),
+          -1);
     }
-  g_list_free_full (accounts, g_object_unref);
-
-  if (is_chatroom)
-    target = tpl_entity_new_from_room_id (chat_id);
-  else
-    target = tpl_entity_new (chat_id, TPL_ENTITY_CONTACT, NULL, NULL);
 
-  hit = _tpl_log_manager_search_hit_new (account, target, date);
+  event = g_string_new (NULL);
+  g_string_printf (event, "<message time='%s' id='%s' name='%s' "
+      "token='%s' isuser='%s' type='%s'",
+      time_str,
+      contact_id ? contact_id : "",
+      contact_name ? contact_name : "",
+      avatar_token ? avatar_token : "",
+      (sender && tpl_entity_get_entity_type (sender)
+          == TPL_ENTITY_SELF) ? "true" : "false",
+      _tpl_text_event_message_type_to_str (msg_type));
 
-  g_strfreev (strv);
-  g_date_free (date);
-  g_object_unref (target);
+  token_str = tpl_text_event_get_message_token (message);
+  if (!TPL_STR_EMPTY (token_str))
+    {
+      gchar *message_token = g_markup_escape_text (token_str, -1);
+      g_string_append_printf (event, " message-token='%s'", message_token);
+      g_free (message_token);
 
-  return hit;
-}
+      token_str = tpl_text_event_get_supersedes_token (message);
+      if (!TPL_STR_EMPTY (token_str))
+        {
+          gchar *supersedes_token = g_markup_escape_text (token_str, -1);
+          guint edit_timestamp;
+          g_string_append_printf (event, " supersedes-token='%s'",
+              supersedes_token);
+          g_free (supersedes_token);
 
+          edit_timestamp = tpl_text_event_get_edit_timestamp (message);
+          if (edit_timestamp != 0)
+            {
+              gchar *edit_timestamp_str =
+                  log_store_xml_format_timestamp (edit_timestamp);
+              g_string_append_printf (event, " edit-timestamp='%s'",
+                  edit_timestamp_str);
+              g_free (edit_timestamp_str);
+            }
+        }
 
-static TplEvent *
-parse_text_node (TplLogStoreXml *self,
-    xmlNodePtr node,
-    gboolean is_room,
-    const gchar *target_id,
-    TpAccount *account)
-{
-  TplEvent *event;
-  TplEntity *sender;
-  TplEntity *receiver;
-  gchar *time_str;
-  gint64 timestamp;
-  gchar *edit_time_str;
-  gint64 edit_timestamp = 0;
-  gchar *sender_id;
-  gchar *sender_name;
-  gchar *sender_avatar_token;
-  gchar *body;
-  gchar *message_token;
-  gchar *supersedes_token;
-  gchar *is_user_str;
-  gboolean is_user = FALSE;
-  gchar *msg_type_str;
-  TpChannelTextMessageType msg_type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL;
+    }
 
-  body = (gchar *) xmlNodeGetContent (node);
-  time_str = (gchar *) xmlGetProp (node, (const xmlChar *) "time");
-  edit_time_str = (gchar *) xmlGetProp (node,
-      (const xmlChar *) "edit-timestamp");
-  sender_id = (gchar *) xmlGetProp (node, (const xmlChar *) "id");
-  sender_name = (gchar *) xmlGetProp (node, (const xmlChar *) "name");
-  sender_avatar_token = (gchar *) xmlGetProp (node,
-      (const xmlChar *) "token");
-  message_token = (gchar *) xmlGetProp (node,
-      (const xmlChar *) "message-token");
-  supersedes_token = (gchar *) xmlGetProp (node,
-      (const xmlChar *) "supersedes-token");
-  is_user_str = (gchar *) xmlGetProp (node, (const xmlChar *) "isuser");
-  msg_type_str = (gchar *) xmlGetProp (node, (const xmlChar *) "type");
+  g_string_append_printf (event, ">%s</message>\n", body);
 
-  if (is_user_str != NULL)
-    is_user = (!tp_strdiff (is_user_str, "true"));
+  DEBUG ("writing text event from %s (ts %s)",
+      contact_id, time_str);
 
-  if (msg_type_str != NULL)
-    msg_type = _tpl_text_event_message_type_from_str (msg_type_str);
+out:
+  g_free (contact_id);
+  g_free (contact_name);
+  g_free (time_str);
+  g_free (body);
+  g_free (avatar_token);
 
-  timestamp = _tpl_time_parse (time_str);
+  return event != NULL ? g_string_free (event, FALSE) : NULL;
+}
 
-  if (supersedes_token != NULL && edit_time_str != NULL)
-    {
-      edit_timestamp = _tpl_time_parse (edit_time_str);
-    }
 
-  if (is_room)
+static gchar *
+log_store_xml_format_call_event (TplCallEvent *event)
+{
+  TplEntity *sender;
+  TplEntity *actor;
+  TplEntity *target;
+  gchar *time_str = NULL;
+  gchar *sender_avatar = NULL;
+  gchar *sender_name = NULL;
+  gchar *sender_id = NULL;
+  gchar *actor_name = NULL;
+  gchar *actor_avatar = NULL;
+  gchar *actor_id = NULL;
+  gchar *log_str = NULL;
+  TpCallStateChangeReason reason;
+
+  g_return_val_if_fail (TPL_IS_CALL_EVENT (event), NULL);
+
+  time_str = log_store_xml_get_timestamp_from_event (
+      TPL_EVENT (event));
+  reason = tpl_call_event_get_end_reason (event);
+
+  sender = tpl_event_get_sender (TPL_EVENT (event));
+  actor = tpl_call_event_get_end_actor (event);
+  target = _tpl_event_get_target (TPL_EVENT (event));
+
+  if (sender != NULL)
+    {
+      sender_id = g_markup_escape_text (tpl_entity_get_identifier (sender), -1);
+      sender_name = g_markup_escape_text (tpl_entity_get_alias (sender), -1);
+      sender_avatar = g_markup_escape_text (tpl_entity_get_avatar_token (sender),
+          -1);
+    }
+
+  if (actor != NULL)
+    {
+      actor_id = g_markup_escape_text (tpl_entity_get_identifier (actor), -1);
+      actor_name = g_markup_escape_text (tpl_entity_get_alias (actor), -1);
+      actor_avatar = g_markup_escape_text (tpl_entity_get_avatar_token (actor),
+          -1);
+    }
+
+
+  log_str = g_strdup_printf ("<call time='%s' "
+      "id='%s' name='%s' isuser='%s' token='%s' "
+      "duration='%" G_GINT64_FORMAT "' "
+      "actor='%s' actortype='%s' "
+      "actorname='%s' actortoken='%s' "
+      "reason='%s' detail='%s'/>\n",
+        time_str,
+        sender_id ? sender_id : "",
+        sender_name ? sender_name : "",
+        (sender && tpl_entity_get_entity_type (sender) ==
+            TPL_ENTITY_SELF) ? "true" : "false",
+        sender_avatar ? sender_avatar : "",
+        tpl_call_event_get_duration (event),
+        actor_id ? actor_id : "",
+        actor ? _tpl_entity_type_to_str (tpl_entity_get_entity_type (actor)) : "",
+        actor_name ? actor_name : "",
+        actor_avatar ? actor_avatar : "",
+        _tpl_call_event_end_reason_to_str (reason),
+        tpl_call_event_get_detailed_end_reason (event));
+
+  DEBUG ("writing call event from %s (ts %s)",
+      tpl_entity_get_identifier (target),
+      time_str);
+
+  g_free (sender_id);
+  g_free (sender_name);
+  g_free (sender_avatar);
+  g_free (actor_id);
+  g_free (actor_name);
+  g_free (actor_avatar);
+  g_free (time_str);
+
+  return log_str;
+}
+
+
+/* First of two phases selection: understand the type Event.
+ * Returns the XML for @event, without LOG_FOOTER, and sets @type to the
+ * kind of file it goes to. Returns %NULL without setting @error for events
+ * this store doesn't handle, and with @error set for those it can't write,
+ * such as text events without a body. */
+static gchar *
+log_store_xml_format_event (TplEvent *event,
+    GType *type,
+    GError **error)
+{
+  if (TPL_IS_TEXT_EVENT (event))
+    {
+      *type = TPL_TYPE_TEXT_EVENT;
+      return log_store_xml_format_text_event (TPL_TEXT_EVENT (event), error);
+    }
+  else if (TPL_IS_CALL_EVENT (event))
+    {
+      *type = TPL_TYPE_CALL_EVENT;
+      return log_store_xml_format_call_event (TPL_CALL_EVENT (event));
+    }
+
+  DEBUG ("TplEntry not handled by this LogStore (%s). "
+      "Ignoring Event", G_OBJECT_TYPE_NAME (event));
+
+  return NULL;
+}
+
+
+static gboolean
+log_store_xml_add_event (TplLogStore *store,
+    TplEvent *event,
+    GError **error)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (store);
+  GError *loc_error = NULL;
+  gchar *event_str;
+  gchar *log_str;
+  GType type;
+  gboolean ret;
+
+  g_return_val_if_fail (TPL_IS_EVENT (event), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  event_str = log_store_xml_format_event (event, &type, &loc_error);
+  if (event_str == NULL)
+    {
+      /* do not consider it an error if this LogStore simply does not
+       * want/need this Event */
+      if (loc_error == NULL)
+        return TRUE;
+
+      g_propagate_error (error, loc_error);
+      return FALSE;
+    }
+
+  log_str = g_strconcat (event_str, LOG_FOOTER, NULL);
+
+  ret = _log_store_xml_write_to_store (self,
+      tpl_event_get_account (event), _tpl_event_get_target (event),
+      log_str, type, tpl_event_get_timestamp (event), error);
+
+  g_free (event_str);
+  g_free (log_str);
+
+  return ret;
+}
+
+
+typedef struct
+{
+  const gchar *filename;
+  gint64 timestamp;
+  GString *events;
+} PendingAppend;
+
+
+/* Events going to the same day file are appended with a single write, in
+ * the order they are in @events */
+static gboolean
+log_store_xml_add_events (TplLogStore *store,
+    GList *events,
+    GError **error)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (store);
+  GHashTable *appends;
+  GQueue order = G_QUEUE_INIT;
+  PendingAppend *append;
+  gboolean retval = TRUE;
+  GList *l;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  /* filename -> borrowed PendingAppend, owned by order */
+  appends = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (l = events; l != NULL; l = g_list_next (l))
+    {
+      TplEvent *event = l->data;
+      GError *loc_error = NULL;
+      gchar *filename;
+      gchar *event_str;
+      GType type;
+
+      event_str = log_store_xml_format_event (event, &type, &loc_error);
+      if (event_str == NULL)
+        {
+          if (loc_error != NULL)
+            {
+              if (retval)
+                g_propagate_error (error, loc_error);
+              else
+                g_error_free (loc_error);
+
+              retval = FALSE;
+            }
+
+          continue;
+        }
+
+      filename = log_store_xml_get_filename (self,
+          tpl_event_get_account (event), _tpl_event_get_target (event),
+          type, tpl_event_get_timestamp (event));
+
+      append = g_hash_table_lookup (appends, filename);
+      if (append == NULL)
+        {
+          append = g_slice_new (PendingAppend);
+          append->filename = filename;
+          append->timestamp = tpl_event_get_timestamp (event);
+          append->events = g_string_new (NULL);
+
+          g_hash_table_insert (appends, filename, append);
+          g_queue_push_tail (&order, append);
+        }
+      else
+        {
+          g_free (filename);
+        }
+
+      g_string_append (append->events, event_str);
+      g_free (event_str);
+    }
+
+  while ((append = g_queue_pop_head (&order)) != NULL)
+    {
+      GError *loc_error = NULL;
+
+      g_string_append (append->events, LOG_FOOTER);
+
+      if (!log_store_xml_write_to_file (self, append->filename,
+            append->timestamp, append->events->str, &loc_error))
+        {
+          if (retval)
+            g_propagate_error (error, loc_error);
+          else
+            g_error_free (loc_error);
+
+          retval = FALSE;
+        }
+
+      g_string_free (append->events, TRUE);
+      g_slice_free (PendingAppend, append);
+    }
+
+  g_hash_table_unref (appends);
+
+  return retval;
+}
+
+
+static gboolean
+log_store_xml_exists_in_directory (const gchar *dirname,
+    GRegex *regex,
+    gint type_mask,
+    gboolean recursive)
+{
+  gboolean exists;
+  const gchar *basename;
+  GDir *dir;
+
+  DEBUG ("Looking in directory '%s' %s",
+      dirname, recursive ? "resursively" : "");
+
+  dir = g_dir_open (dirname, 0, NULL);
+  exists = (dir != NULL);
+
+  if (CONTAINS_ALL_SUPPORTED_TYPES (type_mask) || !exists)
+    goto out;
+
+  exists = FALSE;
+  while ((basename = g_dir_read_name (dir)) != NULL)
+    {
+      gchar *filename;
+
+      filename = g_build_filename (dirname, basename, NULL);
+
+      DEBUG ("Matching with filename '%s'", basename);
+
+      if (recursive && g_file_test (filename, G_FILE_TEST_IS_DIR))
+        exists = log_store_xml_exists_in_directory (filename, regex, type_mask,
+            !tp_strdiff (basename, LOG_DIR_CHATROOMS));
+      else if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
+        exists = g_regex_match (regex, basename, 0, 0);
+
+      g_free (filename);
+
+      if (exists)
+        break;
+    }
+
+out:
+  if (dir != NULL)
+    g_dir_close (dir);
+
+  return exists;
+}
+
+
+static GRegex *
+log_store_xml_create_filename_regex (gint type_mask)
+{
+  GString *pattern;
+  GRegex *regex = NULL;
+  GError *error = NULL;
+
+  pattern = g_string_new ("");
+
+  if (type_mask & TPL_EVENT_MASK_TEXT)
+    g_string_append (pattern, LOG_FILENAME_PATTERN);
+
+  if (type_mask & TPL_EVENT_MASK_CALL)
+    g_string_append_printf (pattern,
+        "%s" LOG_FILENAME_CALL_PATTERN,
+        pattern->len == 0 ? "" : "|");
+
+  if (pattern->len == 0)
+    goto out;
+
+  DEBUG ("Pattern is '%s'", pattern->str);
+
+  regex = g_regex_new (pattern->str, G_REGEX_OPTIMIZE, 0, &error);
+
+  if (regex == NULL)
+    {
+      DEBUG ("Failed to create regex: %s", error->message);
+      g_error_free (error);
+    }
+
+out:
+  g_string_free (pattern, TRUE);
+
+  return regex;
+}
+
+
+static gboolean
+log_store_xml_exists (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask)
+{
+  TplLogStoreXml *self = (TplLogStoreXml *) store;
+  gchar *dirname;
+  GRegex *regex;
+  gboolean exists = FALSE;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), FALSE);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), FALSE);
+  g_return_val_if_fail (target == NULL || TPL_IS_ENTITY (target), FALSE);
+
+  dirname = log_store_xml_get_dir (self, account, target);
+
+  if (target != NULL && !CONTAINS_ALL_SUPPORTED_TYPES (type_mask))
+    {
+      exists = log_store_xml_has_dates (self, dirname, type_mask);
+      g_free (dirname);
+      return exists;
+    }
+
+  regex = log_store_xml_create_filename_regex (type_mask);
+
+  if (regex != NULL)
+    exists = log_store_xml_exists_in_directory (dirname, regex, type_mask,
+        target == NULL);
+
+  g_free (dirname);
+
+  if (regex != NULL)
+    g_regex_unref (regex);
+
+  return exists;
+}
+
+static GDate *
+create_date_from_string (const gchar *str)
+{
+  GDate *date;
+  guint u;
+  guint day, month, year;
+
+  if (sscanf (str, "%u", &u) != 1)
+    return NULL;
+
+  day = (u % 100);
+  month = ((u / 100) % 100);
+  year = (u / 10000);
+
+  if (!g_date_valid_dmy (day, month, year))
+    return NULL;
+
+  date = g_date_new_dmy (day, month, year);
+
+  return date;
+}
+
+
+/* Returns the Julian day of a day file name such as 20100113.call.log, and
+ * sets @type to the kind of events it holds; or 0 if @basename isn't one.
+ * This accepts the names log_store_xml_create_filename_regex () matches. */
+static guint32
+log_store_xml_parse_day_filename (const gchar *basename,
+    GType *type)
+{
+  const gchar *p;
+  gchar *str;
+  GDate *date;
+  guint32 julian;
+
+  for (p = basename; g_ascii_isdigit (*p); p++)
+    ;
+
+  if (p - basename < 8)
+    return 0;
+
+  if (!tp_strdiff (p, LOG_FILENAME_SUFFIX))
+    *type = TPL_TYPE_TEXT_EVENT;
+  else if (!tp_strdiff (p, LOG_FILENAME_CALL_SUFFIX))
+    *type = TPL_TYPE_CALL_EVENT;
+  else
+    return 0;
+
+  str = g_strndup (basename, p - basename);
+  date = create_date_from_string (str);
+  g_free (str);
+
+  if (date == NULL)
+    return 0;
+
+  julian = g_date_get_julian (date);
+  g_date_free (date);
+
+  return julian;
+}
+
+
+static GArray *
+date_index_get_days (DateIndex *index,
+    GType type)
+{
+  return type == TPL_TYPE_CALL_EVENT ? index->call_days : index->text_days;
+}
+
+
+static gint
+date_index_compare_days (gconstpointer a,
+    gconstpointer b)
+{
+  guint32 day_a = *(const guint32 *) a;
+  guint32 day_b = *(const guint32 *) b;
+
+  return day_a < day_b ? -1 : day_a > day_b;
+}
+
+
+/* Returns where @day is in @days, or where it would have to be inserted */
+static guint
+date_index_search (GArray *days,
+    guint32 day)
+{
+  guint lo = 0;
+  guint hi = days->len;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (g_array_index (days, guint32, mid) < day)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+
+/* Sorts @days, dropping duplicates: names with leading zeros may give the
+ * same day twice */
+static void
+date_index_sort (GArray *days)
+{
+  guint i, n = 0;
+
+  g_array_sort (days, date_index_compare_days);
+
+  for (i = 0; i < days->len; i++)
+    {
+      guint32 day = g_array_index (days, guint32, i);
+
+      if (n == 0 || g_array_index (days, guint32, n - 1) != day)
+        g_array_index (days, guint32, n++) = day;
+    }
+
+  g_array_set_size (days, n);
+}
+
+
+static void
+date_index_scan (DateIndex *index,
+    const gchar *dirname)
+{
+  const gchar *basename;
+  GDir *dir;
+
+  g_array_set_size (index->text_days, 0);
+  g_array_set_size (index->call_days, 0);
+
+  dir = g_dir_open (dirname, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  DEBUG ("Indexing dates in:'%s'", dirname);
+
+  while ((basename = g_dir_read_name (dir)) != NULL)
+    {
+      GType type;
+      guint32 day;
+
+      day = log_store_xml_parse_day_filename (basename, &type);
+      if (day != 0)
+        g_array_append_val (date_index_get_days (index, type), day);
+    }
+
+  g_dir_close (dir);
+
+  date_index_sort (index->text_days);
+  date_index_sort (index->call_days);
+}
+
+
+/* Returns the mtime of the directory holding @filename, or -1 if there is no
+ * such directory */
+static time_t
+log_store_xml_get_dir_mtime (const gchar *filename)
+{
+  gchar *dirname = g_path_get_dirname (filename);
+  GStatBuf st;
+  time_t mtime = (time_t) -1;
+
+  if (g_stat (dirname, &st) == 0 && S_ISDIR (st.st_mode))
+    mtime = st.st_mtime;
+
+  g_free (dirname);
+
+  return mtime;
+}
+
+
+/* Returns the index of @dirname, up to date with what is on disk, or NULL if
+ * there is no such directory. Caller holds date_index_lock. */
+static DateIndex *
+log_store_xml_date_index_get (TplLogStoreXml *self,
+    const gchar *dirname)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
+  DateIndex *index;
+  GStatBuf st;
+  time_t now;
+
+  if (g_stat (dirname, &st) != 0 || !S_ISDIR (st.st_mode))
+    {
+      g_hash_table_remove (priv->date_indexes, dirname);
+      return NULL;
+    }
+
+  index = g_hash_table_lookup (priv->date_indexes, dirname);
+
+  /* A change within the second the index was verified in would leave the
+   * same mtime behind */
+  if (index != NULL
+      && index->mtime == st.st_mtime
+      && index->mtime < index->verified_at)
+    return index;
+
+  if (index == NULL)
+    {
+      index = date_index_new ();
+      g_hash_table_insert (priv->date_indexes, g_strdup (dirname), index);
+    }
+
+  now = time (NULL);
+  date_index_scan (index, dirname);
+  index->mtime = st.st_mtime;
+  index->verified_at = now;
+
+  return index;
+}
+
+
+/* Adds the day file @filename, which the store just created, to the index of
+ * its directory. @dir_mtime is the directory mtime from before the file was
+ * created: if the index didn't match it, something else changed the
+ * directory as well and the index is dropped, to be rebuilt when needed. */
+static void
+log_store_xml_date_index_add (TplLogStoreXml *self,
+    const gchar *filename,
+    time_t dir_mtime)
+{
+  TplLogStoreXmlPriv *priv = self->priv;
+  DateIndex *index;
+  gchar *dirname;
+  gchar *basename;
+  GArray *days;
+  GType type;
+  guint32 day;
+  time_t mtime;
+  guint i;
+
+  dirname = g_path_get_dirname (filename);
+  basename = g_path_get_basename (filename);
+  day = log_store_xml_parse_day_filename (basename, &type);
+  mtime = log_store_xml_get_dir_mtime (filename);
+
+  g_mutex_lock (&priv->date_index_lock);
+
+  index = g_hash_table_lookup (priv->date_indexes, dirname);
+  if (index == NULL)
+    goto out;
+
+  if (day == 0
+      || mtime == (time_t) -1
+      || index->mtime != dir_mtime
+      || index->mtime >= index->verified_at)
+    {
+      g_hash_table_remove (priv->date_indexes, dirname);
+      goto out;
+    }
+
+  days = date_index_get_days (index, type);
+  i = date_index_search (days, day);
+  if (i == days->len || g_array_index (days, guint32, i) != day)
+    g_array_insert_val (days, i, day);
+
+  /* The store is the only writer expected in its directories, so trust
+   * the index up to the end of the second the file was created in */
+  index->mtime = mtime;
+  index->verified_at = MAX (index->verified_at, mtime + 1);
+
+out:
+  g_mutex_unlock (&priv->date_index_lock);
+  g_free (dirname);
+  g_free (basename);
+}
+
+
+static void
+log_store_xml_date_index_clear (TplLogStoreXml *self)
+{
+  g_mutex_lock (&self->priv->date_index_lock);
+  g_hash_table_remove_all (self->priv->date_indexes);
+  g_mutex_unlock (&self->priv->date_index_lock);
+}
+
+
+/* Whether @dirname has day files of a type in @type_mask, without reading
+ * the directory if its index is up to date */
+static gboolean
+log_store_xml_has_dates (TplLogStoreXml *self,
+    const gchar *dirname,
+    gint type_mask)
+{
+  DateIndex *index;
+  gboolean ret = FALSE;
+
+  g_mutex_lock (&self->priv->date_index_lock);
+
+  index = log_store_xml_date_index_get (self, dirname);
+
+  if (index != NULL)
+    ret = ((type_mask & TPL_EVENT_MASK_TEXT) && index->text_days->len > 0)
+      || ((type_mask & TPL_EVENT_MASK_CALL) && index->call_days->len > 0);
+
+  g_mutex_unlock (&self->priv->date_index_lock);
+
+  return ret;
+}
+
+
+/* Returns the last @c before @p, or NULL */
+static const gchar *
+log_store_xml_find_back (const gchar *contents,
+    const gchar *p,
+    gchar c)
+{
+  while (p > contents)
+    {
+      p--;
+
+      if (*p == c)
+        return p;
+    }
+
+  return NULL;
+}
+
+
+/* Runs @regex only around the places where @literal, the escaped text it
+ * looks for, shows up.
+ *
+ * Every search pattern is an element's start tag up to an attribute value
+ * containing the text, which can't have a '>' in it, or a start tag and the
+ * element's content up to the end tag, which has no '<' in it. So a match
+ * around an occurrence of the text starts after the last '>' that comes
+ * before the last '<' before it, and ends at the first '>' after the first
+ * '<' after it. Such an occurrence only has to be looked for ignoring the
+ * case of ASCII letters, unless the file has characters matching those
+ * in other ways. */
+static gboolean
+log_store_xml_match_around (GRegex *regex,
+    const gchar *literal,
+    const gchar *contents,
+    gsize length)
+{
+  const gchar *end = contents + length;
+  const gchar *p = contents;
+  gsize literal_len = strlen (literal);
+
+  while ((p = _tpl_ascii_strcasestr_len (p, end - p, literal,
+          literal_len)) != NULL)
+    {
+      const gchar *start, *stop;
+
+      start = log_store_xml_find_back (contents, p, '<');
+      if (start != NULL)
+        start = log_store_xml_find_back (contents, start, '>');
+      start = (start != NULL) ? start + 1 : contents;
+
+      stop = memchr (p + literal_len, '<', end - p - literal_len);
+      if (stop != NULL)
+        stop = memchr (stop, '>', end - stop);
+      stop = (stop != NULL) ? stop + 1 : end;
+
+      if (g_regex_match_full (regex, contents, stop - contents,
+              start - contents, 0, NULL, NULL))
+        return TRUE;
+
+      p++;
+    }
+
+  if (_tpl_utf8_has_ascii_case_folds (contents, length))
+    return g_regex_match_full (regex, contents, length, 0, 0, NULL, NULL);
+
+  return FALSE;
+}
+
+
+/* @literal is the escaped text @regex looks for, if it is plain ASCII, or
+ * NULL to run @regex over the whole file */
+static gboolean
+log_store_xml_match_in_file (const gchar *filename,
+    GRegex *regex,
+    const gchar *literal)
+{
+  gboolean retval = FALSE;
+  GMappedFile *file;
+  gsize length;
+  gchar *contents = NULL;
+
+  file = g_mapped_file_new (filename, FALSE, NULL);
+  if (file == NULL)
+    goto out;
+
+  length = g_mapped_file_get_length (file);
+  contents = g_mapped_file_get_contents (file);
+
+  if (length == 0 || contents == NULL)
+    goto out;
+
+  if (literal != NULL)
+    retval = log_store_xml_match_around (regex, literal, contents, length);
+  else
+    retval = g_regex_match_full (regex, contents, length, 0, 0, NULL, NULL);
+
+  DEBUG ("%s pattern '%s' in file '%s'",
+      retval ? "Matched" : "Not matched",
+      g_regex_get_pattern (regex),
+      filename);
+
+out:
+  if (file != NULL)
+    g_mapped_file_unref (file);
+
+  return retval;
+}
+
+
+static GList *
+log_store_xml_get_dates (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask)
+{
+  TplLogStoreXml *self = (TplLogStoreXml *) store;
+  GList *dates = NULL;
+  gchar *directory;
+  DateIndex *index;
+  GArray *text_days = NULL;
+  GArray *call_days = NULL;
+  guint t = 0, c = 0;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
+
+  directory = log_store_xml_get_dir (self, account, target);
+
+  g_mutex_lock (&self->priv->date_index_lock);
+
+  index = log_store_xml_date_index_get (self, directory);
+  if (index == NULL)
+    {
+      DEBUG ("Could not open directory:'%s'", directory);
+      goto out;
+    }
+
+  if (type_mask & TPL_EVENT_MASK_TEXT)
+    {
+      text_days = index->text_days;
+      t = text_days->len;
+    }
+
+  if (type_mask & TPL_EVENT_MASK_CALL)
+    {
+      call_days = index->call_days;
+      c = call_days->len;
+    }
+
+  /* Merge both sorted arrays from their ends, so that the list is built by
+   * prepending */
+  while (t > 0 || c > 0)
+    {
+      guint32 day;
+
+      if (c == 0 || (t > 0 && g_array_index (text_days, guint32, t - 1) >=
+              g_array_index (call_days, guint32, c - 1)))
+        day = g_array_index (text_days, guint32, --t);
+      else
+        day = g_array_index (call_days, guint32, --c);
+
+      if (dates != NULL && g_date_get_julian (dates->data) == day)
+        continue;
+
+      dates = g_list_prepend (dates, g_date_new_julian (day));
+    }
+
+out:
+  g_mutex_unlock (&self->priv->date_index_lock);
+  g_free (directory);
+
+  DEBUG ("Parsed %d dates", g_list_length (dates));
+
+  return dates;
+}
+
+
+static gchar *
+log_store_xml_get_filename_for_date (TplLogStoreXml *self,
+    TpAccount *account,
+    TplEntity *target,
+    const GDate *date,
+    GType type)
+{
+  gchar *basedir;
+  gchar *timestamp;
+  gchar *filename;
+  gchar str[9];
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
+  g_return_val_if_fail (TP_IS_ACCOUNT (account), NULL);
+  g_return_val_if_fail (TPL_IS_ENTITY (target), NULL);
+  g_return_val_if_fail (date != NULL, NULL);
+
+  g_date_strftime (str, 9, "%Y%m%d", date);
+
+  basedir = log_store_xml_get_dir (self, account, target);
+  timestamp = g_strconcat (str, log_store_xml_get_file_suffix (type), NULL);
+  filename = g_build_filename (basedir, timestamp, NULL);
+
+  g_free (basedir);
+  g_free (timestamp);
+
+  return filename;
+}
+
+
+static TplLogSearchHit *
+log_store_xml_search_hit_new (TplLogStoreXml *self,
+    const gchar *filename)
+{
+  TplLogSearchHit *hit;
+  gchar *account_name;
+  const gchar *end;
+  gchar **strv;
+  guint len;
+  gchar *tmp;
+  TpAccount *account;
+  GDate *date;
+  const gchar *chat_id;
+  gboolean is_chatroom;
+  TplEntity *target;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
+  g_return_val_if_fail (!TPL_STR_EMPTY (filename), NULL);
+  g_return_val_if_fail (g_str_has_suffix (filename, LOG_FILENAME_SUFFIX),
+      NULL);
+
+  strv = g_strsplit (filename, G_DIR_SEPARATOR_S, -1);
+  len = g_strv_length (strv);
+
+  end = strstr (strv[len - 1], LOG_FILENAME_SUFFIX);
+  tmp = g_strndup (strv[len - 1], end - strv[len - 1]);
+  date = create_date_from_string (tmp);
+  g_free (tmp);
+  chat_id = strv[len - 2];
+  is_chatroom = (strcmp (strv[len - 3], LOG_DIR_CHATROOMS) == 0);
+
+  if (is_chatroom)
+    account_name = strv[len - 4];
+  else
+    account_name = strv[len - 3];
+
+  account = _tpl_account_map_dup_account (self->priv->accounts,
+      account_name);
+
+  if (is_chatroom)
+    target = tpl_entity_new_from_room_id (chat_id);
+  else
+    target = tpl_entity_new (chat_id, TPL_ENTITY_CONTACT, NULL, NULL);
+
+  hit = _tpl_log_manager_search_hit_new (account, target, date);
+
+  g_strfreev (strv);
+  g_date_free (date);
+  g_object_unref (target);
+  tp_clear_object (&account);
+
+  return hit;
+}
+
+
+/* Attribute values of a <message/> or <call/> element. They are borrowed
+ * from whichever parser produced them; missing attributes are NULL. */
+typedef struct
+{
+  const gchar *time;
+  const gchar *edit_time;
+  const gchar *id;
+  const gchar *name;
+  const gchar *token;
+  const gchar *is_user;
+  const gchar *type;
+  const gchar *message_token;
+  const gchar *supersedes_token;
+  const gchar *duration;
+  const gchar *actor;
+  const gchar *actor_name;
+  const gchar *actor_type;
+  const gchar *actor_token;
+  const gchar *reason;
+  const gchar *detail;
+} EventAttributes;
+
+static const struct
+{
+  const gchar *name;
+  glong offset;
+} event_attributes[] = {
+  { "time", G_STRUCT_OFFSET (EventAttributes, time) },
+  { "edit-timestamp", G_STRUCT_OFFSET (EventAttributes, edit_time) },
+  { "id", G_STRUCT_OFFSET (EventAttributes, id) },
+  { "name", G_STRUCT_OFFSET (EventAttributes, name) },
+  { "token", G_STRUCT_OFFSET (EventAttributes, token) },
+  { "isuser", G_STRUCT_OFFSET (EventAttributes, is_user) },
+  { "type", G_STRUCT_OFFSET (EventAttributes, type) },
+  { "message-token", G_STRUCT_OFFSET (EventAttributes, message_token) },
+  { "supersedes-token", G_STRUCT_OFFSET (EventAttributes, supersedes_token) },
+  { "duration", G_STRUCT_OFFSET (EventAttributes, duration) },
+  { "actor", G_STRUCT_OFFSET (EventAttributes, actor) },
+  { "actorname", G_STRUCT_OFFSET (EventAttributes, actor_name) },
+  { "actortype", G_STRUCT_OFFSET (EventAttributes, actor_type) },
+  { "actortoken", G_STRUCT_OFFSET (EventAttributes, actor_token) },
+  { "reason", G_STRUCT_OFFSET (EventAttributes, reason) },
+  { "detail", G_STRUCT_OFFSET (EventAttributes, detail) },
+  { NULL, 0 }
+};
+
+
+static const gchar **
+event_attributes_lookup (EventAttributes *attrs,
+    const gchar *name)
+{
+  guint i;
+
+  for (i = 0; event_attributes[i].name != NULL; i++)
+    {
+      if (strcmp (event_attributes[i].name, name) == 0)
+        return G_STRUCT_MEMBER_P (attrs, event_attributes[i].offset);
+    }
+
+  return NULL;
+}
+
+
+static void
+event_attributes_from_node (EventAttributes *attrs,
+    xmlNodePtr node)
+{
+  guint i;
+
+  for (i = 0; event_attributes[i].name != NULL; i++)
+    G_STRUCT_MEMBER (const gchar *, attrs, event_attributes[i].offset) =
+        (const gchar *) xmlGetProp (node,
+            (const xmlChar *) event_attributes[i].name);
+}
+
+
+static void
+event_attributes_free_node_values (EventAttributes *attrs)
+{
+  guint i;
+
+  for (i = 0; event_attributes[i].name != NULL; i++)
+    xmlFree ((xmlChar *) G_STRUCT_MEMBER (const gchar *, attrs,
+          event_attributes[i].offset));
+}
+
+
+static TplEvent *
+text_event_from_attributes (const EventAttributes *attrs,
+    const gchar *body,
+    gboolean is_room,
+    const gchar *target_id,
+    TpAccount *account)
+{
+  TplEvent *event;
+  TplEntity *sender;
+  TplEntity *receiver;
+  gint64 timestamp;
+  gint64 edit_timestamp = 0;
+  gboolean is_user = FALSE;
+  TpChannelTextMessageType msg_type = TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL;
+
+  if (attrs->is_user != NULL)
+    is_user = (!tp_strdiff (attrs->is_user, "true"));
+
+  if (attrs->type != NULL)
+    msg_type = _tpl_text_event_message_type_from_str (attrs->type);
+
+  timestamp = _tpl_time_parse (attrs->time);
+
+  if (attrs->supersedes_token != NULL && attrs->edit_time != NULL)
+    {
+      edit_timestamp = _tpl_time_parse (attrs->edit_time);
+    }
+
+  if (is_room)
     receiver = tpl_entity_new_from_room_id (target_id);
   else if (is_user)
     receiver = tpl_entity_new (target_id, TPL_ENTITY_CONTACT, NULL, NULL);
@@ -1113,9 +2552,9 @@ parse_text_node (TplLogStoreXml *self,
     receiver = tpl_entity_new (tp_account_get_normalized_name (account),
         TPL_ENTITY_SELF, tp_account_get_nickname (account), NULL);
 
-  sender = tpl_entity_new (sender_id,
+  sender = tpl_entity_new (attrs->id,
       is_user ? TPL_ENTITY_SELF : TPL_ENTITY_CONTACT,
-      sender_name, sender_avatar_token);
+      attrs->name, attrs->token);
 
   event = g_object_new (TPL_TYPE_TEXT_EVENT,
       /* TplEvent */
@@ -1127,31 +2566,20 @@ parse_text_node (TplLogStoreXml *self,
       /* TplTextEvent */
       "message-type", msg_type,
       "message", body,
-      "message-token", message_token,
-      "supersedes-token", supersedes_token,
+      "message-token", attrs->message_token,
+      "supersedes-token", attrs->supersedes_token,
       "edit-timestamp", edit_timestamp,
       NULL);
 
   g_object_unref (sender);
   g_object_unref (receiver);
-  xmlFree (time_str);
-  xmlFree (edit_time_str);
-  xmlFree (sender_id);
-  xmlFree (sender_name);
-  xmlFree (body);
-  xmlFree (message_token);
-  xmlFree (supersedes_token);
-  xmlFree (is_user_str);
-  xmlFree (msg_type_str);
-  xmlFree (sender_avatar_token);
 
   return event;
 }
 
 
 static TplEvent *
-parse_call_node (TplLogStoreXml *self,
-    xmlNodePtr node,
+call_event_from_attributes (const EventAttributes *attrs,
     gboolean is_room,
     const gchar *target_id,
     TpAccount *account)
@@ -1160,45 +2588,18 @@ parse_call_node (TplLogStoreXml *self,
   TplEntity *sender;
   TplEntity *receiver;
   TplEntity *actor;
-  gchar *time_str;
   gint64 timestamp;
-  gchar *sender_id;
-  gchar *sender_name;
-  gchar *sender_avatar_token;
-  gchar *is_user_str;
   gboolean is_user = FALSE;
-  gchar *actor_id;
-  gchar *actor_name;
-  gchar *actor_type;
-  gchar *actor_avatar_token;
-  gchar *duration_str;
   gint64 duration = -1;
-  gchar *reason_str;
   TpCallStateChangeReason reason = TP_CALL_STATE_CHANGE_REASON_UNKNOWN;
-  gchar *detailed_reason;
-
-  time_str = (gchar *) xmlGetProp (node, (const xmlChar *) "time");
-  sender_id = (gchar *) xmlGetProp (node, (const xmlChar *) "id");
-  sender_name = (gchar *) xmlGetProp (node, (const xmlChar *) "name");
-  sender_avatar_token = (gchar *) xmlGetProp (node,
-      (const xmlChar *) "token");
-  is_user_str = (gchar *) xmlGetProp (node, (const xmlChar *) "isuser");
-  duration_str = (char *) xmlGetProp (node, (const xmlChar*) "duration");
-  actor_id = (char *) xmlGetProp (node, (const xmlChar *) "actor");
-  actor_name = (char *) xmlGetProp (node, (const xmlChar *) "actorname");
-  actor_type = (char *) xmlGetProp (node, (const xmlChar *) "actortype");
-  actor_avatar_token = (char *) xmlGetProp (node,
-      (const xmlChar *) "actortoken");
-  reason_str = (char *) xmlGetProp (node, (const xmlChar *) "reason");
-  detailed_reason = (char *) xmlGetProp (node, (const xmlChar *) "detail");
-
-  if (is_user_str != NULL)
-    is_user = (!tp_strdiff (is_user_str, "true"));
-
-  if (reason_str != NULL)
-    reason = _tpl_call_event_str_to_end_reason (reason_str);
-
-  timestamp = _tpl_time_parse (time_str);
+
+  if (attrs->is_user != NULL)
+    is_user = (!tp_strdiff (attrs->is_user, "true"));
+
+  if (attrs->reason != NULL)
+    reason = _tpl_call_event_str_to_end_reason (attrs->reason);
+
+  timestamp = _tpl_time_parse (attrs->time);
 
   if (is_room)
     receiver = tpl_entity_new_from_room_id (target_id);
@@ -1208,16 +2609,16 @@ parse_call_node (TplLogStoreXml *self,
     receiver = tpl_entity_new (tp_account_get_normalized_name (account),
         TPL_ENTITY_SELF, tp_account_get_nickname (account), NULL);
 
-  sender = tpl_entity_new (sender_id,
+  sender = tpl_entity_new (attrs->id,
       is_user ? TPL_ENTITY_SELF : TPL_ENTITY_CONTACT,
-      sender_name, sender_avatar_token);
+      attrs->name, attrs->token);
 
-  actor = tpl_entity_new (actor_id,
-      _tpl_entity_type_from_str (actor_type),
-      actor_name, actor_avatar_token);
+  actor = tpl_entity_new (attrs->actor,
+      _tpl_entity_type_from_str (attrs->actor_type),
+      attrs->actor_name, attrs->actor_token);
 
-  if (duration_str != NULL)
-    duration = atoll (duration_str);
+  if (attrs->duration != NULL)
+    duration = atoll (attrs->duration);
 
   event = g_object_new (TPL_TYPE_CALL_EVENT,
       /* TplEvent */
@@ -1230,24 +2631,56 @@ parse_call_node (TplLogStoreXml *self,
       "duration", duration,
       "end-actor", actor,
       "end-reason", reason,
-      "detailed-end-reason", detailed_reason,
+      "detailed-end-reason", attrs->detail,
       NULL);
 
   g_object_unref (sender);
   g_object_unref (receiver);
   g_object_unref (actor);
-  xmlFree (time_str);
-  xmlFree (sender_id);
-  xmlFree (sender_name);
-  xmlFree (sender_avatar_token);
-  xmlFree (is_user_str);
-  xmlFree (actor_id);
-  xmlFree (actor_name);
-  xmlFree (actor_type);
-  xmlFree (actor_avatar_token);
-  xmlFree (duration_str);
-  xmlFree (reason_str);
-  xmlFree (detailed_reason);
+
+  return event;
+}
+
+
+static TplEvent *
+parse_text_node (TplLogStoreXml *self,
+    xmlNodePtr node,
+    gboolean is_room,
+    const gchar *target_id,
+    TpAccount *account)
+{
+  TplEvent *event;
+  EventAttributes attrs;
+  gchar *body;
+
+  body = (gchar *) xmlNodeGetContent (node);
+  event_attributes_from_node (&attrs, node);
+
+  event = text_event_from_attributes (&attrs, body, is_room, target_id,
+      account);
+
+  event_attributes_free_node_values (&attrs);
+  xmlFree (body);
+
+  return event;
+}
+
+
+static TplEvent *
+parse_call_node (TplLogStoreXml *self,
+    xmlNodePtr node,
+    gboolean is_room,
+    const gchar *target_id,
+    TpAccount *account)
+{
+  TplEvent *event;
+  EventAttributes attrs;
+
+  event_attributes_from_node (&attrs, node);
+
+  event = call_event_from_attributes (&attrs, is_room, target_id, account);
+
+  event_attributes_free_node_values (&attrs);
 
   return event;
 }
@@ -1281,46 +2714,467 @@ event_queue_add_text_event (GQueue *events,
     return _tpl_event_queue_insert_sorted_after (events, index,
         TPL_EVENT (event));
 
-  l = g_hash_table_lookup (superseded_links, supersedes_token);
-  if (l != NULL)
-    {
-      event_queue_replace_and_supersede (events, l, superseded_links, event);
-      return index;
-    }
+  l = g_hash_table_lookup (superseded_links, supersedes_token);
+  if (l != NULL)
+    {
+      event_queue_replace_and_supersede (events, l, superseded_links, event);
+      return index;
+    }
+
+  /* Search backwards from "now" and insert (but don't update "now") */
+  for (l = index; l != NULL; l = g_list_previous (l))
+    {
+      if (!tp_strdiff (tpl_text_event_get_message_token (l->data),
+          supersedes_token))
+        {
+          event_queue_replace_and_supersede (events, l, superseded_links,
+              event);
+          return index;
+        }
+    }
+
+  DEBUG ("Can't find event %s (superseded by %s). "
+      "Adding Dummy event.",
+      supersedes_token, tpl_text_event_get_message_token (event));
+
+  dummy_event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", tpl_event_get_account (TPL_EVENT (event)),
+      /* MISSING: "channel-path", channel_path, */
+      "receiver", tpl_event_get_receiver (TPL_EVENT (event)),
+      "sender", tpl_event_get_sender (TPL_EVENT (event)),
+      "timestamp", tpl_event_get_timestamp (TPL_EVENT (event)),
+      /* TplTextEvent */
+      "message-type", tpl_text_event_get_message_type (event),
+      "message", "",
+      "message-token", supersedes_token,
+      NULL);
+
+  index = _tpl_event_queue_insert_sorted_after (events, index,
+      TPL_EVENT (dummy_event));
+  event_queue_replace_and_supersede (events, index, superseded_links, event);
+  return index;
+}
+
+
+/* Adds @event, which comes after every event already in @parse in its day
+ * file */
+static void
+day_parse_add_event (DayParse *parse,
+    TplEvent *event)
+{
+  if (TPL_IS_TEXT_EVENT (event))
+    parse->index = event_queue_add_text_event (&parse->events, parse->index,
+        parse->supersedes_links, TPL_TEXT_EVENT (event));
+  else
+    parse->index = _tpl_event_queue_insert_sorted_after (&parse->events,
+        parse->index, event);
+}
+
+
+/* Parses @filename into a document tree. This copes with files the streaming
+ * parser rejects, as XML_PARSE_RECOVER lets it skip over broken content. */
+static void
+log_store_xml_parse_file_dom (TplLogStoreXml *self,
+    TpAccount *account,
+    const gchar *filename,
+    gboolean is_room,
+    const gchar *target_id,
+    GType type,
+    DayParse *parse)
+{
+  xmlParserCtxtPtr ctxt;
+  xmlDocPtr doc;
+  xmlNodePtr log_node;
+  xmlNodePtr node;
+  guint num_events = 0;
+
+  /* Create parser. */
+  ctxt = xmlNewParserCtxt ();
+
+  /* Parse and validate the file. */
+  doc = xmlCtxtReadFile (ctxt, filename, NULL, XML_PARSE_RECOVER);
+  if (!doc)
+    {
+      if (!self->priv->test_mode)
+        g_warning ("Failed to parse file:'%s'", filename);
+      xmlFreeParserCtxt (ctxt);
+      return;
+    }
+
+  /* The root node, presets. */
+  log_node = xmlDocGetRootElement (doc);
+  if (!log_node)
+    {
+      xmlFreeDoc (doc);
+      xmlFreeParserCtxt (ctxt);
+      return;
+    }
+
+  /* Now get the events. */
+  for (node = log_node->children; node; node = node->next)
+    {
+      TplEvent *event = NULL;
+
+      if (type == TPL_TYPE_TEXT_EVENT
+          && strcmp ((const gchar *) node->name, "message") == 0)
+        {
+          event = parse_text_node (self, node, is_room, target_id, account);
+
+          if (event == NULL)
+            continue;
+
+          day_parse_add_event (parse, event);
+          num_events++;
+        }
+      else if (type == TPL_TYPE_CALL_EVENT
+          && strcmp ((const char*) node->name, "call") == 0)
+        {
+          event = parse_call_node (self, node, is_room, target_id, account);
+
+          if (event == NULL)
+            continue;
+
+          day_parse_add_event (parse, event);
+          num_events++;
+        }
+    }
+
+  DEBUG ("Parsed %u events", num_events);
+
+  xmlFreeDoc (doc);
+  xmlFreeParserCtxt (ctxt);
+}
+
+
+/* Collects the character data of the element @reader is positioned on,
+ * leaving the reader on its end tag. */
+static gboolean
+log_store_xml_reader_read_body (xmlTextReaderPtr reader,
+    GString *body)
+{
+  gint depth = xmlTextReaderDepth (reader);
+
+  g_string_truncate (body, 0);
+
+  if (xmlTextReaderIsEmptyElement (reader))
+    return TRUE;
+
+  while (xmlTextReaderRead (reader) == 1)
+    {
+      switch (xmlTextReaderNodeType (reader))
+        {
+          case XML_READER_TYPE_TEXT:
+          case XML_READER_TYPE_CDATA:
+          case XML_READER_TYPE_WHITESPACE:
+          case XML_READER_TYPE_SIGNIFICANT_WHITESPACE:
+            g_string_append (body,
+                (const gchar *) xmlTextReaderConstValue (reader));
+            break;
+          case XML_READER_TYPE_END_ELEMENT:
+            if (xmlTextReaderDepth (reader) == depth)
+              return TRUE;
+            break;
+          default:
+            break;
+        }
+    }
+
+  return FALSE;
+}
+
+
+/* Builds an event from the <message/> or <call/> element @reader is
+ * positioned on, leaving the reader on the element's last node. Returns NULL
+ * if the element is truncated. */
+static TplEvent *
+log_store_xml_reader_read_event (xmlTextReaderPtr reader,
+    GStringChunk *values,
+    GString *body,
+    gboolean is_text,
+    gboolean is_room,
+    const gchar *target_id,
+    TpAccount *account)
+{
+  EventAttributes attrs = { NULL, };
+
+  /* Values returned by the reader only live until it moves on, so copy
+   * them into a chunk that is recycled for each element. */
+  g_string_chunk_clear (values);
+
+  while (xmlTextReaderMoveToNextAttribute (reader) == 1)
+    {
+      const gchar **slot;
+      const gchar *value;
+
+      slot = event_attributes_lookup (&attrs,
+          (const gchar *) xmlTextReaderConstName (reader));
+      value = (const gchar *) xmlTextReaderConstValue (reader);
+
+      if (slot != NULL && value != NULL)
+        *slot = g_string_chunk_insert (values, value);
+    }
+
+  xmlTextReaderMoveToElement (reader);
+
+  if (!is_text)
+    return call_event_from_attributes (&attrs, is_room, target_id, account);
+
+  if (!log_store_xml_reader_read_body (reader, body))
+    return NULL;
+
+  return text_event_from_attributes (&attrs, body->str, is_room, target_id,
+      account);
+}
+
+
+/* Parses the <log/> document in @buffer with a pull parser, adding the
+ * events to @parse without building a document tree. Returns FALSE if the
+ * document is not well-formed, in which case @parse may hold some of its
+ * events. */
+static gboolean
+log_store_xml_parse_buffer (TplLogStoreXml *self,
+    TpAccount *account,
+    const gchar *filename,
+    const gchar *buffer,
+    gsize length,
+    gboolean is_room,
+    const gchar *target_id,
+    GType type,
+    DayParse *parse)
+{
+  xmlTextReaderPtr reader;
+  GStringChunk *values;
+  GString *body;
+  guint num_events = 0;
+  gint ret;
+
+  if (length > G_MAXINT)
+    return FALSE;
+
+  /* Errors are left to the DOM parser, which reports them when it gets the
+   * file after we give up on it. */
+  reader = xmlReaderForMemory (buffer, (gint) length, filename, NULL,
+      XML_PARSE_RECOVER | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+  if (reader == NULL)
+    return FALSE;
+
+  values = g_string_chunk_new (256);
+  body = g_string_sized_new (256);
+
+  while ((ret = xmlTextReaderRead (reader)) == 1)
+    {
+      const gchar *name;
+      gboolean is_text;
+      TplEvent *event;
+
+      if (xmlTextReaderNodeType (reader) != XML_READER_TYPE_ELEMENT
+          || xmlTextReaderDepth (reader) != 1)
+        continue;
+
+      name = (const gchar *) xmlTextReaderConstName (reader);
+
+      if (type == TPL_TYPE_TEXT_EVENT && strcmp (name, "message") == 0)
+        is_text = TRUE;
+      else if (type == TPL_TYPE_CALL_EVENT && strcmp (name, "call") == 0)
+        is_text = FALSE;
+      else
+        continue;
+
+      event = log_store_xml_reader_read_event (reader, values, body, is_text,
+          is_room, target_id, account);
+
+      if (event == NULL)
+        {
+          ret = -1;
+          break;
+        }
+
+      day_parse_add_event (parse, event);
+      num_events++;
+    }
+
+  g_string_free (body, TRUE);
+  g_string_chunk_free (values);
+  xmlFreeTextReader (reader);
+
+  if (ret != 0)
+    {
+      DEBUG ("Streaming parse of '%s' failed", filename);
+      return FALSE;
+    }
+
+  DEBUG ("Parsed %u events", num_events);
+
+  return TRUE;
+}
+
+
+/* Returns the offset of the closing </log> tag in @contents, or 0 if the
+ * file doesn't end with it, i.e. it is being written or was cut short. */
+static gsize
+log_store_xml_find_footer (const gchar *contents,
+    gsize length)
+{
+  gsize footer_len = strlen ("</log>");
+
+  while (length > 0 && g_ascii_isspace (contents[length - 1]))
+    length--;
+
+  if (length < footer_len
+      || strncmp (contents + length - footer_len, "</log>", footer_len) != 0)
+    return 0;
+
+  return length - footer_len;
+}
+
+
+/* Remembers where @day's file ended when it was last parsed, so that events
+ * written over its footer can be parsed on their own */
+static void
+cached_day_set_footer (CachedDay *day,
+    const gchar *contents,
+    gsize length)
+{
+  day->footer_offset = log_store_xml_find_footer (contents, length);
+  day->tail_len = MIN (day->footer_offset, CACHED_DAY_TAIL_LEN);
+  memcpy (day->tail, contents + day->footer_offset - day->tail_len,
+      day->tail_len);
+}
+
+
+/* Guesses the target of a day file from its directory name */
+static gchar *
+log_store_xml_get_target_id_for_file (const gchar *filename,
+    gboolean *is_room)
+{
+  gchar *dirname;
+  gchar *tmp;
+  gchar *target_id;
+
+  dirname = g_path_get_dirname (filename);
+  target_id = g_path_get_basename (dirname);
+
+  /* Determine if it's a chatroom */
+  tmp = dirname;
+  dirname = g_path_get_dirname (tmp);
+  g_free (tmp);
+  tmp = g_path_get_basename (dirname);
+  *is_room = (g_strcmp0 (LOG_DIR_CHATROOMS, tmp) == 0);
+  g_free (dirname);
+  g_free (tmp);
+
+  return target_id;
+}
+
+
+/* Parses @filename from the start, straight from a mapping of the file.
+ * Files the pull parser rejects are handed to the DOM parser. */
+static CachedDay *
+log_store_xml_parse_day (TplLogStoreXml *self,
+    TpAccount *account,
+    const gchar *filename,
+    GType type)
+{
+  CachedDay *day;
+  GMappedFile *mapped;
+  gboolean is_room;
+  gchar *target_id;
+  GError *error = NULL;
+
+  day = g_slice_new0 (CachedDay);
+  day->filename = g_strdup (filename);
+  day->type = type;
+  day_parse_init (&day->parse);
+
+  target_id = log_store_xml_get_target_id_for_file (filename, &is_room);
+
+  mapped = g_mapped_file_new (filename, FALSE, &error);
+  if (mapped == NULL)
+    {
+      DEBUG ("Failed to map file:'%s': %s", filename, error->message);
+      g_clear_error (&error);
+    }
+
+  if (mapped != NULL
+      && log_store_xml_parse_buffer (self, account, filename,
+          g_mapped_file_get_contents (mapped),
+          g_mapped_file_get_length (mapped), is_room, target_id, type,
+          &day->parse))
+    {
+      cached_day_set_footer (day, g_mapped_file_get_contents (mapped),
+          g_mapped_file_get_length (mapped));
+    }
+  else
+    {
+      day_parse_clear (&day->parse);
+      day_parse_init (&day->parse);
+      log_store_xml_parse_file_dom (self, account, filename, is_room,
+          target_id, type, &day->parse);
+    }
+
+  if (mapped != NULL)
+    g_mapped_file_unref (mapped);
+
+  g_free (target_id);
+
+  return day;
+}
+
+
+/* Parses the events written over @day's footer since the file was last
+ * parsed. Returns FALSE if the file changed in any other way or what was
+ * written doesn't parse; @day then has to be parsed from the start. */
+static gboolean
+log_store_xml_extend_day (TplLogStoreXml *self,
+    TpAccount *account,
+    CachedDay *day)
+{
+  GMappedFile *mapped;
+  const gchar *contents;
+  gsize length;
+  gsize footer;
+  GString *appended;
+  gboolean is_room;
+  gchar *target_id;
+  gboolean ret = FALSE;
+
+  mapped = g_mapped_file_new (day->filename, FALSE, NULL);
+  if (mapped == NULL)
+    return FALSE;
+
+  contents = g_mapped_file_get_contents (mapped);
+  length = g_mapped_file_get_length (mapped);
+  footer = log_store_xml_find_footer (contents, length);
+
+  if (footer < day->footer_offset
+      || memcmp (contents + day->footer_offset - day->tail_len, day->tail,
+          day->tail_len) != 0)
+    goto out;
+
+  /* The new events, wrapped up as a document of their own */
+  appended = g_string_sized_new (footer - day->footer_offset + 16);
+  g_string_append (appended, "<log>");
+  g_string_append_len (appended, contents + day->footer_offset,
+      footer - day->footer_offset);
+  g_string_append (appended, "</log>");
 
-  /* Search backwards from "now" and insert (but don't update "now") */
-  for (l = index; l != NULL; l = g_list_previous (l))
-    {
-      if (!tp_strdiff (tpl_text_event_get_message_token (l->data),
-          supersedes_token))
-        {
-          event_queue_replace_and_supersede (events, l, superseded_links,
-              event);
-          return index;
-        }
-    }
+  target_id = log_store_xml_get_target_id_for_file (day->filename, &is_room);
 
-  DEBUG ("Can't find event %s (superseded by %s). "
-      "Adding Dummy event.",
-      supersedes_token, tpl_text_event_get_message_token (event));
+  ret = log_store_xml_parse_buffer (self, account, day->filename,
+      appended->str, appended->len, is_room, target_id, day->type,
+      &day->parse);
 
-  dummy_event = g_object_new (TPL_TYPE_TEXT_EVENT,
-      /* TplEvent */
-      "account", tpl_event_get_account (TPL_EVENT (event)),
-      /* MISSING: "channel-path", channel_path, */
-      "receiver", tpl_event_get_receiver (TPL_EVENT (event)),
-      "sender", tpl_event_get_sender (TPL_EVENT (event)),
-      "timestamp", tpl_event_get_timestamp (TPL_EVENT (event)),
-      /* TplTextEvent */
-      "message-type", tpl_text_event_get_message_type (event),
-      "message", "",
-      "message-token", supersedes_token,
-      NULL);
+  if (ret)
+    cached_day_set_footer (day, contents, length);
 
-  index = _tpl_event_queue_insert_sorted_after (events, index,
-      TPL_EVENT (dummy_event));
-  event_queue_replace_and_supersede (events, index, superseded_links, event);
-  return index;
+  g_free (target_id);
+  g_string_free (appended, TRUE);
+
+ out:
+  g_mapped_file_unref (mapped);
+
+  return ret;
 }
 
 
@@ -1337,17 +3191,11 @@ log_store_xml_get_events_for_file (TplLogStoreXml *self,
     GType type,
     GQueue *events)
 {
-  xmlParserCtxtPtr ctxt;
-  xmlDocPtr doc;
-  xmlNodePtr log_node;
-  xmlNodePtr node;
-  gboolean is_room;
-  gchar *dirname;
-  gchar *tmp;
-  gchar *target_id;
-  GHashTable *supersedes_links;
-  guint num_events = 0;
-  GList *index;
+  GQueue parsed = G_QUEUE_INIT;
+  GList *index = NULL;
+  GList *l;
+  CachedDay *day;
+  GStatBuf st;
 
   g_return_if_fail (TPL_IS_LOG_STORE_XML (self));
   g_return_if_fail (TP_IS_ACCOUNT (account));
@@ -1356,172 +3204,504 @@ log_store_xml_get_events_for_file (TplLogStoreXml *self,
 
   DEBUG ("Attempting to parse filename:'%s'...", filename);
 
-  if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+  if (g_stat (filename, &st) != 0)
     {
       DEBUG ("Filename:'%s' does not exist", filename);
+      log_store_xml_cache_forget (self, filename);
       return;
     }
 
-  /* Create parser. */
-  ctxt = xmlNewParserCtxt ();
+  if (!log_store_xml_cache_lookup (self, filename, type, &st, &parsed, &day))
+    {
+      gboolean from_start;
 
-  /* Parse and validate the file. */
-  doc = xmlCtxtReadFile (ctxt, filename, NULL, XML_PARSE_RECOVER);
-  if (!doc)
+      from_start = (day == NULL
+          || !log_store_xml_extend_day (self, account, day));
+
+      if (from_start)
+        {
+          tp_clear_pointer (&day, cached_day_free);
+          day = log_store_xml_parse_day (self, account, filename, type);
+        }
+
+      day->inode = st.st_ino;
+      day->size = st.st_size;
+      day->mtime = st.st_mtime;
+
+      for (l = day->parse.events.head; l != NULL; l = g_list_next (l))
+        g_queue_push_tail (&parsed, g_object_ref (l->data));
+
+      log_store_xml_cache_insert (self, day, from_start);
+    }
+
+  /* Both queues are sorted, so each insertion resumes from the last one */
+  for (l = parsed.head; l != NULL; l = g_list_next (l))
+    index = _tpl_event_queue_insert_sorted_after (events, index, l->data);
+
+  g_queue_clear (&parsed);
+}
+
+
+/* Reads the <message/> or <call/> elements of a day file backwards, newest
+ * first, parsing only the elements it hands out. Every '<' in a text or
+ * attribute value is escaped, so an element starts at the last "<message" or
+ * "<call" before the previous one. */
+typedef struct
+{
+  GMappedFile *mapped;
+  const gchar *contents;
+  /* elements still to be read lie before this offset */
+  gsize end;
+  const gchar *element;
+  gboolean is_text;
+  gboolean is_room;
+  gchar *target_id;
+  TpAccount *account;
+  xmlTextReaderPtr reader;
+  GStringChunk *values;
+  GString *body;
+  TplEvent *next;
+  gint64 last_timestamp;
+} TailReader;
+
+
+/* Returns FALSE if @filename exists but can't be read backwards. A NULL or
+ * missing file reads as empty. */
+static gboolean
+tail_reader_init (TailReader *self,
+    const gchar *filename,
+    GType type,
+    TpAccount *account)
+{
+  GError *error = NULL;
+
+  memset (self, 0, sizeof (TailReader));
+  self->last_timestamp = G_MAXINT64;
+
+  if (filename == NULL || !g_file_test (filename, G_FILE_TEST_EXISTS))
+    return TRUE;
+
+  self->mapped = g_mapped_file_new (filename, FALSE, &error);
+  if (self->mapped == NULL)
     {
-      if (!self->priv->test_mode)
-        g_warning ("Failed to parse file:'%s'", filename);
-      xmlFreeParserCtxt (ctxt);
-      return;
+      DEBUG ("Failed to map file:'%s': %s", filename, error->message);
+      g_error_free (error);
+      return FALSE;
     }
 
-  /* The root node, presets. */
-  log_node = xmlDocGetRootElement (doc);
-  if (!log_node)
+  self->contents = g_mapped_file_get_contents (self->mapped);
+  self->end = log_store_xml_find_footer (self->contents,
+      g_mapped_file_get_length (self->mapped));
+
+  if (self->end == 0)
+    return FALSE;
+
+  self->is_text = (type == TPL_TYPE_TEXT_EVENT);
+  self->element = self->is_text ? "message" : "call";
+  self->target_id = log_store_xml_get_target_id_for_file (filename,
+      &self->is_room);
+  self->account = account;
+  self->values = g_string_chunk_new (256);
+  self->body = g_string_sized_new (256);
+
+  return TRUE;
+}
+
+
+static void
+tail_reader_clear (TailReader *self)
+{
+  tp_clear_object (&self->next);
+  tp_clear_pointer (&self->reader, xmlFreeTextReader);
+  tp_clear_pointer (&self->mapped, g_mapped_file_unref);
+
+  if (self->values != NULL)
+    g_string_chunk_free (self->values);
+
+  if (self->body != NULL)
+    g_string_free (self->body, TRUE);
+
+  g_free (self->target_id);
+}
+
+
+/* Returns the offset of the last element start before self->end, or -1 once
+ * only the <log> start tag is left. */
+static gssize
+tail_reader_find_element (TailReader *self)
+{
+  gsize len = strlen (self->element);
+  gsize i = self->end;
+
+  while (i > 0)
     {
-      xmlFreeDoc (doc);
-      xmlFreeParserCtxt (ctxt);
-      return;
+      const gchar *tag;
+
+      if (self->contents[--i] != '<')
+        continue;
+
+      tag = self->contents + i + 1;
+
+      if (strncmp (tag, self->element, len) == 0
+          && (g_ascii_isspace (tag[len]) || tag[len] == '>'
+              || tag[len] == '/'))
+        return i;
+
+      if (strncmp (tag, "log", 3) == 0
+          && (g_ascii_isspace (tag[3]) || tag[3] == '>'))
+        return -1;
     }
 
-  /* Guess the target based on directory name */
-  dirname = g_path_get_dirname (filename);
-  target_id = g_path_get_basename (dirname);
+  return -1;
+}
 
-  /* Determine if it's a chatroom */
-  tmp = dirname;
-  dirname = g_path_get_dirname (tmp);
-  g_free (tmp);
-  tmp = g_path_get_basename (dirname);
-  is_room = (g_strcmp0 (LOG_DIR_CHATROOMS, tmp) == 0);
-  g_free (dirname);
-  g_free (tmp);
 
-  /* Temporary hash from (borrowed) supersedes-token to (borrowed) link in
-   * events, for any event that was once in events, but has since been
-   * superseded (and therefore won't be found by a linear search). */
-  supersedes_links = g_hash_table_new (g_str_hash, g_str_equal);
+/* Sets @event to the newest event not taken yet, or NULL once the start of
+ * the file is reached. Returns FALSE if the file has to be parsed in full
+ * instead. */
+static gboolean
+tail_reader_peek (TailReader *self,
+    TplEvent **event)
+{
+  gssize start;
+  gint ret;
 
-  /* Now get the events. */
-  index = NULL;
-  for (node = log_node->children; node; node = node->next)
+  *event = self->next;
+
+  if (self->next != NULL || self->mapped == NULL)
+    return TRUE;
+
+  start = tail_reader_find_element (self);
+  if (start < 0)
+    return TRUE;
+
+  if (self->reader == NULL)
     {
-      TplEvent *event = NULL;
+      self->reader = xmlReaderForMemory (self->contents + start,
+          (gint) (self->end - start), NULL, NULL,
+          XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+      ret = (self->reader != NULL) ? 0 : -1;
+    }
+  else
+    {
+      ret = xmlReaderNewMemory (self->reader, self->contents + start,
+          (gint) (self->end - start), NULL, NULL,
+          XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+    }
 
-      if (type == TPL_TYPE_TEXT_EVENT
-          && strcmp ((const gchar *) node->name, "message") == 0)
-        {
-          event = parse_text_node (self, node, is_room, target_id, account);
+  self->end = start;
 
-          if (event == NULL)
-            continue;
+  if (ret != 0
+      || xmlTextReaderRead (self->reader) != 1
+      || xmlTextReaderNodeType (self->reader) != XML_READER_TYPE_ELEMENT)
+    return FALSE;
 
-          index = event_queue_add_text_event (events, index,
-              supersedes_links, TPL_TEXT_EVENT (event));
-          num_events++;
+  self->next = log_store_xml_reader_read_event (self->reader, self->values,
+      self->body, self->is_text, self->is_room, self->target_id,
+      self->account);
+
+  if (self->next == NULL)
+    return FALSE;
+
+  /* An edit takes the place of the message it supersedes, which may be
+   * anywhere earlier in the file */
+  if (self->is_text && tpl_text_event_get_supersedes_token (
+          TPL_TEXT_EVENT (self->next)) != NULL)
+    return FALSE;
+
+  /* Events written out of order would have to be sorted against the whole
+   * file */
+  if (tpl_event_get_timestamp (self->next) > self->last_timestamp)
+    return FALSE;
+
+  self->last_timestamp = tpl_event_get_timestamp (self->next);
+  *event = self->next;
+
+  return TRUE;
+}
+
+
+static TplEvent *
+tail_reader_take (TailReader *self)
+{
+  TplEvent *event = self->next;
+
+  self->next = NULL;
+
+  return event;
+}
+
+
+/* Whether the day file called @basename is within @scope's dates */
+static gboolean
+log_store_xml_scope_has_filename (const TplLogSearchScope *scope,
+    const gchar *basename)
+{
+  GDate date;
+  GType type;
+  guint32 julian;
+
+  if (scope == NULL || (scope->from == NULL && scope->to == NULL))
+    return TRUE;
+
+  julian = log_store_xml_parse_day_filename (basename, &type);
+  if (julian == 0)
+    return FALSE;
+
+  g_date_clear (&date, 1);
+  g_date_set_julian (&date, julian);
+
+  return _tpl_log_search_scope_has_date (scope, &date);
+}
+
+
+/* If dir is NULL, basedir will be used instead.
+ * Used to make possible the full search vs. specific subtrees search */
+static GList *
+log_store_xml_get_all_files (TplLogStoreXml *self,
+    const gchar *dir,
+    gint type_mask,
+    const TplLogSearchScope *scope)
+{
+  GDir *gdir;
+  GList *files = NULL;
+  const gchar *name;
+  const gchar *basedir;
+  GRegex *regex;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
+  /* dir can be NULL, do not check */
+
+  basedir = (dir != NULL) ? dir : log_store_xml_get_basedir (self);
+
+  gdir = g_dir_open (basedir, 0, NULL);
+  if (!gdir)
+    return NULL;
+
+  regex = log_store_xml_create_filename_regex (type_mask);
+
+  if (regex == NULL)
+    goto out;
+
+  while ((name = g_dir_read_name (gdir)) != NULL)
+    {
+      gchar *filename;
+
+      filename = g_build_filename (basedir, name, NULL);
+
+      if (g_regex_match (regex, name, 0, NULL))
+        {
+          if (log_store_xml_scope_has_filename (scope, name))
+            files = g_list_prepend (files, filename);
+          else
+            g_free (filename);
         }
-      else if (type == TPL_TYPE_CALL_EVENT
-          && strcmp ((const char*) node->name, "call") == 0)
+      else if (g_file_test (filename, G_FILE_TEST_IS_DIR))
         {
-          event = parse_call_node (self, node, is_room, target_id, account);
+          /* Recursively get all log files */
+          files = g_list_concat (files,
+              log_store_xml_get_all_files (self, filename, type_mask, scope));
+          g_free (filename);
+        }
+      else
+        {
+          g_free (filename);
+        }
+    }
 
-          if (event == NULL)
-            continue;
+out:
+  g_dir_close (gdir);
+
+  if (regex != NULL)
+    g_regex_unref (regex);
+
+  return files;
+}
+
+/* Files being matched against a search pattern. Each thread claims the next
+ * file by bumping next, and records the result in that file's own slot of
+ * matched, so no lock is needed to collect them. Threads give up on the
+ * files left once cancellable is cancelled. The search pool's workers
+ * helping with the files are counted in n_workers, under lock. */
+typedef struct
+{
+  const gchar *pattern;
+  const gchar *literal;
+  GCancellable *cancellable;
+  const gchar **files;
+  gboolean *matched;
+  guint n_files;
+  volatile gint next;
+
+  GMutex lock;
+  GCond done;
+  guint n_workers;
+} SearchScan;
+
+
+/* The regex a search pool worker last compiled, kept for the next batch */
+typedef struct
+{
+  gchar *pattern;
+  GRegex *regex;
+} SearchRegex;
+
+
+static void
+search_regex_free (gpointer data)
+{
+  SearchRegex *cached = data;
+
+  g_free (cached->pattern);
+  g_regex_unref (cached->regex);
+  g_slice_free (SearchRegex, cached);
+}
+
+
+static GPrivate search_regex = G_PRIVATE_INIT (search_regex_free);
+
+
+static void
+log_store_xml_search_scan_files (SearchScan *scan,
+    GRegex *regex)
+{
+  gint i;
+
+  while (!g_cancellable_is_cancelled (scan->cancellable)
+      && (i = g_atomic_int_add (&scan->next, 1)) < (gint) scan->n_files)
+    scan->matched[i] = log_store_xml_match_in_file (scan->files[i], regex,
+        scan->literal);
+}
+
+
+/* Returns: (transfer none): the calling thread's own copy of @pattern,
+ * compiled when the thread first sees it */
+static GRegex *
+log_store_xml_search_get_thread_regex (const gchar *pattern)
+{
+  SearchRegex *cached = g_private_get (&search_regex);
+  GRegex *regex;
 
-          index = _tpl_event_queue_insert_sorted_after (events, index, event);
-          num_events++;
-        }
-    }
+  if (cached != NULL && !tp_strdiff (cached->pattern, pattern))
+    return cached->regex;
 
-  DEBUG ("Parsed %u events", num_events);
+  /* The searching thread already managed to compile @pattern, so this
+   * can't fail */
+  regex = g_regex_new (pattern, G_REGEX_CASELESS | G_REGEX_OPTIMIZE, 0,
+      NULL);
+  g_return_val_if_fail (regex != NULL, NULL);
 
-  g_free (target_id);
-  xmlFreeDoc (doc);
-  xmlFreeParserCtxt (ctxt);
-  g_hash_table_unref (supersedes_links);
+  cached = g_slice_new (SearchRegex);
+  cached->pattern = g_strdup (pattern);
+  cached->regex = regex;
+  g_private_replace (&search_regex, cached);
+
+  return regex;
 }
 
 
-/* If dir is NULL, basedir will be used instead.
- * Used to make possible the full search vs. specific subtrees search */
-static GList *
-log_store_xml_get_all_files (TplLogStoreXml *self,
-    const gchar *dir,
-    gint type_mask)
+static void
+log_store_xml_search_scan_worker (gpointer data,
+    gpointer user_data)
 {
-  GDir *gdir;
-  GList *files = NULL;
-  const gchar *name;
-  const gchar *basedir;
+  SearchScan *scan = data;
   GRegex *regex;
 
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
-  /* dir can be NULL, do not check */
+  regex = log_store_xml_search_get_thread_regex (scan->pattern);
+  if (regex != NULL)
+    log_store_xml_search_scan_files (scan, regex);
 
-  basedir = (dir != NULL) ? dir : log_store_xml_get_basedir (self);
+  g_mutex_lock (&scan->lock);
+  scan->n_workers--;
+  g_cond_signal (&scan->done);
+  g_mutex_unlock (&scan->lock);
+}
 
-  gdir = g_dir_open (basedir, 0, NULL);
-  if (!gdir)
-    return NULL;
 
-  regex = log_store_xml_create_filename_regex (type_mask);
+static guint
+log_store_xml_get_n_processors (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  glong n = sysconf (_SC_NPROCESSORS_ONLN);
 
-  if (regex == NULL)
-    goto out;
+  if (n > 0)
+    return n;
+#endif
 
-  while ((name = g_dir_read_name (gdir)) != NULL)
+  return 1;
+}
+
+
+/* Matches every file in @scan, with the help of the search pool when there
+ * are enough of them to be worth it. The calling thread takes its share
+ * with @regex. */
+static void
+log_store_xml_search_scan_run (TplLogStoreXml *self,
+    SearchScan *scan,
+    GRegex *regex)
+{
+  guint n_threads, i;
+
+  n_threads = MIN (log_store_xml_get_n_processors (), SEARCH_THREADS_MAX);
+  n_threads = MIN (n_threads, scan->n_files / SEARCH_FILES_PER_THREAD);
+
+  /* the calling thread is one of them */
+  for (i = 1; i < n_threads; i++)
     {
-      gchar *filename;
+      GError *error = NULL;
 
-      filename = g_build_filename (basedir, name, NULL);
+      g_mutex_lock (&scan->lock);
+      scan->n_workers++;
+      g_mutex_unlock (&scan->lock);
 
-      if (g_regex_match (regex, name, 0, NULL))
-        files = g_list_prepend (files, filename);
-      else if (g_file_test (filename, G_FILE_TEST_IS_DIR))
-        {
-          /* Recursively get all log files */
-          files = g_list_concat (files,
-              log_store_xml_get_all_files (self, filename, type_mask));
-          g_free (filename);
-        }
-      else
+      if (!g_thread_pool_push (self->priv->search_pool, scan, &error))
         {
-          g_free (filename);
+          DEBUG ("Failed to start search thread: %s", error->message);
+          g_error_free (error);
+
+          g_mutex_lock (&scan->lock);
+          scan->n_workers--;
+          g_mutex_unlock (&scan->lock);
+          break;
         }
     }
 
-out:
-  g_dir_close (gdir);
-
-  if (regex != NULL)
-    g_regex_unref (regex);
+  log_store_xml_search_scan_files (scan, regex);
 
-  return files;
+  /* Workers which only get to @scan now find nothing left to do */
+  g_mutex_lock (&scan->lock);
+  while (scan->n_workers > 0)
+    g_cond_wait (&scan->done, &scan->lock);
+  g_mutex_unlock (&scan->lock);
 }
 
-/*
- * @files: (transfer full) (element-type utf8):
+
+/* Matches @files against @text a batch at a time, passing the hits of each
+ * batch to @func in the order of @files, until @func returns FALSE,
+ * @cancellable is cancelled or there are no files left.
+ *
+ * @files: (transfer none) (element-type utf8):
  */
-static GList *
-_log_store_xml_search_in_files (TplLogStoreXml *self,
+static void
+log_store_xml_search_files (TplLogStoreXml *self,
     const gchar *text,
     GList *files,
-    gint type_mask)
+    gint type_mask,
+    GCancellable *cancellable,
+    TplLogStoreSearchFunc func,
+    gpointer user_data)
 {
   GList *l;
-  GList *hits = NULL;
   gchar *markup_text;
   gchar *escaped_text;
   GString *pattern = NULL;
   GRegex *regex = NULL;
   GError *error = NULL;
-
-  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
-  g_return_val_if_fail (!TPL_STR_EMPTY (text), NULL);
+  SearchScan scan = { NULL, };
+  gboolean more = TRUE;
 
   markup_text = g_markup_escape_text (text, -1);
   escaped_text = g_regex_escape_string (markup_text, -1);
-  g_free (markup_text);
 
   pattern = g_string_new ("");
 
@@ -1556,26 +3736,59 @@ _log_store_xml_search_in_files (TplLogStoreXml *self,
       goto out;
     }
 
-  for (l = files; l; l = g_list_next (l))
+  scan.pattern = pattern->str;
+  scan.literal = _tpl_str_is_ascii (markup_text) ? markup_text : NULL;
+  scan.cancellable = cancellable;
+  scan.files = g_new (const gchar *, SEARCH_BATCH_FILES);
+  scan.matched = g_new (gboolean, SEARCH_BATCH_FILES);
+  g_mutex_init (&scan.lock);
+  g_cond_init (&scan.done);
+
+  l = files;
+  while (l != NULL && more)
     {
-      gchar *filename = l->data;
+      GList *hits = NULL;
+      guint i;
+
+      scan.n_files = 0;
+      scan.next = 0;
+
+      for (; l != NULL && scan.n_files < SEARCH_BATCH_FILES;
+           l = g_list_next (l))
+        scan.files[scan.n_files++] = l->data;
 
-      if (log_store_xml_match_in_file (filename, regex))
+      memset (scan.matched, 0, scan.n_files * sizeof (gboolean));
+
+      log_store_xml_search_scan_run (self, &scan, regex);
+
+      if (g_cancellable_is_cancelled (cancellable))
+        break;
+
+      /* Hits are collected in the order of @files, whichever thread
+       * matched them */
+      for (i = 0; i < scan.n_files; i++)
         {
           TplLogSearchHit *hit;
 
-          hit = log_store_xml_search_hit_new (self, filename);
+          if (!scan.matched[i])
+            continue;
+
+          hit = log_store_xml_search_hit_new (self, scan.files[i]);
           if (hit != NULL)
             {
               hits = g_list_prepend (hits, hit);
               DEBUG ("Found text:'%s' in file:'%s' on date: %04u-%02u-%02u",
-                  text, filename, g_date_get_year (hit->date),
+                  text, scan.files[i], g_date_get_year (hit->date),
                   g_date_get_month (hit->date), g_date_get_day (hit->date));
             }
         }
+
+      if (hits != NULL)
+        more = func (g_list_reverse (hits), user_data);
     }
 
 out:
+  g_free (markup_text);
   g_free (escaped_text);
 
   if (pattern != NULL)
@@ -1584,26 +3797,263 @@ out:
   if (regex != NULL)
     g_regex_unref (regex);
 
+  if (scan.files != NULL)
+    {
+      g_mutex_clear (&scan.lock);
+      g_cond_clear (&scan.done);
+    }
+
+  g_free (scan.files);
+  g_free (scan.matched);
+}
+
+
+static gboolean
+log_store_xml_search_collect (GList *hits,
+    gpointer user_data)
+{
+  GList **collected = user_data;
+
+  /* The whole search used to be built by prepending each hit */
+  *collected = g_list_concat (g_list_reverse (hits), *collected);
+
+  return TRUE;
+}
+
+
+/*
+ * @files: (transfer full) (element-type utf8):
+ */
+static GList *
+_log_store_xml_search_in_files (TplLogStoreXml *self,
+    const gchar *text,
+    GList *files,
+    gint type_mask,
+    GCancellable *cancellable)
+{
+  GList *hits = NULL;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
+  g_return_val_if_fail (!TPL_STR_EMPTY (text), NULL);
+
+  log_store_xml_search_files (self, text, files, type_mask, cancellable,
+      log_store_xml_search_collect, &hits);
+
   g_list_free_full (files, g_free);
   return hits;
 }
 
 
+/* Narrows @files down to those the search index says may contain @text,
+ * after bringing the index up to date with every file that changed since it
+ * was indexed (which, the first time, means indexing all of them, a batch
+ * of files per transaction). Files the index can't tell about are kept, and
+ * so are all of them if @cancellable is cancelled meanwhile. The index only
+ * narrows the search down: the regex still decides what is a hit.
+ *
+ * @files: (transfer full) (element-type utf8): the files of @type_mask
+ *  within @scope
+ * Returns: (transfer full) (element-type utf8): */
+static GList *
+log_store_xml_search_index_filter (TplLogStoreXml *self,
+    TplLogSearchIndex *index,
+    const gchar *text,
+    const gchar *dir,
+    gint type_mask,
+    const TplLogSearchScope *scope,
+    GCancellable *cancellable,
+    GList *files)
+{
+  GHashTable *stamps;
+  GHashTable *indexed;
+  GHashTable *matches;
+  GHashTableIter iter;
+  GPtrArray *pending;
+  GRegex *regex;
+  gpointer path;
+  gchar *markup_text;
+  GList *l;
+
+  /* Files hold the text escaped, and so does the index */
+  markup_text = g_markup_escape_text (text, -1);
+
+  if (g_utf8_strlen (markup_text, -1) < TPL_LOG_SEARCH_INDEX_MIN_TEXT_LEN)
+    {
+      g_free (markup_text);
+      return files;
+    }
+
+  stamps = _tpl_log_search_index_dup_stamps (index,
+      dir != NULL ? dir : log_store_xml_get_basedir (self));
+  indexed = g_hash_table_new (g_str_hash, g_str_equal);
+  pending = g_ptr_array_new_with_free_func (
+      log_store_xml_search_index_file_free);
+
+  for (l = files; l != NULL; l = g_list_next (l))
+    {
+      TplLogSearchIndexStamp *stamp;
+      gchar *filename = l->data;
+      struct stat st;
+
+      if (g_cancellable_is_cancelled (cancellable))
+        goto out;
+
+      stamp = g_hash_table_lookup (stamps, filename);
+
+      if (g_stat (filename, &st) != 0)
+        {
+          /* Gone since it was listed */
+        }
+      else if (stamp != NULL
+          && stamp->inode == (gint64) st.st_ino
+          && stamp->size == (gint64) st.st_size
+          && stamp->mtime == (gint64) st.st_mtime)
+        {
+          if (stamp->indexed)
+            g_hash_table_insert (indexed, filename, filename);
+        }
+      else
+        {
+          TplLogSearchIndexFile *file = g_slice_new (TplLogSearchIndexFile);
+
+          log_store_xml_search_index_read_file (filename, &st, file);
+          g_ptr_array_add (pending, file);
+
+          if (pending->len >= SEARCH_INDEX_BATCH_FILES)
+            log_store_xml_search_index_flush (index, pending, indexed);
+        }
+
+      g_hash_table_remove (stamps, filename);
+    }
+
+  log_store_xml_search_index_flush (index, pending, indexed);
+
+  /* What is left wasn't listed: forget it if it was deleted, or if it should
+   * have been listed. The files of other types or dates stay indexed. */
+  regex = log_store_xml_create_filename_regex (type_mask);
+
+  g_hash_table_iter_init (&iter, stamps);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    {
+      gchar *basename = g_path_get_basename (path);
+      struct stat st;
+
+      if (g_stat (path, &st) != 0
+          || (regex != NULL
+              && g_regex_match (regex, basename, 0, NULL)
+              && log_store_xml_scope_has_filename (scope, basename)))
+        _tpl_log_search_index_remove_file (index, path);
+
+      g_free (basename);
+    }
+
+  if (regex != NULL)
+    g_regex_unref (regex);
+
+  matches = _tpl_log_search_index_match (index, markup_text);
+
+  if (matches != NULL)
+    {
+      l = files;
+      while (l != NULL)
+        {
+          GList *next = g_list_next (l);
+
+          if (g_hash_table_lookup (indexed, l->data) != NULL
+              && g_hash_table_lookup (matches, l->data) == NULL)
+            {
+              g_free (l->data);
+              files = g_list_delete_link (files, l);
+            }
+
+          l = next;
+        }
+
+      g_hash_table_unref (matches);
+    }
+
+ out:
+  g_ptr_array_unref (pending);
+  g_hash_table_unref (indexed);
+  g_hash_table_unref (stamps);
+  g_free (markup_text);
+
+  return files;
+}
+
+
+/* Returns: (transfer full) (element-type utf8): the files within @scope
+ * to search for @text */
+static GList *
+log_store_xml_get_search_files (TplLogStoreXml *self,
+    const gchar *text,
+    gint type_mask,
+    const TplLogSearchScope *scope,
+    GCancellable *cancellable)
+{
+  TplLogSearchIndex *index;
+  GList *files;
+  gchar *dir = NULL;
+
+  if (scope != NULL && scope->account != NULL)
+    dir = log_store_xml_get_dir (self, scope->account, scope->target);
+
+  files = log_store_xml_get_all_files (self, dir, type_mask, scope);
+  DEBUG ("Found %d log files in %s", g_list_length (files),
+      dir != NULL ? dir : "total");
+
+  index = log_store_xml_get_search_index (self);
+  if (index != NULL)
+    {
+      files = log_store_xml_search_index_filter (self, index, text, dir,
+          type_mask, scope, cancellable, files);
+      DEBUG ("%d of them may contain '%s'", g_list_length (files), text);
+    }
+
+  g_free (dir);
+
+  return files;
+}
+
+
 static GList *
 log_store_xml_search_new (TplLogStore *store,
     const gchar *text,
     gint type_mask)
 {
   TplLogStoreXml *self = (TplLogStoreXml *) store;
-  GList *files;
 
   g_return_val_if_fail (TPL_IS_LOG_STORE_XML (self), NULL);
   g_return_val_if_fail (!TPL_STR_EMPTY (text), NULL);
 
-  files = log_store_xml_get_all_files (self, NULL, type_mask);
-  DEBUG ("Found %d log files in total", g_list_length (files));
+  return _log_store_xml_search_in_files (self, text,
+      log_store_xml_get_search_files (self, text, type_mask, NULL, NULL),
+      type_mask, NULL);
+}
+
+
+static void
+log_store_xml_search (TplLogStore *store,
+    const gchar *text,
+    gint type_mask,
+    const TplLogSearchScope *scope,
+    GCancellable *cancellable,
+    TplLogStoreSearchFunc func,
+    gpointer user_data)
+{
+  TplLogStoreXml *self = (TplLogStoreXml *) store;
+  GList *files;
+
+  g_return_if_fail (TPL_IS_LOG_STORE_XML (self));
+  g_return_if_fail (!TPL_STR_EMPTY (text));
+
+  files = log_store_xml_get_search_files (self, text, type_mask, scope,
+      cancellable);
+
+  log_store_xml_search_files (self, text, files, type_mask, cancellable,
+      func, user_data);
 
-  return _log_store_xml_search_in_files (self, text, files, type_mask);
+  g_list_free_full (files, g_free);
 }
 
 
@@ -1777,6 +4227,95 @@ log_store_xml_set_basedir (TplLogStoreXml *self,
 }
 
 
+/* Collects, oldest first, the newest @num_events events of @date that pass
+ * @filter, reading the day files backwards so that the cost depends on
+ * @num_events rather than on how busy the day was. Returns FALSE if the files
+ * have to be parsed in full instead. */
+static gboolean
+log_store_xml_get_newest_events_for_date (TplLogStoreXml *self,
+    TpAccount *account,
+    TplEntity *target,
+    gint type_mask,
+    const GDate *date,
+    guint num_events,
+    TplLogEventFilter filter,
+    gpointer user_data,
+    GList **events,
+    guint *found)
+{
+  TailReader text, call;
+  gchar *text_file = NULL;
+  gchar *call_file = NULL;
+  GList *result = NULL;
+  guint n = 0;
+  gboolean ok;
+
+  if (type_mask & TPL_EVENT_MASK_TEXT)
+    text_file = log_store_xml_get_filename_for_date (self, account, target,
+        date, TPL_TYPE_TEXT_EVENT);
+
+  if (type_mask & TPL_EVENT_MASK_CALL)
+    call_file = log_store_xml_get_filename_for_date (self, account, target,
+        date, TPL_TYPE_CALL_EVENT);
+
+  ok = tail_reader_init (&text, text_file, TPL_TYPE_TEXT_EVENT, account);
+  ok = tail_reader_init (&call, call_file, TPL_TYPE_CALL_EVENT, account)
+    && ok;
+
+  while (ok && n < num_events)
+    {
+      TplEvent *text_event;
+      TplEvent *call_event;
+      TplEvent *event;
+
+      if (!tail_reader_peek (&text, &text_event)
+          || !tail_reader_peek (&call, &call_event))
+        {
+          ok = FALSE;
+          break;
+        }
+
+      if (text_event == NULL && call_event == NULL)
+        break;
+
+      /* Call events sort after text events with the same timestamp */
+      if (call_event != NULL
+          && (text_event == NULL
+              || tpl_event_get_timestamp (call_event) >=
+                  tpl_event_get_timestamp (text_event)))
+        event = tail_reader_take (&call);
+      else
+        event = tail_reader_take (&text);
+
+      if (filter == NULL || filter (event, user_data))
+        {
+          result = g_list_prepend (result, event);
+          n++;
+        }
+      else
+        {
+          g_object_unref (event);
+        }
+    }
+
+  tail_reader_clear (&text);
+  tail_reader_clear (&call);
+  g_free (text_file);
+  g_free (call_file);
+
+  if (!ok)
+    {
+      g_list_free_full (result, g_object_unref);
+      return FALSE;
+    }
+
+  *events = result;
+  *found = n;
+
+  return TRUE;
+}
+
+
 static GList *
 log_store_xml_get_filtered_events (TplLogStore *store,
     TpAccount *account,
@@ -1800,9 +4339,17 @@ log_store_xml_get_filtered_events (TplLogStore *store,
        l = g_list_previous (l))
     {
       GList *new_events, *n;
+      guint found;
+
+      if (log_store_xml_get_newest_events_for_date (self, account, target,
+              type_mask, l->data, num_events - i, filter, user_data,
+              &new_events, &found))
+        {
+          events = g_list_concat (new_events, events);
+          i += found;
+          continue;
+        }
 
-      /* FIXME: We should really restrict the event parsing to get only
-       * the newest num_events. */
       new_events = log_store_xml_get_events_for_date (store, account,
           target, type_mask, l->data);
 
@@ -1838,7 +4385,17 @@ log_store_xml_clear (TplLogStore *store)
 
   DEBUG ("Clear all logs from XML store in: %s", basedir);
 
+  g_mutex_lock (&self->priv->open_files_lock);
+  log_store_xml_close_all_files (self);
   _tpl_rmdir_recursively (basedir);
+  g_mutex_unlock (&self->priv->open_files_lock);
+  log_store_xml_cache_clear (self);
+  log_store_xml_date_index_clear (self);
+
+  g_mutex_lock (&self->priv->search_index_lock);
+  if (self->priv->search_index != NULL)
+    _tpl_log_search_index_clear (self->priv->search_index);
+  g_mutex_unlock (&self->priv->search_index_lock);
 }
 
 
@@ -1855,7 +4412,12 @@ log_store_xml_clear_account (TplLogStore *store,
     {
       DEBUG ("Clear account logs from XML store in: %s",
           account_dir);
+      g_mutex_lock (&self->priv->open_files_lock);
+      log_store_xml_close_all_files (self);
       _tpl_rmdir_recursively (account_dir);
+      g_mutex_unlock (&self->priv->open_files_lock);
+      log_store_xml_cache_clear (self);
+      log_store_xml_date_index_clear (self);
       g_free (account_dir);
     }
   else
@@ -1879,7 +4441,12 @@ log_store_xml_clear_entity (TplLogStore *store,
       DEBUG ("Clear entity logs from XML store in: %s",
           entity_dir);
 
+      g_mutex_lock (&self->priv->open_files_lock);
+      log_store_xml_close_all_files (self);
       _tpl_rmdir_recursively (entity_dir);
+      g_mutex_unlock (&self->priv->open_files_lock);
+      log_store_xml_cache_clear (self);
+      log_store_xml_date_index_clear (self);
       g_free (entity_dir);
     }
   else
@@ -1912,10 +4479,12 @@ log_store_iface_init (gpointer g_iface,
   iface->get_name = log_store_xml_get_name;
   iface->exists = log_store_xml_exists;
   iface->add_event = log_store_xml_add_event;
+  iface->add_events = log_store_xml_add_events;
   iface->get_dates = log_store_xml_get_dates;
   iface->get_events_for_date = log_store_xml_get_events_for_date;
   iface->get_entities = log_store_xml_get_entities;
   iface->search_new = log_store_xml_search_new;
+  iface->search = log_store_xml_search;
   iface->get_filtered_events = log_store_xml_get_filtered_events;
   iface->clear = log_store_xml_clear;
   iface->clear_account = log_store_xml_clear_account;
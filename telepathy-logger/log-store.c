@@ -22,6 +22,7 @@
 #include "config.h"
 
 #include <telepathy-logger/log-store-internal.h>
+#include <telepathy-logger/log-manager-internal.h>
 
 #define DEBUG_FLAG TPL_DEBUG_LOG_STORE
 #include <telepathy-logger/debug-internal.h>
@@ -142,6 +143,55 @@ _tpl_log_store_add_event (TplLogStore *self,
 }
 
 
+/**
+ * _tpl_log_store_add_events:
+ * @self: a TplLogStore
+ * @events: a list of #TplEvent, in the order they have to be stored
+ * @error: memory location used if an error occurs
+ *
+ * Sends all of @events to the LogStore @self, letting it store them in a
+ * single pass if it knows how to. Stores without a batch implementation get
+ * the events one by one through add_event().
+ *
+ * An event failing to be stored does not prevent the following ones from
+ * being stored; @error describes the first failure.
+ *
+ * Returns: %TRUE if all events were stored, %FALSE with @error set otherwise
+ */
+gboolean
+_tpl_log_store_add_events (TplLogStore *self,
+    GList *events,
+    GError **error)
+{
+  gboolean retval = TRUE;
+  GList *l;
+
+  g_return_val_if_fail (TPL_IS_LOG_STORE (self), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (TPL_LOG_STORE_GET_INTERFACE (self)->add_events != NULL)
+    return TPL_LOG_STORE_GET_INTERFACE (self)->add_events (self, events,
+        error);
+
+  for (l = events; l != NULL; l = g_list_next (l))
+    {
+      GError *loc_error = NULL;
+
+      if (!_tpl_log_store_add_event (self, l->data, &loc_error))
+        {
+          if (retval)
+            g_propagate_error (error, loc_error);
+          else
+            g_error_free (loc_error);
+
+          retval = FALSE;
+        }
+    }
+
+  return retval;
+}
+
+
 /**
  * _tpl_log_store_get_dates:
  * @self: a TplLogStore
@@ -266,6 +316,114 @@ _tpl_log_store_search_new (TplLogStore *self,
 }
 
 
+/* Whether @scope covers @date; a NULL @scope covers everything */
+gboolean
+_tpl_log_search_scope_has_date (const TplLogSearchScope *scope,
+    const GDate *date)
+{
+  if (scope == NULL)
+    return TRUE;
+
+  if (scope->from != NULL && g_date_compare (date, scope->from) < 0)
+    return FALSE;
+
+  if (scope->to != NULL && g_date_compare (date, scope->to) > 0)
+    return FALSE;
+
+  return TRUE;
+}
+
+
+gboolean
+_tpl_log_search_scope_has_hit (const TplLogSearchScope *scope,
+    TplLogSearchHit *hit)
+{
+  if (scope == NULL)
+    return TRUE;
+
+  if (scope->account != NULL)
+    {
+      if (hit->account == NULL
+          || tp_strdiff (tp_proxy_get_object_path (hit->account),
+              tp_proxy_get_object_path (scope->account)))
+        return FALSE;
+
+      if (scope->target != NULL
+          && (hit->target == NULL
+            || tp_strdiff (tpl_entity_get_identifier (hit->target),
+                tpl_entity_get_identifier (scope->target))))
+        return FALSE;
+    }
+
+  /* Hits without a date are only out of scope when dates are */
+  if (scope->from == NULL && scope->to == NULL)
+    return TRUE;
+
+  return hit->date != NULL && _tpl_log_search_scope_has_date (scope, hit->date);
+}
+
+
+/**
+ * _tpl_log_store_search:
+ * @self: a TplLogStore
+ * @text: a text to be searched among text messages
+ * @type_mask: event type mask see #TplEventTypeMask
+ * @scope: (allow-none): the logs to search, or %NULL to search them all
+ * @cancellable: (allow-none): a #GCancellable, or %NULL
+ * @func: function to pass the hits to
+ * @user_data: data to pass to @func
+ *
+ * Searches like _tpl_log_store_search_new () does, but hands hits over to
+ * @func as they are found instead of returning them all at the end. The
+ * search stops early when @func returns %FALSE or @cancellable is cancelled.
+ * Stores that can't search this way pass all their hits within @scope to
+ * @func at once.
+ */
+void
+_tpl_log_store_search (TplLogStore *self,
+    const gchar *text,
+    gint type_mask,
+    const TplLogSearchScope *scope,
+    GCancellable *cancellable,
+    TplLogStoreSearchFunc func,
+    gpointer user_data)
+{
+  GList *hits, *l;
+
+  g_return_if_fail (TPL_IS_LOG_STORE (self));
+  g_return_if_fail (func != NULL);
+
+  if (TPL_LOG_STORE_GET_INTERFACE (self)->search != NULL)
+    {
+      TPL_LOG_STORE_GET_INTERFACE (self)->search (self, text, type_mask,
+          scope, cancellable, func, user_data);
+      return;
+    }
+
+  if (g_cancellable_is_cancelled (cancellable))
+    return;
+
+  hits = _tpl_log_store_search_new (self, text, type_mask);
+
+  l = hits;
+  while (l != NULL)
+    {
+      GList *next = g_list_next (l);
+
+      if (!_tpl_log_search_scope_has_hit (scope, l->data))
+        {
+          _tpl_log_manager_search_hit_free (l->data);
+          hits = g_list_delete_link (hits, l);
+        }
+
+      l = next;
+    }
+
+  if (hits != NULL)
+    func (hits, user_data);
+}
+
+
 /**
  * _tpl_log_store_get_filtered_events:
  * @self: a TplLogStore
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TPL_LOG_WRITE_QUEUE_H__
+#define __TPL_LOG_WRITE_QUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  /* the caller writes synchronously, nothing is queued */
+  TPL_LOG_FLUSH_IMMEDIATE,
+  /* write no later than 'limit' milliseconds after an item was queued */
+  TPL_LOG_FLUSH_LATENCY,
+  /* write as soon as 'limit' items are queued */
+  TPL_LOG_FLUSH_BATCH,
+  /* write only when explicitly flushed */
+  TPL_LOG_FLUSH_EXPLICIT
+} TplLogFlushPolicy;
+
+typedef struct _TplLogWriteQueue TplLogWriteQueue;
+
+/* Called from the writer thread with every item taken from the queue in
+ * one go, in the order they were pushed. The queue keeps ownership of the
+ * list and of the items. */
+typedef void (*TplLogWriteQueueFunc) (GList *items, gpointer user_data);
+
+TplLogWriteQueue * _tpl_log_write_queue_new (TplLogWriteQueueFunc func,
+    gpointer user_data,
+    GDestroyNotify item_free);
+
+void _tpl_log_write_queue_free (TplLogWriteQueue *self);
+
+void _tpl_log_write_queue_set_policy (TplLogWriteQueue *self,
+    TplLogFlushPolicy policy,
+    guint limit);
+
+void _tpl_log_write_queue_push (TplLogWriteQueue *self,
+    gpointer item);
+
+void _tpl_log_write_queue_flush (TplLogWriteQueue *self);
+
+void _tpl_log_write_queue_wait (TplLogWriteQueue *self);
+
+G_END_DECLS
+
+#endif /* __TPL_LOG_WRITE_QUEUE_H__ */
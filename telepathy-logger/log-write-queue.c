@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2013 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#include "log-write-queue-internal.h"
+
+#define DEBUG_FLAG TPL_DEBUG_LOG_MANAGER
+#include "debug-internal.h"
+
+typedef struct _TplLogWriteNode TplLogWriteNode;
+
+struct _TplLogWriteNode
+{
+  TplLogWriteNode *next;
+  gpointer item;
+};
+
+struct _TplLogWriteQueue
+{
+  /* Stack of pushed nodes, newest first. Producers push with a
+   * compare-and-exchange on the head and never pop; the writer detaches the
+   * whole stack at once, so there is no ABA problem. */
+  gpointer head;
+  /* Number of items ever pushed, bumped before the node is linked in */
+  gint pushed;
+
+  TplLogWriteQueueFunc func;
+  gpointer user_data;
+  GDestroyNotify item_free;
+  GThread *thread;
+
+  /* Only used to sleep and to wait for flushes, never on the push fast
+   * path. Protects everything below. */
+  GMutex mutex;
+  GCond wakeup;
+  GCond written_cond;
+  /* items detached from the stack (also read by producers without the
+   * mutex) and items already handed to func */
+  gint taken;
+  gint written;
+  /* when the stack last went from empty to non-empty */
+  gint64 first_pending;
+  guint flush_requests;
+  gboolean stopping;
+  TplLogFlushPolicy policy;
+  guint limit;
+};
+
+
+/* counters are allowed to wrap around */
+static gboolean
+counter_reached (gint counter,
+    gint target)
+{
+  return (gint) ((guint) counter - (guint) target) >= 0;
+}
+
+
+static gboolean
+log_write_queue_has_pending (TplLogWriteQueue *self)
+{
+  return g_atomic_pointer_get (&self->head) != NULL;
+}
+
+
+/* Called with the mutex held, returns when there is something to write or
+ * when the writer has to stop */
+static void
+log_write_queue_wait (TplLogWriteQueue *self)
+{
+  for (;;)
+    {
+      gint64 deadline;
+
+      if (self->stopping)
+        return;
+
+      if (!log_write_queue_has_pending (self))
+        {
+          g_cond_wait (&self->wakeup, &self->mutex);
+          continue;
+        }
+
+      if (self->flush_requests > 0)
+        return;
+
+      switch (self->policy)
+        {
+          case TPL_LOG_FLUSH_LATENCY:
+            deadline = self->first_pending
+              + self->limit * G_TIME_SPAN_MILLISECOND;
+
+            if (self->limit == 0 || g_get_monotonic_time () >= deadline)
+              return;
+
+            g_cond_wait_until (&self->wakeup, &self->mutex, deadline);
+            break;
+
+          case TPL_LOG_FLUSH_BATCH:
+            if (counter_reached (g_atomic_int_get (&self->pushed),
+                  self->taken + (gint) self->limit))
+              return;
+
+            g_cond_wait (&self->wakeup, &self->mutex);
+            break;
+
+          case TPL_LOG_FLUSH_EXPLICIT:
+            g_cond_wait (&self->wakeup, &self->mutex);
+            break;
+
+          case TPL_LOG_FLUSH_IMMEDIATE:
+          default:
+            return;
+        }
+    }
+}
+
+
+/* Detach the whole stack and return its items in push order */
+static GList *
+log_write_queue_take_all (TplLogWriteQueue *self,
+    gint *n_items)
+{
+  TplLogWriteNode *node;
+  GList *items = NULL;
+
+  do
+    node = g_atomic_pointer_get (&self->head);
+  while (!g_atomic_pointer_compare_and_exchange (&self->head, node, NULL));
+
+  *n_items = 0;
+
+  /* the stack is newest first, prepending reverses it */
+  while (node != NULL)
+    {
+      TplLogWriteNode *next = node->next;
+
+      items = g_list_prepend (items, node->item);
+      g_slice_free (TplLogWriteNode, node);
+      (*n_items)++;
+      node = next;
+    }
+
+  return items;
+}
+
+
+static gpointer
+log_write_queue_thread (gpointer data)
+{
+  TplLogWriteQueue *self = data;
+
+  g_mutex_lock (&self->mutex);
+
+  for (;;)
+    {
+      GList *items;
+      gint n_items;
+
+      log_write_queue_wait (self);
+
+      if (self->stopping && !log_write_queue_has_pending (self))
+        break;
+
+      items = log_write_queue_take_all (self, &n_items);
+      g_atomic_int_add (&self->taken, n_items);
+
+      g_mutex_unlock (&self->mutex);
+
+      DEBUG ("writing %d queued items", n_items);
+
+      self->func (items, self->user_data);
+
+      if (self->item_free != NULL)
+        g_list_foreach (items, (GFunc) self->item_free, NULL);
+      g_list_free (items);
+
+      g_mutex_lock (&self->mutex);
+
+      self->written += n_items;
+      g_cond_broadcast (&self->written_cond);
+    }
+
+  g_mutex_unlock (&self->mutex);
+
+  return NULL;
+}
+
+
+TplLogWriteQueue *
+_tpl_log_write_queue_new (TplLogWriteQueueFunc func,
+    gpointer user_data,
+    GDestroyNotify item_free)
+{
+  TplLogWriteQueue *self;
+
+  g_return_val_if_fail (func != NULL, NULL);
+
+  self = g_slice_new0 (TplLogWriteQueue);
+  self->func = func;
+  self->user_data = user_data;
+  self->item_free = item_free;
+  self->policy = TPL_LOG_FLUSH_LATENCY;
+
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->wakeup);
+  g_cond_init (&self->written_cond);
+
+  self->thread = g_thread_new ("tpl-log-writer", log_write_queue_thread,
+      self);
+
+  return self;
+}
+
+
+/* Writes everything still queued, then stops the writer thread */
+void
+_tpl_log_write_queue_free (TplLogWriteQueue *self)
+{
+  g_return_if_fail (self != NULL);
+
+  g_mutex_lock (&self->mutex);
+  self->stopping = TRUE;
+  g_cond_signal (&self->wakeup);
+  g_mutex_unlock (&self->mutex);
+
+  g_thread_join (self->thread);
+
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->wakeup);
+  g_cond_clear (&self->written_cond);
+
+  g_slice_free (TplLogWriteQueue, self);
+}
+
+
+void
+_tpl_log_write_queue_set_policy (TplLogWriteQueue *self,
+    TplLogFlushPolicy policy,
+    guint limit)
+{
+  g_return_if_fail (self != NULL);
+
+  g_mutex_lock (&self->mutex);
+  g_atomic_int_set ((gint *) &self->policy, policy);
+  self->limit = limit;
+  g_cond_signal (&self->wakeup);
+  g_mutex_unlock (&self->mutex);
+
+  /* nothing must stay behind once writes go straight to the stores */
+  if (policy == TPL_LOG_FLUSH_IMMEDIATE)
+    _tpl_log_write_queue_flush (self);
+}
+
+
+/* Takes ownership of @item. Safe to call from any thread. */
+void
+_tpl_log_write_queue_push (TplLogWriteQueue *self,
+    gpointer item)
+{
+  TplLogWriteNode *node;
+  TplLogWriteNode *old_head;
+  gboolean wake;
+  gint pushed;
+
+  g_return_if_fail (self != NULL);
+
+  node = g_slice_new (TplLogWriteNode);
+  node->item = item;
+
+  pushed = g_atomic_int_add (&self->pushed, 1) + 1;
+
+  /* node belongs to the writer as soon as it is linked in, don't touch it
+   * afterwards */
+  do
+    {
+      old_head = g_atomic_pointer_get (&self->head);
+      node->next = old_head;
+    }
+  while (!g_atomic_pointer_compare_and_exchange (&self->head, old_head,
+        node));
+
+  /* The writer only needs waking when the queue was empty (it goes through
+   * log_write_queue_wait() before sleeping again) or when a batch is
+   * complete. */
+  wake = (old_head == NULL);
+
+  if (!wake &&
+      g_atomic_int_get ((gint *) &self->policy) == TPL_LOG_FLUSH_BATCH)
+    wake = counter_reached (pushed,
+        g_atomic_int_get (&self->taken) + (gint) self->limit);
+
+  if (wake)
+    {
+      g_mutex_lock (&self->mutex);
+      if (old_head == NULL)
+        self->first_pending = g_get_monotonic_time ();
+      g_cond_signal (&self->wakeup);
+      g_mutex_unlock (&self->mutex);
+    }
+}
+
+
+static void
+log_write_queue_wait_written (TplLogWriteQueue *self,
+    gboolean flush)
+{
+  gint target;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (g_thread_self () != self->thread);
+
+  target = g_atomic_int_get (&self->pushed);
+
+  g_mutex_lock (&self->mutex);
+
+  if (!counter_reached (self->written, target))
+    {
+      if (flush)
+        {
+          self->flush_requests++;
+          g_cond_signal (&self->wakeup);
+        }
+
+      while (!counter_reached (self->written, target))
+        g_cond_wait (&self->written_cond, &self->mutex);
+
+      if (flush)
+        self->flush_requests--;
+    }
+
+  g_mutex_unlock (&self->mutex);
+}
+
+
+/* Blocks until every item pushed before the call has been written. Must not
+ * be called from the writer thread. */
+void
+_tpl_log_write_queue_flush (TplLogWriteQueue *self)
+{
+  log_write_queue_wait_written (self, TRUE);
+}
+
+
+/* Like _tpl_log_write_queue_flush(), but leaves it to the policy to decide
+ * when the items are written: with %TPL_LOG_FLUSH_EXPLICIT, or an incomplete
+ * batch, it only returns once something else flushes them. */
+void
+_tpl_log_write_queue_wait (TplLogWriteQueue *self)
+{
+  log_write_queue_wait_written (self, FALSE);
+}
@@ -38,4 +38,17 @@ GList *_tpl_event_queue_insert_sorted_after (GQueue *events,
     GList *index,
     TplEvent *event);
 
+gint _tpl_event_compare_timestamps (gconstpointer a,
+    gconstpointer b);
+
+gboolean _tpl_str_is_ascii (const gchar *str);
+
+const gchar *_tpl_ascii_strcasestr_len (const gchar *haystack,
+    gsize haystack_len,
+    const gchar *needle,
+    gsize needle_len);
+
+gboolean _tpl_utf8_has_ascii_case_folds (const gchar *str,
+    gsize len);
+
 #endif // __TPL_UTIL_H__
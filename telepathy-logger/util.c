@@ -25,6 +25,7 @@
 #include "util-internal.h"
 
 #include <errno.h>
+#include <string.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 
@@ -133,3 +134,200 @@ _tpl_event_queue_insert_sorted_after (GQueue *events,
   g_queue_insert_after (events, index, event);
   return g_list_next (index);
 }
+
+
+/* A GCompareFunc ordering TplEvents oldest first */
+gint
+_tpl_event_compare_timestamps (gconstpointer a,
+    gconstpointer b)
+{
+  gint64 ts_a = tpl_event_get_timestamp (TPL_EVENT (a));
+  gint64 ts_b = tpl_event_get_timestamp (TPL_EVENT (b));
+
+  return (ts_a > ts_b) - (ts_a < ts_b);
+}
+
+
+gboolean
+_tpl_str_is_ascii (const gchar *str)
+{
+  for (; *str != '\0'; str++)
+    {
+      if ((guchar) *str >= 0x80)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/* Helpers to look at 8 bytes at a time */
+#define BYTES_ONES  G_GUINT64_CONSTANT (0x0101010101010101)
+#define BYTES_HIGHS G_GUINT64_CONSTANT (0x8080808080808080)
+#define BYTES_HAVE_ZERO(x) ((((x) - BYTES_ONES) & ~(x) & BYTES_HIGHS) != 0)
+
+/* Returns the first byte in [start, end) that is @c, or its upper case
+ * version if @c is a lower case ASCII letter, or NULL */
+static const gchar *
+ascii_find_byte_nocase (const gchar *start,
+    const gchar *end,
+    guchar c)
+{
+  const gchar *p = start;
+  guint64 pattern, mask;
+
+  if (!g_ascii_islower (c))
+    return memchr (start, c, end - start);
+
+  /* Setting 0x20 turns upper case letters into lower case ones, and only
+   * those end up equal to a lower case letter that way */
+  pattern = BYTES_ONES * c;
+  mask = BYTES_ONES * 0x20;
+
+  while (p + sizeof (guint64) <= end)
+    {
+      guint64 word;
+
+      memcpy (&word, p, sizeof (word));
+
+      if (BYTES_HAVE_ZERO ((word | mask) ^ pattern))
+        break;
+
+      p += sizeof (word);
+    }
+
+  for (; p < end; p++)
+    {
+      if ((*p | 0x20) == c)
+        return p;
+    }
+
+  return NULL;
+}
+
+
+/* Finds the first occurrence of @needle in @haystack, ignoring the case of
+ * ASCII letters only. @haystack doesn't have to be nul-terminated. */
+const gchar *
+_tpl_ascii_strcasestr_len (const gchar *haystack,
+    gsize haystack_len,
+    const gchar *needle,
+    gsize needle_len)
+{
+  const gchar *p, *end;
+  guchar first;
+
+  if (needle_len == 0)
+    return haystack;
+
+  if (needle_len > haystack_len)
+    return NULL;
+
+  /* where the last possible match starts, plus one */
+  end = haystack + haystack_len - needle_len + 1;
+  first = g_ascii_tolower (needle[0]);
+
+  for (p = haystack; p < end; p++)
+    {
+      gsize i;
+
+      p = ascii_find_byte_nocase (p, end, first);
+      if (p == NULL)
+        break;
+
+      for (i = 1; i < needle_len; i++)
+        {
+          if (g_ascii_tolower (p[i]) != g_ascii_tolower (needle[i]))
+            break;
+        }
+
+      if (i == needle_len)
+        return p;
+    }
+
+  return NULL;
+}
+
+
+/* Whether the UTF-8 @str contains characters that match ASCII letters once
+ * case is ignored, like U+212A KELVIN SIGN or U+00DF LATIN SMALL LETTER SHARP
+ * S (which folds to "ss"). _tpl_ascii_strcasestr_len () can't find those, so
+ * it can only rule a case insensitive match out when there are none. */
+gboolean
+_tpl_utf8_has_ascii_case_folds (const gchar *str,
+    gsize len)
+{
+  const guchar *p = (const guchar *) str;
+  const guchar *end = p + len;
+
+  while (p < end)
+    {
+      guint64 word;
+
+      /* skip plain ASCII quickly */
+      if (p + sizeof (guint64) <= end)
+        {
+          memcpy (&word, p, sizeof (word));
+
+          if ((word & BYTES_HIGHS) == 0)
+            {
+              p += sizeof (word);
+              continue;
+            }
+        }
+
+      if (*p < 0xc3 || p + 1 >= end)
+        {
+          p++;
+          continue;
+        }
+
+      switch (*p)
+        {
+          case 0xc3:
+            /* U+00DF LATIN SMALL LETTER SHARP S */
+            if (p[1] == 0x9f)
+              return TRUE;
+            break;
+          case 0xc4:
+            /* U+0130 and U+0131, the dotted and dotless I */
+            if (p[1] == 0xb0 || p[1] == 0xb1)
+              return TRUE;
+            break;
+          case 0xc5:
+            /* U+0149 LATIN SMALL LETTER N PRECEDED BY APOSTROPHE and
+             * U+017F LATIN SMALL LETTER LONG S */
+            if (p[1] == 0x89 || p[1] == 0xbf)
+              return TRUE;
+            break;
+          case 0xc7:
+            /* U+01F0 LATIN SMALL LETTER J WITH CARON */
+            if (p[1] == 0xb0)
+              return TRUE;
+            break;
+          case 0xe1:
+            /* U+1E96 to U+1E9A, H, T, W, Y and A with diacritics, and
+             * U+1E9E LATIN CAPITAL LETTER SHARP S */
+            if (p + 2 < end && p[1] == 0xba &&
+                ((p[2] >= 0x96 && p[2] <= 0x9a) || p[2] == 0x9e))
+              return TRUE;
+            break;
+          case 0xe2:
+            /* U+212A KELVIN SIGN */
+            if (p + 2 < end && p[1] == 0x84 && p[2] == 0xaa)
+              return TRUE;
+            break;
+          case 0xef:
+            /* U+FB00 to U+FB06, the Latin ligatures */
+            if (p + 2 < end && p[1] == 0xac && p[2] >= 0x80 && p[2] <= 0x86)
+              return TRUE;
+            break;
+          default:
+            break;
+        }
+
+      p++;
+    }
+
+  return FALSE;
+}
@@ -151,6 +151,34 @@ test_entity_instantiation_from_tp_contact (void)
   g_object_unref (client_connection);
 }
 
+static void
+test_entity_hash (void)
+{
+  TplEntity *contact, *same, *room;
+  GHashTable *set;
+
+  contact = tpl_entity_new ("my-identifier", TPL_ENTITY_CONTACT,
+      "my-alias", "my-token");
+  same = tpl_entity_new ("my-identifier", TPL_ENTITY_CONTACT, NULL, NULL);
+  room = tpl_entity_new_from_room_id ("my-identifier");
+
+  g_assert (_tpl_entity_equal (contact, same));
+  g_assert_cmpuint (_tpl_entity_hash (contact), ==, _tpl_entity_hash (same));
+  g_assert (!_tpl_entity_equal (contact, room));
+
+  set = g_hash_table_new (_tpl_entity_hash, _tpl_entity_equal);
+  g_hash_table_add (set, contact);
+  g_hash_table_add (set, room);
+
+  g_assert (g_hash_table_contains (set, same));
+  g_assert_cmpuint (g_hash_table_size (set), ==, 2);
+
+  g_hash_table_unref (set);
+  g_object_unref (contact);
+  g_object_unref (same);
+  g_object_unref (room);
+}
+
 int main (int argc,
     char **argv)
 {
@@ -167,5 +195,8 @@ int main (int argc,
   g_test_add_func ("/entity/instantiation-from-tp-contact",
       test_entity_instantiation_from_tp_contact);
 
+  g_test_add_func ("/entity/hash",
+      test_entity_hash);
+
   return g_test_run ();
 }
@@ -310,6 +310,17 @@ get_dates_async_cb (GObject *object,
   g_main_loop_quit (fixture->main_loop);
 }
 
+static void
+assert_events_sorted (GList *events)
+{
+  GList *l;
+
+  for (l = events; l != NULL && l->next != NULL; l = g_list_next (l))
+    g_assert_cmpint (tpl_event_get_timestamp (l->data), <=,
+        tpl_event_get_timestamp (l->next->data));
+}
+
+
 static void
 test_get_dates (TestCaseFixture *fixture,
     gconstpointer user_data)
@@ -332,10 +343,9 @@ test_get_dates (TestCaseFixture *fixture,
   g_assert_cmpint (g_list_length (fixture->ret), ==, 6);
 
   /* we do not want duplicates, dates are suppose to be ordered */
-  fixture->ret = g_list_sort (fixture->ret, (GCompareFunc) g_date_compare);
   for (loc = fixture->ret; loc != NULL; loc = g_list_next (loc))
     if (loc->next)
-      g_assert (g_date_compare (loc->data, loc->next->data) != 0);
+      g_assert (g_date_compare (loc->data, loc->next->data) < 0);
 
   g_list_foreach (fixture->ret, (GFunc) g_date_free, NULL);
   g_list_free (fixture->ret);
@@ -358,6 +368,210 @@ get_events_for_date_cb (GObject *object,
 }
 
 
+typedef struct
+{
+  TestCaseFixture *fixture;
+
+  GMutex lock;
+  GCond cond;
+  gboolean blocking;
+  gboolean released;
+  /* the names of the jobs, in the order they ran */
+  GList *ran;
+  /* the names of the jobs which failed as cancelled */
+  GList *cancelled;
+  guint n_jobs;
+  guint n_completed;
+} AsyncPoolData;
+
+
+/* Keeps the worker busy until released */
+static void
+async_pool_block (GSimpleAsyncResult *result,
+    GObject *object,
+    GCancellable *cancellable)
+{
+  AsyncPoolData *data = g_simple_async_result_get_op_res_gpointer (result);
+
+  g_mutex_lock (&data->lock);
+
+  data->blocking = TRUE;
+  g_cond_broadcast (&data->cond);
+
+  while (!data->released)
+    g_cond_wait (&data->cond, &data->lock);
+
+  g_mutex_unlock (&data->lock);
+}
+
+
+static void
+async_pool_record (GSimpleAsyncResult *result,
+    GObject *object,
+    GCancellable *cancellable)
+{
+  AsyncPoolData *data = g_simple_async_result_get_op_res_gpointer (result);
+
+  g_mutex_lock (&data->lock);
+  data->ran = g_list_append (data->ran,
+      g_simple_async_result_get_source_tag (result));
+  g_mutex_unlock (&data->lock);
+}
+
+
+static void
+async_pool_cb (GObject *object,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  AsyncPoolData *data = user_data;
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+  GError *error = NULL;
+
+  if (g_simple_async_result_propagate_error (simple, &error))
+    {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+      g_error_free (error);
+
+      data->cancelled = g_list_append (data->cancelled,
+          g_simple_async_result_get_source_tag (simple));
+    }
+
+  if (++data->n_completed == data->n_jobs)
+    g_main_loop_quit (data->fixture->main_loop);
+}
+
+
+static void
+async_pool_push (AsyncPoolData *data,
+    GSimpleAsyncThreadFunc func,
+    const gchar *name,
+    gint priority,
+    GCancellable *cancellable)
+{
+  GSimpleAsyncResult *result;
+
+  result = g_simple_async_result_new (G_OBJECT (data->fixture->manager),
+      async_pool_cb, data, (gpointer) name);
+  g_simple_async_result_set_op_res_gpointer (result, data, NULL);
+
+  log_manager_run_in_pool (data->fixture->manager, result, func, priority,
+      cancellable);
+  data->n_jobs++;
+
+  g_object_unref (result);
+}
+
+
+static void
+test_async_pool (TestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogManagerAsyncStats before, after;
+  AsyncPoolData data = { fixture, };
+  AsyncJob first, second;
+
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  _tpl_log_manager_set_max_async_workers (fixture->manager, 1);
+  _tpl_log_manager_get_async_stats (fixture->manager, &before);
+
+  /* with the only worker busy, the high priority job is queued last but
+   * runs first */
+  async_pool_push (&data, async_pool_block, "block", G_PRIORITY_DEFAULT,
+      NULL);
+
+  g_mutex_lock (&data.lock);
+  while (!data.blocking)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  async_pool_push (&data, async_pool_record, "low", G_PRIORITY_LOW, NULL);
+  async_pool_push (&data, async_pool_record, "high", G_PRIORITY_HIGH, NULL);
+
+  g_mutex_lock (&data.lock);
+  data.released = TRUE;
+  g_cond_broadcast (&data.cond);
+  g_mutex_unlock (&data.lock);
+
+  g_main_loop_run (fixture->main_loop);
+
+  g_assert_cmpuint (g_list_length (data.ran), ==, 2);
+  g_assert_cmpstr (g_list_nth_data (data.ran, 0), ==, "high");
+  g_assert_cmpstr (g_list_nth_data (data.ran, 1), ==, "low");
+  g_assert (data.cancelled == NULL);
+
+  /* queued jobs of the same priority run in order */
+  first.priority = G_PRIORITY_HIGH;
+  first.seq = 2;
+  second.priority = G_PRIORITY_HIGH;
+  second.seq = 3;
+  g_assert_cmpint (async_job_compare (&first, &second, NULL), <, 0);
+  g_assert_cmpint (async_job_compare (&second, &first, NULL), >, 0);
+
+  _tpl_log_manager_get_async_stats (fixture->manager, &after);
+  g_assert_cmpuint (after.completed - before.completed, ==, 3);
+  g_assert_cmpuint (after.queued, ==, 0);
+  g_assert_cmpuint (after.running, ==, 0);
+  g_assert_cmpuint (after.max_queued, >=, 2);
+
+  _tpl_log_manager_set_max_async_workers (fixture->manager,
+      DEFAULT_MAX_ASYNC_WORKERS);
+
+  g_list_free (data.ran);
+  g_cond_clear (&data.cond);
+  g_mutex_clear (&data.lock);
+}
+
+
+static void
+test_async_pool_cancelled (TestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  AsyncPoolData data = { fixture, };
+  GCancellable *cancellable;
+
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  _tpl_log_manager_set_max_async_workers (fixture->manager, 1);
+
+  /* a job cancelled while queued fails without running */
+  async_pool_push (&data, async_pool_block, "block", G_PRIORITY_DEFAULT,
+      NULL);
+
+  g_mutex_lock (&data.lock);
+  while (!data.blocking)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  cancellable = g_cancellable_new ();
+  async_pool_push (&data, async_pool_record, "cancelled", G_PRIORITY_DEFAULT,
+      cancellable);
+  g_cancellable_cancel (cancellable);
+
+  g_mutex_lock (&data.lock);
+  data.released = TRUE;
+  g_cond_broadcast (&data.cond);
+  g_mutex_unlock (&data.lock);
+
+  g_main_loop_run (fixture->main_loop);
+
+  g_assert (data.ran == NULL);
+  g_assert_cmpuint (g_list_length (data.cancelled), ==, 1);
+  g_assert_cmpstr (data.cancelled->data, ==, "cancelled");
+
+  _tpl_log_manager_set_max_async_workers (fixture->manager,
+      DEFAULT_MAX_ASYNC_WORKERS);
+
+  g_object_unref (cancellable);
+  g_list_free (data.cancelled);
+  g_cond_clear (&data.cond);
+  g_mutex_clear (&data.lock);
+}
+
+
 static void
 test_get_events_for_date (TestCaseFixture *fixture,
     gconstpointer user_data)
@@ -383,6 +597,9 @@ test_get_events_for_date (TestCaseFixture *fixture,
   /* We got 6 events in old Empathy and 6 in new TpLogger storage */
   g_assert_cmpint (g_list_length (fixture->ret), ==, 12);
 
+  /* merged from both stores, olders first */
+  assert_events_sorted (fixture->ret);
+
   g_list_foreach (fixture->ret, (GFunc) g_object_unref, NULL);
   g_list_free (fixture->ret);
 }
@@ -424,11 +641,131 @@ test_get_events_for_date_account_unprepared (TestCaseFixture *fixture,
   /* We got 6 events in old Empathy and 6 in new TpLogger storage */
   g_assert_cmpint (g_list_length (fixture->ret), ==, 12);
 
+  /* merged from both stores, olders first */
+  assert_events_sorted (fixture->ret);
+
   g_list_foreach (fixture->ret, (GFunc) g_object_unref, NULL);
   g_list_free (fixture->ret);
   g_object_unref (account);
 }
 
+
+#define CONCURRENT_QUERIES 8
+
+typedef struct
+{
+  TestCaseFixture *fixture;
+  TplEntity *entity;
+  GDate *date;
+  GList *events;
+} ConcurrentQuery;
+
+
+static gpointer
+concurrent_query_thread (gpointer data)
+{
+  ConcurrentQuery *query = data;
+
+  query->events = _tpl_log_manager_get_events_for_date (
+      query->fixture->manager, query->fixture->account, query->entity,
+      TPL_EVENT_MASK_TEXT, query->date);
+
+  return NULL;
+}
+
+
+static void
+test_query_stores (TestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogManagerPriv *priv = fixture->manager->priv;
+  StoreQuery store_query = { fixture->account, NULL, TPL_EVENT_MASK_ANY, };
+  ConcurrentQuery queries[CONCURRENT_QUERIES];
+  GThread *threads[CONCURRENT_QUERIES];
+  TplLogMerge *merge;
+  TplEntity *entity;
+  GDate *date;
+  GList **results;
+  GList *expected, *l;
+  guint i, n;
+
+  entity = tpl_entity_new (ID, TPL_ENTITY_CONTACT, NULL, NULL);
+  date = g_date_new_dmy (13, 1, 2010);
+  store_query.target = entity;
+
+  /* Each store's result comes back in the place of the store */
+  g_assert_cmpuint (g_list_length (priv->readable_stores), >, 1);
+
+  results = log_manager_query_stores (fixture->manager, store_query_dates,
+      &store_query, &n);
+  g_assert_cmpuint (n, ==, g_list_length (priv->readable_stores));
+
+  for (l = priv->readable_stores, i = 0; l != NULL; l = g_list_next (l), i++)
+    {
+      GList *dates = _tpl_log_store_get_dates (l->data, fixture->account,
+          entity, TPL_EVENT_MASK_ANY);
+
+      g_assert_cmpuint (g_list_length (results[i]), ==,
+          g_list_length (dates));
+
+      g_list_free_full (dates, (GDestroyNotify) g_date_free);
+      g_list_free_full (results[i], (GDestroyNotify) g_date_free);
+    }
+
+  g_free (results);
+
+  /* The same events, merged the same way, as when querying the stores one
+   * after the other, even with several calls at once */
+  merge = _tpl_log_merge_new (_tpl_event_compare_timestamps,
+      g_object_unref, 0);
+
+  for (l = priv->readable_stores; l != NULL; l = g_list_next (l))
+    _tpl_log_merge_add (merge, _tpl_log_store_get_events_for_date (l->data,
+          fixture->account, entity, TPL_EVENT_MASK_TEXT, date));
+
+  expected = _tpl_log_merge_finish (merge, 0);
+
+  /* 6 events in old Empathy and 6 in new TpLogger storage */
+  g_assert_cmpint (g_list_length (expected), ==, 12);
+
+  for (i = 0; i < CONCURRENT_QUERIES; i++)
+    {
+      queries[i].fixture = fixture;
+      queries[i].entity = entity;
+      queries[i].date = date;
+      queries[i].events = NULL;
+
+      threads[i] = g_thread_new ("query-stores", concurrent_query_thread,
+          &queries[i]);
+    }
+
+  for (i = 0; i < CONCURRENT_QUERIES; i++)
+    {
+      GList *e;
+
+      g_thread_join (threads[i]);
+
+      g_assert_cmpint (g_list_length (queries[i].events), ==,
+          g_list_length (expected));
+
+      for (l = expected, e = queries[i].events;
+          l != NULL;
+          l = g_list_next (l), e = g_list_next (e))
+        {
+          g_assert_cmpint (tpl_event_get_timestamp (l->data), ==,
+              tpl_event_get_timestamp (e->data));
+          g_assert_cmpstr (tpl_text_event_get_message (l->data), ==,
+              tpl_text_event_get_message (e->data));
+        }
+
+      g_list_free_full (queries[i].events, g_object_unref);
+    }
+
+  g_list_free_full (expected, g_object_unref);
+  g_date_free (date);
+  g_object_unref (entity);
+}
+
 static void
 get_filtered_events_cb (GObject *object,
     GAsyncResult *result,
@@ -492,6 +829,7 @@ test_get_filtered_events (TestCaseFixture *fixture,
   /* We got 6 events in old Empathy and 6 in new TpLogger storage,
    * but we limited to 11 */
   g_assert_cmpint (g_list_length (fixture->ret), ==, 11);
+  assert_events_sorted (fixture->ret);
 
   g_list_foreach (fixture->ret, (GFunc) g_object_unref, NULL);
   g_list_free (fixture->ret);
@@ -595,6 +933,219 @@ test_search (TestCaseFixture *fixture,
   fixture->ret = NULL;
 }
 
+static void
+search_scoped_cb (GObject *object,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  TestCaseFixture *fixture = user_data;
+  GError *error = NULL;
+
+  tpl_log_manager_search_scoped_finish (TPL_LOG_MANAGER (object),
+      result, &fixture->ret, &error);
+
+  g_assert_no_error (error);
+  g_main_loop_quit (fixture->main_loop);
+}
+
+
+static guint
+search_scoped (TestCaseFixture *fixture,
+    TpAccount *account,
+    TplEntity *target,
+    const GDate *from,
+    const GDate *to)
+{
+  GList *l;
+  guint n;
+
+  tpl_log_manager_search_scoped_async (fixture->manager,
+      "user2@collabora.co.uk", TPL_EVENT_MASK_TEXT, account, target, from, to,
+      search_scoped_cb, fixture);
+  g_main_loop_run (fixture->main_loop);
+
+  for (l = fixture->ret; l != NULL; l = g_list_next (l))
+    {
+      TplLogSearchHit *hit = l->data;
+
+      if (from != NULL)
+        g_assert (g_date_compare (hit->date, from) >= 0);
+
+      if (to != NULL)
+        g_assert (g_date_compare (hit->date, to) <= 0);
+
+      if (target != NULL)
+        g_assert_cmpstr (tpl_entity_get_identifier (hit->target), ==,
+            tpl_entity_get_identifier (target));
+    }
+
+  n = g_list_length (fixture->ret);
+
+  tpl_log_manager_search_free (fixture->ret);
+  fixture->ret = NULL;
+
+  return n;
+}
+
+
+static void
+test_search_scoped (TestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplEntity *user2;
+  GDate *from, *to;
+  TplLogSearchScope scope = { NULL, };
+  TplLogSearchHit *hit;
+
+  user2 = tpl_entity_new ("user2@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "User2", "");
+  from = g_date_new_dmy (16, 2, 2010);
+  to = g_date_new_dmy (17, 2, 2010);
+
+  /* The same hits as test_search () */
+  g_assert_cmpuint (search_scoped (fixture, NULL, NULL, NULL, NULL), ==, 10);
+
+  /* All but the Pidgin chat room */
+  g_assert_cmpuint (search_scoped (fixture, fixture->account, user2, NULL,
+        NULL), ==, 9);
+
+  /* Two days in each of the XML stores */
+  g_assert_cmpuint (search_scoped (fixture, fixture->account, user2, from,
+        to), ==, 4);
+
+  /* Only Pidgin has logs from December 2010 */
+  g_date_set_dmy (from, 1, 12, 2010);
+  g_assert_cmpuint (search_scoped (fixture, NULL, NULL, from, NULL), ==, 1);
+
+  /* Hits without a date are only left out when the scope has dates */
+  hit = _tpl_log_manager_search_hit_new (fixture->account, user2, NULL);
+  scope.account = fixture->account;
+  scope.target = user2;
+  g_assert (_tpl_log_search_scope_has_hit (&scope, hit));
+  scope.from = from;
+  g_assert (!_tpl_log_search_scope_has_hit (&scope, hit));
+  _tpl_log_manager_search_hit_free (hit);
+
+  g_date_free (from);
+  g_date_free (to);
+  g_object_unref (user2);
+}
+
+
+typedef struct
+{
+  TestCaseFixture *fixture;
+  guint n_hits;
+  gboolean done;
+  GError *error;
+  guint n_destroyed;
+} SearchIncrementalData;
+
+
+static void
+search_incremental_hits_cb (TplLogManager *manager,
+    GList *hits,
+    gpointer user_data)
+{
+  SearchIncrementalData *data = user_data;
+
+  g_assert (!data->done);
+  g_assert (hits != NULL);
+
+  data->n_hits += g_list_length (hits);
+}
+
+
+static void
+search_incremental_destroy (gpointer user_data)
+{
+  SearchIncrementalData *data = user_data;
+
+  g_assert (data->done);
+  data->n_destroyed++;
+}
+
+
+/* The hits' user data goes once the search's last idle source has run */
+static void
+wait_search_incremental_destroyed (SearchIncrementalData *data,
+    guint n_destroyed)
+{
+  while (data->n_destroyed < n_destroyed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (data->n_destroyed, ==, n_destroyed);
+}
+
+
+static void
+search_incremental_cb (GObject *object,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  SearchIncrementalData *data = user_data;
+
+  tpl_log_manager_search_incremental_finish (TPL_LOG_MANAGER (object),
+      result, &data->error);
+
+  data->done = TRUE;
+  g_main_loop_quit (data->fixture->main_loop);
+}
+
+
+static void
+test_search_incremental (TestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  SearchIncrementalData data = { fixture, 0, FALSE, NULL, 0 };
+  GCancellable *cancellable;
+
+  /* The same hits as test_search () */
+  tpl_log_manager_search_incremental_async (fixture->manager,
+      "user2@collabora.co.uk", TPL_EVENT_MASK_TEXT, 0, NULL,
+      search_incremental_hits_cb, &data, search_incremental_destroy,
+      search_incremental_cb, &data);
+  g_main_loop_run (fixture->main_loop);
+
+  g_assert_no_error (data.error);
+  g_assert_cmpuint (data.n_hits, ==, 10);
+  wait_search_incremental_destroyed (&data, 1);
+
+  /* Stopping early */
+  data.n_hits = 0;
+  data.done = FALSE;
+
+  tpl_log_manager_search_incremental_async (fixture->manager,
+      "user2@collabora.co.uk", TPL_EVENT_MASK_TEXT, 3, NULL,
+      search_incremental_hits_cb, &data, search_incremental_destroy,
+      search_incremental_cb, &data);
+  g_main_loop_run (fixture->main_loop);
+
+  g_assert_no_error (data.error);
+  g_assert_cmpuint (data.n_hits, ==, 3);
+  wait_search_incremental_destroyed (&data, 2);
+
+  /* Cancelled searches deliver nothing */
+  data.n_hits = 0;
+  data.done = FALSE;
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+
+  tpl_log_manager_search_incremental_async (fixture->manager,
+      "user2@collabora.co.uk", TPL_EVENT_MASK_TEXT, 0, cancellable,
+      search_incremental_hits_cb, &data, search_incremental_destroy,
+      search_incremental_cb, &data);
+  g_main_loop_run (fixture->main_loop);
+
+  g_assert_error (data.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpuint (data.n_hits, ==, 0);
+  wait_search_incremental_destroyed (&data, 3);
+
+  g_clear_error (&data.error);
+  g_object_unref (cancellable);
+}
+
+
 static gboolean
 check_ignored_messages (TestCaseFixture *fixture,
     TplTextEvent *event,
@@ -740,6 +1291,129 @@ test_ignorelist (TestCaseFixture *fixture,
   g_object_unref (receiver);
 }
 
+static TplEvent *
+new_text_event (TestCaseFixture *fixture,
+    TplEntity *sender,
+    TplEntity *receiver)
+{
+  return g_object_new (TPL_TYPE_TEXT_EVENT,
+      "account", fixture->account,
+      "channel-path", "org.freedesktop.Telepathy.channel.path",
+      "receiver", receiver,
+      "sender", sender,
+      "timestamp", (gint64) time (NULL),
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", "Test",
+      NULL);
+}
+
+
+static guint
+count_stored_events (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target)
+{
+  GList *events;
+  guint count;
+
+  events = _tpl_log_store_get_filtered_events (store, account, target,
+      TPL_EVENT_MASK_ANY, G_MAXUINT, NULL, NULL);
+  count = g_list_length (events);
+  g_list_free_full (events, g_object_unref);
+
+  return count;
+}
+
+
+static void
+test_flush_policy (TestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogManagerPriv *priv = fixture->manager->priv;
+  TplLogStore *store = NULL;
+  TplEntity *me, *contact;
+  TplEvent *event;
+  GList *l, *events;
+  guint i;
+
+  for (l = priv->writable_stores; l != NULL; l = g_list_next (l))
+    if (TPL_IS_LOG_STORE_XML (l->data))
+      store = l->data;
+
+  g_assert (store != NULL);
+
+  me = tpl_entity_new (MY_ID, TPL_ENTITY_SELF, "Me", "no-avatar");
+  contact = tpl_entity_new ("flushed@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "Someone Else", "no-avatar");
+
+  /* Nothing is written until flushed */
+  _tpl_log_manager_set_flush_policy (fixture->manager,
+      TPL_LOG_FLUSH_EXPLICIT, 0);
+
+  for (i = 0; i < 3; i++)
+    {
+      event = new_text_event (fixture, me, contact);
+      g_assert (_tpl_log_manager_add_event (fixture->manager, event, NULL));
+      g_object_unref (event);
+    }
+
+  g_assert_cmpuint (count_stored_events (store, fixture->account, contact),
+      ==, 0);
+
+  _tpl_log_manager_flush (fixture->manager);
+  g_assert_cmpuint (count_stored_events (store, fixture->account, contact),
+      ==, 3);
+
+  /* Queries see queued events */
+  event = new_text_event (fixture, contact, me);
+  _tpl_log_manager_add_event (fixture->manager, event, NULL);
+  g_object_unref (event);
+
+  events = _tpl_log_manager_get_filtered_events (fixture->manager,
+      fixture->account, contact, TPL_EVENT_MASK_ANY, G_MAXUINT, NULL, NULL);
+  g_assert_cmpuint (g_list_length (events), ==, 4);
+  g_list_free_full (events, g_object_unref);
+
+  /* The writer starts once a batch is complete */
+  _tpl_log_manager_set_flush_policy (fixture->manager, TPL_LOG_FLUSH_BATCH, 2);
+
+  event = new_text_event (fixture, me, contact);
+  _tpl_log_manager_add_event (fixture->manager, event, NULL);
+  g_object_unref (event);
+
+  g_assert_cmpuint (count_stored_events (store, fixture->account, contact),
+      ==, 4);
+
+  event = new_text_event (fixture, me, contact);
+  _tpl_log_manager_add_event (fixture->manager, event, NULL);
+  g_object_unref (event);
+
+  /* the batch is complete, wait for the writer without flushing it */
+  _tpl_log_write_queue_wait (priv->write_queue);
+
+  g_assert_cmpuint (count_stored_events (store, fixture->account, contact),
+      ==, 6);
+
+  /* Written before returning */
+  _tpl_log_manager_set_flush_policy (fixture->manager,
+      TPL_LOG_FLUSH_IMMEDIATE, 0);
+
+  event = new_text_event (fixture, me, contact);
+  g_assert (_tpl_log_manager_add_event (fixture->manager, event, NULL));
+  g_object_unref (event);
+
+  g_assert_cmpuint (count_stored_events (store, fixture->account, contact),
+      ==, 7);
+
+  _tpl_log_manager_clear_entity (fixture->manager, fixture->account, contact);
+  _tpl_log_manager_set_flush_policy (fixture->manager, DEFAULT_FLUSH_POLICY,
+      DEFAULT_FLUSH_LIMIT);
+
+  g_object_unref (me);
+  g_object_unref (contact);
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -783,6 +1457,10 @@ main (int argc, char **argv)
       TestCaseFixture, params,
       setup, test_get_events_for_date_account_unprepared, teardown);
 
+  g_test_add ("/log-manager/query-stores",
+      TestCaseFixture, params,
+      setup, test_query_stores, teardown);
+
   g_test_add ("/log-manager/get-filtered-events",
       TestCaseFixture, params,
       setup, test_get_filtered_events, teardown);
@@ -795,10 +1473,30 @@ main (int argc, char **argv)
       TestCaseFixture, params,
       setup, test_search, teardown);
 
+  g_test_add ("/log-manager/search-scoped",
+      TestCaseFixture, params,
+      setup, test_search_scoped, teardown);
+
+  g_test_add ("/log-manager/search-incremental",
+      TestCaseFixture, params,
+      setup, test_search_incremental, teardown);
+
+  g_test_add ("/log-manager/async-pool",
+      TestCaseFixture, params,
+      setup, test_async_pool, teardown);
+
+  g_test_add ("/log-manager/async-pool-cancelled",
+      TestCaseFixture, params,
+      setup, test_async_pool_cancelled, teardown);
+
   g_test_add ("/log-manager/ignorelist",
       TestCaseFixture, params,
       setup_for_writing, test_ignorelist, teardown);
 
+  g_test_add ("/log-manager/flush-policy",
+      TestCaseFixture, params,
+      setup_for_writing, test_flush_policy, teardown);
+
   retval = g_test_run ();
 
   g_list_foreach (l, (GFunc) g_hash_table_unref, NULL);
@@ -268,6 +268,26 @@ test_basedir (PidginTestCaseFixture *fixture,
   g_free (dir);
 }
 
+static void
+test_account_key (PidginTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gchar *dir;
+  gchar *key;
+
+  /* Search hits get the account whose key names their directory */
+  dir = log_store_pidgin_get_dir (TPL_LOG_STORE (fixture->store),
+      fixture->account, NULL);
+  key = log_store_pidgin_account_to_key (fixture->account);
+
+  g_assert (key != NULL);
+  g_assert (g_str_has_suffix (dir, key));
+  g_assert (dir[strlen (dir) - strlen (key) - 1] == G_DIR_SEPARATOR);
+
+  g_free (dir);
+  g_free (key);
+}
+
 static void
 test_get_dates_jabber (PidginTestCaseFixture *fixture,
     gconstpointer user_data)
@@ -467,6 +487,15 @@ test_search_new (PidginTestCaseFixture *fixture,
 
   tpl_log_manager_search_free (l);
 
+  /* case is ignored */
+  l = log_store_pidgin_search_new (TPL_LOG_STORE (fixture->store),
+      "HEY You",
+      TPL_EVENT_MASK_ANY);
+
+  g_assert_cmpint (g_list_length (l), ==, 1);
+
+  tpl_log_manager_search_free (l);
+
   /* non empty search, checking chatrooms are also searched */
   l = log_store_pidgin_search_new (TPL_LOG_STORE (fixture->store),
       "disco remote servers",
@@ -568,6 +597,10 @@ main (int argc, char **argv)
       PidginTestCaseFixture, params,
       setup, test_basedir, teardown);
 
+  g_test_add ("/log-store-pidgin/account-key-jabber",
+      PidginTestCaseFixture, params,
+      setup, test_account_key, teardown);
+
   g_test_add ("/log-store-pidgin/get-dates-jabber",
       PidginTestCaseFixture, params,
       setup, test_get_dates_jabber, teardown);
@@ -594,6 +627,10 @@ main (int argc, char **argv)
   g_hash_table_insert (params, "account-path",
       tp_g_value_slice_new_static_string (ACCOUNT_PATH_IRC));
 
+  g_test_add ("/log-store-pidgin/account-key-irc",
+      PidginTestCaseFixture, params,
+      setup, test_account_key, teardown);
+
   g_test_add ("/log-store-pidgin/get-dates-irc",
       PidginTestCaseFixture, params,
       setup, test_get_dates_irc, teardown);
@@ -0,0 +1,835 @@
+#include "config.h"
+
+#include "lib/logger-test-helper.h"
+#include "lib/util.h"
+
+#include "telepathy-logger/call-event.h"
+#include "telepathy-logger/debug-internal.h"
+#include "telepathy-logger/entity-internal.h"
+#include "telepathy-logger/log-iter-internal.h"
+#include "telepathy-logger/log-manager-internal.h"
+#include "telepathy-logger/log-store-internal.h"
+#include "telepathy-logger/log-store-sqlite-events-internal.h"
+#include "telepathy-logger/text-event-internal.h"
+#include <telepathy-logger/client-factory-internal.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sqlite3.h>
+
+#define DEBUG_FLAG TPL_DEBUG_TESTSUITE
+
+
+typedef struct
+{
+  gchar *filename;
+  TplLogStore *store;
+  TpDBusDaemon *bus;
+  TpSimpleClientFactory *factory;
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *me;
+  TplEntity *contact;
+  TplEntity *room;
+} SqliteEventsTestCaseFixture;
+
+
+static void
+setup (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->filename = g_build_filename (g_get_tmp_dir (),
+      "logger-test-events.sqlite", NULL);
+  g_unlink (fixture->filename);
+
+  fixture->store = g_object_new (TPL_TYPE_LOG_STORE_SQLITE_EVENTS,
+      "filename", fixture->filename,
+      "testmode", TRUE,
+      NULL);
+
+  fixture->bus = tp_tests_dbus_daemon_dup_or_die ();
+  g_assert (fixture->bus != NULL);
+
+  tp_dbus_daemon_request_name (fixture->bus,
+      TP_ACCOUNT_MANAGER_BUS_NAME,
+      FALSE,
+      &error);
+  g_assert_no_error (error);
+
+  fixture->factory = _tpl_client_factory_dup (fixture->bus);
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "idle/irc/me",
+      &fixture->account, &fixture->account_service);
+
+  fixture->me = tpl_entity_new ("bob.mcbadgers@example.com", TPL_ENTITY_SELF,
+      "my-alias", "my-avatar");
+  fixture->contact = tpl_entity_new ("contact", TPL_ENTITY_CONTACT,
+      "contact-alias", "contact-token");
+  fixture->room = tpl_entity_new_from_room_id ("room");
+
+  tp_debug_divert_messages (g_getenv ("TPL_LOGFILE"));
+
+#ifdef ENABLE_DEBUG
+  _tpl_debug_set_flags_from_env ();
+#endif /* ENABLE_DEBUG */
+}
+
+
+static void
+teardown (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  tpl_test_release_account (fixture->bus, fixture->account,
+      fixture->account_service);
+
+  tp_dbus_daemon_release_name (fixture->bus, TP_ACCOUNT_MANAGER_BUS_NAME,
+      &error);
+  g_assert_no_error (error);
+
+  g_object_unref (fixture->me);
+  g_object_unref (fixture->contact);
+  g_object_unref (fixture->room);
+  g_object_unref (fixture->store);
+  g_clear_object (&fixture->factory);
+  g_object_unref (fixture->bus);
+
+  g_unlink (fixture->filename);
+  g_free (fixture->filename);
+}
+
+
+static TplEvent *
+new_text_event (SqliteEventsTestCaseFixture *fixture,
+    TplEntity *sender,
+    TplEntity *receiver,
+    gint64 timestamp,
+    const gchar *message,
+    const gchar *token,
+    const gchar *supersedes)
+{
+  return g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", fixture->account,
+      "sender", sender,
+      "receiver", receiver,
+      "timestamp", timestamp,
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", message,
+      "message-token", token,
+      "supersedes-token", supersedes,
+      "edit-timestamp", supersedes != NULL ? timestamp : (gint64) 0,
+      NULL);
+}
+
+
+static TplEvent *
+add_text_event (SqliteEventsTestCaseFixture *fixture,
+    TplEntity *sender,
+    TplEntity *receiver,
+    gint64 timestamp,
+    const gchar *message,
+    const gchar *token,
+    const gchar *supersedes)
+{
+  TplEvent *event;
+  GError *error = NULL;
+
+  event = new_text_event (fixture, sender, receiver, timestamp, message,
+      token, supersedes);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+
+  return event;
+}
+
+
+static void
+assert_cmp_text_event (TplEvent *event,
+    TplEvent *stored_event)
+{
+  TplEntity *sender, *stored_sender;
+
+  g_assert (TPL_IS_TEXT_EVENT (stored_event));
+  g_assert_cmpstr (tpl_event_get_account_path (event), ==,
+      tpl_event_get_account_path (stored_event));
+
+  sender = tpl_event_get_sender (event);
+  stored_sender = tpl_event_get_sender (stored_event);
+
+  g_assert (_tpl_entity_compare (sender, stored_sender) == 0);
+  g_assert_cmpstr (tpl_entity_get_alias (sender), ==,
+      tpl_entity_get_alias (stored_sender));
+  g_assert_cmpstr (tpl_entity_get_avatar_token (sender), ==,
+      tpl_entity_get_avatar_token (stored_sender));
+  g_assert (_tpl_entity_compare (tpl_event_get_receiver (event),
+        tpl_event_get_receiver (stored_event)) == 0);
+
+  g_assert_cmpstr (tpl_text_event_get_message (TPL_TEXT_EVENT (event)),
+      ==, tpl_text_event_get_message (TPL_TEXT_EVENT (stored_event)));
+  g_assert_cmpstr (tpl_text_event_get_message_token (TPL_TEXT_EVENT (event)),
+      ==, tpl_text_event_get_message_token (TPL_TEXT_EVENT (stored_event)));
+  g_assert_cmpint (tpl_event_get_timestamp (event), ==,
+      tpl_event_get_timestamp (stored_event));
+}
+
+
+static TplEvent *
+add_call_event (SqliteEventsTestCaseFixture *fixture,
+    TplEntity *sender,
+    TplEntity *receiver,
+    gint64 timestamp,
+    gint64 duration,
+    TplEntity *actor,
+    TpCallStateChangeReason reason,
+    const gchar *detail)
+{
+  TplEvent *event;
+  GError *error = NULL;
+
+  event = g_object_new (TPL_TYPE_CALL_EVENT,
+      /* TplEvent */
+      "account", fixture->account,
+      "sender", sender,
+      "receiver", receiver,
+      "timestamp", timestamp,
+      /* TplCallEvent */
+      "duration", duration,
+      "end-actor", actor,
+      "end-reason", reason,
+      "detailed-end-reason", detail,
+      NULL);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+
+  return event;
+}
+
+
+static void
+assert_cmp_call_event (TplEvent *event,
+    TplEvent *stored_event)
+{
+  TplEntity *actor, *stored_actor;
+
+  g_assert (TPL_IS_CALL_EVENT (stored_event));
+  g_assert_cmpstr (tpl_event_get_account_path (event), ==,
+      tpl_event_get_account_path (stored_event));
+  g_assert (_tpl_entity_compare (tpl_event_get_sender (event),
+        tpl_event_get_sender (stored_event)) == 0);
+  g_assert (_tpl_entity_compare (tpl_event_get_receiver (event),
+        tpl_event_get_receiver (stored_event)) == 0);
+  g_assert_cmpint (tpl_event_get_timestamp (event), ==,
+      tpl_event_get_timestamp (stored_event));
+
+  g_assert_cmpint (tpl_call_event_get_duration (TPL_CALL_EVENT (event)),
+      ==, tpl_call_event_get_duration (TPL_CALL_EVENT (stored_event)));
+
+  actor = tpl_call_event_get_end_actor (TPL_CALL_EVENT (event));
+  stored_actor = tpl_call_event_get_end_actor (TPL_CALL_EVENT (stored_event));
+
+  g_assert (_tpl_entity_compare (actor, stored_actor) == 0);
+  g_assert_cmpstr (tpl_entity_get_alias (actor), ==,
+      tpl_entity_get_alias (stored_actor));
+  g_assert_cmpint (tpl_call_event_get_end_reason (TPL_CALL_EVENT (event)),
+      ==, tpl_call_event_get_end_reason (TPL_CALL_EVENT (stored_event)));
+  g_assert_cmpstr (
+      tpl_call_event_get_detailed_end_reason (TPL_CALL_EVENT (event)),
+      ==,
+      tpl_call_event_get_detailed_end_reason (TPL_CALL_EVENT (stored_event)));
+}
+
+
+static void
+test_add_text_event (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  TplEvent *sent, *received, *in_room, *yesterday;
+  GList *events, *dates, *entities;
+
+  sent = add_text_event (fixture, fixture->me, fixture->contact, timestamp,
+      "my message 1", NULL, NULL);
+  received = add_text_event (fixture, fixture->contact, fixture->me,
+      timestamp + 1, "my message 2", NULL, NULL);
+  in_room = add_text_event (fixture, fixture->contact, fixture->room,
+      timestamp, "my message 3", NULL, NULL);
+  yesterday = add_text_event (fixture, fixture->me, fixture->contact,
+      timestamp - (60 * 60 * 24), "my message 4", NULL, NULL);
+
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_TEXT));
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_CALL));
+
+  /* Both days, in order */
+  dates = _tpl_log_store_get_dates (fixture->store, fixture->account,
+      fixture->contact, TPL_EVENT_MASK_ANY);
+  g_assert_cmpint (g_list_length (dates), ==, 2);
+  g_assert_cmpint (g_date_compare (dates->data, dates->next->data), <, 0);
+
+  /* The day's events, oldest first */
+  events = _tpl_log_store_get_events_for_date (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_ANY,
+      dates->next->data);
+  g_assert_cmpint (g_list_length (events), ==, 2);
+  assert_cmp_text_event (sent, events->data);
+  assert_cmp_text_event (received, events->next->data);
+  g_list_free_full (events, g_object_unref);
+
+  g_list_free_full (dates, (GDestroyNotify) g_date_free);
+
+  /* The newest events, across days */
+  events = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_TEXT, 3, NULL,
+      NULL);
+  g_assert_cmpint (g_list_length (events), ==, 3);
+  assert_cmp_text_event (yesterday, events->data);
+  assert_cmp_text_event (received, g_list_last (events)->data);
+  g_list_free_full (events, g_object_unref);
+
+  events = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->room, TPL_EVENT_MASK_TEXT, 10, NULL, NULL);
+  g_assert_cmpint (g_list_length (events), ==, 1);
+  assert_cmp_text_event (in_room, events->data);
+  g_list_free_full (events, g_object_unref);
+
+  entities = _tpl_log_store_get_entities (fixture->store, fixture->account);
+  g_assert_cmpint (g_list_length (entities), ==, 2);
+  g_list_free_full (entities, g_object_unref);
+
+  g_object_unref (sent);
+  g_object_unref (received);
+  g_object_unref (in_room);
+  g_object_unref (yesterday);
+}
+
+
+static void
+test_add_events_failing (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  TplEvent *before, *after;
+  GList *batch = NULL, *events;
+  GError *error = NULL;
+  sqlite3 *db;
+  char *errmsg = NULL;
+  guint i;
+
+  /* creates the database, then makes the events with a given message fail
+   * to be inserted */
+  g_object_unref (add_text_event (fixture, fixture->me, fixture->contact,
+        timestamp, "my message 0", NULL, NULL));
+
+  g_assert_cmpint (sqlite3_open (fixture->filename, &db), ==, SQLITE_OK);
+  sqlite3_exec (db,
+      "CREATE TRIGGER fail BEFORE INSERT ON events "
+        "WHEN new.message = 'fail' BEGIN "
+          "SELECT RAISE (ABORT, 'failed'); "
+        "END",
+      NULL, NULL, &errmsg);
+  g_assert_cmpstr (errmsg, ==, NULL);
+  sqlite3_close (db);
+
+  before = new_text_event (fixture, fixture->me, fixture->contact,
+      timestamp + 1, "my message 1", NULL, NULL);
+  after = new_text_event (fixture, fixture->me, fixture->contact,
+      timestamp + 3, "my message 3", NULL, NULL);
+
+  batch = g_list_append (batch, before);
+  batch = g_list_append (batch, new_text_event (fixture, fixture->me,
+        fixture->contact, timestamp + 2, "fail", NULL, NULL));
+  batch = g_list_append (batch, after);
+
+  /* The failing event is reported, but the others are still stored */
+  g_assert (!_tpl_log_store_add_events (fixture->store, batch, &error));
+  g_assert_error (error, TPL_LOG_STORE_ERROR, TPL_LOG_STORE_ERROR_ADD_EVENT);
+  g_clear_error (&error);
+
+  events = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_ANY, 10, NULL,
+      NULL);
+  g_assert_cmpint (g_list_length (events), ==, 3);
+  assert_cmp_text_event (before, events->next->data);
+  assert_cmp_text_event (after, events->next->next->data);
+  g_list_free_full (events, g_object_unref);
+
+  /* The store can still be written to */
+  for (i = 0; i < 2; i++)
+    g_object_unref (add_text_event (fixture, fixture->me, fixture->contact,
+          timestamp + 4 + i, "my message", NULL, NULL));
+
+  events = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_ANY, 10, NULL,
+      NULL);
+  g_assert_cmpint (g_list_length (events), ==, 5);
+  g_list_free_full (events, g_object_unref);
+
+  g_list_free_full (batch, g_object_unref);
+}
+
+
+static void
+test_add_superseding_event (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  TplEvent *original, *edit;
+  GList *events, *supersedes;
+
+  original = add_text_event (fixture, fixture->me, fixture->contact,
+      timestamp, "my message", "token-1", NULL);
+  edit = add_text_event (fixture, fixture->me, fixture->contact,
+      timestamp + 1, "my edited message", "token-2", "token-1");
+
+  /* The edit replaces the message it edits */
+  events = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_TEXT, 10, NULL,
+      NULL);
+  g_assert_cmpint (g_list_length (events), ==, 1);
+  assert_cmp_text_event (edit, events->data);
+
+  supersedes = tpl_text_event_get_supersedes (TPL_TEXT_EVENT (events->data));
+  g_assert_cmpint (g_list_length (supersedes), ==, 1);
+  assert_cmp_text_event (original, supersedes->data);
+
+  g_list_free_full (events, g_object_unref);
+  g_object_unref (original);
+  g_object_unref (edit);
+}
+
+
+static void
+test_search (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  GList *hits;
+
+  g_object_unref (add_text_event (fixture, fixture->me, fixture->contact,
+        timestamp, "Hello World", NULL, NULL));
+  g_object_unref (add_text_event (fixture, fixture->contact, fixture->me,
+        timestamp + (60 * 60 * 24), "hello again, 100% sure", NULL, NULL));
+  g_object_unref (add_text_event (fixture, fixture->contact, fixture->room,
+        timestamp, "goodbye", NULL, NULL));
+
+  /* Through the index, ignoring case: one hit per day */
+  hits = _tpl_log_store_search_new (fixture->store, "HELLO",
+      TPL_EVENT_MASK_TEXT);
+  g_assert_cmpint (g_list_length (hits), ==, 2);
+  tpl_log_manager_search_free (hits);
+
+  hits = _tpl_log_store_search_new (fixture->store, "HELLO",
+      TPL_EVENT_MASK_CALL);
+  g_assert_cmpint (g_list_length (hits), ==, 0);
+
+  /* Too short for the index, and with a LIKE wildcard in it */
+  hits = _tpl_log_store_search_new (fixture->store, "0%",
+      TPL_EVENT_MASK_TEXT);
+  g_assert_cmpint (g_list_length (hits), ==, 1);
+  g_assert_cmpstr (tpl_entity_get_identifier (
+        ((TplLogSearchHit *) hits->data)->target), ==, "contact");
+  tpl_log_manager_search_free (hits);
+
+  hits = _tpl_log_store_search_new (fixture->store, "_",
+      TPL_EVENT_MASK_TEXT);
+  g_assert_cmpint (g_list_length (hits), ==, 0);
+
+  /* Cleared logs can't be found anymore */
+  _tpl_log_store_clear_entity (fixture->store, fixture->account,
+      fixture->room);
+
+  hits = _tpl_log_store_search_new (fixture->store, "goodbye",
+      TPL_EVENT_MASK_TEXT);
+  g_assert_cmpint (g_list_length (hits), ==, 0);
+
+  _tpl_log_store_clear (fixture->store);
+
+  hits = _tpl_log_store_search_new (fixture->store, "hello",
+      TPL_EVENT_MASK_TEXT);
+  g_assert_cmpint (g_list_length (hits), ==, 0);
+}
+
+
+static void
+test_add_call_event (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  TplEvent *text, *outgoing, *missed;
+  GList *events, *dates;
+
+  /* A call sorts after a message sent at the same time */
+  outgoing = add_call_event (fixture, fixture->me, fixture->contact,
+      timestamp, 1234, fixture->me,
+      TP_CALL_STATE_CHANGE_REASON_USER_REQUESTED, TP_ERROR_STR_CANCELLED);
+  text = add_text_event (fixture, fixture->me, fixture->contact, timestamp,
+      "my message", NULL, NULL);
+  missed = add_call_event (fixture, fixture->contact, fixture->room,
+      timestamp, -1, fixture->room, TP_CALL_STATE_CHANGE_REASON_NO_ANSWER,
+      "");
+
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_CALL));
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->room, TPL_EVENT_MASK_CALL));
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->room, TPL_EVENT_MASK_TEXT));
+
+  dates = _tpl_log_store_get_dates (fixture->store, fixture->account,
+      fixture->contact, TPL_EVENT_MASK_ANY);
+  g_assert_cmpint (g_list_length (dates), ==, 1);
+
+  events = _tpl_log_store_get_events_for_date (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_ANY, dates->data);
+  g_assert_cmpint (g_list_length (events), ==, 2);
+  assert_cmp_text_event (text, events->data);
+  assert_cmp_call_event (outgoing, events->next->data);
+  g_list_free_full (events, g_object_unref);
+
+  events = _tpl_log_store_get_events_for_date (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_CALL, dates->data);
+  g_assert_cmpint (g_list_length (events), ==, 1);
+  assert_cmp_call_event (outgoing, events->data);
+  g_list_free_full (events, g_object_unref);
+
+  g_list_free_full (dates, (GDestroyNotify) g_date_free);
+
+  events = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->room, TPL_EVENT_MASK_CALL, 1, NULL, NULL);
+  g_assert_cmpint (g_list_length (events), ==, 1);
+  assert_cmp_call_event (missed, events->data);
+  g_list_free_full (events, g_object_unref);
+
+  g_object_unref (text);
+  g_object_unref (outgoing);
+  g_object_unref (missed);
+}
+
+
+static gboolean
+filter_out_odd (TplEvent *event,
+    gpointer user_data)
+{
+  guint *n_filtered = user_data;
+
+  (*n_filtered)++;
+
+  return (tpl_event_get_timestamp (event) % 2 == 0);
+}
+
+
+static void
+test_get_filtered_events (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  TplEvent *events[6];
+  GList *filtered;
+  guint n_filtered = 0;
+  guint i;
+
+  /* Two events a day over three days, every other one with an odd
+   * timestamp */
+  for (i = 0; i < G_N_ELEMENTS (events); i++)
+    {
+      gchar *message = g_strdup_printf ("message %u", i);
+
+      events[i] = add_text_event (fixture, fixture->me, fixture->contact,
+          timestamp + (i / 2) * (60 * 60 * 24) + (i % 2), message, NULL,
+          NULL);
+
+      g_free (message);
+    }
+
+  /* The newest events first, across days, returned oldest first */
+  filtered = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_ANY, 3, NULL, NULL);
+  g_assert_cmpint (g_list_length (filtered), ==, 3);
+  assert_cmp_text_event (events[3], filtered->data);
+  assert_cmp_text_event (events[4], filtered->next->data);
+  assert_cmp_text_event (events[5], filtered->next->next->data);
+  g_list_free_full (filtered, g_object_unref);
+
+  /* Rejected events don't count, and the filter isn't called anymore once
+   * enough events were found */
+  filtered = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_ANY, 2,
+      filter_out_odd, &n_filtered);
+  g_assert_cmpint (g_list_length (filtered), ==, 2);
+  assert_cmp_text_event (events[2], filtered->data);
+  assert_cmp_text_event (events[4], filtered->next->data);
+  g_assert_cmpuint (n_filtered, ==, 4);
+  g_list_free_full (filtered, g_object_unref);
+
+  /* Asking for more than there is */
+  filtered = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_ANY, 10, NULL,
+      NULL);
+  g_assert_cmpint (g_list_length (filtered), ==, G_N_ELEMENTS (events));
+  assert_cmp_text_event (events[0], filtered->data);
+  g_list_free_full (filtered, g_object_unref);
+
+  filtered = _tpl_log_store_get_filtered_events (fixture->store,
+      fixture->account, fixture->contact, TPL_EVENT_MASK_CALL, 10, NULL,
+      NULL);
+  g_assert (filtered == NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (events); i++)
+    g_object_unref (events[i]);
+}
+
+
+static void
+test_get_entities (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  GList *entities, *l;
+  gboolean found_contact = FALSE, found_room = FALSE;
+
+  entities = _tpl_log_store_get_entities (fixture->store, fixture->account);
+  g_assert (entities == NULL);
+
+  /* Both directions of a conversation are the same entity */
+  g_object_unref (add_text_event (fixture, fixture->me, fixture->contact,
+        timestamp, "my message 1", NULL, NULL));
+  g_object_unref (add_text_event (fixture, fixture->contact, fixture->me,
+        timestamp + 1, "my message 2", NULL, NULL));
+  g_object_unref (add_call_event (fixture, fixture->contact, fixture->room,
+        timestamp, -1, fixture->room, TP_CALL_STATE_CHANGE_REASON_NO_ANSWER,
+        ""));
+
+  entities = _tpl_log_store_get_entities (fixture->store, fixture->account);
+  g_assert_cmpint (g_list_length (entities), ==, 2);
+
+  for (l = entities; l != NULL; l = g_list_next (l))
+    {
+      TplEntity *entity = l->data;
+
+      if (tpl_entity_get_entity_type (entity) == TPL_ENTITY_ROOM)
+        {
+          g_assert_cmpstr (tpl_entity_get_identifier (entity), ==, "room");
+          found_room = TRUE;
+        }
+      else
+        {
+          g_assert_cmpint (tpl_entity_get_entity_type (entity), ==,
+              TPL_ENTITY_CONTACT);
+          g_assert_cmpstr (tpl_entity_get_identifier (entity), ==,
+              "contact");
+          found_contact = TRUE;
+        }
+    }
+
+  g_assert (found_contact);
+  g_assert (found_room);
+  g_list_free_full (entities, g_object_unref);
+}
+
+
+static void
+test_exists (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  TplEntity *stranger;
+
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account, NULL,
+        TPL_EVENT_MASK_ANY));
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_ANY));
+
+  g_object_unref (add_text_event (fixture, fixture->me, fixture->contact,
+        timestamp, "my message", NULL, NULL));
+
+  /* The whole account */
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account, NULL,
+        TPL_EVENT_MASK_ANY));
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account, NULL,
+        TPL_EVENT_MASK_TEXT));
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account, NULL,
+        TPL_EVENT_MASK_CALL));
+
+  /* A target, which is a contact or a room with the same identifier */
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_ANY));
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->room, TPL_EVENT_MASK_ANY));
+
+  stranger = tpl_entity_new_from_room_id ("contact");
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account,
+        stranger, TPL_EVENT_MASK_ANY));
+  g_object_unref (stranger);
+
+  stranger = tpl_entity_new ("stranger", TPL_ENTITY_CONTACT, NULL, NULL);
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account,
+        stranger, TPL_EVENT_MASK_ANY));
+  g_object_unref (stranger);
+}
+
+
+static void
+test_clear (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+
+  g_object_unref (add_text_event (fixture, fixture->me, fixture->contact,
+        timestamp, "my message", NULL, NULL));
+  g_object_unref (add_call_event (fixture, fixture->contact, fixture->room,
+        timestamp, -1, fixture->room, TP_CALL_STATE_CHANGE_REASON_NO_ANSWER,
+        ""));
+
+  /* Only the entity's logs go */
+  _tpl_log_store_clear_entity (fixture->store, fixture->account,
+      fixture->room);
+
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->room, TPL_EVENT_MASK_ANY));
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_ANY));
+
+  _tpl_log_store_clear_account (fixture->store, fixture->account);
+
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account, NULL,
+        TPL_EVENT_MASK_ANY));
+  g_assert (_tpl_log_store_get_entities (fixture->store,
+        fixture->account) == NULL);
+
+  /* The store is still usable once cleared */
+  g_object_unref (add_text_event (fixture, fixture->me, fixture->contact,
+        timestamp, "my message", NULL, NULL));
+
+  g_assert (_tpl_log_store_exists (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_ANY));
+
+  _tpl_log_store_clear (fixture->store);
+
+  g_assert (!_tpl_log_store_exists (fixture->store, fixture->account, NULL,
+        TPL_EVENT_MASK_ANY));
+  g_assert (_tpl_log_store_get_dates (fixture->store, fixture->account,
+        fixture->contact, TPL_EVENT_MASK_ANY) == NULL);
+}
+
+
+static void
+test_create_iter (SqliteEventsTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  gint64 timestamp = 1263427264;
+  TplEvent *events[5];
+  TplLogIter *iter;
+  GList *got;
+  GError *error = NULL;
+  guint i;
+
+  /* Over two days */
+  for (i = 0; i < G_N_ELEMENTS (events); i++)
+    {
+      gchar *message = g_strdup_printf ("message %u", i);
+
+      events[i] = add_text_event (fixture, fixture->me, fixture->contact,
+          timestamp + (i / 3) * (60 * 60 * 24) + i, message, NULL, NULL);
+
+      g_free (message);
+    }
+
+  iter = _tpl_log_store_create_iter (fixture->store, fixture->account,
+      fixture->contact, TPL_EVENT_MASK_ANY);
+  g_assert (iter != NULL);
+
+  /* Backwards from the newest event, across the day boundary */
+  got = tpl_log_iter_get_events (iter, 3, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_list_length (got), ==, 3);
+  assert_cmp_text_event (events[2], got->data);
+  assert_cmp_text_event (events[4], g_list_last (got)->data);
+  g_list_free_full (got, g_object_unref);
+
+  /* Giving back the two newest of those */
+  tpl_log_iter_rewind (iter, 2, &error);
+  g_assert_no_error (error);
+
+  got = tpl_log_iter_get_events (iter, 3, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_list_length (got), ==, 3);
+  assert_cmp_text_event (events[1], got->data);
+  assert_cmp_text_event (events[3], g_list_last (got)->data);
+  g_list_free_full (got, g_object_unref);
+
+  got = tpl_log_iter_get_events (iter, 3, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_list_length (got), ==, 1);
+  assert_cmp_text_event (events[0], got->data);
+  g_list_free_full (got, g_object_unref);
+
+  got = tpl_log_iter_get_events (iter, 3, &error);
+  g_assert_no_error (error);
+  g_assert (got == NULL);
+
+  g_object_unref (iter);
+
+  for (i = 0; i < G_N_ELEMENTS (events); i++)
+    g_object_unref (events[i]);
+}
+
+
+gint main (gint argc, gchar **argv)
+{
+  g_type_init ();
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_bug_base ("http://bugs.freedesktop.org/show_bug.cgi?id=");
+
+  g_test_add ("/log-store-sqlite-events/add-text-event",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_add_text_event, teardown);
+
+  g_test_add ("/log-store-sqlite-events/add-events-failing",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_add_events_failing, teardown);
+
+  g_test_add ("/log-store-sqlite-events/add-superseding-event",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_add_superseding_event, teardown);
+
+  g_test_add ("/log-store-sqlite-events/search",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_search, teardown);
+
+  g_test_add ("/log-store-sqlite-events/add-call-event",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_add_call_event, teardown);
+
+  g_test_add ("/log-store-sqlite-events/get-filtered-events",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_get_filtered_events, teardown);
+
+  g_test_add ("/log-store-sqlite-events/get-entities",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_get_entities, teardown);
+
+  g_test_add ("/log-store-sqlite-events/exists",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_exists, teardown);
+
+  g_test_add ("/log-store-sqlite-events/clear",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_clear, teardown);
+
+  g_test_add ("/log-store-sqlite-events/create-iter",
+      SqliteEventsTestCaseFixture, NULL,
+      setup, test_create_iter, teardown);
+
+  return g_test_run ();
+}
@@ -1,40 +1,613 @@
 #include "config.h"
 
-#include <telepathy-logger/log-store-sqlite-internal.h>
+#include "telepathy-logger/log-store-sqlite.c"
+
+#include "lib/simple-conn.h"
+#include "lib/util.h"
+
 #include <telepathy-logger/debug-internal.h>
 #include <telepathy-logger/client-factory-internal.h>
 
-int
-main (int argc, char **argv)
+#include <glib/gstdio.h>
+
+/* it was defined in telepathy-logger/log-store-sqlite.c */
+#undef DEBUG_FLAG
+#define DEBUG_FLAG TPL_DEBUG_TESTSUITE
+
+#define ACCOUNT_PATH TP_ACCOUNT_OBJECT_PATH_BASE \
+  "gabble/jabber/danielle_2emadeley_40collabora_2eco_2euk0"
+
+
+typedef struct
 {
+  gchar *filename;
   TplLogStore *store;
   TpDBusDaemon *bus;
+  TpSimpleClientFactory *factory;
   TpAccount *account;
+  TplEntity *me;
+} SqliteTestCaseFixture;
+
+
+static void
+remove_db (const gchar *filename)
+{
+  gchar *path;
+
+  g_unlink (filename);
+
+  path = g_strconcat (filename, "-wal", NULL);
+  g_unlink (path);
+  g_free (path);
+
+  path = g_strconcat (filename, "-shm", NULL);
+  g_unlink (path);
+  g_free (path);
+}
+
+
+static void
+setup (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
   GError *error = NULL;
-  TpSimpleClientFactory* factory;
 
-  g_type_init ();
+  /* The store is opened by each test, some of them have to prepare the
+   * database first */
+  fixture->filename = get_db_filename ();
+  remove_db (fixture->filename);
+
+  fixture->bus = tp_tests_dbus_daemon_dup_or_die ();
+  fixture->factory = _tpl_client_factory_dup (fixture->bus);
+
+  fixture->account = tp_simple_client_factory_ensure_account (
+      fixture->factory, ACCOUNT_PATH, NULL, &error);
+  g_assert_no_error (error);
+
+  fixture->me = tpl_entity_new ("danielle.madeley@collabora.co.uk",
+      TPL_ENTITY_SELF, "Danielle", "");
 
+  tp_debug_divert_messages (g_getenv ("TPL_LOGFILE"));
+
+#ifdef ENABLE_DEBUG
   _tpl_debug_set_flags_from_env ();
+#endif /* ENABLE_DEBUG */
+}
+
+
+static void
+teardown (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  if (fixture->store != NULL)
+    {
+      g_object_unref (fixture->store);
+      /* it's a singleton, which mustn't outlive the test */
+      g_assert (singleton == NULL);
+    }
+
+  g_object_unref (fixture->me);
+  g_object_unref (fixture->account);
+  g_object_unref (fixture->factory);
+  g_object_unref (fixture->bus);
+
+  remove_db (fixture->filename);
+  g_free (fixture->filename);
+}
+
+
+static TplLogStoreSqlitePrivate *
+open_store (SqliteTestCaseFixture *fixture)
+{
+  fixture->store = _tpl_log_store_sqlite_dup ();
+  g_assert (TPL_IS_LOG_STORE_SQLITE (fixture->store));
+  g_assert (TPL_LOG_STORE_SQLITE (fixture->store)->priv->db != NULL);
+
+  return TPL_LOG_STORE_SQLITE (fixture->store)->priv;
+}
+
+
+/* Commits the transaction the store's writes are grouped in, as its timer
+ * would */
+static void
+commit_writes (TplLogStoreSqlitePrivate *priv)
+{
+  g_mutex_lock (&priv->statements_lock);
+  commit_transaction (priv);
+  g_mutex_unlock (&priv->statements_lock);
+}
+
+
+/* A connection of its own, which only sees what the store committed */
+static sqlite3 *
+open_db (SqliteTestCaseFixture *fixture)
+{
+  sqlite3 *db;
+
+  g_assert_cmpint (sqlite3_open (fixture->filename, &db), ==, SQLITE_OK);
+
+  return db;
+}
+
+
+static void
+exec_sql (sqlite3 *db,
+    const gchar *query)
+{
+  char *errmsg = NULL;
+
+  sqlite3_exec (db, query, NULL, NULL, &errmsg);
+  g_assert_cmpstr (errmsg, ==, NULL);
+}
+
+
+/* Returns: the integer @query, which has a single row, comes to */
+static gint64
+query_int (sqlite3 *db,
+    const gchar *query)
+{
+  sqlite3_stmt *sql;
+  gint64 value;
+
+  g_assert_cmpint (sqlite3_prepare_v2 (db, query, -1, &sql, NULL), ==,
+      SQLITE_OK);
+  g_assert_cmpint (sqlite3_step (sql), ==, SQLITE_ROW);
+  value = sqlite3_column_int64 (sql, 0);
+  g_assert_cmpint (sqlite3_step (sql), ==, SQLITE_DONE);
+  sqlite3_finalize (sql);
+
+  return value;
+}
+
+
+/* Logs a message from @identifier, sent on @day at noon */
+static void
+add_message (SqliteTestCaseFixture *fixture,
+    const gchar *identifier,
+    GDateDay day,
+    GDateMonth month,
+    GDateYear year)
+{
+  TplEntity *contact;
+  TplEvent *event;
+  GDateTime *when;
+  GError *error = NULL;
+
+  contact = tpl_entity_new (identifier, TPL_ENTITY_CONTACT, identifier, "");
+  when = g_date_time_new_utc (year, month, day, 12, 0, 0);
+
+  event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", fixture->account,
+      "sender", contact,
+      "receiver", fixture->me,
+      "timestamp", g_date_time_to_unix (when),
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", "hi",
+      NULL);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+
+  g_object_unref (event);
+  g_date_time_unref (when);
+  g_object_unref (contact);
+}
+
+
+static void
+test_contact_stats (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreSqlite *self;
+  GHashTable *stats;
+  GHashTableIter iter;
+  TplContactStats *contact;
+
+  open_store (fixture);
+  self = TPL_LOG_STORE_SQLITE (fixture->store);
+
+  add_message (fixture, "dannielle.meyer@gmail.com", 13, 1, 2010);
+  add_message (fixture, "dannielle.meyer@gmail.com", 14, 1, 2010);
+  add_message (fixture, "user2@collabora.co.uk", 14, 1, 2010);
+
+  stats = _tpl_log_store_sqlite_get_contact_stats (self, fixture->account);
+  g_assert (stats != NULL);
+  g_assert_cmpuint (g_hash_table_size (stats), ==, 2);
+
+  /* The same figures as the single contact queries */
+  g_hash_table_iter_init (&iter, stats);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &contact))
+    {
+      g_assert_cmpint (contact->most_recent, ==,
+          _tpl_log_store_sqlite_get_most_recent (self, fixture->account,
+            contact->identifier));
+      g_assert_cmpfloat (contact->frequency, ==,
+          _tpl_log_store_sqlite_get_frequency (self, fixture->account,
+            contact->identifier));
+    }
+
+  g_hash_table_unref (stats);
+}
+
+
+static void
+test_counters (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreSqlitePrivate *priv;
+  TplLogStoreSqlite *self;
+  sqlite3 *db;
+  gdouble freq, more_freq;
+  guint i;
+
+  priv = open_store (fixture);
+  self = TPL_LOG_STORE_SQLITE (fixture->store);
+
+  /* A day's messages all end up in the same row */
+  for (i = 0; i < 5; i++)
+    add_message (fixture, "contact", 13, 1, 2010);
+
+  freq = _tpl_log_store_sqlite_get_frequency (self, fixture->account,
+      "contact");
+  g_assert_cmpfloat (freq, >, 0.);
+
+  /* Running the cached statements again adds to it */
+  add_message (fixture, "contact", 13, 1, 2010);
+  add_message (fixture, "contact", 14, 1, 2010);
+
+  more_freq = _tpl_log_store_sqlite_get_frequency (self, fixture->account,
+      "contact");
+  g_assert_cmpfloat (more_freq, >, freq);
+
+  commit_writes (priv);
+
+  db = open_db (fixture);
+  g_assert_cmpint (query_int (db,
+        "SELECT COUNT(*) FROM messagecounts WHERE identifier='contact'"),
+      ==, 2);
+  g_assert_cmpint (query_int (db,
+        "SELECT messages FROM messagecounts WHERE identifier='contact' "
+        "AND date='2010-01-13'"), ==, 6);
+  g_assert_cmpint (query_int (db,
+        "SELECT messages FROM messagecounts WHERE identifier='contact' "
+        "AND date='2010-01-14'"), ==, 1);
+  sqlite3_close (db);
+}
+
+
+static void
+test_counters_retry (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreSqlitePrivate *priv;
+  Counter *counter;
+  GHashTableIter iter;
+  sqlite3 *db;
+
+  priv = open_store (fixture);
+
+  add_message (fixture, "contact", 13, 1, 2010);
+  add_message (fixture, "contact", 13, 1, 2010);
+
+  /* Counters which fail to be written are kept for the next flush */
+  db = open_db (fixture);
+  exec_sql (db,
+      "CREATE TRIGGER fail BEFORE INSERT ON messagecounts BEGIN "
+        "SELECT RAISE (ABORT, 'failed'); "
+      "END");
+  sqlite3_close (db);
+
+  flush_counters (priv);
+  commit_writes (priv);
+
+  g_assert_cmpuint (g_hash_table_size (priv->counters), ==, 1);
+  g_assert_cmpuint (priv->flush_id, !=, 0);
+
+  /* and added up with the ones logged since */
+  add_message (fixture, "contact", 13, 1, 2010);
+
+  g_hash_table_iter_init (&iter, priv->counters);
+  g_assert (g_hash_table_iter_next (&iter, (gpointer *) &counter, NULL));
+  g_assert_cmpuint (counter->messages, ==, 3);
+
+  db = open_db (fixture);
+  exec_sql (db, "DROP TRIGGER fail");
+
+  flush_counters (priv);
+  commit_writes (priv);
+
+  g_assert_cmpuint (g_hash_table_size (priv->counters), ==, 0);
+  g_assert_cmpint (query_int (db,
+        "SELECT messages FROM messagecounts WHERE identifier='contact' "
+        "AND date='2010-01-13'"), ==, 3);
+  sqlite3_close (db);
+}
+
+
+/* Enough counters for the writing thread to flush them a few times */
+#define CONCURRENT_COUNTERS (COUNTERS_MAX_PENDING * 4)
+
+typedef struct
+{
+  SqliteTestCaseFixture *fixture;
+  volatile gint n_added;
+} ConcurrentCounters;
+
+
+static gpointer
+add_counters_thread (gpointer user_data)
+{
+  ConcurrentCounters *data = user_data;
+  guint i;
+
+  for (i = 0; i < CONCURRENT_COUNTERS; i++)
+    {
+      gchar *identifier = g_strdup_printf ("contact%u", i);
+
+      add_message (data->fixture, identifier, 13, 1, 2010);
+      g_atomic_int_set (&data->n_added, i + 1);
+      g_free (identifier);
+    }
+
+  return NULL;
+}
+
+
+static void
+test_counters_concurrent (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  ConcurrentCounters data = { fixture, 0 };
+  GThread *thread;
+  gint n_added;
+
+  open_store (fixture);
+
+  /* Whatever was counted before reading is read back, even while the
+   * other thread is flushing counters */
+  thread = g_thread_new ("add-counters", add_counters_thread, &data);
+
+  do
+    {
+      GList *entities;
+
+      n_added = g_atomic_int_get (&data.n_added);
+      entities = _tpl_log_store_get_entities (fixture->store,
+          fixture->account);
+      g_assert_cmpuint (g_list_length (entities), >=, n_added);
+      g_list_free_full (entities, g_object_unref);
+    }
+  while (n_added < CONCURRENT_COUNTERS);
+
+  g_thread_join (thread);
+}
+
+
+static void
+test_migrate (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  const gchar *account_name = get_account_name (fixture->account);
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  sqlite3 *db;
+  gchar *dirname, *query;
+
+  /* A database as it was before schema versions: no keys, and so duplicated
+   * counters and pending messages */
+  dirname = g_path_get_dirname (fixture->filename);
+  g_mkdir_with_parents (dirname, 0700);
+  g_free (dirname);
+
+  db = open_db (fixture);
+  exec_sql (db,
+      "CREATE TABLE messagecounts ("
+        "account TEXT, identifier TEXT, chatroom BOOLEAN, date DATE, "
+        "messages INTEGER);"
+      "CREATE TABLE pending_messages ("
+        "channel TEXT NOT NULL, id INTEGER, timestamp INTEGER)");
+
+  query = g_strdup_printf (
+      "INSERT INTO messagecounts VALUES "
+        "('%s', 'contact', 0, '2010-01-13', 2),"
+        "('%s', 'contact', 0, '2010-01-13', 3),"
+        "('%s', 'contact', 0, '2010-01-14', 1),"
+        "('%s', 'room', 1, '2010-01-13', 4)",
+      account_name, account_name, account_name, account_name);
+  exec_sql (db, query);
+  g_free (query);
+
+  query = g_strdup_printf (
+      "INSERT INTO pending_messages VALUES "
+        "('chan', 1, %" G_GINT64_FORMAT "),"
+        "('chan', 1, %" G_GINT64_FORMAT ")",
+      now - 10, now);
+  exec_sql (db, query);
+  g_free (query);
 
-  bus = tp_dbus_daemon_dup (&error);
+  g_assert_cmpint (query_int (db, "PRAGMA user_version"), ==, 0);
+  sqlite3_close (db);
+
+  open_store (fixture);
+
+  db = open_db (fixture);
+  g_assert_cmpint (query_int (db, "PRAGMA user_version"), ==,
+      SCHEMA_VERSION);
+  g_assert_cmpint (query_int (db, "SELECT COUNT(*) FROM messagecounts"), ==,
+      3);
+  g_assert_cmpint (query_int (db,
+        "SELECT messages FROM messagecounts WHERE identifier='contact' "
+        "AND date='2010-01-13'"), ==, 5);
+  g_assert_cmpint (query_int (db,
+        "SELECT messages FROM messagecounts WHERE identifier='room'"), ==, 4);
+
+  /* The latest of the pending messages is kept */
+  g_assert_cmpint (query_int (db, "SELECT COUNT(*) FROM pending_messages"),
+      ==, 1);
+  g_assert_cmpint (query_int (db, "SELECT timestamp FROM pending_messages"),
+      ==, now);
+  sqlite3_close (db);
+
+  /* The merged counter can be added to */
+  add_message (fixture, "contact", 13, 1, 2010);
+  g_object_unref (fixture->store);
+  fixture->store = NULL;
+
+  db = open_db (fixture);
+  g_assert_cmpint (query_int (db,
+        "SELECT messages FROM messagecounts WHERE identifier='contact' "
+        "AND date='2010-01-13'"), ==, 6);
+  sqlite3_close (db);
+
+  /* Opening it again doesn't migrate anything */
+  open_store (fixture);
+
+  db = open_db (fixture);
+  g_assert_cmpint (query_int (db, "PRAGMA user_version"), ==,
+      SCHEMA_VERSION);
+  g_assert_cmpint (query_int (db, "SELECT COUNT(*) FROM messagecounts"), ==,
+      3);
+  sqlite3_close (db);
+}
+
+
+#define BURST_COUNTERS (COUNTERS_MAX_PENDING * 2)
+
+static void
+test_transactions (SqliteTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreSqlitePrivate *priv;
+  TpBaseConnection *base_connection;
+  TpConnection *connection;
+  TpChannel *channel;
+  GHashTable *props;
+  GList *pending, *ids = NULL, *l;
+  GError *error = NULL;
+  gchar *chan_path;
+  sqlite3 *db;
+  guint i;
+
+  priv = open_store (fixture);
+
+  /* A burst of writes is grouped in a transaction, which other connections
+   * only see once it is committed */
+  for (i = 0; i < BURST_COUNTERS; i++)
+    {
+      gchar *identifier = g_strdup_printf ("contact%u", i);
+
+      add_message (fixture, identifier, 13, 1, 2010);
+      g_free (identifier);
+    }
+
+  g_assert_cmpuint (priv->transaction_writes, >, 0);
+  g_assert (!sqlite3_get_autocommit (priv->db));
+
+  db = open_db (fixture);
+  g_assert_cmpint (query_int (db, "SELECT COUNT(*) FROM messagecounts"), ==,
+      0);
+
+  commit_writes (priv);
+  g_assert (sqlite3_get_autocommit (priv->db));
+
+  g_assert_cmpint (query_int (db, "SELECT COUNT(*) FROM messagecounts"), ==,
+      BURST_COUNTERS);
+
+  /* Pending messages join the same transactions; removing some of them
+   * is done in a savepoint within it */
+  tp_tests_create_and_connect_conn (TP_TESTS_TYPE_SIMPLE_CONNECTION,
+      "me@test.com", &base_connection, &connection);
+
+  chan_path = tp_tests_simple_connection_ensure_text_chan (
+      TP_TESTS_SIMPLE_CONNECTION (base_connection), "contact", &props);
+  channel = tp_channel_new_from_properties (connection, chan_path, props,
+      &error);
+  g_assert_no_error (error);
+
+  for (i = 1; i <= 3; i++)
+    {
+      _tpl_log_store_sqlite_add_pending_message (fixture->store, channel, i,
+          g_get_real_time () / G_USEC_PER_SEC, &error);
+      g_assert_no_error (error);
+    }
+
+  ids = g_list_prepend (ids, GUINT_TO_POINTER (1));
+  ids = g_list_prepend (ids, GUINT_TO_POINTER (2));
+  g_assert (_tpl_log_store_sqlite_remove_pending_messages (fixture->store,
+        channel, ids, &error));
   g_assert_no_error (error);
+  g_list_free (ids);
 
-  factory = _tpl_client_factory_dup (bus);
+  /* The savepoint is released into the transaction, not committed */
+  g_assert (!sqlite3_get_autocommit (priv->db));
+  g_assert_cmpint (query_int (db, "SELECT COUNT(*) FROM pending_messages"),
+      ==, 0);
 
-  account =  tp_simple_client_factory_ensure_account (factory,
-      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/danielle_2emadeley_40collabora_2eco_2euk0",
-      NULL, &error);
+  pending = _tpl_log_store_sqlite_get_pending_messages (fixture->store,
+      channel, &error);
   g_assert_no_error (error);
+  g_assert_cmpuint (g_list_length (pending), ==, 1);
+  g_assert_cmpuint (((TplPendingMessage *) pending->data)->id, ==, 3);
+
+  for (l = pending; l != NULL; l = g_list_next (l))
+    g_free (l->data);
+  g_list_free (pending);
+
+  commit_writes (priv);
+
+  g_assert_cmpint (query_int (db, "SELECT COUNT(*) FROM pending_messages"),
+      ==, 1);
+  g_assert_cmpint (query_int (db, "SELECT id FROM pending_messages"), ==, 3);
+  sqlite3_close (db);
+
+  g_object_unref (channel);
+  g_free (chan_path);
+  g_hash_table_unref (props);
+
+  tp_tests_connection_assert_disconnect_succeeds (connection);
+  g_object_unref (connection);
+  g_object_unref (base_connection);
+}
+
+
+gint main (gint argc, gchar **argv)
+{
+  gchar *cache_dir;
+
+  /* Keep the cache out of the user's, before GLib looks it up */
+  cache_dir = g_build_filename (g_get_tmp_dir (), "logger-test-cache", NULL);
+  g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+  g_free (cache_dir);
+
+  g_type_init ();
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_bug_base ("http://bugs.freedesktop.org/show_bug.cgi?id=");
+
+  g_test_add ("/log-store-sqlite/contact-stats",
+      SqliteTestCaseFixture, NULL,
+      setup, test_contact_stats, teardown);
+
+  g_test_add ("/log-store-sqlite/counters",
+      SqliteTestCaseFixture, NULL,
+      setup, test_counters, teardown);
+
+  g_test_add ("/log-store-sqlite/counters-retry",
+      SqliteTestCaseFixture, NULL,
+      setup, test_counters_retry, teardown);
+
+  g_test_add ("/log-store-sqlite/counters-concurrent",
+      SqliteTestCaseFixture, NULL,
+      setup, test_counters_concurrent, teardown);
 
-  store = _tpl_log_store_sqlite_dup ();
+  g_test_add ("/log-store-sqlite/migrate",
+      SqliteTestCaseFixture, NULL,
+      setup, test_migrate, teardown);
 
-  g_print ("freq = %g\n",
-      _tpl_log_store_sqlite_get_frequency (TPL_LOG_STORE_SQLITE (store),
-        account, "dannielle.meyer@gmail.com"));
+  g_test_add ("/log-store-sqlite/transactions",
+      SqliteTestCaseFixture, NULL,
+      setup, test_transactions, teardown);
 
-  g_object_unref (store);
-  g_object_unref (account);
-  g_object_unref (bus);
-  g_object_unref (factory);
+  return g_test_run ();
 }
@@ -13,6 +13,9 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <glib.h>
 
+#include <sys/resource.h>
+#include <sys/wait.h>
+
 /* it was defined in telepathy-logger/log-store-xml.c */
 #undef DEBUG_FLAG
 #define DEBUG_FLAG TPL_DEBUG_TESTSUITE
@@ -471,6 +474,215 @@ test_add_text_event (XmlTestCaseFixture *fixture,
   g_list_free (events);
 }
 
+static TplEvent *
+new_text_event (TpAccount *account,
+    TplEntity *sender,
+    TplEntity *receiver,
+    gint64 timestamp,
+    const gchar *message)
+{
+  return g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", account,
+      "sender", sender,
+      "receiver", receiver,
+      "timestamp", timestamp,
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", message,
+      NULL);
+}
+
+static void
+test_add_empty_text_event (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *me, *contact;
+  TplEvent *event;
+  GList *batch = NULL, *events;
+  GError *error = NULL;
+  gint64 timestamp = time (NULL);
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "idle/irc/me",
+      &account, &account_service);
+
+  me = tpl_entity_new ("bob.mcbadgers@example.com", TPL_ENTITY_SELF,
+      "my-alias", "my-avatar");
+  contact = tpl_entity_new ("empty-contact", TPL_ENTITY_CONTACT,
+      "contact-alias", "contact-token");
+
+  /* A message without a body can't be written, and says so */
+  event = new_text_event (account, me, contact, timestamp, "");
+
+  g_assert (!_tpl_log_store_add_event (fixture->store, event, &error));
+  g_assert_error (error, TPL_LOG_STORE_ERROR, TPL_LOG_STORE_ERROR_FAILED);
+  g_clear_error (&error);
+
+  g_object_unref (event);
+
+  /* ... also in a batch, without preventing the others from being
+   * written */
+  batch = g_list_append (batch,
+      new_text_event (account, me, contact, timestamp, "my message 1"));
+  batch = g_list_append (batch,
+      new_text_event (account, me, contact, timestamp + 1, ""));
+  batch = g_list_append (batch,
+      new_text_event (account, me, contact, timestamp + 2, "my message 2"));
+
+  g_assert (!_tpl_log_store_add_events (fixture->store, batch, &error));
+  g_assert_error (error, TPL_LOG_STORE_ERROR, TPL_LOG_STORE_ERROR_FAILED);
+  g_clear_error (&error);
+
+  events = _tpl_log_store_get_filtered_events (fixture->store, account,
+      contact, TPL_EVENT_MASK_TEXT, 10, NULL, NULL);
+
+  g_assert_cmpint (g_list_length (events), ==, 2);
+  assert_cmp_text_event (batch->data, events->data);
+  assert_cmp_text_event (g_list_last (batch)->data, events->next->data);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+  g_list_free_full (events, g_object_unref);
+  g_list_free_full (batch, g_object_unref);
+  g_object_unref (me);
+  g_object_unref (contact);
+}
+
+static void
+test_add_event_open_files (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+  TpAccount *account;
+  TplEntity *me, *contact, *room;
+  TplEvent *event;
+  GError *error = NULL;
+  GList *events;
+  gint64 timestamp = time (NULL);
+  TpTestsSimpleAccount *account_service;
+  guint i;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "idle/irc/me",
+      &account, &account_service);
+
+  me = tpl_entity_new ("me", TPL_ENTITY_SELF, "my-alias", "my-avatar");
+  contact = tpl_entity_new ("contact", TPL_ENTITY_CONTACT, "contact-alias",
+      "contact-token");
+  room = tpl_entity_new_from_room_id ("room");
+
+  /* Only one file may stay open, so alternating between the contact and
+   * the room evicts the other file every time */
+  g_object_set (fixture->store, "max-open-files", 1, NULL);
+
+  for (i = 0; i < 10; i++)
+    {
+      event = g_object_new (TPL_TYPE_TEXT_EVENT,
+          /* TplEvent */
+          "account", account,
+          "sender", me,
+          "receiver", (i % 2 == 0) ? contact : room,
+          "timestamp", timestamp,
+          /* TplTextEvent */
+          "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+          "message", "my message",
+          NULL);
+
+      _tpl_log_store_add_event (fixture->store, event, &error);
+      g_assert_no_error (error);
+      g_object_unref (event);
+
+      g_assert_cmpuint (g_hash_table_size (self->priv->open_files), ==, 1);
+    }
+
+  events = _tpl_log_store_get_filtered_events (fixture->store, account, contact,
+      TPL_EVENT_MASK_TEXT, 1000000, NULL, NULL);
+  g_assert_cmpint (g_list_length (events), ==, 5);
+  g_list_foreach (events, (GFunc) g_object_unref, NULL);
+  g_list_free (events);
+
+  /* Keep both files open; each append must land before the footer */
+  g_object_set (fixture->store, "max-open-files", 2, NULL);
+
+  for (i = 0; i < 10; i++)
+    {
+      event = g_object_new (TPL_TYPE_TEXT_EVENT,
+          /* TplEvent */
+          "account", account,
+          "sender", me,
+          "receiver", (i % 2 == 0) ? contact : room,
+          "timestamp", timestamp,
+          /* TplTextEvent */
+          "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+          "message", "my message",
+          NULL);
+
+      _tpl_log_store_add_event (fixture->store, event, &error);
+      g_assert_no_error (error);
+      g_object_unref (event);
+    }
+
+  g_assert_cmpuint (g_hash_table_size (self->priv->open_files), ==, 2);
+
+  events = _tpl_log_store_get_filtered_events (fixture->store, account, room,
+      TPL_EVENT_MASK_TEXT, 1000000, NULL, NULL);
+  g_assert_cmpint (g_list_length (events), ==, 10);
+  g_list_foreach (events, (GFunc) g_object_unref, NULL);
+  g_list_free (events);
+
+  /* A delayed event for a past day doesn't stay open */
+  event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", account,
+      "sender", me,
+      "receiver", contact,
+      "timestamp", timestamp - (60 * 60 * 24),
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", "my message",
+      NULL);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+  g_object_unref (event);
+
+  g_assert_cmpuint (g_hash_table_size (self->priv->open_files), ==, 2);
+
+  /* Clearing must not leave us appending to unlinked files */
+  _tpl_log_store_clear_entity (fixture->store, account, contact);
+  g_assert_cmpuint (g_hash_table_size (self->priv->open_files), ==, 0);
+
+  event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", account,
+      "sender", me,
+      "receiver", contact,
+      "timestamp", timestamp,
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", "my message",
+      NULL);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+
+  events = _tpl_log_store_get_filtered_events (fixture->store, account, contact,
+      TPL_EVENT_MASK_TEXT, 1000000, NULL, NULL);
+  g_assert_cmpint (g_list_length (events), ==, 1);
+  assert_cmp_text_event (event, events->data);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+  g_object_unref (event);
+  g_list_foreach (events, (GFunc) g_object_unref, NULL);
+  g_list_free (events);
+  g_object_unref (me);
+  g_object_unref (contact);
+  g_object_unref (room);
+}
+
+
 static void
 test_add_superseding_event (XmlTestCaseFixture *fixture,
     gconstpointer user_data)
@@ -1073,48 +1285,1370 @@ test_get_events_for_date (XmlTestCaseFixture *fixture,
 }
 
 
-gint main (gint argc, gchar **argv)
+static gboolean
+parse_file_stream (TplLogStoreXml *self,
+    TpAccount *account,
+    const gchar *filename,
+    gboolean is_room,
+    const gchar *target_id,
+    GType type,
+    DayParse *parse)
 {
-  g_type_init ();
+  GMappedFile *mapped;
+  gboolean ret;
 
-  g_test_init (&argc, &argv, NULL);
-  g_test_bug_base ("http://bugs.freedesktop.org/show_bug.cgi?id=");
+  mapped = g_mapped_file_new (filename, FALSE, NULL);
+  g_assert (mapped != NULL);
 
-  g_test_add ("/log-store-xml/clear",
-      XmlTestCaseFixture, NULL,
-      setup_for_writing, test_clear, teardown);
+  ret = log_store_xml_parse_buffer (self, account, filename,
+      g_mapped_file_get_contents (mapped), g_mapped_file_get_length (mapped),
+      is_room, target_id, type, parse);
 
-  g_test_add ("/log-store-xml/clear-account",
-      XmlTestCaseFixture, NULL,
-      setup_for_writing, test_clear_account, teardown);
+  g_mapped_file_unref (mapped);
+  return ret;
+}
 
-  g_test_add ("/log-store-xml/clear-entity",
-      XmlTestCaseFixture, GINT_TO_POINTER (FALSE),
-      setup_for_writing, test_clear_entity, teardown);
 
-  g_test_add ("/log-store-xml/clear-entity-room",
-      XmlTestCaseFixture, GINT_TO_POINTER (TRUE),
-      setup_for_writing, test_clear_entity, teardown);
+static void
+assert_stream_matches_dom (XmlTestCaseFixture *fixture,
+    TpAccount *account,
+    const gchar *relative_path,
+    GType type)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+  DayParse streamed, parsed;
+  gchar *filename;
+  GList *s, *d;
 
-  g_test_add ("/log-store-xml/add-text-event",
-      XmlTestCaseFixture, NULL,
-      setup_for_writing, test_add_text_event, teardown);
+  filename = g_build_filename (g_getenv ("TPL_TEST_LOG_DIR"), "TpLogger",
+      "logs", relative_path, NULL);
 
-  g_test_add ("/log-store-xml/add-superseding-event",
-      XmlTestCaseFixture, NULL,
-      setup_for_writing, test_add_superseding_event, teardown);
+  day_parse_init (&streamed);
+  day_parse_init (&parsed);
 
-  g_test_add ("/log-store-xml/add-call-event",
-      XmlTestCaseFixture, NULL,
-      setup_for_writing, test_add_call_event, teardown);
+  g_assert (parse_file_stream (self, account, filename, FALSE,
+        "target@collabora.co.uk", type, &streamed));
+  log_store_xml_parse_file_dom (self, account, filename, FALSE,
+      "target@collabora.co.uk", type, &parsed);
 
-  g_test_add ("/log-store-xml/exists",
-      XmlTestCaseFixture, NULL,
-      setup, test_exists, teardown);
+  g_assert_cmpuint (g_queue_get_length (&streamed.events), >, 0);
+  g_assert_cmpuint (g_queue_get_length (&streamed.events), ==,
+      g_queue_get_length (&parsed.events));
 
-  g_test_add ("/log-store-xml/get-events-for-date",
-      XmlTestCaseFixture, NULL,
-      setup, test_get_events_for_date, teardown);
+  for (s = streamed.events.head, d = parsed.events.head;
+       s != NULL;
+       s = g_list_next (s), d = g_list_next (d))
+    {
+      g_assert (tpl_event_equal (s->data, d->data));
+
+      if (type == TPL_TYPE_TEXT_EVENT)
+        {
+          TplTextEvent *a = s->data, *b = d->data;
+
+          g_assert_cmpstr (tpl_text_event_get_message_token (a), ==,
+              tpl_text_event_get_message_token (b));
+          g_assert_cmpstr (tpl_text_event_get_supersedes_token (a), ==,
+              tpl_text_event_get_supersedes_token (b));
+          g_assert_cmpint (tpl_text_event_get_edit_timestamp (a), ==,
+              tpl_text_event_get_edit_timestamp (b));
+          g_assert_cmpuint (g_list_length (tpl_text_event_get_supersedes (a)),
+              ==, g_list_length (tpl_text_event_get_supersedes (b)));
+        }
+      else
+        {
+          TplCallEvent *a = s->data, *b = d->data;
+
+          g_assert_cmpint (tpl_call_event_get_duration (a), ==,
+              tpl_call_event_get_duration (b));
+          g_assert_cmpint (tpl_call_event_get_end_reason (a), ==,
+              tpl_call_event_get_end_reason (b));
+          g_assert_cmpstr (tpl_call_event_get_detailed_end_reason (a), ==,
+              tpl_call_event_get_detailed_end_reason (b));
+          g_assert_cmpstr (
+              tpl_entity_get_identifier (tpl_call_event_get_end_actor (a)), ==,
+              tpl_entity_get_identifier (tpl_call_event_get_end_actor (b)));
+        }
+    }
+
+  g_queue_foreach (&streamed, (GFunc) g_object_unref, NULL);
+  g_queue_clear (&streamed);
+  g_queue_foreach (&parsed, (GFunc) g_object_unref, NULL);
+  g_queue_clear (&parsed);
+  g_free (filename);
+}
+
+
+static void
+test_parse_stream (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  GQueue events = G_QUEUE_INIT;
+  DayParse parse;
+  gchar *filename;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  assert_stream_matches_dom (fixture, account,
+      "gabble_jabber_user_40collabora_2eco_2euk/user4@collabora.co.uk/"
+      "20100113.log", TPL_TYPE_TEXT_EVENT);
+  assert_stream_matches_dom (fixture, account,
+      "gabble_jabber_user_40collabora_2eco_2euk/user4@collabora.co.uk/"
+      "20100113.call.log", TPL_TYPE_CALL_EVENT);
+  assert_stream_matches_dom (fixture, account,
+      "gabble_jabber_test2_40collabora_2eco_2euk0/derek.foreman@collabora.co.uk/"
+      "20110210.log", TPL_TYPE_TEXT_EVENT);
+
+  /* This file contains invalid character references: the streaming parser
+   * must give up, and the DOM fallback must still recover the events. */
+  filename = g_build_filename (g_getenv ("TPL_TEST_LOG_DIR"), "TpLogger",
+      "logs", "gabble_jabber_user_40collabora_2eco_2euk",
+      "user6@collabora.co.uk", "20140102.log", NULL);
+
+  day_parse_init (&parse);
+  g_assert (!parse_file_stream (TPL_LOG_STORE_XML (fixture->store), account,
+        filename, FALSE, "user6@collabora.co.uk", TPL_TYPE_TEXT_EVENT,
+        &parse));
+  day_parse_clear (&parse);
+
+  log_store_xml_get_events_for_file (TPL_LOG_STORE_XML (fixture->store),
+      account, filename, TPL_TYPE_TEXT_EVENT, &events);
+  g_assert_cmpuint (g_queue_get_length (&events), ==, 2);
+
+  g_queue_foreach (&events, (GFunc) g_object_unref, NULL);
+  g_queue_clear (&events);
+  g_free (filename);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+#define TAIL_MESSAGE(time, token, body) \
+  "<message time='" time "' cm_id='1' id='user7@collabora.co.uk' " \
+  "name='User7' token='' isuser='false' type='normal' message-token='" \
+  token "'>" body "</message>\n"
+
+#define TAIL_CALL(time, duration) \
+  "<call time='" time "' id='user7@collabora.co.uk' name='User7' " \
+  "isuser='false' token='' duration='" duration "' " \
+  "actor='user7@collabora.co.uk' actortype='contact' actorname='User7' " \
+  "actortoken='' reason='user-requested' detail='' />\n"
+
+
+static void
+write_day_file (const gchar *dir,
+    const gchar *name,
+    const gchar *elements)
+{
+  gchar *filename = g_build_filename (dir, name, NULL);
+  gchar *contents = g_strconcat (LOG_HEADER, elements, LOG_FOOTER, NULL);
+  GError *error = NULL;
+
+  g_file_set_contents (filename, contents, -1, &error);
+  g_assert_no_error (error);
+
+  g_free (contents);
+  g_free (filename);
+}
+
+
+static gboolean
+filter_odd_timestamps (TplEvent *event,
+    gpointer user_data)
+{
+  return tpl_event_get_timestamp (event) % 2 == 1;
+}
+
+
+/* What get_filtered_events () used to do: parse every day file in full */
+static GList *
+get_filtered_events_from_full_parse (TplLogStore *store,
+    TpAccount *account,
+    TplEntity *target,
+    guint num_events,
+    TplLogEventFilter filter)
+{
+  GList *dates, *l, *events = NULL;
+  guint i = 0;
+
+  dates = _tpl_log_store_get_dates (store, account, target,
+      TPL_EVENT_MASK_ANY);
+
+  for (l = g_list_last (dates); l != NULL && i < num_events;
+       l = g_list_previous (l))
+    {
+      GList *day, *n;
+
+      day = _tpl_log_store_get_events_for_date (store, account, target,
+          TPL_EVENT_MASK_ANY, l->data);
+
+      for (n = g_list_last (day); n != NULL && i < num_events;
+           n = g_list_previous (n))
+        {
+          if (filter == NULL || filter (n->data, NULL))
+            {
+              events = g_list_prepend (events, g_object_ref (n->data));
+              i++;
+            }
+        }
+
+      g_list_free_full (day, g_object_unref);
+    }
+
+  g_list_free_full (dates, (GDestroyNotify) g_date_free);
+
+  return events;
+}
+
+
+static void
+assert_filtered_events_match_full_parse (XmlTestCaseFixture *fixture,
+    TpAccount *account,
+    TplEntity *target)
+{
+  guint counts[] = { 1, 3, 8, 20 };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (counts); i++)
+    {
+      TplLogEventFilter filter = (i % 2 == 0) ? NULL : filter_odd_timestamps;
+      GList *events, *expected, *e, *x;
+
+      events = _tpl_log_store_get_filtered_events (fixture->store, account,
+          target, TPL_EVENT_MASK_ANY, counts[i], filter, NULL);
+      expected = get_filtered_events_from_full_parse (fixture->store,
+          account, target, counts[i], filter);
+
+      g_assert_cmpuint (g_list_length (events), ==,
+          g_list_length (expected));
+
+      for (e = events, x = expected; e != NULL;
+           e = g_list_next (e), x = g_list_next (x))
+        {
+          g_assert (G_OBJECT_TYPE (e->data) == G_OBJECT_TYPE (x->data));
+          g_assert (tpl_event_equal (e->data, x->data));
+        }
+
+      g_list_free_full (events, g_object_unref);
+      g_list_free_full (expected, g_object_unref);
+    }
+}
+
+
+static void
+test_get_filtered_events_tail (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *target;
+  GDate *date;
+  GList *events;
+  guint found;
+  gchar *dir;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  target = tpl_entity_new ("user7@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "User7", "");
+
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user7@collabora.co.uk",
+      NULL);
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+
+  write_day_file (dir, "20130101.log",
+      TAIL_MESSAGE ("20130101T09:00:00", "t1", "a")
+      TAIL_MESSAGE ("20130101T09:00:01", "t2", "b")
+      TAIL_MESSAGE ("20130101T09:00:02", "t3", "c")
+      TAIL_MESSAGE ("20130101T09:00:03", "t4", "d")
+      TAIL_MESSAGE ("20130101T09:00:04", "t5", "e"));
+
+  /* Escaped markup in a body must not be taken for an element */
+  write_day_file (dir, "20130102.log",
+      TAIL_MESSAGE ("20130102T10:00:00", "t6", "f")
+      TAIL_MESSAGE ("20130102T10:00:01", "t7", "&lt;call time='x'/&gt;")
+      TAIL_MESSAGE ("20130102T10:00:02", "t8", "two\nlines")
+      TAIL_MESSAGE ("20130102T10:00:03", "t9", "&lt;message&gt;")
+      TAIL_MESSAGE ("20130102T10:00:05", "t10", "j"));
+
+  write_day_file (dir, "20130102.call.log",
+      TAIL_CALL ("20130102T10:00:02", "1")
+      TAIL_CALL ("20130102T10:00:04", "2"));
+
+  /* The newest day can be served from the tail of its files */
+  date = g_date_new_dmy (2, 1, 2013);
+  g_assert (log_store_xml_get_newest_events_for_date (self, account, target,
+        TPL_EVENT_MASK_ANY, date, 3, NULL, NULL, &events, &found));
+  g_assert_cmpuint (found, ==, 3);
+  g_assert_cmpuint (g_list_length (events), ==, 3);
+  g_assert (TPL_IS_TEXT_EVENT (events->data));
+  g_assert_cmpstr (tpl_text_event_get_message (events->data), ==,
+      "<message>");
+  g_assert (TPL_IS_CALL_EVENT (g_list_nth_data (events, 1)));
+  g_assert_cmpstr (tpl_text_event_get_message (g_list_nth_data (events, 2)),
+      ==, "j");
+  g_list_free_full (events, g_object_unref);
+
+  assert_filtered_events_match_full_parse (fixture, account, target);
+
+  /* An edit moves next to the message it supersedes, so the whole day has to
+   * be parsed */
+  write_day_file (dir, "20130102.log",
+      TAIL_MESSAGE ("20130102T10:00:00", "t6", "f")
+      TAIL_MESSAGE ("20130102T10:00:01", "t7", "&lt;call time='x'/&gt;")
+      TAIL_MESSAGE ("20130102T10:00:02", "t8", "two\nlines")
+      TAIL_MESSAGE ("20130102T10:00:03", "t9", "&lt;message&gt;")
+      TAIL_MESSAGE ("20130102T10:00:05", "t10", "j")
+      "<message time='20130102T10:00:07' cm_id='1' "
+      "id='user7@collabora.co.uk' name='User7' token='' isuser='false' "
+      "type='normal' message-token='t11' supersedes-token='t9' "
+      "edit-timestamp='20130102T10:00:07'>i</message>\n");
+
+  g_assert (!log_store_xml_get_newest_events_for_date (self, account, target,
+        TPL_EVENT_MASK_ANY, date, 3, NULL, NULL, &events, &found));
+
+  assert_filtered_events_match_full_parse (fixture, account, target);
+
+  g_date_free (date);
+  g_free (dir);
+  g_object_unref (target);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+static void
+assert_event_cache_stats (XmlTestCaseFixture *fixture,
+    guint hits,
+    guint misses)
+{
+  guint cache_hits, cache_misses;
+
+  g_object_get (fixture->store,
+      "event-cache-hits", &cache_hits,
+      "event-cache-misses", &cache_misses,
+      NULL);
+
+  g_assert_cmpuint (cache_hits, ==, hits);
+  g_assert_cmpuint (cache_misses, ==, misses);
+}
+
+
+static void
+test_event_cache (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *me, *user4;
+  TplEvent *event;
+  GDateTime *when;
+  GDate *date;
+  GList *events, *cached;
+  gpointer first, last;
+  GError *error = NULL;
+  gchar *dir;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  me = tpl_entity_new ("user@collabora.co.uk", TPL_ENTITY_SELF,
+      "Me", "");
+  user4 = tpl_entity_new ("user4@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "User4", "");
+  date = g_date_new_dmy (13, 1, 2010);
+
+  /* The second read is served from the cache, sharing the events */
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user4, TPL_EVENT_MASK_TEXT, date);
+  assert_event_cache_stats (fixture, 0, 1);
+
+  cached = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user4, TPL_EVENT_MASK_TEXT, date);
+  assert_event_cache_stats (fixture, 1, 1);
+
+  g_assert_cmpuint (g_list_length (events), ==, 3);
+  g_assert_cmpuint (g_list_length (cached), ==, 3);
+  g_assert (events->data == cached->data);
+  g_assert (g_list_last (events)->data == g_list_last (cached)->data);
+
+  /* The cache keeps its own references, so these stay valid for comparing */
+  first = events->data;
+  last = g_list_last (events)->data;
+
+  g_list_free_full (events, g_object_unref);
+  g_list_free_full (cached, g_object_unref);
+
+  /* Appending to the day through the store only parses what was appended */
+  when = g_date_time_new_utc (2010, 1, 13, 18, 0, 0);
+  event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", account,
+      "sender", me,
+      "receiver", user4,
+      "timestamp", g_date_time_to_unix (when),
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", "appended",
+      NULL);
+  g_date_time_unref (when);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+  g_object_unref (event);
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user4, TPL_EVENT_MASK_TEXT, date);
+  assert_event_cache_stats (fixture, 2, 1);
+  g_assert_cmpuint (g_list_length (events), ==, 4);
+  g_assert (events->data == first);
+  g_assert (g_list_nth_data (events, 2) == last);
+  g_assert_cmpstr (
+      tpl_text_event_get_message (g_list_last (events)->data), ==,
+      "appended");
+  g_list_free_full (events, g_object_unref);
+
+  /* Changing the file behind the store's back makes it parse it again */
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user4@collabora.co.uk",
+      NULL);
+  write_day_file (dir, "20100113.log",
+      "<message time='20100113T17:00:00' cm_id='1' "
+      "id='user4@collabora.co.uk' name='User4' token='' isuser='false' "
+      "type='normal'>rewritten</message>\n");
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user4, TPL_EVENT_MASK_TEXT, date);
+  assert_event_cache_stats (fixture, 2, 2);
+  g_assert_cmpuint (g_list_length (events), ==, 1);
+  g_assert_cmpstr (tpl_text_event_get_message (events->data), ==,
+      "rewritten");
+  g_list_free_full (events, g_object_unref);
+
+  /* Without a budget nothing is kept */
+  g_object_set (fixture->store, "event-cache-size", 0, NULL);
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user4, TPL_EVENT_MASK_TEXT, date);
+  g_list_free_full (events, g_object_unref);
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user4, TPL_EVENT_MASK_TEXT, date);
+  g_list_free_full (events, g_object_unref);
+  assert_event_cache_stats (fixture, 2, 4);
+
+  g_free (dir);
+  g_date_free (date);
+  g_object_unref (me);
+  g_object_unref (user4);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+#define LARGE_DAY_EVENTS 2000
+
+static void
+test_event_cache_large_day (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *user8;
+  GDate *date;
+  GList *events;
+  GString *elements;
+  GStatBuf st;
+  gchar *dir, *filename, *body;
+  gsize budget;
+  guint i;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  user8 = tpl_entity_new ("user8@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "User8", "");
+  date = g_date_new_dmy (1, 3, 2013);
+
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user8@collabora.co.uk",
+      NULL);
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+
+  /* A busy day: lots of short messages, so the XML markup outweighs them */
+  body = g_strnfill (200, 'x');
+  elements = g_string_new (NULL);
+  for (i = 0; i < LARGE_DAY_EVENTS; i++)
+    g_string_append_printf (elements,
+        "<message time='20130301T%02u:%02u:%02u' cm_id='1' "
+        "id='user8@collabora.co.uk' name='User8' token='' isuser='false' "
+        "type='normal'>%s</message>\n",
+        i / 3600, (i / 60) % 60, i % 60, body);
+  write_day_file (dir, "20130301.log", elements->str);
+
+  filename = g_build_filename (dir, "20130301.log", NULL);
+  g_assert_cmpint (g_stat (filename, &st), ==, 0);
+
+  /* The day takes more than half of the budget on disk, and would not have
+   * fit if it was charged its file size plus the per event overhead */
+  budget = st.st_size + LARGE_DAY_EVENTS * 200;
+  g_assert_cmpuint (st.st_size, >, budget / 2);
+  g_object_set (fixture->store, "event-cache-size", budget, NULL);
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user8, TPL_EVENT_MASK_TEXT, date);
+  g_assert_cmpuint (g_list_length (events), ==, LARGE_DAY_EVENTS);
+  g_list_free_full (events, g_object_unref);
+  assert_event_cache_stats (fixture, 0, 1);
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user8, TPL_EVENT_MASK_TEXT, date);
+  g_assert_cmpuint (g_list_length (events), ==, LARGE_DAY_EVENTS);
+  g_list_free_full (events, g_object_unref);
+  assert_event_cache_stats (fixture, 1, 1);
+
+  g_string_free (elements, TRUE);
+  g_free (body);
+  g_free (filename);
+  g_free (dir);
+  g_date_free (date);
+  g_object_unref (user8);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+static void
+add_edit (XmlTestCaseFixture *fixture,
+    TpAccount *account,
+    TplEntity *sender,
+    TplEntity *receiver,
+    gint seconds,
+    const gchar *token,
+    const gchar *message)
+{
+  TplEvent *event;
+  GDateTime *when;
+  GError *error = NULL;
+
+  when = g_date_time_new_utc (2013, 2, 1, 9, 0, seconds);
+  event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", account,
+      "sender", sender,
+      "receiver", receiver,
+      "timestamp", g_date_time_to_unix (when),
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", message,
+      "message-token", token,
+      "supersedes-token", "e1",
+      "edit-timestamp", g_date_time_to_unix (when),
+      NULL);
+  g_date_time_unref (when);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+  g_object_unref (event);
+}
+
+
+static void
+assert_events_match_full_parse (XmlTestCaseFixture *fixture,
+    TpAccount *account,
+    const gchar *filename,
+    GList *events)
+{
+  DayParse parsed;
+  GList *e, *p;
+
+  day_parse_init (&parsed);
+  log_store_xml_parse_file_dom (TPL_LOG_STORE_XML (fixture->store), account,
+      filename, FALSE, "user7@collabora.co.uk", TPL_TYPE_TEXT_EVENT, &parsed);
+  g_assert_cmpuint (g_list_length (events), ==,
+      g_queue_get_length (&parsed.events));
+
+  for (e = events, p = parsed.events.head;
+       e != NULL;
+       e = g_list_next (e), p = g_list_next (p))
+    {
+      g_assert (tpl_event_equal (e->data, p->data));
+      g_assert_cmpstr (tpl_text_event_get_message (e->data), ==,
+          tpl_text_event_get_message (p->data));
+      g_assert_cmpuint (
+          g_list_length (tpl_text_event_get_supersedes (e->data)), ==,
+          g_list_length (tpl_text_event_get_supersedes (p->data)));
+    }
+
+  day_parse_clear (&parsed);
+}
+
+
+static void
+test_event_cache_append (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *me, *user7;
+  GDate *date;
+  GList *events;
+  gchar *dir, *filename;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  me = tpl_entity_new ("user@collabora.co.uk", TPL_ENTITY_SELF,
+      "Me", "");
+  user7 = tpl_entity_new ("user7@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "User7", "");
+  date = g_date_new_dmy (1, 2, 2013);
+
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user7@collabora.co.uk",
+      NULL);
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+
+  filename = g_build_filename (dir, "20130201.log", NULL);
+  write_day_file (dir, "20130201.log",
+      TAIL_MESSAGE ("20130201T09:00:00", "e1", "typo")
+      TAIL_MESSAGE ("20130201T09:00:01", "e2", "other"));
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user7, TPL_EVENT_MASK_TEXT, date);
+  assert_event_cache_stats (fixture, 0, 1);
+  g_assert_cmpuint (g_list_length (events), ==, 2);
+  g_list_free_full (events, g_object_unref);
+
+  /* An appended edit replaces the message it supersedes in the cached day */
+  add_edit (fixture, account, user7, me, 2, "e3", "fixed");
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user7, TPL_EVENT_MASK_TEXT, date);
+  assert_event_cache_stats (fixture, 1, 1);
+  g_assert_cmpuint (g_list_length (events), ==, 2);
+  g_assert_cmpstr (tpl_text_event_get_message (events->data), ==, "fixed");
+  g_assert_cmpuint (
+      g_list_length (tpl_text_event_get_supersedes (events->data)), ==, 1);
+  assert_events_match_full_parse (fixture, account, filename, events);
+  g_list_free_full (events, g_object_unref);
+
+  /* A second edit of the same message is found through the links kept from
+   * the earlier parses */
+  add_edit (fixture, account, user7, me, 3, "e4", "fixed again");
+
+  events = _tpl_log_store_get_events_for_date (fixture->store, account,
+      user7, TPL_EVENT_MASK_TEXT, date);
+  assert_event_cache_stats (fixture, 2, 1);
+  g_assert_cmpuint (g_list_length (events), ==, 2);
+  g_assert_cmpstr (tpl_text_event_get_message (events->data), ==,
+      "fixed again");
+  g_assert_cmpuint (
+      g_list_length (tpl_text_event_get_supersedes (events->data)), ==, 2);
+  assert_events_match_full_parse (fixture, account, filename, events);
+  g_list_free_full (events, g_object_unref);
+
+  g_free (filename);
+  g_free (dir);
+  g_date_free (date);
+  g_object_unref (me);
+  g_object_unref (user7);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+static void
+assert_dates (GList *dates,
+    const guint32 *expected,
+    guint n_expected)
+{
+  GList *l;
+  guint i = 0;
+
+  g_assert_cmpuint (g_list_length (dates), ==, n_expected);
+
+  for (l = dates; l != NULL; l = g_list_next (l), i++)
+    {
+      GDate *date = l->data;
+
+      g_assert_cmpuint (g_date_get_year (date) * 10000
+          + g_date_get_month (date) * 100 + g_date_get_day (date), ==,
+          expected[i]);
+    }
+
+  g_list_free_full (dates, (GDestroyNotify) g_date_free);
+}
+
+
+static void
+test_get_dates_index (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  static const guint32 text_only[] = { 20090101, 20110101, 20120229 };
+  static const guint32 call_only[] = { 20100101, 20110101 };
+  static const guint32 any[] = { 20090101, 20100101, 20110101, 20120229 };
+  static const guint32 added[] = { 20090101, 20100101, 20110101, 20120229,
+      20130101 };
+  static const guint32 written[] = { 20090101, 20100101, 20110101, 20120229,
+      20130101, 20130301 };
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *me, *user8;
+  TplEvent *event;
+  GDateTime *when;
+  GError *error = NULL;
+  gchar *dir;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  me = tpl_entity_new ("user@collabora.co.uk", TPL_ENTITY_SELF,
+      "Me", "");
+  user8 = tpl_entity_new ("user8@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "User8", "");
+
+  g_assert (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_ANY) == NULL);
+  g_assert (!_tpl_log_store_exists (fixture->store, account, user8,
+        TPL_EVENT_MASK_TEXT));
+
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user8@collabora.co.uk",
+      NULL);
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+
+  /* Written in no particular order, along with files that aren't days */
+  write_day_file (dir, "20120229.log", "");
+  write_day_file (dir, "20110101.call.log", "");
+  write_day_file (dir, "20090101.log", "");
+  write_day_file (dir, "20110101.log", "");
+  write_day_file (dir, "20100101.call.log", "");
+  write_day_file (dir, "20100230.log", "");
+  write_day_file (dir, "2010010.log", "");
+  write_day_file (dir, "20100101.log~", "");
+
+  assert_dates (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_TEXT), text_only, G_N_ELEMENTS (text_only));
+  assert_dates (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_CALL), call_only, G_N_ELEMENTS (call_only));
+  assert_dates (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_ANY), any, G_N_ELEMENTS (any));
+  g_assert (_tpl_log_store_exists (fixture->store, account, user8,
+        TPL_EVENT_MASK_CALL));
+
+  /* Files added behind the store's back are noticed */
+  write_day_file (dir, "20130101.log", "");
+
+  assert_dates (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_ANY), added, G_N_ELEMENTS (added));
+
+  /* And so are those the store creates */
+  when = g_date_time_new_utc (2013, 3, 1, 12, 0, 0);
+  event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", account,
+      "sender", me,
+      "receiver", user8,
+      "timestamp", g_date_time_to_unix (when),
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", "new day",
+      NULL);
+  g_date_time_unref (when);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+  g_object_unref (event);
+
+  assert_dates (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_ANY), written, G_N_ELEMENTS (written));
+  assert_dates (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_CALL), call_only, G_N_ELEMENTS (call_only));
+
+  /* Clearing the entity drops its index */
+  _tpl_log_store_clear_entity (fixture->store, account, user8);
+  g_assert (_tpl_log_store_get_dates (fixture->store, account, user8,
+        TPL_EVENT_MASK_ANY) == NULL);
+
+  g_free (dir);
+  g_object_unref (me);
+  g_object_unref (user8);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+static GList *
+search_hit_keys (GList *hits)
+{
+  GList *keys = NULL;
+  GList *l;
+
+  for (l = hits; l != NULL; l = g_list_next (l))
+    {
+      TplLogSearchHit *hit = l->data;
+
+      keys = g_list_prepend (keys, g_strdup_printf ("%s %s %u",
+            hit->account != NULL ?
+              tp_proxy_get_object_path (hit->account) : "",
+            tpl_entity_get_identifier (hit->target),
+            g_date_get_julian (hit->date)));
+    }
+
+  tpl_log_manager_search_free (hits);
+
+  return g_list_sort (keys, (GCompareFunc) g_strcmp0);
+}
+
+
+/* Checks that searching through the index finds exactly what reading every
+ * file does */
+static void
+assert_search_matches_full_scan (XmlTestCaseFixture *fixture,
+    const gchar *text,
+    gint type_mask,
+    guint expected)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+  GList *indexed, *scanned, *i, *s;
+
+  indexed = search_hit_keys (_tpl_log_store_search_new (fixture->store,
+        text, type_mask));
+  scanned = search_hit_keys (_log_store_xml_search_in_files (self, text,
+        log_store_xml_get_all_files (self, NULL, type_mask, NULL), type_mask,
+        NULL));
+
+  g_assert_cmpuint (g_list_length (indexed), ==, expected);
+  g_assert_cmpuint (g_list_length (scanned), ==, expected);
+
+  for (i = indexed, s = scanned; i != NULL;
+       i = g_list_next (i), s = g_list_next (s))
+    g_assert_cmpstr (i->data, ==, s->data);
+
+  g_list_free_full (indexed, g_free);
+  g_list_free_full (scanned, g_free);
+}
+
+
+/* The number of text day files the search index has a stamp for */
+static guint
+count_indexed_text_files (TplLogSearchIndex *index,
+    const gchar *dir)
+{
+  GHashTable *stamps;
+  GHashTableIter iter;
+  gpointer path;
+  guint n = 0;
+
+  stamps = _tpl_log_search_index_dup_stamps (index, dir);
+
+  g_hash_table_iter_init (&iter, stamps);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    {
+      if (!g_str_has_suffix (path, LOG_FILENAME_CALL_SUFFIX))
+        n++;
+    }
+
+  g_hash_table_unref (stamps);
+
+  return n;
+}
+
+static void
+test_search_index (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+  TplLogSearchIndex *index;
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  TplEntity *me, *user4;
+  TplEvent *event;
+  GDateTime *when;
+  GHashTable *matches;
+  GError *error = NULL;
+  gchar *dir, *filename;
+  guint n_text_files;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  /* The first search indexes every file; user6's file isn't well-formed,
+   * but it is indexed as text all the same */
+  assert_search_matches_full_scan (fixture, "user@collabora.co.uk",
+      TPL_EVENT_MASK_TEXT, 5);
+  assert_search_matches_full_scan (fixture, "USER3@collabora",
+      TPL_EVENT_MASK_ANY, 1);
+  assert_search_matches_full_scan (fixture, "Nicolas1",
+      TPL_EVENT_MASK_CALL, 3);
+  assert_search_matches_full_scan (fixture, "no such text anywhere",
+      TPL_EVENT_MASK_ANY, 0);
+
+  /* Too short for the index, these read every file */
+  assert_search_matches_full_scan (fixture, "8", TPL_EVENT_MASK_TEXT, 6);
+
+  index = log_store_xml_get_search_index (self);
+  g_assert (index != NULL);
+  g_assert (_tpl_log_search_index_match (index, "8") == NULL);
+
+  /* Searching the calls leaves the text files indexed */
+  n_text_files = count_indexed_text_files (index,
+      log_store_xml_get_basedir (self));
+  g_assert_cmpuint (n_text_files, >, 0);
+  assert_search_matches_full_scan (fixture, "Nicolas1",
+      TPL_EVENT_MASK_CALL, 3);
+  g_assert_cmpuint (count_indexed_text_files (index,
+        log_store_xml_get_basedir (self)), ==, n_text_files);
+
+  /* Events written through the store are indexed as they are written */
+  me = tpl_entity_new ("user@collabora.co.uk", TPL_ENTITY_SELF,
+      "Me", "");
+  user4 = tpl_entity_new ("user4@collabora.co.uk", TPL_ENTITY_CONTACT,
+      "User4", "");
+
+  when = g_date_time_new_utc (2010, 1, 13, 18, 0, 0);
+  event = g_object_new (TPL_TYPE_TEXT_EVENT,
+      /* TplEvent */
+      "account", account,
+      "sender", me,
+      "receiver", user4,
+      "timestamp", g_date_time_to_unix (when),
+      /* TplTextEvent */
+      "message-type", TP_CHANNEL_TEXT_MESSAGE_TYPE_NORMAL,
+      "message", "Zebra & crossing",
+      NULL);
+  g_date_time_unref (when);
+
+  _tpl_log_store_add_event (fixture->store, event, &error);
+  g_assert_no_error (error);
+  g_object_unref (event);
+
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user4@collabora.co.uk",
+      NULL);
+  filename = g_build_filename (dir, "20100113.log", NULL);
+
+  matches = _tpl_log_search_index_match (index, "zebra &amp; cross");
+  g_assert (matches != NULL);
+  g_assert_cmpuint (g_hash_table_size (matches), ==, 1);
+  g_assert (g_hash_table_lookup (matches, filename) != NULL);
+  g_hash_table_unref (matches);
+
+  assert_search_matches_full_scan (fixture, "zebra & cross",
+      TPL_EVENT_MASK_TEXT, 1);
+  assert_search_matches_full_scan (fixture, "user@collabora.co.uk",
+      TPL_EVENT_MASK_TEXT, 6);
+
+  /* Files changed behind the store's back are indexed again, and deleted
+   * ones forgotten */
+  write_day_file (dir, "20100114.log",
+      "<message time='20100114T10:00:00' cm_id='1' "
+      "id='user4@collabora.co.uk' name='User4' token='' isuser='false' "
+      "type='normal'>quokka</message>\n");
+  assert_search_matches_full_scan (fixture, "quokka", TPL_EVENT_MASK_TEXT, 1);
+
+  g_free (filename);
+  filename = g_build_filename (dir, "20100114.log", NULL);
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+  assert_search_matches_full_scan (fixture, "quokka", TPL_EVENT_MASK_TEXT, 0);
+
+  matches = _tpl_log_search_index_match (index, "quokka");
+  g_assert (matches != NULL);
+  g_assert_cmpuint (g_hash_table_size (matches), ==, 0);
+  g_hash_table_unref (matches);
+
+  g_free (filename);
+  g_free (dir);
+  g_object_unref (me);
+  g_object_unref (user4);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+/* Enough files for the search to be spread over several threads */
+#define SEARCH_PARALLEL_FILES (SEARCH_THREADS_MAX * SEARCH_FILES_PER_THREAD)
+
+static void
+test_search_parallel (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  GList *files = NULL;
+  GList *hits, *l;
+  GDate *date;
+  gchar *dir;
+  guint i, expected = 0;
+  guint32 last_day = G_MAXUINT32;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user7@collabora.co.uk",
+      NULL);
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+
+  date = g_date_new_dmy (1, G_DATE_JANUARY, 2011);
+
+  for (i = 0; i < SEARCH_PARALLEL_FILES; i++)
+    {
+      gchar name[sizeof ("YYYYMMDD.log")];
+
+      g_date_strftime (name, sizeof (name), "%Y%m%d.log", date);
+      write_day_file (dir, name, i % 3 == 0 ?
+          "<message time='20110101T10:00:00' cm_id='1' "
+          "id='user7@collabora.co.uk' name='User7' token='' isuser='false' "
+          "type='normal'>a needle in a haystack</message>\n" :
+          "<message time='20110101T10:00:00' cm_id='1' "
+          "id='user7@collabora.co.uk' name='User7' token='' isuser='false' "
+          "type='normal'>just hay</message>\n");
+
+      if (i % 3 == 0)
+        expected++;
+
+      files = g_list_prepend (files, g_build_filename (dir, name, NULL));
+      g_date_add_days (date, 1);
+    }
+
+  /* Oldest file first. Hits come out in the reverse order of the files,
+   * as they did when files were matched one at a time */
+  files = g_list_reverse (files);
+  hits = _log_store_xml_search_in_files (self, "NEEDLE", files,
+      TPL_EVENT_MASK_TEXT, NULL);
+
+  g_assert_cmpuint (g_list_length (hits), ==, expected);
+
+  for (l = hits; l != NULL; l = g_list_next (l))
+    {
+      TplLogSearchHit *hit = l->data;
+
+      g_assert_cmpstr (tpl_entity_get_identifier (hit->target), ==,
+          "user7@collabora.co.uk");
+      g_assert_cmpuint (g_date_get_julian (hit->date), <, last_day);
+      last_day = g_date_get_julian (hit->date);
+    }
+
+  tpl_log_manager_search_free (hits);
+  g_date_free (date);
+  g_free (dir);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+#define SEARCH_LITERAL_MESSAGE(text) \
+  "<message time='20110101T10:00:00' cm_id='1' " \
+  "id='user7@collabora.co.uk' name='User7' token='' isuser='false' " \
+  "type='normal'>" text "</message>\n"
+
+static const struct
+{
+  const gchar *elements;
+  const gchar *text;
+  gint type_mask;
+  gboolean matches;
+} search_literal_cases[] = {
+  { SEARCH_LITERAL_MESSAGE ("Hello World"), "hello world",
+    TPL_EVENT_MASK_TEXT, TRUE },
+  { SEARCH_LITERAL_MESSAGE ("fish &amp; chips"), "FISH & Chips",
+    TPL_EVENT_MASK_TEXT, TRUE },
+  /* '>' is allowed in element content */
+  { SEARCH_LITERAL_MESSAGE ("a > b > c and d"), "and d",
+    TPL_EVENT_MASK_TEXT, TRUE },
+  /* in the start tag */
+  { SEARCH_LITERAL_MESSAGE ("hi"), "User7", TPL_EVENT_MASK_TEXT, TRUE },
+  /* the text has to be in a single element */
+  { SEARCH_LITERAL_MESSAGE ("fish") SEARCH_LITERAL_MESSAGE ("chips"),
+    "fish chips", TPL_EVENT_MASK_TEXT, FALSE },
+  /* first found where it doesn't count, then where it does */
+  { "<call time='20110101T10:00:00' id='user7@collabora.co.uk' "
+    "name='needle' actor='user7@collabora.co.uk' actortype='contact' "
+    "actorname='User7' actortoken='' duration='1' reason='user-requested' "
+    "detail=''/>\n" SEARCH_LITERAL_MESSAGE ("a needle"), "NEEDLE",
+    TPL_EVENT_MASK_TEXT, TRUE },
+  { "<call time='20110101T10:00:00' id='user7@collabora.co.uk' "
+    "name='needle' actor='user7@collabora.co.uk' actortype='contact' "
+    "actorname='User7' actortoken='' duration='1' reason='user-requested' "
+    "detail=''/>\n", "needle", TPL_EVENT_MASK_TEXT, FALSE },
+  /* U+00DF LATIN SMALL LETTER SHARP S makes the whole file go through the
+   * regex */
+  { SEARCH_LITERAL_MESSAGE ("Stra\xc3\x9f" "e"), "strasse",
+    TPL_EVENT_MASK_TEXT, FALSE },
+  { SEARCH_LITERAL_MESSAGE ("Stra\xc3\x9f" "e"), "STRA",
+    TPL_EVENT_MASK_TEXT, TRUE },
+  /* non-ASCII texts always do */
+  { SEARCH_LITERAL_MESSAGE ("caf\xc3\xa9"), "CAF\xc3\xa9",
+    TPL_EVENT_MASK_TEXT, TRUE },
+};
+
+static void
+test_search_literal (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  gchar *dir;
+  guint i;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  dir = g_build_filename (fixture->tmp_basedir,
+      "gabble_jabber_user_40collabora_2eco_2euk", "user7@collabora.co.uk",
+      NULL);
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+
+  for (i = 0; i < G_N_ELEMENTS (search_literal_cases); i++)
+    {
+      GList *hits;
+
+      write_day_file (dir, "20110101.log", search_literal_cases[i].elements);
+
+      hits = _log_store_xml_search_in_files (self,
+          search_literal_cases[i].text,
+          g_list_prepend (NULL, g_build_filename (dir, "20110101.log", NULL)),
+          search_literal_cases[i].type_mask, NULL);
+
+      g_assert_cmpuint (g_list_length (hits), ==,
+          search_literal_cases[i].matches ? 1 : 0);
+
+      tpl_log_manager_search_free (hits);
+    }
+
+  g_free (dir);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+#define BENCHMARK_EVENTS 50000
+
+typedef struct
+{
+  guint num_events;
+  gdouble elapsed;
+  glong peak_rss_kb;
+} BenchmarkResult;
+
+
+static void
+benchmark_parse_file (XmlTestCaseFixture *fixture,
+    TpAccount *account,
+    const gchar *filename,
+    gboolean stream)
+{
+  const gchar *label = stream ? "stream" : "DOM";
+  BenchmarkResult result;
+  gint fds[2];
+  gint status;
+  pid_t pid;
+
+  g_assert_cmpint (pipe (fds), ==, 0);
+
+  /* Parse in a child so that each parser starts from the same peak RSS */
+  pid = fork ();
+  g_assert_cmpint (pid, >=, 0);
+
+  if (pid == 0)
+    {
+      TplLogStoreXml *self = TPL_LOG_STORE_XML (fixture->store);
+      DayParse parse;
+      struct rusage before, after;
+
+      close (fds[0]);
+      day_parse_init (&parse);
+      getrusage (RUSAGE_SELF, &before);
+      g_test_timer_start ();
+
+      if (stream)
+        parse_file_stream (self, account, filename, TRUE,
+            "meego@conference.collabora.co.uk", TPL_TYPE_TEXT_EVENT, &parse);
+      else
+        log_store_xml_parse_file_dom (self, account, filename, TRUE,
+            "meego@conference.collabora.co.uk", TPL_TYPE_TEXT_EVENT, &parse);
+
+      result.elapsed = g_test_timer_elapsed ();
+      getrusage (RUSAGE_SELF, &after);
+
+      result.num_events = g_queue_get_length (&parse.events);
+      result.peak_rss_kb = after.ru_maxrss - before.ru_maxrss;
+
+      if (write (fds[1], &result, sizeof (result)) != sizeof (result))
+        _exit (1);
+      _exit (0);
+    }
+
+  close (fds[1]);
+  g_assert_cmpint (read (fds[0], &result, sizeof (result)), ==,
+      sizeof (result));
+  close (fds[0]);
+
+  g_assert_cmpint (waitpid (pid, &status, 0), ==, pid);
+  g_assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  g_assert_cmpuint (result.num_events, ==, BENCHMARK_EVENTS);
+
+  g_test_maximized_result (result.num_events / result.elapsed,
+      "%s: %.0f events/s", label, result.num_events / result.elapsed);
+  g_test_minimized_result (result.peak_rss_kb,
+      "%s: peak RSS grew by %ld KiB", label, result.peak_rss_kb);
+}
+
+
+static void
+test_parse_benchmark (XmlTestCaseFixture *fixture,
+    gconstpointer user_data)
+{
+  TpAccount *account;
+  TpTestsSimpleAccount *account_service;
+  GString *contents;
+  gchar *dir;
+  gchar *filename;
+  GError *error = NULL;
+  guint i;
+
+  tpl_test_create_and_prepare_account (fixture->bus, fixture->factory,
+      TP_ACCOUNT_OBJECT_PATH_BASE "gabble/jabber/user_40collabora_2eco_2euk",
+      &account, &account_service);
+
+  /* A busy chatroom day */
+  contents = g_string_new (LOG_HEADER);
+
+  for (i = 0; i < BENCHMARK_EVENTS; i++)
+    g_string_append_printf (contents,
+        "<message time='20110112T%02u:%02u:%02u' cm_id='%u' "
+        "id='meego@conference.collabora.co.uk/user%u@collabora.co.uk' "
+        "name='User %u' token='' isuser='false' type='normal' "
+        "message-token='token-%u'>Message number %u, with some "
+        "&lt;escaped&gt; text &amp; a bit of padding to look real</message>\n",
+        (i / 3600) % 24, (i / 60) % 60, i % 60, i, i % 50, i % 50, i, i);
+
+  g_string_append (contents, LOG_FOOTER);
+
+  dir = g_build_filename (fixture->tmp_basedir, "benchmark",
+      LOG_DIR_CHATROOMS, "meego@conference.collabora.co.uk", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+  filename = g_build_filename (dir, "20110112.log", NULL);
+
+  g_file_set_contents (filename, contents->str, contents->len, &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Parsing %u events (%" G_GSIZE_FORMAT " bytes)",
+      BENCHMARK_EVENTS, contents->len);
+
+  benchmark_parse_file (fixture, account, filename, FALSE);
+  benchmark_parse_file (fixture, account, filename, TRUE);
+
+  g_string_free (contents, TRUE);
+  g_free (filename);
+  g_free (dir);
+
+  tpl_test_release_account (fixture->bus, account, account_service);
+}
+
+
+gint main (gint argc, gchar **argv)
+{
+  g_type_init ();
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_bug_base ("http://bugs.freedesktop.org/show_bug.cgi?id=");
+
+  g_test_add ("/log-store-xml/clear",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_clear, teardown);
+
+  g_test_add ("/log-store-xml/clear-account",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_clear_account, teardown);
+
+  g_test_add ("/log-store-xml/clear-entity",
+      XmlTestCaseFixture, GINT_TO_POINTER (FALSE),
+      setup_for_writing, test_clear_entity, teardown);
+
+  g_test_add ("/log-store-xml/clear-entity-room",
+      XmlTestCaseFixture, GINT_TO_POINTER (TRUE),
+      setup_for_writing, test_clear_entity, teardown);
+
+  g_test_add ("/log-store-xml/add-text-event",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_add_text_event, teardown);
+
+  g_test_add ("/log-store-xml/add-empty-text-event",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_add_empty_text_event, teardown);
+
+  g_test_add ("/log-store-xml/add-event-open-files",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_add_event_open_files, teardown);
+
+  g_test_add ("/log-store-xml/add-superseding-event",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_add_superseding_event, teardown);
+
+  g_test_add ("/log-store-xml/add-call-event",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_add_call_event, teardown);
+
+  g_test_add ("/log-store-xml/exists",
+      XmlTestCaseFixture, NULL,
+      setup, test_exists, teardown);
+
+  g_test_add ("/log-store-xml/get-events-for-date",
+      XmlTestCaseFixture, NULL,
+      setup, test_get_events_for_date, teardown);
+
+  g_test_add ("/log-store-xml/get-filtered-events-tail",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_get_filtered_events_tail, teardown);
+
+  g_test_add ("/log-store-xml/event-cache",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_event_cache, teardown);
+  g_test_add ("/log-store-xml/event-cache-append",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_event_cache_append, teardown);
+  g_test_add ("/log-store-xml/event-cache-large-day",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_event_cache_large_day, teardown);
+  g_test_add ("/log-store-xml/get-dates-index",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_get_dates_index, teardown);
+  g_test_add ("/log-store-xml/search-index",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_search_index, teardown);
+  g_test_add ("/log-store-xml/search-parallel",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_search_parallel, teardown);
+  g_test_add ("/log-store-xml/search-literal",
+      XmlTestCaseFixture, NULL,
+      setup_for_writing, test_search_literal, teardown);
+
+  g_test_add ("/log-store-xml/parse-stream",
+      XmlTestCaseFixture, NULL,
+      setup, test_parse_stream, teardown);
+
+  if (g_test_perf ())
+    g_test_add ("/log-store-xml/parse-benchmark",
+        XmlTestCaseFixture, NULL,
+        setup_for_writing, test_parse_benchmark, teardown);
 
   return g_test_run ();
 }
@@ -6,6 +6,10 @@ int
 main (int argc, char **argv)
 {
   TplConf *conf, *conf2;
+  const gchar *ignorelist[] = {
+      "gabble/jabber/user_40example_2ecom/friend@example.com",
+      "idle/irc/user0/#room/with/slashes",
+      NULL };
 
   g_type_init ();
 
@@ -23,6 +27,25 @@ main (int argc, char **argv)
   /* it points to the same mem area, it should be still valid */
   g_assert (TPL_IS_CONF (conf2));
 
+  /* the ignore list is looked up by account and identifier, the latter
+   * possibly containing slashes */
+  _tpl_conf_set_ignorelist (conf, ignorelist);
+  g_assert (_tpl_conf_is_ignored (conf, "gabble/jabber/user_40example_2ecom",
+        "friend@example.com"));
+  g_assert (_tpl_conf_is_ignored (conf, "idle/irc/user0",
+        "#room/with/slashes"));
+  g_assert (!_tpl_conf_is_ignored (conf, "idle/irc/user0",
+        "friend@example.com"));
+  g_assert (!_tpl_conf_is_ignored (conf, "gabble/jabber/other",
+        "friend@example.com"));
+
+  _tpl_conf_set_ignorelist (conf, NULL);
+  g_assert (!_tpl_conf_is_ignored (conf, "gabble/jabber/user_40example_2ecom",
+        "friend@example.com"));
+
+  /* a valid level of SQLite's synchronous pragma */
+  g_assert_cmpuint (_tpl_conf_get_sqlite_synchronous (conf), <=, 3);
+
   /* proper disposal for the singleton when no references are present */
   g_object_unref (conf);
 